@@ -4,14 +4,15 @@
  * @brief Implementation of Cascade Consensus's CAC Broadcast for Distributed
  *  Delivery Service
  *
- *  TODO: To optimize bandwidth, the actual message is not sent during
- *      every phase, but referred to using a hash most of the time. It is possible
- *      to reach a decision to deliver a message without having received this
- *      message before. If the diffusion of this message is not guaranteed,
- *      we should introduce a mechanism to allow a given member to ask other
- *      members for this message. This mechanism could be similar to the one
- *      that would allow disconnected group members to synchronize with the
- *      group after being offline for a certain period of time.
+ *  To optimize bandwidth, the actual message is only sent by its proposer, and
+ *      referred to using a hash in every other phase. It is possible to reach
+ *      a decision to deliver a message without having received this message
+ *      before: when a fetch callback is set, messages witnessed by others but
+ *      still unknown after the fetch delay (the proposer's broadcast is
+ *      usually in flight) are asked to their signers, and the pending
+ *      statements are evaluated again on receipt (see
+ *      receiveRequestedMessage). Without fetch callback, chosen messages are
+ *      piggybacked instead.
  */
 
 #ifndef __CAC_BROADCAST_HPP__
@@ -20,33 +21,41 @@
 #include <algorithm>
 #include <cassert>
 #include <cstdint>
+#include <functional>
 #include <iterator>
 #include <map>
 #include <optional>
 #include <queue>
 #include <sys/types.h>
-#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "mls/messages.h"
 #include "mls/tree_math.h"
 
 #include "cac_signature.hpp"
+#include "cached_message.hpp"
 #include "dds_message.hpp"
 #include "extended_mls_state.hpp"
+#include "metrics.hpp"
+#include "network.hpp"
+#include "quorum_tracker.hpp"
 
 // The only assumption made on type MessageT is that the message can be hashed
 //  using ExtendedMLSState::cipher_suite().ref()
 // Additionally the type MessageT should fit into the encoding of a CACMessage
+// Messages are handled as CachedMessage so that each is hashed only once
 template <typename MessageT>
 class CACBroadcast
 {
 public:
-    using ChoiceCallback = std::function<const MessageT &(const std::vector<MessageT> &)>;
-    using TransmitCallback = std::function<void(const MessageT &)>;
-    using CACDeliverCallback = std::function<void(const MessageT &,
+    using Message = CachedMessage<MessageT>;
+    using ChoiceCallback = std::function<const Message &(const std::vector<Message> &)>;
+    using TransmitCallback = std::function<void(const Message &)>;
+    using CACDeliverCallback = std::function<void(const Message &,
         const std::vector<MessageRef> &, const std::vector<CACSignature> &)>;
     using CACBroadcastCallback = std::function<void(const CACMessage<MessageT> &)>;
+    using FetchCallback = std::function<void(const MessageRef &, const std::vector<mls::LeafIndex> &)>;
 
     CACBroadcast(uint k, const ChoiceCallback & choiceCallback,
         const TransmitCallback & transmitCallback,
@@ -61,22 +70,64 @@ public:
         m_state = state;
 
         assert(k >= 1);
-        n = m_state->getMembersIdentity(false).size(); // TODO Not very efficient
+        n = m_state->members().size();
         t = (n - k) / 5; // TODO Consider case n>3t+k and n>5t+k
         qw = 4*t + k; // TODO Not sure 4t for n>5t+k
         qr = n - t; 
 
         m_sigCount = 0;
         m_hasSentReady = false;
+        m_generation++;
 
-        m_messages.clear();
-        m_validSignatures.clear();
-        m_validMessages.clear(), m_seenMessages.clear(), m_waitingMessages.clear(),
-            m_deliveredMessages.clear();
-        m_sequences.clear();
-        m_signaturesCount.clear();
+        const size_t leaves = m_state->tree().size.val;
+        m_quorum.reset(leaves, k, qw);
+        m_validSlots.clear();
 
-        m_waitingMessages.clear();
+        m_signatures.clear();
+        m_knownSignatures.clear();
+        m_sentSignatures = 0;
+        m_pendingSignatures.clear();
+        m_sequences.assign(leaves, 0);
+        m_senders.reset(leaves);
+
+        m_witnessedAt = {}, m_readyAt = {};
+
+        cancelFetch();
+    }
+
+    // Only piggyback the signatures this node has not broadcast yet, instead
+    //  of every known signature (links are reliable and broadcasts reach every
+    //  member, receivers reorder signatures using their sequence)
+    void setDeltaSignatures(bool enabled)
+    {
+        m_deltaSignatures = enabled;
+    }
+
+    // Deliver as soon as n - t members witnessed a message and no other message
+    //  was signed, without waiting for the ready quorum (requires n > 5t)
+    void setFastPath(bool enabled)
+    {
+        m_fastPath = enabled;
+    }
+
+    // Signatures received and phase timings are recorded when given metrics
+    void setMetrics(Metrics * metrics)
+    {
+        m_metrics = metrics;
+    }
+
+    // Only send references of the chosen messages, unknown messages are asked
+    //  to the members that witnessed them (an empty callback piggybacks them)
+    void setFetchCallback(const FetchCallback & fetchCallback)
+    {
+        m_fetch = fetchCallback;
+    }
+    // Unknown messages are only fetched if still missing after the delay, 0
+    //  (or no network) fetches them on the first signature
+    void setFetchDelay(Network * network, const std::function<int()> & delay)
+    {
+        m_network = network;
+        m_fetchDelay = delay;
     }
 
     // Return whether the broadcast instance has started for the current epoch
@@ -85,16 +136,17 @@ public:
         return m_sigCount > 0;
     }
 
-    void broadcast(const MessageT & message)
+    void broadcast(const Message & message)
     {
         if(m_sigCount > 0) // Already signed a statement
             return;
 
-        const MessageRef ref = m_state->cipher_suite().ref(message);
+        const MessageRef & ref = message.ref(m_state->cipher_suite());
 
-        m_messages.insert({ref, message});
-        m_seenMessages.insert(ref);
-        m_validMessages.insert(ref);
+        const uint32_t slot = m_quorum.slot(ref);
+        m_quorum[slot].payload.message = message;
+        m_quorum[slot].payload.seen = true;
+        setValid(slot);
 
         emitSignature(CACSignature::WITNESS, ref);
         
@@ -122,50 +174,60 @@ public:
         }
     }
 
+    // Message asked through the fetch callback
+    void receiveRequestedMessage(const Message & message)
+    {
+        const auto slot = m_quorum.find(message.ref(m_state->cipher_suite()));
+        if(!slot || !m_quorum[slot.value()].payload.requested
+            || m_quorum[slot.value()].payload.message)
+            return; // Not asked, or already received
+
+        m_quorum[slot.value()].payload.message = message;
+
+        // Statements waiting for the message are evaluated again
+        receiveMessage({ .witnessOrReady = CACSignature::WITNESS });
+        receiveMessage({ .witnessOrReady = CACSignature::READY });
+    }
+
     void _receiveMessage(const CACMessage<MessageT> & message)
     {
         if(message.hasBroadcastMessage())
         {
-            const MessageRef ref = m_state->cipher_suite().ref(message.broadcastMessage());
-            if(!m_messages.contains(ref))
-                m_messages[ref] = message.broadcastMessage();
+            const Message broadcastMessage{message.broadcastMessage()};
+            auto & statement = m_quorum[m_quorum.slot(
+                broadcastMessage.ref(m_state->cipher_suite()))].payload;
+            if(!statement.message)
+                statement.message = broadcastMessage;
+            cancelFetchIfComplete();
         }
 
-        std::set<CACSignature> outOfOrderSigs; // Sigs might not be stored by order of their sequence number
         for(const auto & sig : message.sigs)
         {
-            if(m_validSignatures.contains(m_state->cipher_suite().ref(sig)))
+            if(m_knownSignatures.contains(sig.signature))
+            {
+                METRIC(m_metrics, count(Counter::CAC_SIGNATURES_DUPLICATE));
                 continue;
+            }
+            METRIC(m_metrics, count(Counter::CAC_SIGNATURES_RECEIVED));
 
             const auto verifiedSig = CACSignature::verifyAndConvert(*m_state, sig);
             if(verifiedSig)
             {
                 // printf("New verified signature %s\n", verifiedSig->toString().c_str());
 
-                if(verifiedSig->sequence > m_sequences[verifiedSig->sender()] + 1)
-                    outOfOrderSigs.insert(verifiedSig.value());
+                // Sigs might not be received by order of their sequence number,
+                //  possibly across messages: keep them until the gap is filled
+                const auto sender = verifiedSig->sender();
+                m_senders.insert(sender.val);
+                if(verifiedSig->sequence > m_sequences[sender.val] + 1)
+                    m_pendingSignatures[sender].emplace(verifiedSig->sequence, verifiedSig.value());
                 else
-                    processNewSig(verifiedSig.value()); // Will increase the sequence
-            }
-        }
-
-        std::set<CACSignature> processedSignatures;
-        do // Loop through out of order signatures to check them (TODO: improve)
-        {
-            for(const auto & sig : processedSignatures)
-                outOfOrderSigs.erase(sig);
-            processedSignatures.clear();
-
-            for(const auto & sig : outOfOrderSigs)
-            {
-                if(sig.sequence <= m_sequences[sig.sender()] + 1)
                 {
-                    processNewSig(sig);
-                    processedSignatures.insert(sig);
+                    processNewSig(verifiedSig.value()); // Will increase the sequence
+                    processPendingSignatures(sender);
                 }
             }
         }
-        while(!processedSignatures.empty());
 
         if(message.isWitness())
             receivedWitness();
@@ -173,139 +235,154 @@ public:
             receivedReady();
     }
 
-    void validateMessage(const MessageT & message)
+    void validateMessage(const Message & message)
     {
-        const MessageRef ref = m_state->cipher_suite().ref(message);
-        m_validMessages.insert(ref);
+        const uint32_t slot = m_quorum.slot(message.ref(m_state->cipher_suite()));
+        if(!m_quorum[slot].payload.message)
+            m_quorum[slot].payload.message = message;
+        setValid(slot);
+        cancelFetchIfComplete();
 
         if(m_sigCount == 0) // Has not sign any statement yet
         {
-            std::vector<MessageT> choices;
-            for(const auto & validRef : m_validMessages)
-                choices.emplace_back(m_messages[validRef]);
-            const MessageT & chosen = m_choice(choices);
-
-            const MessageRef chosenRef = m_state->cipher_suite().ref(chosen);
-            m_waitingMessages.erase(chosenRef);
+            const uint32_t chosen = chooseValid();
+            m_quorum[chosen].payload.waiting = false;
 
-            emitSignature(CACSignature::WITNESS, chosenRef);
+            emitSignature(CACSignature::WITNESS, m_quorum[chosen].ref);
 
-            // TODO Think about not piggybacking the message
-            broadcastMessage(CACSignature::WITNESS, { chosen });
+            broadcastMessage(CACSignature::WITNESS,
+                piggybacked(m_quorum[chosen].payload.message.value()));
         }
 
-        if(m_waitingMessages.contains(ref))
+        if(m_quorum[slot].payload.waiting)
         {
-            m_waitingMessages.erase(ref);
+            m_quorum[slot].payload.waiting = false;
 
-            emitSignature(CACSignature::WITNESS, ref);
+            emitSignature(CACSignature::WITNESS, m_quorum[slot].ref);
             broadcastMessage(CACSignature::WITNESS);
         }
     }
 
-    const std::map<MessageRef, MessageT> & messages() const
+    // Message seen during the epoch, if any
+    const Message * message(const MessageRef & ref) const
     {
-        return m_messages;
+        const auto slot = m_quorum.find(ref);
+        if(!slot || !m_quorum[slot.value()].payload.message)
+            return nullptr;
+
+        return &m_quorum[slot.value()].payload.message.value();
     }
 
-    const std::map<AuthContentRef, CACSignature> & signatures() const
+    // By order of reception
+    const std::vector<CACSignature> & signatures() const
     {
-        return m_validSignatures;
+        return m_signatures;
     }
 
+    // Deliveries since the start, and those taking the fast path
+    size_t deliveries() const { return m_deliveries; }
+    size_t fastDeliveries() const { return m_fastDeliveries; }
+
 protected:
     void receivedWitness()
     {
-        std::vector<MessageRef> toBeTransmitted;
-        for(const auto & [ref, _] : m_signaturesCount)
+        requestMissingMessages();
+
+        std::vector<uint32_t> toBeTransmitted;
+        for(uint32_t slot = 0; slot < m_quorum.size(); ++slot)
         {
-            if(!m_seenMessages.contains(ref)
-                && m_messages.contains(ref))
+            auto & statement = m_quorum[slot];
+            if(statement.hasSignatures() && !statement.payload.seen
+                && statement.payload.message)
             {
-                m_seenMessages.insert(ref);
-                toBeTransmitted.emplace_back(ref);
+                statement.payload.seen = true;
+                toBeTransmitted.emplace_back(slot);
             }
         }
-        for(const auto & ref : toBeTransmitted) // Outside of iteration to avoid race condition
+        for(const auto slot : toBeTransmitted) // Outside of iteration to avoid race condition
         {
-            m_transmit(m_messages[ref]);
+            m_transmit(m_quorum[slot].payload.message.value());
         }
 
-        if(m_sigCount == 0 && m_validMessages.size()) // Has not sign any statement yet
+        if(m_sigCount == 0 && !m_validSlots.empty()) // Has not sign any statement yet
         {
-            std::vector<MessageT> choices;
-            for(const auto & validRef : m_validMessages)
-                choices.emplace_back(m_messages[validRef]);
-            const MessageT & chosen = m_choice(choices);
-
-            const MessageRef chosenRef = m_state->cipher_suite().ref(chosen);
-            emitSignature(CACSignature::WITNESS, chosenRef);
+            const uint32_t chosen = chooseValid();
+            emitSignature(CACSignature::WITNESS, m_quorum[chosen].ref);
 
-            // TODO Think about not piggybacking the message
-            broadcastMessage(CACSignature::WITNESS, { chosen });
+            broadcastMessage(CACSignature::WITNESS,
+                piggybacked(m_quorum[chosen].payload.message.value()));
         }
 
-        if(std::any_of(m_signaturesCount.begin(), m_signaturesCount.end(),
-            [this](const auto & sigs)
-            { return sigs.second.witnessCount() >= (n + t) / 2 + 1; }))
+        const uint64_t generation = m_generation;
+
+        if(m_quorum.maxWitnesses() >= (n + t) / 2 + 1)
         {
-            for(const auto & message : messagesWithEnoughWitness())
+            const std::vector<uint32_t> readySlots = m_quorum.ready(); // Grows when signing
+            for(const auto slot : readySlots)
             {
-                if(!m_signaturesCount[message].signedReady.contains(m_state->index()))
+                if(!m_quorum[slot].readies.contains(m_state->index()))
                 {
-                    emitSignature(CACSignature::READY, message);
+                    emitSignature(CACSignature::READY, m_quorum[slot].ref);
                     broadcastMessage(CACSignature::READY);
                 }
 
-                if(n > 5*t && m_signaturesCount[message].witnessCount() >= n - t
-                    && m_signaturesCount.size() == 1 // forall m' != m, witCount(m') = 0
-                    && !m_deliveredMessages.contains(message))
+                auto & statement = m_quorum[slot];
+                if(m_fastPath && n > 5*t && statement.witnesses.count() >= n - t
+                    && m_quorum.signedCount() == 1 // forall m' != m, witCount(m') = 0
+                    && !statement.payload.delivered
+                    && statement.payload.message)
                 {
-                    m_deliver(m_messages[message], { message }, validSignatures());
+                    statement.payload.delivered = true;
+                    m_deliveries++, m_fastDeliveries++;
+                    METRIC(m_metrics, observeSince(Histogram::CAC_DELIVER, m_witnessedAt));
+
+                    // Copies, the statements are cleared if delivery leads to another epoch
+                    const Message delivered = statement.payload.message.value();
+                    const MessageRef ref = statement.ref;
+                    m_deliver(delivered, { ref }, validSignatures());
+                    if(generation != m_generation)
+                        return; // Delivery led to another epoch
                 }
             }
         }
 
-        const size_t seenProcesses = m_sequences.size() + 1;
+        const size_t seenProcesses = m_senders.count() + 1;
         if(seenProcesses >= n - t && !m_hasSentReady)
         {
-            const auto msgWithEnoughWitness = std::find_if(
-                m_signaturesCount.begin(), m_signaturesCount.end(),
-                [this, seenProcesses](const auto & sigs)
-                { return sigs.second.witnessCount() >= seenProcesses - 2*t; });
-
-            if(n > 5*t && msgWithEnoughWitness != m_signaturesCount.end()
-                && !m_signaturesCount[msgWithEnoughWitness->first]
-                    .signedWitness.contains(m_state->index())
-                && m_validMessages.contains(msgWithEnoughWitness->first))
+            const size_t enoughWitnesses = seenProcesses - 2*t;
+            std::optional<uint32_t> msgWithEnoughWitness = {};
+            if(m_quorum.maxWitnesses() >= enoughWitnesses)
+                for(uint32_t slot = 0; slot < m_quorum.size() && !msgWithEnoughWitness; ++slot)
+                    if(m_quorum[slot].witnesses.count() >= enoughWitnesses)
+                        msgWithEnoughWitness = slot;
+
+            if(n > 5*t && msgWithEnoughWitness
+                && !m_quorum[msgWithEnoughWitness.value()].witnesses.contains(m_state->index())
+                && m_quorum[msgWithEnoughWitness.value()].payload.valid)
             {
-                emitSignature(CACSignature::WITNESS, msgWithEnoughWitness->first);
+                emitSignature(CACSignature::WITNESS, m_quorum[msgWithEnoughWitness.value()].ref);
 
                 broadcastMessage(CACSignature::WITNESS);
             }
             else
             {
-                std::map<MessageRef, MessageSigs> witnessedMessages;
-                std::copy_if(m_signaturesCount.begin(), m_signaturesCount.end(),
-                    std::inserter(witnessedMessages, witnessedMessages.begin()),
-                    [](const auto & sigs){ return sigs.second.witnessCount() > 0; });
-
-                const size_t minWitnesses = std::max<int>(1, n - t * (witnessedMessages.size() + 1));
-                for(const auto & msg : witnessedMessages)
+                const size_t minWitnesses = std::max<int>(1, n - t * (m_quorum.witnessedCount() + 1));
+                for(uint32_t slot = 0; slot < m_quorum.size(); ++slot)
                 {
-                    if(msg.second.witnessCount() >= minWitnesses
-                        && !m_waitingMessages.contains(msg.first)
-                        && !m_signaturesCount[msg.first].signedWitness
-                            .contains(m_state->index()))
+                    auto & statement = m_quorum[slot];
+                    if(statement.witnesses.count() > 0
+                        && statement.witnesses.count() >= minWitnesses
+                        && !statement.payload.waiting
+                        && !statement.witnesses.contains(m_state->index()))
                     {
-                        if(m_validMessages.contains(msg.first))
+                        if(statement.payload.valid)
                         {
-                            emitSignature(CACSignature::WITNESS, msg.first);
+                            emitSignature(CACSignature::WITNESS, statement.ref);
 
                             broadcastMessage(CACSignature::WITNESS);
                         }
                         else
-                            m_waitingMessages.insert(msg.first);
+                            statement.payload.waiting = true;
                     }
                 }
             }
@@ -314,101 +391,210 @@ protected:
 
     void receivedReady()
     {
-        const auto readyMessages = messagesWithEnoughWitness();
+        requestMissingMessages();
+
+        const std::vector<uint32_t> readySlots = m_quorum.ready();
 
-        if(!readyMessages.empty())
+        if(!readySlots.empty())
         {
-            for(const auto & readyMsg : readyMessages)
-                if(!m_signaturesCount[readyMsg].signedReady.contains(m_state->index()))
+            for(const auto slot : readySlots)
+                if(!m_quorum[slot].readies.contains(m_state->index()))
                 {
-                    emitSignature(CACSignature::READY, readyMsg);
+                    emitSignature(CACSignature::READY, m_quorum[slot].ref);
                     broadcastMessage(CACSignature::READY);
                 }
 
+            // Sorted, every member gets the same set
+            std::vector<std::pair<MessageRef, uint32_t>> conflicting;
+            for(const auto slot : m_quorum.conflicting())
+                conflicting.emplace_back(m_quorum[slot].ref, slot);
+            std::sort(conflicting.begin(), conflicting.end());
+
             std::vector<MessageRef> conflictSet;
-            for(const auto & messageSigs : m_signaturesCount)
-                if(messageSigs.second.witnessCount() >= k)
-                    conflictSet.emplace_back(messageSigs.first);
+            for(const auto & [ref, _] : conflicting)
+                conflictSet.emplace_back(ref);
 
-            for(const auto & ref : conflictSet)
-                if(m_signaturesCount[ref].readyCount() >= qr
-                    && !m_deliveredMessages.contains(ref))
+            const uint64_t generation = m_generation;
+            for(const auto & [_, slot] : conflicting)
+            {
+                auto & statement = m_quorum[slot];
+                if(statement.readies.count() >= qr
+                    && !statement.payload.delivered
+                    && statement.payload.message) // Otherwise evaluated again once fetched
                 {
-                    m_deliveredMessages.insert(ref);
-
-                    m_deliver(m_messages[ref], conflictSet, validSignatures());
+                    statement.payload.delivered = true;
+                    m_deliveries++;
+                    METRIC(m_metrics, observeSince(Histogram::CAC_READY_TO_DELIVER, m_readyAt));
+                    METRIC(m_metrics, observeSince(Histogram::CAC_DELIVER, m_witnessedAt));
+
+                    const Message delivered = statement.payload.message.value();
+                    m_deliver(delivered, conflictSet, validSignatures());
+                    if(generation != m_generation)
+                        return; // Delivery led to another epoch
                 }
+            }
         }
     }
 
-    // Message that received more than qW witness signatures
-    std::vector<MessageRef> messagesWithEnoughWitness()
+    // Messages witnessed by others but never received
+    void requestMissingMessages()
     {
-        std::vector<MessageRef> readyMessages;
-        for(const auto & messageSigs : m_signaturesCount)
-            if(messageSigs.second.witnessCount() >= qw)
-                readyMessages.emplace_back(messageSigs.first);
+        if(!m_fetch)
+            return;
 
-        return readyMessages;
+        const int delay = m_network && m_fetchDelay ? m_fetchDelay() : 0;
+        if(delay <= 0)
+            fetchMissingMessages();
+        else if(!m_fetchTimeout && hasMissingMessages())
+            m_fetchTimeout = m_network->registerTimeout(delay, [this](auto)
+            {
+                m_fetchTimeout = {};
+                fetchMissingMessages();
+            });
+    }
+
+    bool hasMissingMessages() const
+    {
+        for(const auto slot : m_quorum.conflicting())
+            if(!m_quorum[slot].payload.message && !m_quorum[slot].payload.requested)
+                return true;
+
+        return false;
+    }
+
+    void fetchMissingMessages()
+    {
+        for(const auto slot : m_quorum.conflicting())
+        {
+            auto & statement = m_quorum[slot];
+            if(!statement.payload.message && !statement.payload.requested)
+            {
+                statement.payload.requested = true;
+                m_fetch(statement.ref, statement.witnesses.leaves());
+            }
+        }
+    }
+
+    void cancelFetchIfComplete()
+    {
+        if(m_fetchTimeout && !hasMissingMessages())
+            cancelFetch();
+    }
+
+    void cancelFetch()
+    {
+        if(m_fetchTimeout)
+            m_network->unregisterTimeout(m_fetchTimeout.value());
+        m_fetchTimeout = {};
+    }
+
+    std::optional<Message> piggybacked(const Message & message) const
+    {
+        if(m_fetch)
+            return {}; // Can be fetched from the signers
+        return message;
+    }
+
+    void setValid(uint32_t slot)
+    {
+        if(!m_quorum[slot].payload.valid)
+        {
+            m_quorum[slot].payload.valid = true;
+            m_validSlots.emplace_back(slot);
+        }
+    }
+
+    uint32_t chooseValid()
+    {
+        std::vector<Message> choices;
+        for(const auto slot : m_validSlots)
+            choices.emplace_back(m_quorum[slot].payload.message.value());
+
+        const Message & chosen = m_choice(choices);
+        return m_quorum.find(chosen.ref(m_state->cipher_suite())).value();
     }
 
     void processNewSig(const CACSignature & sig)
     {
-        m_sequences[sig.sender()] += 1;
+        if(m_knownSignatures.contains(sig.authContentRef))
+            return; // Also received while pending
 
-        m_validSignatures.insert({m_state->cipher_suite().ref(sig.authContent), sig});
+        m_sequences[sig.sender().val] += 1;
 
-        const auto sender = sig.sender();
-        if(sig.isWitness())
-            m_signaturesCount[sig.referencedMessage].signedWitness.insert(sender);
-        else if(sig.isReady())
-            m_signaturesCount[sig.referencedMessage].signedReady.insert(sender);
+        addSignature(sig);
+    }
+
+    void processPendingSignatures(const mls::LeafIndex & sender)
+    {
+        auto pendingIt = m_pendingSignatures.find(sender);
+        if(pendingIt == m_pendingSignatures.end())
+            return;
+
+        auto & pending = pendingIt->second;
+        while(!pending.empty() && pending.begin()->first <= m_sequences[sender.val] + 1)
+        {
+            processNewSig(pending.begin()->second);
+            pending.erase(pending.begin());
+        }
+
+        if(pending.empty())
+            m_pendingSignatures.erase(pendingIt);
     }
 
     void emitSignature(bool witnessOrReady, const MessageRef & ref)
     {
         CACSignature sig = CACSignature::sign(*m_state, m_sigCount++, witnessOrReady, ref);
-        const AuthContentRef sigRef = m_state->cipher_suite().ref(sig.authContent);
 
         // printf("Emitting %s ref %u\n", sig.toString().c_str(),
-        //     MLS_UTIL_HASH(*m_state, sig.authContent));
+        //     MLS_UTIL_HASH_REF(sig.authContentRef));
+
+        addSignature(sig);
+    }
 
-        m_validSignatures.insert({sigRef, sig});
+    void addSignature(const CACSignature & sig)
+    {
+        m_knownSignatures.insert(sig.authContentRef);
+        m_signatures.emplace_back(sig);
 
-        const auto sender = sig.sender();
+        const uint32_t slot = m_quorum.slot(sig.referencedMessage);
         if(sig.isWitness())
-            m_signaturesCount[sig.referencedMessage].signedWitness.insert(sender);
+        {
+            METRIC(m_metrics, mark(m_witnessedAt));
+            m_quorum.witness(slot, sig.sender());
+        }
         else if(sig.isReady())
-            m_signaturesCount[sig.referencedMessage].signedReady.insert(sender);
+            m_quorum.ready(slot, sig.sender());
     }
 
     void broadcastMessage(bool witnessOrReady,
-        const std::optional<MessageT> & message = {})
+        const std::optional<Message> & message = {})
     {
-        if(witnessOrReady == CACSignature::READY)
+        if(witnessOrReady == CACSignature::READY && !m_hasSentReady)
+        {
             m_hasSentReady = true;
+            METRIC(m_metrics, mark(m_readyAt));
+            METRIC(m_metrics, observeSince(Histogram::CAC_WITNESS_TO_READY, m_witnessedAt));
+        }
 
-        std::vector<mls::AuthenticatedContent> sigs;
-        for(const auto & sig : m_validSignatures)
-            sigs.emplace_back(sig.second.authContent);
+        // Signatures are appended: the ones not broadcast yet are at the end
+        std::vector<ControlSignature> sigs;
+        for(size_t idx = m_deltaSignatures ? m_sentSignatures : 0; idx < m_signatures.size(); ++idx)
+            sigs.emplace_back(m_signatures[idx].controlSignature);
+        m_sentSignatures = m_signatures.size();
 
         CACMessage msg = {
             .witnessOrReady = witnessOrReady,
             .sigs = sigs,
             .optBroadcastMessage = message
+                ? std::optional<MessageT>{message->message()} : std::nullopt
         };
 
         m_broadcast(msg);
     }
 
-    std::vector<CACSignature> validSignatures()
+    std::vector<CACSignature> validSignatures() const
     {
-        std::vector<CACSignature> sigs;
-        std::transform(m_validSignatures.begin(), m_validSignatures.end(),
-            std::back_inserter(sigs),
-            [](const auto & pair){ return pair.second; });
-
-        return sigs;
+        return m_signatures;
     }
 
 private:
@@ -418,33 +604,45 @@ private:
     const ChoiceCallback m_choice;
     const CACDeliverCallback m_deliver;
     const CACBroadcastCallback m_broadcast;
+    FetchCallback m_fetch;
+    Network * m_network = nullptr;
+    std::function<int()> m_fetchDelay;
+    std::optional<timeoutID> m_fetchTimeout = {};
 
     const uint k;
     uint n, t, qw, qr;
 
     uint32_t m_sigCount;
     bool m_hasSentReady = false;
+    bool m_deltaSignatures = false;
+    bool m_fastPath = true;
+    size_t m_deliveries = 0, m_fastDeliveries = 0;
+    uint64_t m_generation = 0; // Incremented by newEpoch, a callback may start another epoch
 
     // To serialize treatment of messages (handleMessage can be call recursively
     //  as broadcasts of local message directly triggers another handleMessage)
     bool m_messageQueueLock = false;
     std::queue<CACMessage<MessageT>> m_messageQueue;
 
-    std::map<MessageRef, MessageT> m_messages; // a.k.a seen messages
-    std::map<AuthContentRef, CACSignature> m_validSignatures;
-    std::set<MessageRef> m_validMessages, m_seenMessages, m_waitingMessages, m_deliveredMessages;
-    std::map<mls::LeafIndex, uint32_t> m_sequences;
-    
-    struct MessageSigs
+    // What is known of each message during the epoch, with its signers
+    struct MessageState
     {
-        std::set<mls::LeafIndex> signedWitness, signedReady;
-
-        size_t witnessCount() const
-        { return signedWitness.size(); }
-        size_t readyCount() const
-        { return signedReady.size(); }
+        std::optional<Message> message; // a.k.a seen messages
+        bool valid = false, seen = false, waiting = false;
+        bool delivered = false, requested = false;
     };
-    std::map<MessageRef, MessageSigs> m_signaturesCount;
+    QuorumTracker<MessageState> m_quorum;
+    std::vector<uint32_t> m_validSlots;
+
+    std::vector<CACSignature> m_signatures; // Valid ones, by order of reception
+    std::unordered_set<AuthContentRef, SignatureHash> m_knownSignatures;
+    size_t m_sentSignatures = 0; // Prefix of m_signatures already broadcast
+    std::map<mls::LeafIndex, std::map<uint32_t, CACSignature>> m_pendingSignatures;
+    std::vector<uint32_t> m_sequences; // By LeafIndex
+    LeafBitset m_senders; // Members whose signatures were received
+
+    Metrics * m_metrics = nullptr;
+    std::optional<Metrics::Clock::time_point> m_witnessedAt, m_readyAt; // First ones of the epoch
 };
 
 #endif
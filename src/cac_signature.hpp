@@ -1,8 +1,8 @@
 /**
  * @file cac_signature.hpp
  * @author Ludovic PAILLAT (Ludovic.PAILLAT@hivenet.com)
- * @brief Implementation of CAC Broadcast's signature based on MLS structure for
- *  authenticated content: MLSAuthenticatedContent
+ * @brief Implementation of CAC Broadcast's signature based on the detached
+ *  control signature: ControlSignature
  */
 
 #ifndef __CAC_SIGNATURE_HPP__
@@ -21,34 +21,26 @@
 #include "mls/tree_math.h"
 #include "tls/tls_syntax.h"
 
+#include "control_signature.hpp"
 #include "extended_mls_state.hpp"
 #include "message.hpp"
 
-struct CACSignatureData
-{
-    uint32_t sequence;
-    uint8_t witnessOrReady;
-    MessageRef messageReference;
-
-    TLS_SERIALIZABLE(sequence, witnessOrReady, messageReference);
-};
-
 class CACSignature
 {
 public:
     static constexpr bool WITNESS = true, READY = false;
-    static constexpr uint8_t WITNESS_CODE = 1, READY_CODE = 2;
+    static constexpr uint8_t WITNESS_CODE = CONTROL_CAC_WITNESS, READY_CODE = CONTROL_CAC_READY;
 
     const uint32_t sequence;
     bool witnessOrReady;
     const MessageRef referencedMessage;
 
-    const mls::AuthenticatedContent authContent;
-    const AuthContentRef authContentRef;    // For simplicity and efficient comparison
+    const ControlSignature controlSignature;
+    const AuthContentRef authContentRef;    // For simplicity and efficient comparison, no hashing needed
 
     mls::LeafIndex sender() const
     {
-        return std::get<mls::MemberSender>(authContent.content.sender.sender).sender;
+        return mls::LeafIndex{ controlSignature.signer };
     }
 
     bool isWitness() const { return witnessOrReady == WITNESS; }
@@ -56,44 +48,33 @@ public:
 
     mls::bytes_ns::bytes marshal() const
     {
-        return mls::tls::marshal(authContent);
+        return mls::tls::marshal(controlSignature);
     }
 
     static std::optional<CACSignature> verifyAndConvert(const ExtendedMLSState & state,
-        const mls::AuthenticatedContent & authContent)
+        const ControlSignature & controlSignature)
     {
-        if(!state.verify(authContent)
-            || authContent.content.epoch != state.epoch()
-            || authContent.content.sender.sender_type() != mls::SenderType::member
-            || authContent.content.content_type() != mls::ContentType::application)
+        if((controlSignature.type != WITNESS_CODE && controlSignature.type != READY_CODE)
+            || !state.verify(controlSignature)) // Also checks the epoch
         {
             return {};
         }
 
-        const auto content = std::get<mls::ApplicationData>(authContent.content.content).data;
-
-        CACSignatureData data;
-        mls::tls::unmarshal(content, data);
-
-        if(data.witnessOrReady != WITNESS_CODE && data.witnessOrReady != READY_CODE)
-            return {};
-
-        return { CACSignature(data.sequence, data.witnessOrReady == WITNESS_CODE,
-            data.messageReference, authContent, state) };
+        return { CACSignature(controlSignature.sequence,
+            controlSignature.type == WITNESS_CODE, controlSignature.reference,
+            controlSignature) };
     }
 
     static CACSignature sign(const ExtendedMLSState & state,
         uint32_t sequence, bool witnessOrReady,
         const MessageRef referencedMessage)
     {
-        const auto authContent = state.sign(mls::tls::marshal((CACSignatureData) {
-            .sequence = sequence,
-            .witnessOrReady = witnessOrReady == WITNESS ? WITNESS_CODE : READY_CODE,
-            .messageReference = referencedMessage
-        }));
+        const auto controlSignature = state.signControl(
+            witnessOrReady == WITNESS ? CONTROL_CAC_WITNESS : CONTROL_CAC_READY,
+            sequence, referencedMessage);
         
         return CACSignature{sequence, witnessOrReady, referencedMessage,
-            authContent, state};
+            controlSignature};
     }
 
     // Compatibility with std::set and others
@@ -117,11 +98,10 @@ private:
     // We only allow construction of valid CACSignature objects
     CACSignature(uint32_t sequence, bool witnessOrReady,
         const MessageRef & messageReference,
-        const mls::AuthenticatedContent & authContent,
-        const ExtendedMLSState & state)
+        const ControlSignature & controlSignature)
         : sequence(sequence), witnessOrReady(witnessOrReady),
-            referencedMessage(messageReference), authContent(authContent),
-            authContentRef(state.cipher_suite().ref(authContent))
+            referencedMessage(messageReference), controlSignature(controlSignature),
+            authContentRef(controlSignature.signature)
     { }
 };
 
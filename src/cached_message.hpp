@@ -0,0 +1,88 @@
+/**
+ * @file cached_message.hpp
+ * @author Ludovic PAILLAT (Ludovic.PAILLAT@hivenet.com)
+ * @brief Message wrapper memoizing its serialization and reference
+ *
+ * The same commit goes through Gossip, both CAC instances and the consensus,
+ *  each of them needing its reference (hash of its serialization). The wrapper
+ *  computes them on first use only, and copies share the result.
+ */
+
+#ifndef __CACHED_MESSAGE_HPP__
+#define __CACHED_MESSAGE_HPP__
+
+#include <memory>
+#include <optional>
+#include <utility>
+
+#include "bytes/bytes.h"
+#include "mls/crypto.h"
+#include "mls/messages.h"
+#include "tls/tls_syntax.h"
+
+#include "extended_mls_state.hpp"
+
+template <typename T>
+class CachedMessage
+{
+public:
+    CachedMessage(const T & message)
+        : m_cache(std::make_shared<Cache>(message))
+    { }
+
+    CachedMessage(T && message)
+        : m_cache(std::make_shared<Cache>(std::move(message)))
+    { }
+
+    const T & message() const
+    {
+        return m_cache->message;
+    }
+
+    const T * operator->() const
+    {
+        return &m_cache->message;
+    }
+
+    // Same as tls::marshal(message())
+    const mls::bytes_ns::bytes & bytes() const
+    {
+        if(!m_cache->bytes)
+            m_cache->bytes = mls::tls::marshal(m_cache->message);
+
+        return m_cache->bytes.value();
+    }
+
+    // Same as suite.ref(message()), the suite must not change between calls
+    const MessageRef & ref(const mls::CipherSuite & suite) const
+    {
+        if(!m_cache->ref)
+            m_cache->ref = suite.raw_ref(mls::CipherSuite::reference_label<T>(), bytes());
+
+        return m_cache->ref.value();
+    }
+
+    // Compatibility with std::map and others
+    bool operator<(const CachedMessage & other) const
+    {
+        return m_cache != other.m_cache && bytes() < other.bytes();
+    }
+
+private:
+    // Messages are immutable, copies of the wrapper share the same cache
+    struct Cache
+    {
+        Cache(const T & message) : message(message) { }
+        Cache(T && message) : message(std::move(message)) { }
+
+        const T message;
+        std::optional<mls::bytes_ns::bytes> bytes;
+        std::optional<MessageRef> ref;
+    };
+
+    std::shared_ptr<Cache> m_cache;
+};
+
+using CachedMLSMessage = CachedMessage<mls::MLSMessage>;
+
+#endif
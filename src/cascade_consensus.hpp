@@ -21,17 +21,39 @@
 
 #include "cac_broadcast.hpp"
 #include "cac_signature.hpp"
+#include "cached_message.hpp"
+#include "compression.hpp"
+#include "config.hpp"
 #include "dds_message.hpp"
+#include "epoch_buffer.hpp"
 #include "extended_mls_state.hpp"
 #include "full_consensus.hpp"
+#include "metrics.hpp"
 #include "network.hpp"
+#include "quorum_certificate.hpp"
+#include "relay_tree.hpp"
 #include "restrained_consensus.hpp"
+#include "rtt_estimator.hpp"
 
-using ChoiceCallback = std::function<const mls::MLSMessage &(const std::vector<mls::MLSMessage> &)>;
-using DeliverCallback = std::function<void(const mls::MLSMessage &)>;
+using ChoiceCallback = std::function<const CachedMLSMessage &(const std::vector<CachedMLSMessage> &)>;
+using CommitDeliverCallback = std::function<void(const CachedMLSMessage &)>;
 
 static constexpr uint CAC_K = 1;
 
+// Epochs decided by each tier of the cascade since the start
+struct ConsensusStats
+{
+    size_t fastPath = 0;            // CAC 1, unanimous witnesses
+    size_t cac1 = 0;                // CAC 1, ready quorum
+    size_t restrained = 0;          // Restrained consensus decisions
+    size_t restrainedTimeouts = 0;  // Restrained consensus ended without decision
+    size_t cac2 = 0;
+    size_t fullConsensus = 0;
+    size_t viewChanges = 0;         // Full consensus views given up
+    size_t skippedViews = 0;        // Of them, skipped as led by suspected members
+    size_t rejectedPrePrepares = 0; // Of another value than the one prepared
+};
+
 // To be able to reference content of CAC Message (2nd instance following RC)
 template <>
 const mls::bytes_ns::bytes & mls::CipherSuite::reference_label<CAC2Content>()
@@ -45,8 +67,9 @@ class CascadeConsensus
 public:
     CascadeConsensus(Network & network, int networkRtt,
         const CACBroadcast<mls::MLSMessage>::TransmitCallback & transmitCallback,
-        const ChoiceCallback & choiceCallback, const DeliverCallback & deliverCallback)
-        : m_network(network), m_networkRTT(networkRtt),
+        const ChoiceCallback & choiceCallback, const CommitDeliverCallback & deliverCallback,
+        const CACBroadcast<mls::MLSMessage>::FetchCallback & fetchCallback)
+        : m_network(network), m_networkRTT(networkRtt), m_fetchCommit(fetchCallback),
             m_choice(choiceCallback), m_deliver(deliverCallback),
             m_cacInstance1(CAC_K, choiceCallback, transmitCallback,
                 std::bind(&CascadeConsensus::handleCAC1Delivery, this,
@@ -59,8 +82,8 @@ public:
                     std::placeholders::_1, std::placeholders::_2, std::placeholders::_3),
                 std::bind(&CascadeConsensus::broadcastCAC2Message, this, std::placeholders::_1)),
             m_restrainedConsensus(network, networkRtt,
-                std::bind(&CascadeConsensus::handleRCDeliver, this,
-                    std::placeholders::_1, std::placeholders::_2, std::placeholders::_3),
+                std::bind(&CascadeConsensus::handleRCDeliver, this, std::placeholders::_1,
+                    std::placeholders::_2, std::placeholders::_3, std::placeholders::_4),
                 std::bind(&CascadeConsensus::handleRCBottom, this),
                 std::bind(&CascadeConsensus::broadcastRCMessage, this,
                     std::placeholders::_1, std::placeholders::_2)),
@@ -71,7 +94,92 @@ public:
                     std::placeholders::_1, std::placeholders::_2),
                 std::bind(&CascadeConsensus::handleFullConsensusDelivery,
                     this, std::placeholders::_1))
-    { }
+    {
+        // Commits are only sent by their proposer, CAC 2 contents are piggybacked
+        m_cacInstance1.setFetchCallback(m_fetchCommit);
+        m_cacInstance1.setFetchDelay(&m_network, [this](){ return rtt(); });
+
+        // Only reached after a conflict in CAC 1, the fast path is counted
+        //  for CAC 1 alone
+        m_cacInstance2.setFastPath(false);
+
+#ifdef TEST
+        // Same conflict set in another order: another value to the consensus
+        m_consensus.setEquivocation([](const CAC2Content & content)
+        {
+            CAC2Content altered = content;
+            std::reverse(altered.conflictingMessages.begin(), altered.conflictingMessages.end());
+            return altered;
+        });
+#endif
+    }
+
+    void configure(const ClientConfig & config)
+    {
+        m_cacInstance1.setFetchCallback(config.piggybackCommits
+            ? CACBroadcast<mls::MLSMessage>::FetchCallback{} : m_fetchCommit);
+
+        m_cacInstance1.setDeltaSignatures(config.deltaSignatures);
+        m_cacInstance2.setDeltaSignatures(config.deltaSignatures);
+
+        m_quorumCertificates = config.quorumCertificates;
+        m_restrainedConsensus.setQuorumCertificates(config.quorumCertificates);
+
+        m_consensus.setBufferBudget(config.bufferBudget);
+        m_consensus.setBufferHorizon(config.bufferEpochs);
+        m_consensus.setSkipSuspectedLeaders(config.skipSuspectedLeaders);
+
+        m_cacInstance1.setFastPath(config.cacFastPath);
+    }
+
+    // Timeouts follow the measured rtt instead of the configured one
+    void setRttEstimator(const RttEstimator * estimator)
+    {
+        m_rttEstimator = estimator;
+        m_restrainedConsensus.setRttEstimator(estimator);
+        m_consensus.setRttEstimator(estimator);
+    }
+
+    // Large CAC and full consensus messages are relayed along the tree instead
+    //  of being sent to each member
+    void setRelayTree(RelayTree * relayTree)
+    {
+        m_relayTree = relayTree;
+    }
+
+    // Messages are compressed once every member can read them
+    void setCompressor(PayloadCompressor * compressor)
+    {
+        m_compressor = compressor;
+    }
+
+    // Phase timings are recorded when given metrics, only CAC 1 is timed
+    void setMetrics(Metrics * metrics)
+    {
+        m_metrics = metrics;
+        m_cacInstance1.setMetrics(metrics);
+        m_consensus.setMetrics(metrics);
+    }
+
+    ConsensusStats consensusStats() const
+    {
+        ConsensusStats stats = m_stats;
+        stats.fastPath = m_cacInstance1.fastDeliveries();
+        stats.cac1 -= stats.fastPath;
+        stats.viewChanges = m_consensus.viewChanges();
+        stats.skippedViews = m_consensus.skippedViews();
+        stats.rejectedPrePrepares = m_consensus.rejectedPrePrepares();
+        return stats;
+    }
+
+    BufferStats bufferStats() const
+    {
+        return {
+            .futureBytes = m_consensus.bufferedBytes(),
+            .futureMessages = m_consensus.bufferedMessages(),
+            .dropped = m_consensus.droppedMessages()
+        };
+    }
 
     void newEpoch(ExtendedMLSState * state)
     {
@@ -89,6 +197,8 @@ public:
 
         m_consensus.newEpoch(state);
         m_consensusProposed = false;
+
+        m_restrainedStartedAt = {}, m_consensusStartedAt = {};
     }
 
     void receiveMessage(const CascadeConsensusMessage & msg)
@@ -118,12 +228,12 @@ public:
         }
     }
 
-    void proposeCommit(const mls::MLSMessage & commit)
+    void proposeCommit(const CachedMLSMessage & commit)
     {
         m_cacInstance1.broadcast(commit);
     }
 
-    void validateCommit(const mls::MLSMessage & commit)
+    void validateCommit(const CachedMLSMessage & commit)
     {
         m_cacInstance1.validateMessage(commit);
     }
@@ -133,7 +243,54 @@ public:
         return m_cacInstance1.hasStarted();
     }
 
+    // Commit seen during the epoch, if any
+    const CachedMLSMessage * commit(const MessageRef & ref) const
+    {
+        return m_cacInstance1.message(ref);
+    }
+
+    // Commit asked through the fetch callback
+    void receiveRequestedCommit(const CachedMLSMessage & commit)
+    {
+        m_cacInstance1.receiveRequestedMessage(commit);
+    }
+
 protected:
+    mls::MLSMessage protect(const CascadeConsensusMessage & ccMessage)
+    {
+        mls::bytes_ns::bytes plaintext = mls::tls::marshal(ccMessage);
+        if(m_compressor && membersHave(FEATURE_ZSTD))
+            plaintext = m_compressor->compress(plaintext);
+
+        return m_state->protect({}, plaintext, 0);
+    }
+
+    bool membersHave(uint8_t feature) const
+    {
+        for(const auto & member : m_state->members().indexes())
+        {
+            if(member == m_state->index())
+                continue;
+
+            const auto features = m_network.peerFeatures(m_state->members().name(member));
+            if(!features || !(features.value() & feature))
+                return false;
+        }
+
+        return true;
+    }
+
+    void broadcastProtected(const mls::MLSMessage & message)
+    {
+        DDSMessage msg = (DDSMessage) {
+            .content = { message }
+        };
+        const SharedBytes frame = marshalToBytes(msg);
+
+        if(!m_relayTree || !m_relayTree->disseminate(message, frame, rtt()))
+            m_network.broadcast(frame);
+    }
+
     void broadcastCAC1Message(const CACMessage<mls::MLSMessage> & cacMessage)
     {
         CascadeConsensusMessage ccMessage = (CascadeConsensusMessage) {
@@ -141,12 +298,7 @@ protected:
             .content = { cacMessage }
         };
         
-        auto ccMessageBytes = marshalToBytes(ccMessage);
-        DDSMessage msg = (DDSMessage) {
-            .content = { m_state->protect({},
-                std::vector<uint8_t>{ccMessageBytes.content, ccMessageBytes.content + ccMessageBytes.size}, 0) }
-        };
-        m_network.broadcast(marshalToBytes(msg));
+        broadcastProtected(protect(ccMessage));
 
         // Network Broadcast does not include self
         m_cacInstance1.receiveMessage(cacMessage);
@@ -159,12 +311,7 @@ protected:
             .content = { cacMessage }
         };
         
-        auto ccMessageBytes = marshalToBytes(ccMessage);
-        DDSMessage msg = (DDSMessage) {
-            .content = { m_state->protect({},
-                std::vector<uint8_t>{ccMessageBytes.content, ccMessageBytes.content + ccMessageBytes.size}, 0) }
-        };
-        m_network.broadcast(marshalToBytes(msg));
+        broadcastProtected(protect(ccMessage));
 
         // Network Broadcast does not include self
         m_cacInstance2.receiveMessage(cacMessage);
@@ -178,10 +325,8 @@ protected:
             .content = { message }
         };
         
-        auto ccMessageBytes = marshalToBytes(ccMessage);
         DDSMessage msg = (DDSMessage) {
-            .content = { m_state->protect({},
-                std::vector<uint8_t>{ccMessageBytes.content, ccMessageBytes.content + ccMessageBytes.size}, 0) }
+            .content = { protect(ccMessage) }
         };
         m_network.broadcastSample(recipients, marshalToBytes(msg));
     }
@@ -193,12 +338,7 @@ protected:
             .content = { message }
         };
         
-        auto ccMessageBytes = marshalToBytes(ccMessage);
-        DDSMessage msg = (DDSMessage) {
-            .content = { m_state->protect({},
-                std::vector<uint8_t>{ccMessageBytes.content, ccMessageBytes.content + ccMessageBytes.size}, 0) }
-        };
-        m_network.broadcast(marshalToBytes(msg));
+        broadcastProtected(protect(ccMessage));
     }
 
     void sendFullConsensusMessage(const ConsensusMessage<CAC2Content> & message,
@@ -209,28 +349,28 @@ protected:
             .content = { message }
         };
         
-        auto ccMessageBytes = marshalToBytes(ccMessage);
         DDSMessage msg = (DDSMessage) {
-            .content = { m_state->protect({},
-                std::vector<uint8_t>{ccMessageBytes.content, ccMessageBytes.content + ccMessageBytes.size}, 0) }
+            .content = { protect(ccMessage) }
         };
         m_network.send(recipient, marshalToBytes(msg));
     }
 
-    void handleCAC1Delivery(const mls::MLSMessage & message,
+    void handleCAC1Delivery(const CachedMLSMessage & message,
         const std::vector<MessageRef> & conflictSet,
         const std::vector<CACSignature> & sigs)
     {
-        m_delivered.emplace_back(m_state->cipher_suite().ref(message));
+        m_delivered.emplace_back(message.ref(m_state->cipher_suite()));
 
         if(conflictSet.size() == 1)
         {
+            m_stats.cac1++; // Fast path included
             m_deliver(message);
         }
         else
         {
             printf("CAC1 Deliver: Conflict between %ld commit messages\n",
                 conflictSet.size());
+            METRIC(m_metrics, mark(m_restrainedStartedAt));
 
 #ifdef TEST
             // Allow to test random crashes before starting a restrained consensus
@@ -240,81 +380,116 @@ protected:
                 printf("TEST_RC_CRASH: Crash\n");
                 exit(0);
             }
+
+            // Allow to test the full consensus on each conflict, without the
+            //  restrained consensus and CAC 2
+            if(std::getenv("TEST_FC_ON_CONFLICT"))
+            {
+                if(!m_consensusProposed)
+                {
+                    m_consensusProposed = true;
+                    METRIC(m_metrics, mark(m_consensusStartedAt));
+
+                    std::vector<MessageRef> conflicting = conflictSet;
+                    std::sort(conflicting.begin(), conflicting.end());
+                    m_consensus.propose((CAC2Content) { .conflictingMessages = conflicting });
+                }
+                return;
+            }
 #endif
 
-            const auto sender = m_state->getCommitSender(message);
+            const auto sender = m_state->getCommitSender(message.message());
             if(sender == m_state->index())
             {
                 std::vector<std::pair<mls::LeafIndex, MessageRef>> senderConflictSet;
-                const auto messages = m_cacInstance1.messages();
 
                 for(const auto & ref : conflictSet)
-                    if(messages.contains(ref))
+                    if(const auto * commit = m_cacInstance1.message(ref))
                         senderConflictSet.emplace_back(std::pair{
-                            m_state->getCommitSender(messages.at(ref)), ref});
+                            m_state->getCommitSender(commit->message()), ref});
 
                 m_restrainedConsensus.propose(senderConflictSet, sigs);
             }
             else if(!m_RCTimeout)
             {
-                m_RCTimeout = m_network.registerTimeout(3 * m_networkRTT,
+                m_RCTimeout = m_network.registerTimeout(3 * rtt(),
                     [this](auto){ m_RCTimeout = {}; handleRCBottom(); });
             }
         }
     }
 
     void handleRCDeliver(const std::vector<MessageRef> & set,
-        const std::vector<mls::AuthenticatedContent> & sigs,
-        const std::vector<mls::AuthenticatedContent> & retractSigs)
+        const std::vector<ControlSignature> & sigs, const std::vector<ConflictSet> & endorsedSets,
+        const std::vector<ControlSignature> & retractSigs)
     {
-        const auto comparator =
-            [](const mls::AuthenticatedContent & lhs, const mls::AuthenticatedContent & rhs)
-            { return std::get<mls::ApplicationData>(lhs.content.content).data
-                < std::get<mls::ApplicationData>(rhs.content.content).data; };
+        m_stats.restrained++;
+        METRIC(m_metrics, observeSince(Histogram::RESTRAINED_CONSENSUS, m_restrainedStartedAt));
+        m_restrainedStartedAt = {};
 
         std::vector<MessageRef> sortedSet = set;
-        std::vector<mls::AuthenticatedContent> sortedSigs = sigs,
-            sortedRetractSigs = retractSigs;
+        std::vector<std::pair<ControlSignature, ConflictSet>> endorsements;
+        for(size_t idx = 0; idx < sigs.size(); ++idx)
+            endorsements.emplace_back(sigs[idx], endorsedSets[idx]);
+        std::vector<ControlSignature> sortedRetractSigs = retractSigs;
 
         // Sort so that when generating the hash, a similar message will have the same hash
         //  Thus, if another member submit the same set and signature, they will be consider identical
         std::sort(sortedSet.begin(), sortedSet.end());
-        std::sort(sortedSigs.begin(), sortedSigs.end(), comparator);
-        std::sort(sortedRetractSigs.begin(), sortedRetractSigs.end(),
-            comparator);
+        std::sort(endorsements.begin(), endorsements.end(),
+            [](const auto & a, const auto & b){ return a.first < b.first; });
+        std::sort(sortedRetractSigs.begin(), sortedRetractSigs.end());
 
+        std::vector<ControlSignature> sortedSigs;
+        std::vector<ConflictSet> sortedEndorsedSets;
+        for(auto & [sig, conflictSet] : endorsements)
+        {
+            sortedSigs.emplace_back(std::move(sig));
+            sortedEndorsedSets.emplace_back(std::move(conflictSet));
+        }
         sortedSigs.insert(sortedSigs.end(), sortedRetractSigs.begin(),
             sortedRetractSigs.end());
 
         m_cacInstance2.broadcast((CAC2Content) {
             .conflictingMessages = sortedSet,
-            .signatures = sortedSigs
+            .signatures = sortedSigs,
+            .endorsedSets = sortedEndorsedSets
         });
     }
 
     void handleRCBottom()
     {
-        const auto comparator =
-            [](const mls::AuthenticatedContent & lhs, const mls::AuthenticatedContent & rhs)
-            { return std::get<mls::ApplicationData>(lhs.content.content).data
-                < std::get<mls::ApplicationData>(rhs.content.content).data; };
+        m_stats.restrainedTimeouts++;
+        METRIC(m_metrics, observeSince(Histogram::RESTRAINED_CONSENSUS, m_restrainedStartedAt));
+        m_restrainedStartedAt = {};
 
         std::sort(m_delivered.begin(), m_delivered.end());
 
-        std::vector<mls::AuthenticatedContent> sigs;
-        for(const auto & sig : m_cacInstance1.signatures())
+        std::vector<ControlSignature> sigs;
+        std::vector<QuorumCertificate> certificates;
+        if(m_quorumCertificates)
         {
-            sigs.emplace_back(sig.second.authContent);
+            std::vector<CACSignature> cacSigs;
+            for(const auto & sig : m_cacInstance1.signatures())
+                cacSigs.emplace_back(sig);
+            certificates = QuorumCertificate::fromSignatures(cacSigs);
+        }
+        else
+        {
+            for(const auto & sig : m_cacInstance1.signatures())
+            {
+                sigs.emplace_back(sig.controlSignature);
+            }
+            std::sort(sigs.begin(), sigs.end());
         }
-        std::sort(sigs.begin(), sigs.end(), comparator);
 
         m_cacInstance2.broadcast((CAC2Content) {
             .conflictingMessages = m_delivered,
-            .signatures = sigs
+            .signatures = sigs,
+            .certificates = certificates
         });
     }
 
-    void handleCAC2Delivery(const CAC2Content & message,
+    void handleCAC2Delivery(const CachedMessage<CAC2Content> & message,
         const std::vector<MessageRef> & conflictSet,
         const std::vector<CACSignature> & sigs)
     {
@@ -329,16 +504,17 @@ protected:
         if(conflictSet.size() == 1)
         {
             printf("CAC2 Deliver: Agreement reached on a set of %ld messages\n",
-                message.conflictingMessages.size());
+                message->conflictingMessages.size());
+            m_stats.cac2++;
 
-            std::vector<mls::MLSMessage> choices;
-            for(const auto & ref : message.conflictingMessages)
+            std::vector<CachedMLSMessage> choices;
+            for(const auto & ref : message->conflictingMessages)
             {
-                if(!m_cacInstance1.messages().contains(ref))
+                if(const auto * commit = m_cacInstance1.message(ref))
+                    choices.emplace_back(*commit);
+                else
                     printf("CAC2 Deliver: Error unknown reference %u\n",
                         MLS_UTIL_HASH_REF(ref));
-                else
-                    choices.emplace_back(m_cacInstance1.messages().at(ref));
             }
 
             m_deliver(m_choice(choices));
@@ -350,18 +526,23 @@ protected:
             printf("CAC2 Deliver: Conflict between %ld messages\n",
                 conflictSet.size());
 
-            m_consensus.propose(message);
+            METRIC(m_metrics, mark(m_consensusStartedAt));
+            m_consensus.propose(message.message());
         }
     }
 
-    void handleCAC2Candidate(const CAC2Content & content)
+    void handleCAC2Candidate(const CachedMessage<CAC2Content> & content)
     {
         // TODO Something better (e.g. don't validate if signatures not valid)
+        if(!QuorumCertificate::toSignatures(*m_state, content->certificates)
+            || !RestrainedConsensus::verifyDecision(*m_state, content.message()))
+            return;
 
         m_cacInstance2.validateMessage(content);
     }
 
-    const CAC2Content & handleCAC2Choice(const std::vector<CAC2Content> & choices)
+    const CachedMessage<CAC2Content> & handleCAC2Choice(
+        const std::vector<CachedMessage<CAC2Content>> & choices)
     {
         // Choice is not important as multiple possibilities will lead to Full Consensus
         return choices[0];
@@ -370,27 +551,40 @@ protected:
     void handleFullConsensusDelivery(const CAC2Content & decidedContent)
     {
         printf("Full Consensus: Agreement reached\n");
+        m_stats.fullConsensus++;
+        METRIC(m_metrics, observeSince(Histogram::FULL_CONSENSUS, m_consensusStartedAt));
 
-        std::vector<mls::MLSMessage> choices;
+        std::vector<CachedMLSMessage> choices;
         for(const auto & ref : decidedContent.conflictingMessages)
         {
-            if(!m_cacInstance1.messages().contains(ref))
+            if(const auto * commit = m_cacInstance1.message(ref))
+                choices.emplace_back(*commit);
+            else
                 printf("CAC2 Deliver: Error unknown reference %u\n",
                     MLS_UTIL_HASH_REF(ref));
-            else
-                choices.emplace_back(m_cacInstance1.messages().at(ref));
         }
 
         m_deliver(m_choice(choices));
     }
 
+    int rtt() const
+    {
+        return m_rttEstimator ? m_rttEstimator->rtt() : m_networkRTT;
+    }
+
 private:
     Network & m_network;
     const int m_networkRTT;
+    const RttEstimator * m_rttEstimator = nullptr;
+    RelayTree * m_relayTree = nullptr;
+    PayloadCompressor * m_compressor = nullptr;
+    Metrics * m_metrics = nullptr;
+    std::optional<Metrics::Clock::time_point> m_restrainedStartedAt, m_consensusStartedAt;
     ExtendedMLSState * m_state = nullptr;
 
+    const CACBroadcast<mls::MLSMessage>::FetchCallback m_fetchCommit;
     const ChoiceCallback m_choice;
-    const DeliverCallback m_deliver;
+    const CommitDeliverCallback m_deliver;
 
     CACBroadcast<mls::MLSMessage> m_cacInstance1;
     CACBroadcast<CAC2Content> m_cacInstance2;
@@ -402,6 +596,9 @@ private:
 
     FullConsensus<CAC2Content> m_consensus;
     bool m_consensusProposed;
+
+    bool m_quorumCertificates = false;
+    ConsensusStats m_stats;
 };
 
 #endif
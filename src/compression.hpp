@@ -0,0 +1,142 @@
+/**
+ * @file compression.hpp
+ * @author Ludovic PAILLAT (Ludovic.PAILLAT@hivenet.com)
+ * @brief Compression of the Cascade Consensus messages before they are
+ *  protected by MLS, with a dictionary of the epoch
+ *
+ * Frames only carry MLS ciphertexts, which do not compress: messages are
+ *  compressed before being encrypted. The dictionary holds the group id and
+ *  the epoch as they are serialized in the messages and signatures, so that
+ *  these repeated fields become short references. Compressed plaintexts start
+ *  with a byte that can't start a CascadeConsensusMessage, and are only sent
+ *  once every member announced, in its connection hello, that it can read
+ *  them. zstd is only linked when built with ZSTD=1.
+ */
+
+#ifndef __COMPRESSION_HPP__
+#define __COMPRESSION_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+#include "bytes/bytes.h"
+#include "mls/messages.h"
+#include "tls/tls_syntax.h"
+
+#ifdef DDS_ZSTD
+#   include <zstd.h>
+#endif
+
+// Features announced in the connection hello
+static constexpr uint8_t FEATURE_ZSTD = 1;
+#ifdef DDS_ZSTD
+static constexpr uint8_t LOCAL_FEATURES = FEATURE_ZSTD;
+#else
+static constexpr uint8_t LOCAL_FEATURES = 0;
+#endif
+
+static constexpr uint8_t COMPRESSED_MARKER = 0xFF; // Instances are 0 to 2
+static constexpr size_t MAX_DECOMPRESSED_SIZE = 16 * 1024 * 1024;
+static constexpr int COMPRESSION_LEVEL = 3;
+
+class PayloadCompressor
+{
+public:
+    PayloadCompressor() = default;
+    PayloadCompressor(const PayloadCompressor &) = delete;
+    PayloadCompressor & operator=(const PayloadCompressor &) = delete;
+
+    ~PayloadCompressor()
+    {
+        release();
+#ifdef DDS_ZSTD
+        ZSTD_freeCCtx(m_cctx);
+        ZSTD_freeDCtx(m_dctx);
+#endif
+    }
+
+    void newEpoch(const mls::bytes_ns::bytes & groupId, mls::epoch_t epoch)
+    {
+        // Serialized as in the MLS messages, and as in the control signatures
+        mls::bytes_ns::bytes dictionary = mls::tls::marshal(groupId);
+        dictionary += mls::tls::marshal(epoch);
+        dictionary += groupId;
+
+#ifdef DDS_ZSTD
+        release();
+        m_cdict = ZSTD_createCDict(dictionary.data(), dictionary.size(), COMPRESSION_LEVEL);
+        m_ddict = ZSTD_createDDict(dictionary.data(), dictionary.size());
+#endif
+    }
+
+    // Unchanged if compression does not make it smaller
+    mls::bytes_ns::bytes compress(const mls::bytes_ns::bytes & plaintext)
+    {
+#ifdef DDS_ZSTD
+        if(!m_cdict)
+            return plaintext;
+
+        mls::bytes_ns::bytes compressed(1 + ZSTD_compressBound(plaintext.size()));
+        compressed[0] = COMPRESSED_MARKER;
+        const size_t size = ZSTD_compress_usingCDict(m_cctx, compressed.data() + 1,
+            compressed.size() - 1, plaintext.data(), plaintext.size(), m_cdict);
+
+        if(ZSTD_isError(size) || 1 + size >= plaintext.size())
+            return plaintext;
+
+        compressed.resize(1 + size);
+        return compressed;
+#else
+        return plaintext;
+#endif
+    }
+
+    // Plaintexts not compressed are returned as is, nothing if invalid
+    std::optional<mls::bytes_ns::bytes> decompress(const mls::bytes_ns::bytes & plaintext)
+    {
+        if(plaintext.empty() || plaintext[0] != COMPRESSED_MARKER)
+            return plaintext;
+
+#ifdef DDS_ZSTD
+        if(!m_ddict)
+            return {};
+
+        const unsigned long long size = ZSTD_getFrameContentSize(plaintext.data() + 1,
+            plaintext.size() - 1);
+        if(size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR
+            || size > MAX_DECOMPRESSED_SIZE)
+            return {};
+
+        mls::bytes_ns::bytes decompressed(size);
+        const size_t written = ZSTD_decompress_usingDDict(m_dctx, decompressed.data(),
+            decompressed.size(), plaintext.data() + 1, plaintext.size() - 1, m_ddict);
+        if(ZSTD_isError(written) || written != size)
+            return {};
+
+        return decompressed;
+#else
+        return {}; // Not sent to members which did not announce FEATURE_ZSTD
+#endif
+    }
+
+protected:
+    void release()
+    {
+#ifdef DDS_ZSTD
+        ZSTD_freeCDict(m_cdict);
+        ZSTD_freeDDict(m_ddict);
+        m_cdict = nullptr, m_ddict = nullptr;
+#endif
+    }
+
+private:
+#ifdef DDS_ZSTD
+    ZSTD_CCtx * m_cctx = ZSTD_createCCtx();
+    ZSTD_DCtx * m_dctx = ZSTD_createDCtx();
+    ZSTD_CDict * m_cdict = nullptr;
+    ZSTD_DDict * m_ddict = nullptr;
+#endif
+};
+
+#endif
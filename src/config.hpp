@@ -0,0 +1,208 @@
+/**
+ * @file config.hpp
+ * @author Ludovic PAILLAT (Ludovic.PAILLAT@hivenet.com)
+ * @brief Tunable parameters of the client, set using optional arguments of the
+ *  form --name=value
+ */
+
+#ifndef __CONFIG_HPP__
+#define __CONFIG_HPP__
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "dds_message.hpp"
+#include "epoch_buffer.hpp"
+#include "gossip_bcast.hpp"
+#include "metrics.hpp"
+#include "network.hpp"
+#include "relay_tree.hpp"
+#include "rtt_estimator.hpp"
+
+struct ClientConfig
+{
+    size_t sendHighWaterMark = DEFAULT_SEND_HIGH_WATER_MARK;
+    int addressCacheTtlMs = DEFAULT_ADDRESS_CACHE_TTL_MS;
+    size_t connectionCache = DEFAULT_CONNECTION_CACHE;
+    size_t groups = 1;
+    bool deltaSignatures = false;
+    bool quorumCertificates = false;
+    bool piggybackCommits = false;
+    int gossipFanoutConstant = DEFAULT_GOSSIP_FANOUT_CONSTANT;
+    int gossipDigestIntervalMs = DEFAULT_GOSSIP_DIGEST_INTERVAL_MS;
+    size_t bufferBudget = DEFAULT_BUFFER_BUDGET;
+    uint64_t bufferEpochs = DEFAULT_BUFFER_HORIZON;
+    bool pipelineCommits = false;
+    size_t commitQuorum = 0;
+    bool cacFastPath = true;
+    bool skipSuspectedLeaders = false;
+    bool adaptiveRtt = false;
+    int rttProbeIntervalMs = DEFAULT_RTT_PROBE_INTERVAL_MS;
+    size_t cryptoThreads = 0;
+    std::optional<uint32_t> seed = {}; // Random by default
+    size_t batchMessages = DEFAULT_BATCH_MESSAGES;
+    size_t batchBytes = DEFAULT_BATCH_BYTES;
+    int batchDelayMs = DEFAULT_BATCH_DELAY_MS;
+    size_t commitLogEpochs = DEFAULT_COMMIT_LOG_EPOCHS;
+    size_t relayFanout = DEFAULT_RELAY_FANOUT;
+    size_t relayBytes = DEFAULT_RELAY_BYTES;
+    bool compress = false;
+    std::string metricsFile = {};      // Not dumped by default
+    int metricsIntervalMs = DEFAULT_METRICS_INTERVAL_MS;
+};
+
+struct ClientOption
+{
+    const char * name;
+    const char * description;
+    std::function<void(ClientConfig &, const char *)> set;
+};
+
+static const std::vector<ClientOption> & clientOptions()
+{
+    static const std::vector<ClientOption> options = {
+        { "send-hwm", "bytes queued for a peer before dropping messages",
+            [](ClientConfig & config, const char * value)
+            { config.sendHighWaterMark = std::stoul(value); } },
+        { "pki-cache-ttl", "time (in ms) a peer address from the PKI is reused",
+            [](ClientConfig & config, const char * value)
+            { config.addressCacheTtlMs = std::stoi(value); } },
+        { "connection-cache", "connections kept open to peers that are not members",
+            [](ClientConfig & config, const char * value)
+            { config.connectionCache = std::stoul(value); } },
+        { "groups", "groups the client can be a member of at once, over the same connections",
+            [](ClientConfig & config, const char * value)
+            { config.groups = std::max<size_t>(std::stoul(value), 1); } },
+        { "cac-delta", "1 to only piggyback CAC signatures not broadcast yet",
+            [](ClientConfig & config, const char * value)
+            { config.deltaSignatures = std::stoi(value) != 0; } },
+        { "qc-proofs", "1 to send CAC proofs as quorum certificates",
+            [](ClientConfig & config, const char * value)
+            { config.quorumCertificates = std::stoi(value) != 0; } },
+        { "cac-piggyback", "1 to piggyback chosen commits instead of fetching missing ones",
+            [](ClientConfig & config, const char * value)
+            { config.piggybackCommits = std::stoi(value) != 0; } },
+        { "gossip-fanout", "constant c of the gossip sample size ln(n) + c",
+            [](ClientConfig & config, const char * value)
+            { config.gossipFanoutConstant = std::stoi(value); } },
+        { "gossip-digest-interval", "time (in ms) between gossip anti-entropy rounds, 0 to disable",
+            [](ClientConfig & config, const char * value)
+            { config.gossipDigestIntervalMs = std::stoi(value); } },
+        { "buffer-budget", "bytes of each buffer of messages received ahead of time",
+            [](ClientConfig & config, const char * value)
+            { config.bufferBudget = std::stoul(value); } },
+        { "buffer-epochs", "how many epochs ahead messages are buffered",
+            [](ClientConfig & config, const char * value)
+            { config.bufferEpochs = std::stoul(value); } },
+        { "commit-pipeline", "1 to build candidate commits on a worker thread as proposals arrive",
+            [](ClientConfig & config, const char * value)
+            { config.pipelineCommits = std::stoi(value) != 0; } },
+        { "commit-quorum", "proposals triggering the committer choice without waiting one rtt, 0 to disable",
+            [](ClientConfig & config, const char * value)
+            { config.commitQuorum = std::stoul(value); } },
+        { "cac-fast-path", "1 to deliver on n-t unanimous witnesses without the ready round, 0 to disable",
+            [](ClientConfig & config, const char * value)
+            { config.cacFastPath = std::stoi(value) != 0; } },
+        { "fc-skip-leaders", "1 to skip the full consensus views led by members whose last view failed",
+            [](ClientConfig & config, const char * value)
+            { config.skipSuspectedLeaders = std::stoi(value) != 0; } },
+        { "adaptive-rtt", "1 to derive timeouts from the measured rtt of the members",
+            [](ClientConfig & config, const char * value)
+            { config.adaptiveRtt = std::stoi(value) != 0; } },
+        { "rtt-probe-interval", "ms between two rounds of rtt probes (with adaptive-rtt)",
+            [](ClientConfig & config, const char * value)
+            { config.rttProbeIntervalMs = std::stoi(value); } },
+        { "crypto-threads", "threads verifying consensus signatures, 0 to verify on the network thread",
+            [](ClientConfig & config, const char * value)
+            { config.cryptoThreads = std::stoul(value); } },
+        { "seed", "seed of the random choices (gossip sampling), random by default",
+            [](ClientConfig & config, const char * value)
+            { config.seed = std::stoul(value); } },
+        { "batch-messages", "application messages packed in one MLS message (1 to disable)",
+            [](ClientConfig & config, const char * value)
+            { config.batchMessages = std::stoul(value); } },
+        { "batch-bytes", "bytes of application messages after which a batch is sent",
+            [](ClientConfig & config, const char * value)
+            { config.batchBytes = std::stoul(value); } },
+        { "batch-delay", "time (in ms) a batch waits for more application messages",
+            [](ClientConfig & config, const char * value)
+            { config.batchDelayMs = std::stoi(value); } },
+        { "commit-log", "decided commits kept for lagging members to catch up, 0 to disable",
+            [](ClientConfig & config, const char * value)
+            { config.commitLogEpochs = std::stoul(value); } },
+        { "relay-fanout", "children of each member in the tree relaying consensus messages, 0 to broadcast directly",
+            [](ClientConfig & config, const char * value)
+            { config.relayFanout = std::stoul(value); } },
+        { "relay-bytes", "consensus messages smaller than this are broadcast directly (with relay-fanout)",
+            [](ClientConfig & config, const char * value)
+            { config.relayBytes = std::stoul(value); } },
+        { "compress", "1 to compress consensus messages once every member can read them (built with ZSTD=1)",
+            [](ClientConfig & config, const char * value)
+            { config.compress = std::stoi(value) != 0; } },
+        { "metrics-file", "file the metrics are periodically written to (built with METRICS=1)",
+            [](ClientConfig & config, const char * value)
+            { config.metricsFile = value; } },
+        { "metrics-interval", "time (in ms) between two writes of the metrics file",
+            [](ClientConfig & config, const char * value)
+            { config.metricsIntervalMs = std::stoi(value); } }
+    };
+
+    return options;
+}
+
+static void printClientOptions(FILE * out)
+{
+    fprintf(out, "options:\n");
+    for(const auto & option : clientOptions())
+        fprintf(out, "  --%s=<value>\t%s\n", option.name, option.description);
+}
+
+static ClientConfig parseClientOptions(int argc, char * argv[], int first)
+{
+    ClientConfig config;
+
+    for(int idx = first; idx < argc; ++idx)
+    {
+        const char * arg = argv[idx];
+        const char * value = strchr(arg, '=');
+
+        bool found = false;
+        if(strncmp(arg, "--", 2) == 0 && value)
+        {
+            const std::string name{arg + 2, value};
+            for(const auto & option : clientOptions())
+                if(name == option.name)
+                {
+                    try
+                    {
+                        option.set(config, value + 1);
+                    }
+                    catch(const std::exception &)
+                    {
+                        fprintf(stderr, "Invalid value for option --%s\n", option.name);
+                        exit(EXIT_FAILURE);
+                    }
+                    found = true;
+                }
+        }
+
+        if(!found)
+        {
+            fprintf(stderr, "Unknown option %s\n", arg);
+            printClientOptions(stderr);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return config;
+}
+
+#endif
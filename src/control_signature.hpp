@@ -0,0 +1,66 @@
+/**
+ * @file control_signature.hpp
+ * @author Ludovic PAILLAT (Ludovic.PAILLAT@hivenet.com)
+ * @brief Detached signature of the consensus control statements (CAC
+ *  witness/ready, restrained consensus and full consensus votes)
+ *
+ * Unlike an MLSAuthenticatedContent, only the fields the statement needs are
+ *  sent: the group id is part of the signed data but is not transmitted. It is
+ *  signed and verified with the MLS signature key of the member, see
+ *  ExtendedMLSState::signControl() and ExtendedMLSState::verify().
+ */
+
+#ifndef __CONTROL_SIGNATURE_HPP__
+#define __CONTROL_SIGNATURE_HPP__
+
+#include <cstdint>
+
+#include "bytes/bytes.h"
+#include "mls/common.h"
+#include "tls/tls_syntax.h"
+
+enum ControlSignatureType : uint8_t
+{
+    CONTROL_CAC_WITNESS = 1,
+    CONTROL_CAC_READY,
+    CONTROL_RC_SUBSET,          /** Conflict set, endorsing its subsets containing the signer */
+    CONTROL_RC_RETRACT,
+    CONTROL_FC_PRE_PREPARE,
+    CONTROL_FC_PREPARE,
+    CONTROL_FC_COMMIT,
+    CONTROL_FC_VIEW_CHANGE,
+    CONTROL_DECIDED             /** Commit delivered by the signer, to let lagging members catch up */
+};
+
+struct ControlSignature
+{
+    uint8_t type;                       // ControlSignatureType
+    uint32_t signer;                    // LeafIndex of the signer
+    mls::epoch_t epoch;
+    uint32_t sequence;                  // CAC sequence or consensus view
+    mls::bytes_ns::bytes reference;     // Reference of the statement's subject, may be empty
+    mls::bytes_ns::bytes signature;
+
+    TLS_SERIALIZABLE(type, signer, epoch, sequence, reference, signature);
+
+    // Compatibility with std::sort and others, signatures are unique
+    bool operator<(const ControlSignature & other) const
+    {
+        return signature < other.signature;
+    }
+};
+
+// What is actually signed
+struct ControlSignatureContent
+{
+    mls::bytes_ns::bytes groupId;
+    uint8_t type;
+    uint32_t signer;
+    mls::epoch_t epoch;
+    uint32_t sequence;
+    mls::bytes_ns::bytes reference;
+
+    TLS_SERIALIZABLE(groupId, type, signer, epoch, sequence, reference);
+};
+
+#endif
@@ -14,6 +14,10 @@ DDSMessage:
         case WELCOME:           WelcomeMessage,
         case GOSSIP_BCAST:      GossipBroadcastMessage,
         case CASCADE_CONSENSUS: MLSMessage<CascadeConsensusMessage> // MLS Encapsulated to protect message and control epochs flow
+        case FETCH:             FetchMessage,
+        case PROBE:             ProbeMessage,
+        case CATCH_UP:          CatchUpMessage,
+        case RELAY:             RelayMessage
     }
 }
 
@@ -28,10 +32,54 @@ GossipBroadcast:
     select(type)
     {
         case SUBSCRIBE: { identity: bytes }, // TODO In better setting, just subscribe on current p2p link. Only think that is not secure/signed
-        case GOSSIP:    MLSMessage // Proposal or app message, commit should not be allowed
+        case GOSSIP:    MLSMessage, // Proposal or app message, commit should not be allowed
+        case DIGEST:    { identity: bytes, epoch: u64, reply: u8, refs: list<bytes> } // Anti-entropy, receiver pushes the messages missing from refs
     }
 }
 
+FetchMessage: // Ask a member for messages known only by their reference
+{
+    type: u8,
+    select(type)
+    {
+        case REQUEST:  { identity: bytes, refs: list<bytes> }, // Commit (MessageRef) or proposal (ProposalRef) references
+        case RESPONSE: { messages: list<MLSMessage> }          // The requested messages known by the member
+    }
+}
+
+ProbeMessage: // Round trip time measurement
+{
+    identity: bytes,
+    reply: u8,      // Whether it answers a probe
+    timestamp: u64  // Local clock of the prober, echoed in the reply
+}
+
+CatchUpMessage: // Commits decided in epochs a lagging member missed
+{
+    type: u8,
+    select(type)
+    {
+        case REQUEST:  { identity: bytes, epoch: u64, full: u8 }, // Epochs from epoch, commits included if full
+        case RESPONSE:
+        {
+            commits: list<{ commit: MLSMessage, proposals: list<MLSMessage> }>,
+            attestations: list<ControlSignature> // CONTROL_DECIDED by the responder, one per epoch
+        }
+    }
+}
+
+RelayMessage: // Cascade Consensus message forwarded down the k-ary tree rooted at its sender
+{
+    origin: u32,    // LeafIndex of the sender
+    fanout: u8,     // Children of each member in the tree
+    message: MLSMessage<CascadeConsensusMessage>
+}
+
+ApplicationBatch: // Plaintext of an application MLSMessage whose authenticated data is "DDS batch"
+{
+    payloads: list<bytes>
+}
+
 CascadeConsensusMessage:
 {
     type: u8,
@@ -58,11 +106,34 @@ CACMessage:
     }
 }
 
-CACSignature: MLSAuthenticatedContent<{ seq: u32, witOrReady: u8, messageHash: bytes }>
-// TODO Consider a lighter structure: MLSAuthContent contains unnecessary fields in this context
+CACSignature: ControlSignature // type WITNESS or READY, sequence, messageHash as reference
+
+ControlSignature: (see control_signature.hpp)
+{
+    type: u8,
+    signer: u32, // Leaf index
+    epoch: u64,
+    sequence: u32,
+    reference: bytes,
+    signature: bytes // Over { group_id, type, signer, epoch, sequence, reference }
+}
+
+QuorumCertificate: (CACSignatures on the same statement, see quorum_certificate.hpp)
+{
+    witOrReady: u8,
+    messageHash: bytes,
+    signers: bytes, // Bitmap indexed by leaf index
+    sequences: list<u32>,
+    signatures: list<bytes>
+}
 
-RCMessage: TBD
-FCMessage: TBD
+RCMessage: TBD, CAC signatures used as proofs are either full CACSignatures
+    or QuorumCertificates. The sender signs the hash of the sorted conflict
+    set once, endorsing all its subsets containing the sender, retractions
+    are ControlSignatures too
+FCMessage: TBD, votes are ControlSignatures with the view as sequence, view
+    changes also carry the value prepared in the highest view with its 2f + 1
+    prepare votes
 
 Misc:
 
@@ -103,25 +174,42 @@ optional<T>:
 #include "tls/tls_syntax.h"
 
 #include "cac_signature.hpp"
+#include "control_signature.hpp"
 #include "extended_mls_state.hpp"
 #include "network.hpp"
+#include "quorum_certificate.hpp"
 
 enum DDSMessageType : uint8_t
 {
     DDS_WELCOME = 1,
     DDS_GOSSIP_BCAST,
-    DDS_CASCADE_CONSENSUS
+    DDS_CASCADE_CONSENSUS,
+    DDS_FETCH,
+    DDS_PROBE,
+    DDS_CATCH_UP,
+    DDS_RELAY
 };
 
 enum GossipBcastMessageType : uint8_t
 {
     GOSSIP_SUBSCRIBE = 1, // TODO Handle unsubscribe ?
-    GOSSIP_GOSSIP
+    GOSSIP_GOSSIP,
+    GOSSIP_DIGEST
+};
+
+struct GossipDigest
+{
+    mls::bytes_ns::bytes senderId;
+    mls::epoch_t epoch;
+    uint8_t reply;                          // Whether it answers a digest
+    std::vector<MessageRef> refs;           // Messages received during the epoch
+
+    TLS_SERIALIZABLE(senderId, epoch, reply, refs);
 };
 
 struct GossipBcastMessage
 {
-    std::variant<mls::bytes_ns::bytes, mls::MLSMessage> content;
+    std::variant<mls::bytes_ns::bytes, mls::MLSMessage, GossipDigest> content;
 
     GossipBcastMessageType type() const
     { return mls::tls::variant<GossipBcastMessageType>::type(content); }
@@ -130,16 +218,154 @@ struct GossipBcastMessage
     { return type() == GOSSIP_SUBSCRIBE; }
     bool isGossip() const
     { return type() == GOSSIP_GOSSIP; }
+    bool isDigest() const
+    { return type() == GOSSIP_DIGEST; }
 
     const mls::bytes_ns::bytes & subscriberId() const
     { return std::get<mls::bytes_ns::bytes>(content); }
     const mls::MLSMessage & bcastMessage() const
     { return std::get<mls::MLSMessage>(content); }
+    const GossipDigest & digest() const
+    { return std::get<GossipDigest>(content); }
 
     TLS_SERIALIZABLE(content);
     TLS_TRAITS(mls::tls::variant<GossipBcastMessageType>);
 };
 
+enum FetchMessageType : uint8_t
+{
+    FETCH_REQUEST = 1,
+    FETCH_RESPONSE
+};
+
+static constexpr size_t FETCH_MAX_REFS = 256; // Per request, others are ignored
+
+struct FetchRequest
+{
+    mls::bytes_ns::bytes requesterId;
+    std::vector<mls::bytes_ns::bytes> refs;
+
+    TLS_SERIALIZABLE(requesterId, refs);
+};
+
+struct FetchResponse
+{
+    std::vector<mls::MLSMessage> messages;
+
+    TLS_SERIALIZABLE(messages);
+};
+
+struct FetchMessage
+{
+    std::variant<FetchRequest, FetchResponse> content;
+
+    FetchMessageType type() const
+    { return mls::tls::variant<FetchMessageType>::type(content); }
+
+    bool isRequest() const
+    { return type() == FETCH_REQUEST; }
+    bool isResponse() const
+    { return type() == FETCH_RESPONSE; }
+
+    const FetchRequest & request() const
+    { return std::get<FetchRequest>(content); }
+    const FetchResponse & response() const
+    { return std::get<FetchResponse>(content); }
+
+    TLS_SERIALIZABLE(content);
+    TLS_TRAITS(mls::tls::variant<FetchMessageType>);
+};
+
+struct ProbeMessage
+{
+    mls::bytes_ns::bytes senderId;
+    uint8_t reply;
+    uint64_t timestamp;
+
+    TLS_SERIALIZABLE(senderId, reply, timestamp);
+};
+
+enum CatchUpMessageType : uint8_t
+{
+    CATCH_UP_REQUEST = 1,
+    CATCH_UP_RESPONSE
+};
+
+static constexpr size_t DEFAULT_COMMIT_LOG_EPOCHS = 16;
+static constexpr size_t CATCH_UP_MAX_EPOCHS = 8; // Per response
+
+struct CatchUpRequest
+{
+    mls::bytes_ns::bytes requesterId;
+    mls::epoch_t epoch;         // First epoch missing
+    uint8_t full;               // Whether commits are sent, or only attestations
+
+    TLS_SERIALIZABLE(requesterId, epoch, full);
+};
+
+// Commit decided in the epoch, with the proposals it may reference
+struct DecidedCommit
+{
+    mls::MLSMessage commit;
+    std::vector<mls::MLSMessage> proposals;
+
+    TLS_SERIALIZABLE(commit, proposals);
+};
+
+struct CatchUpResponse
+{
+    mls::bytes_ns::bytes responderId;
+    std::vector<DecidedCommit> commits;
+    std::vector<ControlSignature> attestations; // Of the responder only
+
+    TLS_SERIALIZABLE(responderId, commits, attestations);
+};
+
+struct CatchUpMessage
+{
+    std::variant<CatchUpRequest, CatchUpResponse> content;
+
+    CatchUpMessageType type() const
+    { return mls::tls::variant<CatchUpMessageType>::type(content); }
+
+    bool isRequest() const
+    { return type() == CATCH_UP_REQUEST; }
+    bool isResponse() const
+    { return type() == CATCH_UP_RESPONSE; }
+
+    const CatchUpRequest & request() const
+    { return std::get<CatchUpRequest>(content); }
+    const CatchUpResponse & response() const
+    { return std::get<CatchUpResponse>(content); }
+
+    TLS_SERIALIZABLE(content);
+    TLS_TRAITS(mls::tls::variant<CatchUpMessageType>);
+};
+
+// The sender is not authenticated before the message is decrypted: a wrong
+//  origin only misroutes it, the direct broadcast after a timeout covers it
+struct RelayMessage
+{
+    uint32_t origin;
+    uint8_t fanout;
+    mls::MLSMessage message;
+
+    TLS_SERIALIZABLE(origin, fanout, message);
+};
+
+// Application payloads packed in a single MLS message
+static const mls::bytes_ns::bytes APPLICATION_BATCH_AAD = { 'D', 'D', 'S', ' ', 'b', 'a', 't', 'c', 'h' };
+static constexpr size_t DEFAULT_BATCH_MESSAGES = 1; // Not batched
+static constexpr size_t DEFAULT_BATCH_BYTES = 64 * 1024;
+static constexpr int DEFAULT_BATCH_DELAY_MS = 5;
+
+struct ApplicationBatch
+{
+    std::vector<mls::bytes_ns::bytes> payloads;
+
+    TLS_SERIALIZABLE(payloads);
+};
+
 enum CascadeConsensusMessageType : uint8_t
 {
     CASCADE_CONSENSUS_CAC = 1,
@@ -152,7 +378,7 @@ template <typename T>
 struct CACMessage
 {
     bool witnessOrReady;
-    std::vector<mls::AuthenticatedContent> sigs;
+    std::vector<ControlSignature> sigs;
     std::optional<T> optBroadcastMessage;
 
     bool isWitness() const
@@ -174,18 +400,22 @@ enum RestrainedConsensusMessageType : uint8_t
     RESTRAINED_CONSENSUS_RETRACT
 };
 
+// Commits in conflict with the sender of each, sorted
+using ConflictSet = std::vector<std::pair<mls::LeafIndex, MessageRef>>;
+
 struct RestrainedConsContent
 {
-    std::vector<mls::AuthenticatedContent> sigSet;
-    std::vector<std::vector<std::pair<mls::LeafIndex, MessageRef>>> powerConflictSet;
-    std::vector<mls::AuthenticatedContent> proofs;
+    ControlSignature signature;     // References the hash of conflictSet
+    ConflictSet conflictSet;
+    std::vector<ControlSignature> proofs;
+    std::vector<QuorumCertificate> proofCertificates; // Proofs in compact form
 
-    TLS_SERIALIZABLE(sigSet, powerConflictSet, proofs);
+    TLS_SERIALIZABLE(signature, conflictSet, proofs, proofCertificates);
 };
 
 struct RestrainedConsensusMessage
 {
-    std::variant<RestrainedConsContent, mls::AuthenticatedContent> content;
+    std::variant<RestrainedConsContent, ControlSignature> content;
 
     RestrainedConsensusMessageType type() const
     { return mls::tls::variant<RestrainedConsensusMessageType>::type(content); }
@@ -197,8 +427,8 @@ struct RestrainedConsensusMessage
 
     const RestrainedConsContent & restrainedCons() const
     { return std::get<RestrainedConsContent>(content); }
-    const mls::AuthenticatedContent & retract() const
-    { return std::get<mls::AuthenticatedContent>(content); }
+    const ControlSignature & retract() const
+    { return std::get<ControlSignature>(content); }
 
     TLS_SERIALIZABLE(content);
     TLS_TRAITS(mls::tls::variant<RestrainedConsensusMessageType>);
@@ -207,9 +437,13 @@ struct RestrainedConsensusMessage
 struct CAC2Content
 {
     std::vector<MessageRef> conflictingMessages;
-    std::vector<mls::AuthenticatedContent> signatures;
+    std::vector<ControlSignature> signatures;
+    std::vector<QuorumCertificate> certificates; // CAC1 signatures in compact form
+    // Signed by the restrained consensus endorsements of signatures, in the
+    //  same order: each proves its signer endorsed the subset on its own
+    std::vector<ConflictSet> endorsedSets;
 
-    TLS_SERIALIZABLE(conflictingMessages, signatures);
+    TLS_SERIALIZABLE(conflictingMessages, signatures, certificates, endorsedSets);
 };
 
 enum ConsensusMessageType : uint8_t
@@ -229,6 +463,7 @@ struct ConsensusProposeMessage
     TLS_SERIALIZABLE(view, content);
 };
 
+// Content of a signed vote (view as sequence, consensusMessage as reference)
 struct ConsensusMessageContent
 {
     uint32_t view;
@@ -239,27 +474,32 @@ struct ConsensusMessageContent
 template <typename T>
 struct ConsensusPrePrepareMessage
 {
-    mls::AuthenticatedContent signedContent;
+    ControlSignature signedContent;
     T proposedMessage;
     TLS_SERIALIZABLE(signedContent, proposedMessage);
 };
 
 struct ConsensusPrepareMessage
 {
-    mls::AuthenticatedContent signedContent;
+    ControlSignature signedContent;
     TLS_SERIALIZABLE(signedContent);
 };
 
 struct ConsensusCommitMessage
 {
-    mls::AuthenticatedContent signedContent;
+    ControlSignature signedContent;
     TLS_SERIALIZABLE(signedContent);
 };
 
-struct ViewChangeMessageContent
+// Signed with the new view as sequence and the prepared value, if any, as
+//  reference: the leader of the new view proposes it again
+template <typename T>
+struct ConsensusViewChangeMessage
 {
-    uint32_t view;
-    TLS_SERIALIZABLE(view);
+    ControlSignature signedContent;
+    std::vector<ControlSignature> prepared; // Prepares of a single view
+    std::optional<T> preparedMessage;
+    TLS_SERIALIZABLE(signedContent, prepared, preparedMessage);
 };
 
 template <typename T>
@@ -267,7 +507,7 @@ struct ConsensusMessage
 {
     std::variant<ConsensusProposeMessage<T>, ConsensusPrePrepareMessage<T>,
         ConsensusPrepareMessage, ConsensusCommitMessage,
-        mls::AuthenticatedContent> content;
+        ConsensusViewChangeMessage<T>> content;
 
     ConsensusMessageType type() const
     { return mls::tls::variant<ConsensusMessageType>::type(content); }
@@ -280,8 +520,8 @@ struct ConsensusMessage
     { return std::get<ConsensusPrepareMessage>(content); }
     const ConsensusCommitMessage & commitMessage() const
     { return std::get<ConsensusCommitMessage>(content); }
-    const mls::AuthenticatedContent & viewChange() const
-    { return std::get<mls::AuthenticatedContent>(content); }
+    const ConsensusViewChangeMessage<T> & viewChange() const
+    { return std::get<ConsensusViewChangeMessage<T>>(content); }
 
     TLS_SERIALIZABLE(content);
     TLS_TRAITS(mls::tls::variant<ConsensusMessageType>);
@@ -321,7 +561,8 @@ struct CascadeConsensusMessage
 
 struct DDSMessage
 {
-    std::variant<mls::Welcome, GossipBcastMessage, mls::MLSMessage> content;
+    std::variant<mls::Welcome, GossipBcastMessage, mls::MLSMessage, FetchMessage,
+        ProbeMessage, CatchUpMessage, RelayMessage> content;
 
     DDSMessageType type() const
     { return mls::tls::variant<DDSMessageType>::type(content); }
@@ -332,6 +573,14 @@ struct DDSMessage
     { return type() == DDS_GOSSIP_BCAST; }
     bool isCascadeConsensus() const
     { return type() == DDS_CASCADE_CONSENSUS; }
+    bool isFetch() const
+    { return type() == DDS_FETCH; }
+    bool isProbe() const
+    { return type() == DDS_PROBE; }
+    bool isCatchUp() const
+    { return type() == DDS_CATCH_UP; }
+    bool isRelay() const
+    { return type() == DDS_RELAY; }
 
     const mls::Welcome & welcome() const
     { return std::get<mls::Welcome>(content); }
@@ -339,6 +588,14 @@ struct DDSMessage
     { return std::get<GossipBcastMessage>(content); }
     const mls::MLSMessage & cascadeConsensusMessage() const
     { return std::get<mls::MLSMessage>(content); }
+    const FetchMessage & fetchMessage() const
+    { return std::get<FetchMessage>(content); }
+    const ProbeMessage & probeMessage() const
+    { return std::get<ProbeMessage>(content); }
+    const CatchUpMessage & catchUpMessage() const
+    { return std::get<CatchUpMessage>(content); }
+    const RelayMessage & relayMessage() const
+    { return std::get<RelayMessage>(content); }
 
     TLS_SERIALIZABLE(content);
     TLS_TRAITS(mls::tls::variant<DDSMessageType>);
@@ -348,10 +605,17 @@ namespace mls::tls
 {
     TLS_VARIANT_MAP(GossipBcastMessageType, mls::bytes_ns::bytes, GOSSIP_SUBSCRIBE);
     TLS_VARIANT_MAP(GossipBcastMessageType, mls::MLSMessage, GOSSIP_GOSSIP);
+    TLS_VARIANT_MAP(GossipBcastMessageType, GossipDigest, GOSSIP_DIGEST);
+
+    TLS_VARIANT_MAP(FetchMessageType, FetchRequest, FETCH_REQUEST);
+    TLS_VARIANT_MAP(FetchMessageType, FetchResponse, FETCH_RESPONSE);
+
+    TLS_VARIANT_MAP(CatchUpMessageType, CatchUpRequest, CATCH_UP_REQUEST);
+    TLS_VARIANT_MAP(CatchUpMessageType, CatchUpResponse, CATCH_UP_RESPONSE);
 
     TLS_VARIANT_MAP(RestrainedConsensusMessageType, RestrainedConsContent,
         RESTRAINED_CONSENSUS_PARTICIPATE);
-    TLS_VARIANT_MAP(RestrainedConsensusMessageType, mls::AuthenticatedContent,
+    TLS_VARIANT_MAP(RestrainedConsensusMessageType, ControlSignature,
         RESTRAINED_CONSENSUS_RETRACT);
 
     TLS_VARIANT_MAP(ConsensusMessageType, ConsensusProposeMessage<CAC2Content>,
@@ -360,7 +624,8 @@ namespace mls::tls
         CONSENSUS_PRE_PREPARE);
     TLS_VARIANT_MAP(ConsensusMessageType, ConsensusPrepareMessage, CONSENSUS_PREPARE);
     TLS_VARIANT_MAP(ConsensusMessageType, ConsensusCommitMessage,CONSENSUS_COMMIT);
-    TLS_VARIANT_MAP(ConsensusMessageType, mls::AuthenticatedContent, CONSENSUS_VIEW_CHANGE);
+    TLS_VARIANT_MAP(ConsensusMessageType, ConsensusViewChangeMessage<CAC2Content>,
+        CONSENSUS_VIEW_CHANGE);
 
     TLS_VARIANT_MAP(CascadeConsensusMessageType, CACMessage<MLSMessage>, CASCADE_CONSENSUS_CAC);
     TLS_VARIANT_MAP(CascadeConsensusMessageType, CACMessage<CAC2Content>,
@@ -373,6 +638,10 @@ namespace mls::tls
     TLS_VARIANT_MAP(DDSMessageType, mls::Welcome, DDS_WELCOME);
     TLS_VARIANT_MAP(DDSMessageType, GossipBcastMessage, DDS_GOSSIP_BCAST);
     TLS_VARIANT_MAP(DDSMessageType, mls::MLSMessage, DDS_CASCADE_CONSENSUS);
+    TLS_VARIANT_MAP(DDSMessageType, FetchMessage, DDS_FETCH);
+    TLS_VARIANT_MAP(DDSMessageType, ProbeMessage, DDS_PROBE);
+    TLS_VARIANT_MAP(DDSMessageType, CatchUpMessage, DDS_CATCH_UP);
+    TLS_VARIANT_MAP(DDSMessageType, RelayMessage, DDS_RELAY);
 }
 
 // Add TLS serialization support for pairs
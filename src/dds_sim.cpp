@@ -0,0 +1,915 @@
+/**
+ * @file dds_sim.cpp
+ * @author Ludovic PAILLAT (Ludovic.PAILLAT@hivenet.com)
+ * @brief Deterministic simulation of a group of clients using the Distributed
+ *  Delivery Service, all running in this process
+ *
+ * Usage: ./dds_sim [--sim-option=value...] [--option=value...]
+ *  - sim options: size of the group, scenario and network model, see
+ *      simOptions() (running with --help lists them)
+ *  - options:     tunable parameters of the clients, see config.hpp
+ *
+ * Clients exchange their frames through a simulated network driven by a
+ *  virtual clock: each link has a latency, each client an upload bandwidth
+ *  shared by its frames, and a lost frame is retransmitted after two link
+ *  latencies (links are reliable, as TCP ones). Events are ordered by time,
+ *  then by scheduling order: runs with the same seed have the same network
+ *  schedule (latencies, losses, proposers and gossip samples), unless the
+ *  computing time is simulated too (--cpu=1), which is measured. Keys and
+ *  signatures are drawn by the crypto library, which is not seeded, so the
+ *  messages themselves differ between runs.
+ *
+ * The group is created by the first client, which adds every other one in a
+ *  single commit. Then each epoch, a few members send an update proposal and
+ *  the epoch ends once every member reached the next one. With --committers,
+ *  members commit at once instead, and their commits conflict.
+ *
+ * Worker threads are not simulated: the tasks of the worker pools of a client
+ *  (--commit-pipeline, --crypto-threads) are events of the client run after
+ *  --worker-delay, and their results are handed back as posted events.
+ *
+ * With --crashed, the leaders of the first views of the full consensus stop
+ *  once the group is created, their frames and timers are dropped, and the
+ *  epochs only await the other members.
+ *
+ * Then, with --app-messages, each member sends application messages and the
+ *  throughput is measured until every member received the messages of the
+ *  others (see the batch-* client options).
+ *
+ * Output: for each group size, the percentiles of the time for the members
+ *  to reach the next epoch, the bytes sent per commit, the signatures
+ *  verified per member and the tier of the consensus deciding the epochs,
+ *  and the application messages delivered per second
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <optional>
+#include <queue>
+#include <random>
+#include <span>
+#include <string>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "bytes/bytes.h"
+#include "mls/crypto.h"
+#include "mls/messages.h"
+
+#include "compression.hpp"
+#include "config.hpp"
+#include "message.hpp"
+#include "mls_client.hpp"
+#include "network.hpp"
+#include "worker_pool.hpp"
+
+struct SimConfig
+{
+    std::vector<size_t> groupSizes = { 10 };
+    size_t epochs = 10;
+    size_t proposers = 1;           // Update proposals per epoch
+    size_t committers = 0;          // Members committing at once each epoch, instead of the proposals
+    int latencyMs = 50;             // Mean one-way latency of a link
+    double latencySpread = 0.5;     // Latencies are uniform in latency * [1 - spread, 1 + spread]
+    double loss = 0;                // Probability that a frame is retransmitted
+    double bandwidth = 12.5 * 1000; // Upload of each client, bytes per ms (100 Mbit/s)
+    uint32_t seed = 1;
+    bool cpu = false;               // Whether the computing time of the clients is simulated
+    int workerDelayMs = 0;          // Time taken by each task of the worker pools
+    std::optional<int> networkRtt;  // Given to the clients, twice the largest latency by default
+    int epochTimeoutRtts = 100;     // An epoch not reached after this many rtt is a failure
+    bool verbose = false;           // Keep the output of the clients
+    size_t appMessages = 0;         // Application messages sent by each member after the epochs
+    size_t appSize = 100;           // Bytes of each application message
+    double appRate = 0;             // Messages per second of each member, 0 to send them at once
+    size_t crashed = 0;             // Leaders of the first full consensus views, crashed after the join
+    std::optional<bool> expectFastPath; // Whether the epochs have to be decided by the fast path
+    bool expectSkippedViews = false;    // Whether full consensus views have to be skipped
+    bool expectRejectedPrePrepares = false; // Whether pre-prepares have to be rejected
+    bool expectSpeculation = false;     // Whether commits built in advance have to be proposed
+    bool expectStaleSpeculation = false; // Whether some have to be dropped as stale
+};
+
+struct SimOption
+{
+    const char * name;
+    const char * description;
+    std::function<void(SimConfig &, const char *)> set;
+};
+
+static const std::vector<SimOption> & simOptions()
+{
+    static const std::vector<SimOption> options = {
+        { "nodes", "comma separated group sizes, each simulated in turn",
+            [](SimConfig & config, const char * value)
+            {
+                config.groupSizes.clear();
+                for(const char * size = value; size; size = strchr(size, ','))
+                {
+                    if(*size == ',')
+                        ++size;
+                    config.groupSizes.emplace_back(std::stoul(size));
+                }
+            } },
+        { "epochs", "epochs measured after the group is created",
+            [](SimConfig & config, const char * value)
+            { config.epochs = std::stoul(value); } },
+        { "proposers", "members sending an update proposal each epoch",
+            [](SimConfig & config, const char * value)
+            { config.proposers = std::stoul(value); } },
+        { "committers", "members committing at once at the start of each epoch, instead of the"
+            " update proposals (from 2, the commits conflict)",
+            [](SimConfig & config, const char * value)
+            { config.committers = std::stoul(value); } },
+        { "latency", "mean one-way latency of the links (in ms)",
+            [](SimConfig & config, const char * value)
+            { config.latencyMs = std::stoi(value); } },
+        { "latency-spread", "latencies are uniform in latency * [1 - spread, 1 + spread]",
+            [](SimConfig & config, const char * value)
+            { config.latencySpread = std::stod(value); } },
+        { "loss", "probability that a frame is lost and retransmitted",
+            [](SimConfig & config, const char * value)
+            { config.loss = std::stod(value); } },
+        { "bandwidth", "upload bandwidth of each client (in Mbit/s)",
+            [](SimConfig & config, const char * value)
+            { config.bandwidth = std::stod(value) * 1000 * 1000 / 8 / 1000; } },
+        { "sim-seed", "seed of the simulation",
+            [](SimConfig & config, const char * value)
+            { config.seed = std::stoul(value); } },
+        { "cpu", "1 to delay each client by its measured computing time (not deterministic)",
+            [](SimConfig & config, const char * value)
+            { config.cpu = std::stoi(value) != 0; } },
+        { "worker-delay", "time taken by each task of the worker pools of the clients (in ms),"
+            " with --commit-pipeline and --crypto-threads",
+            [](SimConfig & config, const char * value)
+            { config.workerDelayMs = std::stoi(value); } },
+        { "rtt", "network-rtt given to the clients (in ms), twice the largest latency by default",
+            [](SimConfig & config, const char * value)
+            { config.networkRtt = std::stoi(value); } },
+        { "epoch-timeout", "rtts after which an epoch not reached by every member is a failure",
+            [](SimConfig & config, const char * value)
+            { config.epochTimeoutRtts = std::stoi(value); } },
+        { "app-messages", "application messages sent by each member once the epochs are measured",
+            [](SimConfig & config, const char * value)
+            { config.appMessages = std::stoul(value); } },
+        { "app-size", "bytes of each application message",
+            [](SimConfig & config, const char * value)
+            { config.appSize = std::stoul(value); } },
+        { "app-rate", "application messages per second of each member, 0 to send them at once",
+            [](SimConfig & config, const char * value)
+            { config.appRate = std::stod(value); } },
+        { "crashed", "members crashing once the group is created, the leaders of the first views"
+            " of the full consensus in the next epoch",
+            [](SimConfig & config, const char * value)
+            { config.crashed = std::stoul(value); } },
+        { "expect-fast-path", "1 to fail unless some epochs are decided by the CAC fast path,"
+            " 0 to fail if one is (group creation excluded)",
+            [](SimConfig & config, const char * value)
+            { config.expectFastPath = std::stoi(value) != 0; } },
+        { "expect-skipped-views", "1 to fail unless full consensus views led by suspected members"
+            " are skipped",
+            [](SimConfig & config, const char * value)
+            { config.expectSkippedViews = std::stoi(value) != 0; } },
+        { "expect-rejected-pre-prepares", "1 to fail unless full consensus pre-prepares of"
+            " another value than the one prepared are rejected",
+            [](SimConfig & config, const char * value)
+            { config.expectRejectedPrePrepares = std::stoi(value) != 0; } },
+        { "expect-speculation", "1 to fail unless commits built in advance are proposed"
+            " (with --commit-pipeline)",
+            [](SimConfig & config, const char * value)
+            { config.expectSpeculation = std::stoi(value) != 0; } },
+        { "expect-stale-speculation", "1 to fail unless commits built in advance are dropped"
+            " as the proposals changed meanwhile (with --commit-pipeline)",
+            [](SimConfig & config, const char * value)
+            { config.expectStaleSpeculation = std::stoi(value) != 0; } },
+        { "verbose", "1 to keep the output of the clients",
+            [](SimConfig & config, const char * value)
+            { config.verbose = std::stoi(value) != 0; } }
+    };
+
+    return options;
+}
+
+class SimulatedNetwork;
+
+/**
+ * Virtual clock and queue of the events of every client, with the model of
+ *  the links between them
+ */
+class Simulation
+{
+public:
+    using Event = std::function<void()>;
+    static constexpr size_t NO_NODE = std::numeric_limits<size_t>::max();
+
+    Simulation(const SimConfig & config)
+        : m_config(config), m_random(config.seed)
+    { }
+
+    timePoint now() const
+    {
+        if(!m_config.cpu || m_running == NO_NODE)
+            return m_now;
+
+        // Time spent by the running client
+        return m_now + std::chrono::duration_cast<timePoint::duration>(
+            std::chrono::steady_clock::now() - m_runningSince);
+    }
+
+    void schedule(timePoint at, size_t node, Event event)
+    {
+        m_events.push({ at, m_sequence++, node, std::move(event) });
+    }
+
+    // Run the next event, false if there is none
+    bool step()
+    {
+        if(m_events.empty())
+            return false;
+
+        ScheduledEvent next = std::move(const_cast<ScheduledEvent &>(m_events.top()));
+        m_events.pop();
+        m_now = std::max(m_now, next.at);
+
+        // Frames, timers and tasks of a crashed client are dropped
+        if(next.node != NO_NODE && m_crashed[next.node])
+            return true;
+
+        // A busy client handles its events once it is done
+        if(m_config.cpu && next.node != NO_NODE && m_busyUntil[next.node] > m_now)
+        {
+            schedule(m_busyUntil[next.node], next.node, std::move(next.event));
+            return true;
+        }
+
+        m_running = next.node, m_runningSince = std::chrono::steady_clock::now();
+        next.event();
+        if(m_config.cpu && next.node != NO_NODE)
+            m_busyUntil[next.node] = now();
+        m_running = NO_NODE;
+
+        if(next.node != NO_NODE && m_afterEvent)
+            m_afterEvent(next.node);
+
+        return true;
+    }
+
+    // Called with the client whose event was just handled
+    void setAfterEvent(const std::function<void(size_t)> & afterEvent)
+    {
+        m_afterEvent = afterEvent;
+    }
+
+    void addNode(const std::string & name, SimulatedNetwork * network)
+    {
+        m_nodes.emplace(name, m_networks.size());
+        m_networks.emplace_back(network);
+        m_uplinkFree.emplace_back(m_now);
+        m_busyUntil.emplace_back(m_now);
+        m_crashed.emplace_back(false);
+    }
+
+    // The client stops at once, without notice
+    void crash(size_t node)
+    {
+        m_crashed[node] = true;
+    }
+
+    bool crashed(size_t node) const
+    {
+        return m_crashed[node];
+    }
+
+    std::optional<size_t> node(const std::string & name) const
+    {
+        const auto nodeIt = m_nodes.find(name);
+        if(nodeIt == m_nodes.end())
+            return {};
+        return nodeIt->second;
+    }
+
+    // Frames are serialized on the upload link of the sender, then travel
+    void transmit(size_t from, size_t to, const SharedBytes & message);
+
+    uint64_t bytesSent() const { return m_bytesSent; }
+    uint64_t framesSent() const { return m_framesSent; }
+
+private:
+    struct ScheduledEvent
+    {
+        timePoint at;
+        uint64_t sequence;
+        size_t node;
+        Event event;
+
+        bool operator>(const ScheduledEvent & other) const
+        {
+            return at != other.at ? at > other.at : sequence > other.sequence;
+        }
+    };
+
+    // Same for both directions, fixed for a given seed
+    timePoint::duration linkLatency(size_t from, size_t to) const
+    {
+        uint64_t hash = (std::min(from, to) << 32) ^ std::max(from, to) ^ ((uint64_t) m_config.seed << 48);
+        hash += 0x9E3779B97F4A7C15, hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9;
+        hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EB, hash ^= hash >> 31; // splitmix64
+
+        const double uniform = (hash >> 11) * (1.0 / (uint64_t{1} << 53));
+        const double latency = m_config.latencyMs
+            * (1 - m_config.latencySpread + 2 * m_config.latencySpread * uniform);
+
+        return std::chrono::duration_cast<timePoint::duration>(
+            std::chrono::duration<double, std::milli>{latency});
+    }
+
+    const SimConfig & m_config;
+    std::mt19937_64 m_random;
+
+    timePoint m_now = {};
+    uint64_t m_sequence = 0;
+    std::priority_queue<ScheduledEvent, std::vector<ScheduledEvent>,
+        std::greater<ScheduledEvent>> m_events;
+    std::function<void(size_t)> m_afterEvent;
+
+    size_t m_running = NO_NODE;
+    std::chrono::steady_clock::time_point m_runningSince;
+
+    std::unordered_map<std::string, size_t> m_nodes;
+    std::vector<SimulatedNetwork *> m_networks;
+    std::vector<timePoint> m_uplinkFree, m_busyUntil;
+    std::vector<bool> m_crashed;
+
+    uint64_t m_bytesSent = 0, m_framesSent = 0;
+};
+
+class SimulatedNetwork
+    : public Network
+{
+public:
+    SimulatedNetwork(Simulation & simulation, size_t self)
+        : m_simulation(simulation), m_self(self)
+    { }
+
+    timePoint now() const override
+    {
+        return m_simulation.now();
+    }
+
+    timeoutID registerTimeout(int msDelay, timeoutCallback callback) override
+    {
+        const timeoutID id = m_timeoutCounter++;
+        m_timeouts.insert(id);
+
+        m_simulation.schedule(now() + std::chrono::milliseconds{msDelay}, m_self,
+            [this, id, callback = std::move(callback)]()
+            {
+                if(m_timeouts.erase(id)) // Otherwise cancelled
+                    callback(id);
+            });
+
+        return id;
+    }
+
+    void unregisterTimeout(timeoutID id) override
+    {
+        m_timeouts.erase(id);
+    }
+
+    // The simulation has a single thread: the results of the worker tasks,
+    //  themselves events of this client, are handed back as new events
+    void post(std::function<void()> task) override
+    {
+        m_simulation.schedule(now(), m_self, std::move(task));
+    }
+
+    void setHandleMessage(const MessageHandler & handleMessage) override
+    {
+        if(!m_handleMessage)
+            m_handleMessage = handleMessage;
+    }
+
+    void connect(const std::string & id) override
+    {
+        const auto peer = m_simulation.node(id);
+        if(peer && peer.value() != m_self)
+            m_peers.insert(peer.value());
+    }
+
+    void connect(const std::vector<std::string> & ids) override
+    {
+        for(const auto & id : ids)
+            connect(id);
+    }
+
+    void disconnect(const std::string & id) override
+    {
+        if(const auto peer = m_simulation.node(id))
+            m_peers.erase(peer.value());
+    }
+
+    void broadcast(const SharedBytes & message) override
+    {
+        // Sorted, the order of the frames does not depend on the hash table
+        std::vector<size_t> peers{m_peers.begin(), m_peers.end()};
+        std::sort(peers.begin(), peers.end());
+
+        for(const auto peer : peers)
+            m_simulation.transmit(m_self, peer, message);
+    }
+
+    void broadcastSample(const std::vector<std::string> & sample,
+        const SharedBytes & message) override
+    {
+        for(const auto & id : sample)
+            if(const auto peer = m_simulation.node(id); peer && m_peers.contains(peer.value()))
+                m_simulation.transmit(m_self, peer.value(), message);
+    }
+
+    void send(const std::string & id, const SharedBytes & message) override
+    {
+        connect(id);
+
+        if(const auto peer = m_simulation.node(id); peer && peer.value() != m_self)
+            m_simulation.transmit(m_self, peer.value(), message);
+    }
+
+    // Every client of the simulation runs this build
+    std::optional<uint8_t> peerFeatures(const std::string & id) const override
+    {
+        (void) id;
+        return LOCAL_FEATURES;
+    }
+
+    void receive(std::span<const uint8_t> message)
+    {
+        if(m_handleMessage)
+            m_handleMessage(message);
+    }
+
+private:
+    Simulation & m_simulation;
+    const size_t m_self;
+
+    MessageHandler m_handleMessage;
+    std::unordered_set<size_t> m_peers;
+
+    timeoutID m_timeoutCounter = 0;
+    std::unordered_set<timeoutID> m_timeouts;
+};
+
+void Simulation::transmit(size_t from, size_t to, const SharedBytes & message)
+{
+    const size_t frameSize = sizeof(uint32_t) + message.size(); // Size prefix of the frame
+    m_bytesSent += frameSize, m_framesSent++;
+
+    const timePoint sent = std::max(now(), m_uplinkFree[from])
+        + std::chrono::duration_cast<timePoint::duration>(
+            std::chrono::duration<double, std::milli>{frameSize / m_config.bandwidth});
+    m_uplinkFree[from] = sent;
+
+    timePoint arrival = sent + linkLatency(from, to);
+    std::bernoulli_distribution lost{m_config.loss};
+    while(lost(m_random))
+        arrival += 2 * linkLatency(from, to);
+
+    schedule(arrival, to, [this, to, message]()
+    {
+        m_networks[to]->receive(message.span());
+    });
+}
+
+static double percentile(std::vector<double> values, double rank)
+{
+    if(values.empty())
+        return 0;
+
+    std::sort(values.begin(), values.end());
+    return values[std::min(values.size() - 1, (size_t) (rank * values.size()))];
+}
+
+static double millis(timePoint::duration duration)
+{
+    return std::chrono::duration<double, std::milli>{duration}.count();
+}
+
+struct SimNode
+{
+    std::string name;
+    std::unique_ptr<SimulatedNetwork> network;
+    std::unique_ptr<WorkerPool> workers; // Tasks run as events of the client
+    std::unique_ptr<MLSClient> client;
+};
+
+// Every member sends its messages, until each one received those of the others
+static bool benchmarkApplication(const SimConfig & simConfig, Simulation & simulation,
+    std::vector<SimNode> & nodes, timePoint::duration timeout, FILE * report)
+{
+    const size_t groupSize = nodes.size();
+    const size_t expected = (groupSize - 1) * simConfig.appMessages; // Not delivered to their sender
+
+    std::vector<size_t> receivedBefore(groupSize);
+    for(size_t node = 0; node < groupSize; ++node)
+        receivedBefore[node] = nodes[node].client->receivedMessages();
+
+    size_t completeCount = 0;
+    std::vector<bool> complete(groupSize, false);
+    simulation.setAfterEvent([&](size_t node)
+    {
+        if(!complete[node] && nodes[node].client->receivedMessages() - receivedBefore[node] >= expected)
+            complete[node] = true, completeCount++;
+    });
+
+    const timePoint start = simulation.now();
+    const uint64_t bytesBefore = simulation.bytesSent(), framesBefore = simulation.framesSent();
+    const auto interval = simConfig.appRate > 0
+        ? std::chrono::duration_cast<timePoint::duration>(std::chrono::duration<double>{1 / simConfig.appRate})
+        : timePoint::duration::zero();
+
+    for(size_t node = 0; node < groupSize; ++node)
+        for(size_t idx = 0; idx < simConfig.appMessages; ++idx)
+            simulation.schedule(start + (long) idx * interval, node, [&, node, idx]()
+            {
+                std::string message = nodes[node].name + ":" + std::to_string(idx) + " ";
+                message.resize(std::max(simConfig.appSize, message.size()), '.');
+                nodes[node].client->message(message);
+            });
+
+    const auto wallStart = std::chrono::steady_clock::now();
+    while(completeCount < groupSize && simulation.now() < start + timeout && simulation.step())
+        ;
+    const double wallSeconds = std::chrono::duration<double>{std::chrono::steady_clock::now() - wallStart}.count();
+    const double seconds = std::chrono::duration<double>{simulation.now() - start}.count();
+
+    size_t delivered = 0;
+    for(size_t node = 0; node < groupSize; ++node)
+        delivered += nodes[node].client->receivedMessages() - receivedBefore[node];
+
+    const double sent = groupSize * simConfig.appMessages;
+    fprintf(report, "  application: %zu/%zu members received the %zu messages of %zu bytes"
+        " of each other member in %.1f ms\n", completeCount, groupSize, simConfig.appMessages,
+        simConfig.appSize, seconds * 1000);
+    fprintf(report, "  application throughput: %.0f messages/s per member, %.0f bytes and"
+        " %.2f frames per message sent, %.0f deliveries per second of computing time\n",
+        seconds > 0 ? delivered / seconds / groupSize : 0,
+        (simulation.bytesSent() - bytesBefore) / sent, (simulation.framesSent() - framesBefore) / sent,
+        wallSeconds > 0 ? delivered / wallSeconds : 0);
+    fflush(report);
+
+    return completeCount == groupSize;
+}
+
+// Simulate a group of the given size, then print a line of results
+static bool simulate(const SimConfig & simConfig, const ClientConfig & clientConfig,
+    size_t groupSize, FILE * report)
+{
+    const mls::CipherSuite suite{ mls::CipherSuite::ID::X25519_AES128GCM_SHA256_Ed25519 };
+    const int networkRtt = simConfig.networkRtt.value_or(
+        2 * simConfig.latencyMs * (1 + simConfig.latencySpread) + 1);
+    const auto epochTimeout = std::chrono::milliseconds{simConfig.epochTimeoutRtts * networkRtt};
+
+    Simulation simulation{simConfig};
+    srand(simConfig.seed);
+
+    std::map<std::string, mls::KeyPackage> directory; // In place of the PKI
+    const KeyPackageLookup lookup = [&directory](const std::vector<std::string> & ids)
+    {
+        std::vector<std::optional<mls::KeyPackage>> keyPackages;
+        for(const auto & id : ids)
+        {
+            const auto keyPackageIt = directory.find(id);
+            keyPackages.emplace_back(keyPackageIt == directory.end()
+                ? std::nullopt : std::optional{keyPackageIt->second});
+        }
+        return keyPackages;
+    };
+
+    std::vector<SimNode> nodes(groupSize);
+    for(size_t idx = 0; idx < groupSize; ++idx)
+    {
+        SimNode & node = nodes[idx];
+        node.name = "client" + std::to_string(idx);
+        node.network = std::make_unique<SimulatedNetwork>(simulation, idx);
+        simulation.addNode(node.name, node.network.get());
+
+        ClientConfig config = clientConfig;
+        config.seed = simConfig.seed * 7919 + idx;
+
+        const mls::bytes_ns::bytes id{node.name.begin(), node.name.end()};
+        node.client = std::make_unique<MLSClient>(suite, id, *node.network, lookup, networkRtt, config);
+
+        node.workers = std::make_unique<WorkerPool>([&simulation, &simConfig, idx](std::function<void()> task)
+        {
+            simulation.schedule(simulation.now() + std::chrono::milliseconds{simConfig.workerDelayMs},
+                idx, std::move(task));
+        });
+        node.client->setWorkerPools(config.pipelineCommits ? node.workers.get() : nullptr,
+            config.cryptoThreads > 0 ? node.workers.get() : nullptr);
+        node.network->setHandleMessage([client = node.client.get()](std::span<const uint8_t> message)
+        {
+            client->handleMessage(message);
+        });
+
+        directory.emplace(node.name, node.client->getKeyPackage());
+    }
+
+    // When each member reached the awaited epoch
+    mls::epoch_t awaitedEpoch = 1;
+    std::vector<std::optional<timePoint>> reached(groupSize);
+    size_t reachedCount = 0;
+    simulation.setAfterEvent([&](size_t node)
+    {
+        const auto * state = nodes[node].client->groupState();
+        if(!reached[node] && state && state->epoch() >= awaitedEpoch)
+        {
+            reached[node] = simulation.now();
+            reachedCount++;
+        }
+    });
+
+    const auto awaitEpoch = [&](mls::epoch_t epoch, timePoint start)
+    {
+        awaitedEpoch = epoch;
+        reached.assign(groupSize, std::nullopt);
+        reachedCount = 0;
+
+        for(size_t node = 0; node < groupSize; ++node)
+        {
+            const auto * state = nodes[node].client->groupState();
+            if(simulation.crashed(node) || (state && state->epoch() >= epoch))
+                reached[node] = start, reachedCount++; // Crashed clients are not awaited
+        }
+
+        while(reachedCount < groupSize && simulation.now() < start + epochTimeout
+            && simulation.step())
+            ;
+
+        return reachedCount == groupSize;
+    };
+
+    // The first member creates the group and adds every other one
+    timePoint start = simulation.now();
+    nodes[0].client->create(GROUP_ID);
+    if(groupSize > 1)
+    {
+        std::string others;
+        for(size_t idx = 1; idx < groupSize; ++idx)
+            others += (idx > 1 ? "," : "") + nodes[idx].name;
+        nodes[0].client->add(others);
+
+        if(!awaitEpoch(1, start))
+        {
+            fprintf(report, "%zu members: only %zu joined the group\n", groupSize, reachedCount);
+            return false;
+        }
+    }
+    const double joinMs = millis(simulation.now() - start);
+
+    // Members are added in order, client i has leaf i: view v of the full
+    //  consensus in the epoch e is led by client (v + e) % n
+    size_t observer = 0; // Any running client, to follow the epochs
+    const mls::epoch_t firstEpoch = nodes[0].client->groupState()->epoch();
+    for(size_t view = 0; view < std::min(simConfig.crashed, groupSize - 1); ++view)
+        simulation.crash((view + firstEpoch) % groupSize);
+    while(simulation.crashed(observer))
+        observer++;
+
+    std::vector<size_t> verifiedBefore(groupSize), speculativeBefore(groupSize),
+        staleSpeculativeBefore(groupSize);
+    size_t fastPathBefore = 0;
+    for(size_t node = 0; node < groupSize; ++node)
+    {
+        verifiedBefore[node] = nodes[node].client->groupState()->verifiedSignatures();
+        speculativeBefore[node] = nodes[node].client->speculativeCommits();
+        staleSpeculativeBefore[node] = nodes[node].client->staleSpeculativeCommits();
+        fastPathBefore += nodes[node].client->deliveryService().consensusStats().fastPath;
+    }
+
+    std::mt19937_64 random{simConfig.seed};
+    std::vector<double> latencies, lastLatencies;
+    uint64_t bytes = 0, frames = 0;
+    size_t completed = 0;
+
+    for(size_t epochIdx = 0; epochIdx < simConfig.epochs; ++epochIdx)
+    {
+        const mls::epoch_t epoch = nodes[observer].client->groupState()->epoch();
+        start = simulation.now();
+        const uint64_t bytesBefore = simulation.bytesSent(), framesBefore = simulation.framesSent();
+
+        std::vector<size_t> proposers(groupSize);
+        for(size_t node = 0; node < groupSize; ++node)
+            proposers[node] = node;
+        std::shuffle(proposers.begin(), proposers.end(), random);
+        std::erase_if(proposers, [&simulation](size_t node){ return simulation.crashed(node); });
+
+        if(simConfig.committers > 0)
+        {
+            // Commits built at the same time, none was received by the others yet
+            proposers.resize(std::min(proposers.size(), simConfig.committers));
+            for(const auto committer : proposers)
+                simulation.schedule(start, committer, [&, committer](){ nodes[committer].client->commit(); });
+        }
+        else
+        {
+            proposers.resize(std::min(proposers.size(), std::max<size_t>(1, simConfig.proposers)));
+            for(const auto proposer : proposers)
+                simulation.schedule(start, proposer, [&, proposer](){ nodes[proposer].client->update(); });
+        }
+
+        if(!awaitEpoch(epoch + 1, start))
+        {
+            fprintf(report, "%zu members: epoch %zu only reached by %zu members\n",
+                groupSize, (size_t) epoch + 1, reachedCount);
+            break;
+        }
+
+        double last = 0;
+        for(size_t node = 0; node < groupSize; ++node)
+        {
+            if(simulation.crashed(node))
+                continue;
+
+            latencies.emplace_back(millis(reached[node].value() - start));
+            last = std::max(last, latencies.back());
+        }
+        lastLatencies.emplace_back(last);
+
+        bytes += simulation.bytesSent() - bytesBefore;
+        frames += simulation.framesSent() - framesBefore;
+        completed++;
+    }
+
+    std::vector<double> verified;
+    ConsensusStats tiers;
+    size_t speculative = 0, staleSpeculative = 0;
+    for(size_t node = 0; node < groupSize; ++node)
+    {
+        if(simulation.crashed(node))
+            continue;
+
+        verified.emplace_back(nodes[node].client->groupState()->verifiedSignatures()
+            - verifiedBefore[node]);
+
+        const ConsensusStats stats = nodes[node].client->deliveryService().consensusStats();
+        tiers.fastPath += stats.fastPath, tiers.cac1 += stats.cac1;
+        tiers.cac2 += stats.cac2, tiers.fullConsensus += stats.fullConsensus;
+        tiers.restrained += stats.restrained;
+        tiers.restrainedTimeouts += stats.restrainedTimeouts;
+        tiers.viewChanges += stats.viewChanges, tiers.skippedViews += stats.skippedViews;
+        tiers.rejectedPrePrepares += stats.rejectedPrePrepares;
+
+        speculative += nodes[node].client->speculativeCommits() - speculativeBefore[node];
+        staleSpeculative += nodes[node].client->staleSpeculativeCommits() - staleSpeculativeBefore[node];
+    }
+
+    const double perEpoch = std::max<size_t>(completed, 1);
+    fprintf(report, "%zu members: join %.1f ms, %zu/%zu epochs\n", groupSize, joinMs,
+        completed, simConfig.epochs);
+    fprintf(report, "  epoch latency (ms): p50 %.1f, p90 %.1f, p99 %.1f, max %.1f,"
+        " last member p50 %.1f\n",
+        percentile(latencies, 0.5), percentile(latencies, 0.9), percentile(latencies, 0.99),
+        percentile(latencies, 1), percentile(lastLatencies, 0.5));
+    fprintf(report, "  per commit: %.0f bytes, %.0f frames\n", bytes / perEpoch, frames / perEpoch);
+    fprintf(report, "  signatures verified per member and epoch: p50 %.1f, max %.1f\n",
+        percentile(verified, 0.5) / perEpoch, percentile(verified, 1) / perEpoch);
+    fprintf(report, "  decisions (all members, group creation included): %zu fast path,"
+        " %zu CAC 1, %zu CAC 2, %zu full consensus (%zu restrained consensus,"
+        " %zu without decision)\n",
+        tiers.fastPath, tiers.cac1, tiers.cac2, tiers.fullConsensus, tiers.restrained,
+        tiers.restrainedTimeouts);
+    if(tiers.viewChanges > 0)
+        fprintf(report, "  full consensus views (all members): %zu given up, %zu of them"
+            " skipped as led by suspected members\n", tiers.viewChanges, tiers.skippedViews);
+    if(tiers.rejectedPrePrepares > 0)
+        fprintf(report, "  full consensus pre-prepares rejected (all members): %zu, of another"
+            " value than the one prepared\n", tiers.rejectedPrePrepares);
+    if(clientConfig.pipelineCommits)
+        fprintf(report, "  commits built in advance (all members): %zu proposed, %zu dropped"
+            " as the proposals changed meanwhile\n", speculative, staleSpeculative);
+    fflush(report);
+
+    bool expected = true;
+    if(simConfig.expectFastPath && *simConfig.expectFastPath != (tiers.fastPath > fastPathBefore))
+    {
+        fprintf(report, "  %zu decisions by the fast path, %s expected\n",
+            tiers.fastPath - fastPathBefore, *simConfig.expectFastPath ? "some were" : "none was");
+        fflush(report);
+        expected = false;
+    }
+
+    if(simConfig.expectSkippedViews && tiers.skippedViews == 0)
+    {
+        fprintf(report, "  no full consensus view was skipped, some were expected\n");
+        fflush(report);
+        expected = false;
+    }
+
+    if(simConfig.expectRejectedPrePrepares && tiers.rejectedPrePrepares == 0)
+    {
+        fprintf(report, "  no full consensus pre-prepare was rejected, some were expected\n");
+        fflush(report);
+        expected = false;
+    }
+
+    if(simConfig.expectSpeculation && speculative == 0)
+    {
+        fprintf(report, "  no commit built in advance was proposed, some were expected\n");
+        fflush(report);
+        expected = false;
+    }
+
+    if(simConfig.expectStaleSpeculation && staleSpeculative == 0)
+    {
+        fprintf(report, "  no commit built in advance was dropped as stale, some were expected\n");
+        fflush(report);
+        expected = false;
+    }
+
+    bool delivered = true;
+    if(simConfig.appMessages > 0 && groupSize > 1)
+        delivered = benchmarkApplication(simConfig, simulation, nodes, epochTimeout, report);
+
+    return completed == simConfig.epochs && expected && delivered;
+}
+
+static void printSimOptions(FILE * out)
+{
+    fprintf(out, "simulation options:\n");
+    for(const auto & option : simOptions())
+        fprintf(out, "  --%s=<value>\t%s\n", option.name, option.description);
+}
+
+int main(int argc, char * argv[])
+{
+    SimConfig simConfig;
+
+    // Simulation options first, the others are the ones of the clients
+    std::vector<char *> clientArgs = { argv[0] };
+    for(int idx = 1; idx < argc; ++idx)
+    {
+        const char * arg = argv[idx];
+        const char * value = strchr(arg, '=');
+
+        if(strcmp(arg, "--help") == 0)
+        {
+            fprintf(stderr, "usage: %s [--option=value...]\n", argv[0]);
+            printSimOptions(stderr);
+            printClientOptions(stderr);
+            return EXIT_SUCCESS;
+        }
+
+        bool found = false;
+        if(strncmp(arg, "--", 2) == 0 && value)
+        {
+            const std::string name{arg + 2, value};
+            for(const auto & option : simOptions())
+                if(name == option.name)
+                {
+                    try
+                    {
+                        option.set(simConfig, value + 1);
+                    }
+                    catch(const std::exception &)
+                    {
+                        fprintf(stderr, "Invalid value for option --%s\n", option.name);
+                        exit(EXIT_FAILURE);
+                    }
+                    found = true;
+                }
+        }
+
+        if(!found)
+            clientArgs.emplace_back(argv[idx]);
+    }
+
+    ClientConfig clientConfig = parseClientOptions(clientArgs.size(), clientArgs.data(), 1);
+    if(simConfig.crashed > 0 && simConfig.appMessages > 0)
+    {
+        fprintf(stderr, "Application messages await every member, --app-messages is disabled"
+            " with --crashed\n");
+        simConfig.appMessages = 0;
+    }
+
+    // The results are printed on the standard output, the clients' traces are dropped
+    FILE * report = fdopen(dup(STDOUT_FILENO), "w");
+    PCHECK(report ? 0 : -1);
+    if(!simConfig.verbose && !freopen("/dev/null", "w", stdout))
+        sys_error("Error redirecting the output of the clients");
+
+    bool success = true;
+    for(const size_t groupSize : simConfig.groupSizes)
+        success = simulate(simConfig, clientConfig, groupSize, report) && success;
+
+    fclose(report);
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -9,11 +9,16 @@
 
 #include <algorithm>
 #include <cstdint>
+#include <deque>
 #include <exception>
 #include <functional>
 #include <iterator>
+#include <map>
+#include <memory>
 #include <optional>
-#include <ranges>
+#include <set>
+#include <string>
+#include <span>
 #include <unordered_map>
 #include <vector>
 
@@ -24,16 +29,25 @@
 #include "mls/tree_math.h"
 #include "tls/tls_syntax.h"
 
+#include "cached_message.hpp"
 #include "cascade_consensus.hpp"
+#include "compression.hpp"
+#include "config.hpp"
 #include "dds_message.hpp"
+#include "epoch_buffer.hpp"
 #include "extended_mls_state.hpp"
 #include "gossip_bcast.hpp"
 #include "message.hpp"
+#include "metrics.hpp"
 #include "network.hpp"
+#include "relay_tree.hpp"
+#include "rtt_estimator.hpp"
+#include "verification_pipeline.hpp"
 
 using welcomeCallback = std::function<ExtendedMLSState * (const mls::Welcome &)>;
-using commitCallback = std::function<ExtendedMLSState * (const mls::MLSMessage &)>;
-using messageCallback = std::function<void(const mls::MLSMessage &)>;
+using commitCallback = std::function<ExtendedMLSState * (const CachedMLSMessage &)>;
+using messageCallback = std::function<void(const mls::MLSMessage &, const mls::AuthenticatedContent &)>;
+using applicationCallback = std::function<void(const mls::AuthenticatedContent &, const mls::bytes_ns::bytes &)>;
 
 // To allow to easily reference commits
 template <>
@@ -48,35 +62,144 @@ class DistributedDeliveryService
 public:
     DistributedDeliveryService(Network & network, int networkRtt,
         const welcomeCallback & receiveWelcome,
-        const messageCallback & receiveProposalOrMessage,
+        const messageCallback & receiveProposal,
+        const applicationCallback & receiveApplication,
         const commitCallback & receiveCommit, const mls::bytes_ns::bytes & selfId,
         const mls::CipherSuite & suite)
-        : m_network(network), m_deliverWelcome(receiveWelcome),
-            m_deliverProposalOrMessage(receiveProposalOrMessage),
+        : m_network(network), m_networkRtt(networkRtt), m_rttEstimator(networkRtt), m_selfId(selfId),
+            m_deliverWelcome(receiveWelcome),
+            m_deliverProposal(receiveProposal),
+            m_deliverApplication(receiveApplication),
             m_deliverCommit(receiveCommit),
             m_gossipBcast(network, selfId, suite, 
                 std::bind(&DistributedDeliveryService::handleGossipDelivery, this, std::placeholders::_1)),
             m_cascadeConsensus(network, networkRtt,
                 std::bind(&DistributedDeliveryService::handleCommit, this, std::placeholders::_1),
                 std::bind(&DistributedDeliveryService::chooseCommit, this, std::placeholders::_1),
-                std::bind(&DistributedDeliveryService::handleConsensusDelivery, this, std::placeholders::_1))
+                std::bind(&DistributedDeliveryService::handleConsensusDelivery, this, std::placeholders::_1),
+                std::bind(&DistributedDeliveryService::fetchCommit, this,
+                    std::placeholders::_1, std::placeholders::_2)),
+            m_verificationPipeline(network,
+                std::bind(&CascadeConsensus::receiveMessage, &m_cascadeConsensus, std::placeholders::_1)),
+            m_relayTree(network)
     { }
 
+    void configure(const ClientConfig & config)
+    {
+        m_cascadeConsensus.configure(config);
+
+        m_gossipBcast.setFanoutConstant(config.gossipFanoutConstant);
+        m_gossipBcast.setDigestInterval(config.gossipDigestIntervalMs);
+        m_gossipBcast.setStoreBudget(config.bufferBudget);
+        if(config.seed)
+            m_gossipBcast.setSeed(config.seed.value());
+
+        for(auto * buffer : {&m_futureProposals, &m_futureCascadeConsensus})
+        {
+            buffer->setBudget(config.bufferBudget, config.bufferBudget);
+            buffer->setHorizon(config.bufferEpochs);
+        }
+
+        m_probeInterval = config.adaptiveRtt ? config.rttProbeIntervalMs : 0;
+        m_cascadeConsensus.setRttEstimator(config.adaptiveRtt ? &m_rttEstimator : nullptr);
+
+        m_relayTree.setFanout(config.relayFanout);
+        m_relayTree.setMinBytes(config.relayBytes);
+        m_cascadeConsensus.setRelayTree(config.relayFanout > 0 ? &m_relayTree : nullptr);
+
+        m_cascadeConsensus.setCompressor(config.compress ? &m_compressor : nullptr);
+        if(config.compress && !(LOCAL_FEATURES & FEATURE_ZSTD))
+            printf("Messages are not compressed, build with ZSTD=1 to compress them\n");
+
+        m_batchMessages = std::max<size_t>(config.batchMessages, 1);
+        m_batchBytesLimit = config.batchBytes;
+        m_batchDelay = config.batchDelayMs;
+
+        m_commitLogEpochs = config.commitLogEpochs;
+
+#ifdef DDS_METRICS
+        configureMetrics(config);
+#else
+        if(!config.metricsFile.empty())
+            printf("Metrics are not collected, build with METRICS=1 to write them\n");
+#endif
+    }
+
+    // Signatures are verified by the threads of the pool (--crypto-threads),
+    //  shared by the groups of the process
+    void setVerificationPool(WorkerPool * pool)
+    {
+        m_verificationPipeline.setPool(pool);
+    }
+
+    // Base of the timeouts, measured if adaptive timeouts are enabled
+    int rtt() const
+    {
+        return m_probeInterval > 0 ? m_rttEstimator.rtt() : m_networkRtt;
+    }
+
+    ConsensusStats consensusStats() const
+    {
+        return m_cascadeConsensus.consensusStats();
+    }
+
+    // Prometheus text format, empty when metrics are not collected
+    std::string metrics()
+    {
+        if(!m_metrics)
+            return {};
+
+        const ConsensusStats stats = consensusStats();
+        m_metrics->set(Counter::FAST_PATH, stats.fastPath);
+        m_metrics->set(Counter::CAC1, stats.cac1);
+        m_metrics->set(Counter::RESTRAINED, stats.restrained);
+        m_metrics->set(Counter::RESTRAINED_TIMEOUTS, stats.restrainedTimeouts);
+        m_metrics->set(Counter::CAC2, stats.cac2);
+        m_metrics->set(Counter::FULL_CONSENSUS, stats.fullConsensus);
+        if(state)
+            m_metrics->set(Counter::SIGNATURES_VERIFIED, state->verifiedSignatures());
+
+        return m_metrics->prometheus();
+    }
+
+    // Commits replayed from the commit logs of other members
+    size_t caughtUpEpochs() const { return m_caughtUpEpochs; }
+
+    // Bytes held for later processing: future epochs, views and gossip store
+    BufferStats bufferStats() const
+    {
+        BufferStats stats = m_cascadeConsensus.bufferStats();
+        stats.futureBytes += m_futureProposals.bytes() + m_futureCascadeConsensus.bytes();
+        stats.futureMessages += m_futureProposals.size() + m_futureCascadeConsensus.size();
+        stats.dropped += m_futureProposals.dropped() + m_futureCascadeConsensus.dropped();
+        stats.gossipBytes = m_gossipBcast.storedBytes();
+
+        return stats;
+    }
+
     void init(ExtendedMLSState * initState)
     {
         state = initState;
-        advanceEpoch();
 
+        // As on a new epoch, every component follows the state before the
+        //  buffered messages are released
         m_gossipBcast.init(*state);
+        m_relayTree.newEpoch(*state);
+        m_compressor.newEpoch(state->group_id(), state->epoch());
+        m_verificationPipeline.newEpoch(state);
         m_cascadeConsensus.newEpoch(state);
+        advanceEpoch();
+
+        if(m_probeInterval > 0 && !m_probeTimeout)
+            probeRound();
     }
 
-    void receiveNetworkMessage(const Bytes & rawMessage)
+    void receiveNetworkMessage(std::span<const uint8_t> rawMessage)
     {
         try
         {
             DDSMessage message;
-            mls::tls::unmarshal(std::vector<uint8_t>{rawMessage.content, rawMessage.content + rawMessage.size}, message);
+            unmarshal(rawMessage, message);
 
             if(message.isWelcome())
             {
@@ -93,6 +216,22 @@ public:
             {
                 handleCascadeConsensusReception(message.cascadeConsensusMessage());
             }
+            else if(message.isFetch())
+            {
+                handleFetch(message.fetchMessage());
+            }
+            else if(message.isProbe())
+            {
+                handleProbe(message.probeMessage());
+            }
+            else if(message.isCatchUp())
+            {
+                handleCatchUp(message.catchUpMessage());
+            }
+            else if(message.isRelay())
+            {
+                handleRelay(message.relayMessage());
+            }
         }
         catch(const std::exception & e)
         {
@@ -108,12 +247,55 @@ public:
         m_gossipBcast.dispatchMessage(msg);
     }
 
+    // Packed with the next application payloads when batching is enabled, the
+    //  batch is sent once full or when the delay of its first payload expires
+    void sendApplicationMessage(const mls::bytes_ns::bytes & payload)
+    {
+        if(!state)
+            return; // Client Error
+
+        if(m_batchMessages <= 1)
+        {
+            m_gossipBcast.dispatchMessage(state->protect({}, payload, 0));
+            return;
+        }
+
+        m_batch.payloads.emplace_back(payload);
+        m_batchedBytes += payload.size();
+
+        if(m_batch.payloads.size() >= m_batchMessages || m_batchedBytes >= m_batchBytesLimit)
+            flushApplicationMessages();
+        else if(!m_batchTimeout)
+            m_batchTimeout = m_network.registerTimeout(m_batchDelay,
+                [this](auto){ m_batchTimeout = {}; flushApplicationMessages(); });
+    }
+
+    // Send the pending batch now
+    void flushApplicationMessages()
+    {
+        if(m_batchTimeout)
+        {
+            m_network.unregisterTimeout(m_batchTimeout.value());
+            m_batchTimeout = {};
+        }
+
+        if(!state || m_batch.payloads.empty())
+            return;
+
+        const mls::MLSMessage message = state->protect(APPLICATION_BATCH_AAD,
+            mls::tls::marshal(m_batch), 0);
+        m_batch.payloads.clear();
+        m_batchedBytes = 0;
+
+        m_gossipBcast.dispatchMessage(message);
+    }
+
     bool canProposeCommit() const
     {
         return !m_cascadeConsensus.cac1HasStarted();
     }
 
-    void proposeCommit(const mls::MLSMessage & msg, std::optional<mls::Welcome> welcome)
+    void proposeCommit(const CachedMLSMessage & msg, std::optional<mls::Welcome> welcome)
     {
         if(!state)
             return; // Client Error
@@ -141,85 +323,144 @@ protected:
 
     void handleGossipDelivery(const mls::MLSMessage & message)
     {
-        if(!state)
-        {
-            m_futureProposals.emplace_back(message);
-            return;
-        }
-
-        if(message.epoch() < state->epoch())
-            return; // Invalid
-        else if(message.epoch() > state->epoch())
+        if(!state || message.epoch() > state->epoch())
         {
-            m_futureProposals.emplace_back(message);
+            bufferFutureMessage(m_futureProposals, message);
+            noticeLag();
         }
-        else
+        else if(message.epoch() == state->epoch())
             handleProposal(message);
+        // Else invalid
+    }
+
+    // Encrypted for an epoch not reached yet, the sender can't be read: only
+    //  the global budget applies
+    void bufferFutureMessage(EpochBuffer<mls::MLSMessage> & buffer, const mls::MLSMessage & message)
+    {
+        std::optional<uint64_t> current = {};
+        if(state)
+            current = state->epoch();
+
+        buffer.push(current, message.epoch(), {}, message, mls::tls::marshal(message).size());
     }
 
     void handleProposal(const mls::MLSMessage & message)
     {
-        const auto proposalRef = state->isValidProposal(message);
-        if(proposalRef)
+        // Decrypted and verified once, the client is given the content
+        const auto content = state->validateAndExtractContent(message);
+        if(!content)
+            return;
+
+        if(content->content.content_type() == mls::ContentType::proposal)
         {
-            m_deliverProposalOrMessage(message);
+            const mls::ProposalRef proposalRef = state->cipher_suite().ref(content.value());
+            if(m_receivedProposals.contains(proposalRef))
+                return; // Replayed by a catch-up
+
+            m_deliverProposal(message, content.value());
 
-            m_receivedProposals.insert(proposalRef.value());
+            m_receivedProposals.insert(proposalRef);
+            m_proposalMessages.insert({proposalRef, message});
+
+            lookUnlockCommits(proposalRef);
+        }
+        else if(content->content.content_type() == mls::ContentType::application)
+            handleApplicationMessage(content.value());
+    }
+
+    void handleApplicationMessage(const mls::AuthenticatedContent & content)
+    {
+        const auto & data = ExtendedMLSState::applicationData(content);
+        if(content.content.authenticated_data != APPLICATION_BATCH_AAD)
+        {
+            m_deliverApplication(content, data);
+            return;
+        }
 
-            lookUnlockCommits(proposalRef.value());
+        ApplicationBatch batch;
+        try
+        {
+            mls::tls::unmarshal(data, batch);
         }
-        else if(state->isValidApplicationMessage(message))
-            m_deliverProposalOrMessage(message);
+        catch(const std::exception & e)
+        {
+            printf("Received incorrect application batch: %s\n", e.what());
+            return;
+        }
+
+        for(const auto & payload : batch.payloads)
+            m_deliverApplication(content, payload);
     }
 
     void lookUnlockCommits(const mls::ProposalRef & newRef)
     {
-        const auto commits = std::views::keys(m_incompleteCommits);
+        std::vector<CachedMLSMessage> completeCommits;
 
-        for(const auto & commit : commits)
+        for(auto commitIt = m_incompleteCommits.begin(); commitIt != m_incompleteCommits.end(); )
         {
-            if(m_incompleteCommits[commit].contains(newRef))
-            {
-                m_incompleteCommits[commit].erase(newRef);
+            commitIt->second.erase(newRef);
 
-                if(m_incompleteCommits[commit].empty())
-                {
-                    m_incompleteCommits.erase(commit);
-                    handleCompleteCommit(commit);
-                }
+            if(commitIt->second.empty())
+            {
+                completeCommits.emplace_back(commitIt->first);
+                commitIt = m_incompleteCommits.erase(commitIt);
             }
+            else
+                commitIt++;
         }
+
+        for(const auto & commit : completeCommits) // Outside of iteration, may clear the map
+            handleCompleteCommit(commit);
     }
 
     void handleCascadeConsensusReception(const mls::MLSMessage & message)
     {
-        if(!state)
+        if(!state || message.epoch() > state->epoch())
         {
-            m_futureCascadeConsensus.emplace_back(message);
-            return;
+            bufferFutureMessage(m_futureCascadeConsensus, message);
+            noticeLag();
         }
+        else if(message.epoch() == state->epoch())
+            handleCascadeConsensusMessage(message);
+        // Else invalid
+    }
 
-        if(message.epoch() < state->epoch())
-            return; // Invalid
-        else if(message.epoch() > state->epoch())
+    // Relayed down the tree before a later epoch is reached, but not before
+    //  being decrypted: only members can use a member as a relay
+    void handleRelay(const RelayMessage & relay)
+    {
+        if(!state || relay.message.epoch() > state->epoch())
         {
-            m_futureCascadeConsensus.emplace_back(message);
+            bufferFutureMessage(m_futureCascadeConsensus, relay.message);
+            noticeLag();
         }
-        else
-            handleCascadeConsensusMessage(message);
+        else if(relay.message.epoch() == state->epoch())
+            handleCascadeConsensusMessage(relay.message, &relay);
+        // Else invalid
     }
 
-    void handleCascadeConsensusMessage(const mls::MLSMessage & message)
+    void handleCascadeConsensusMessage(const mls::MLSMessage & message,
+        const RelayMessage * relay = nullptr)
     {
         const auto cascadeConsensusMessageBytes = state->isValidApplicationMessage(message);
         if(cascadeConsensusMessageBytes)
         {
+            if(relay)
+                m_relayTree.forward(*relay);
+
+            const auto plaintext = m_compressor.decompress(cascadeConsensusMessageBytes.value());
+            if(!plaintext)
+            {
+                printf("Received incorrect compressed Cascade Consensus message\n");
+                return;
+            }
+
             try
             {
                 CascadeConsensusMessage cascadeConsensusMessage;
-                mls::tls::unmarshal(cascadeConsensusMessageBytes.value(), cascadeConsensusMessage);
+                mls::tls::unmarshal(plaintext.value(), cascadeConsensusMessage);
 
-                m_cascadeConsensus.receiveMessage(cascadeConsensusMessage);
+                m_verificationPipeline.receiveMessage(cascadeConsensusMessage);
             }
             catch(const std::exception & e)
             {
@@ -232,9 +473,9 @@ protected:
         }
     }
 
-    void handleCommit(const mls::MLSMessage & message)
+    void handleCommit(const CachedMLSMessage & message)
     {
-        auto referencedProposals = state->isValidCommit(message);
+        auto referencedProposals = state->isValidCommit(message.message());
         if(referencedProposals)
         {
             auto referencedSet = referencedProposals.value();
@@ -248,28 +489,423 @@ protected:
             if(remainingReferences.empty())
                 handleCompleteCommit(message);
             else
+            {
                 m_incompleteCommits.insert({message, remainingReferences});
+
+                // The committer knows them
+                sendFetchRequest({remainingReferences.begin(), remainingReferences.end()},
+                    state->getCommitSender(message.message()));
+            }
         }
     }
 
-    void handleCompleteCommit(const mls::MLSMessage & message)
+    // Ask the members who witnessed the commit, one after the other
+    void fetchCommit(const MessageRef & ref, const std::vector<mls::LeafIndex> & signers)
+    {
+        requestCommit(ref, signers, 0);
+    }
+
+    void requestCommit(const MessageRef & ref, const std::vector<mls::LeafIndex> & signers,
+        size_t attempt)
+    {
+        while(attempt < signers.size() && signers[attempt] == state->index())
+            attempt++;
+
+        if(attempt >= signers.size() || m_cascadeConsensus.commit(ref))
+            return;
+
+        sendFetchRequest({ ref }, signers[attempt]);
+
+        const auto epoch = state->epoch();
+        m_network.registerTimeout(2 * rtt(), [this, ref, signers, attempt, epoch](auto)
+        {
+            if(state->epoch() == epoch)
+                requestCommit(ref, signers, attempt + 1);
+        });
+    }
+
+    void sendFetchRequest(const std::vector<mls::bytes_ns::bytes> & refs, mls::LeafIndex member)
+    {
+        DDSMessage msg = {
+            .content = { (FetchMessage) {
+                .content = { (FetchRequest) {
+                    .requesterId = m_selfId,
+                    .refs = refs
+                }}
+            }}
+        };
+
+        m_network.send(state->members().name(member), marshalToBytes(msg));
+    }
+
+    void handleFetch(const FetchMessage & message)
+    {
+        if(!state)
+            return;
+
+        if(message.isRequest())
+        {
+            const auto & request = message.request();
+
+            if(!state->members().contains(request.requesterId) || request.requesterId == m_selfId)
+                return; // Only answer members
+
+            FetchResponse response;
+            for(size_t idx = 0; idx < request.refs.size() && idx < FETCH_MAX_REFS; ++idx)
+            {
+                const auto & ref = request.refs[idx];
+                if(const auto * commit = m_cascadeConsensus.commit(ref))
+                    response.messages.emplace_back(commit->message());
+                else if(m_proposalMessages.contains(ref))
+                    response.messages.emplace_back(m_proposalMessages.at(ref));
+            }
+
+            if(response.messages.empty())
+                return;
+
+            DDSMessage msg = {
+                .content = { (FetchMessage) {
+                    .content = { response }
+                }}
+            };
+            m_network.send({request.requesterId.begin(), request.requesterId.end()},
+                marshalToBytes(msg));
+        }
+        else
+        {
+            for(const auto & fetched : message.response().messages)
+            {
+                if(fetched.epoch() != state->epoch())
+                    continue;
+
+                // Proposals follow the gossip path, which validates them
+                if(state->isValidCommit(fetched))
+                    m_cascadeConsensus.receiveRequestedCommit(fetched);
+                else
+                    m_gossipBcast.receiveMessage((GossipBcastMessage) {
+                        .content = { fetched }
+                    });
+            }
+        }
+    }
+
+    void configureMetrics(const ClientConfig & config)
+    {
+        m_metrics = std::make_unique<Metrics>();
+        m_metrics->setClient({m_selfId.begin(), m_selfId.end()});
+        m_metrics->setClock([this](){ return m_network.now(); });
+
+        m_network.setMetrics(m_metrics.get());
+        m_gossipBcast.setMetrics(m_metrics.get());
+        m_cascadeConsensus.setMetrics(m_metrics.get());
+
+        m_metrics->setGauge(Gauge::EPOCH, [this](){ return state ? state->epoch() : 0; });
+        m_metrics->setGauge(Gauge::RTT_MS, [this](){ return rtt(); });
+        m_metrics->setGauge(Gauge::FUTURE_BUFFER_BYTES, [this](){ return bufferStats().futureBytes; });
+        m_metrics->setGauge(Gauge::FUTURE_BUFFER_MESSAGES, [this](){ return bufferStats().futureMessages; });
+        m_metrics->setGauge(Gauge::PENDING_VERIFICATIONS,
+            [this](){ return m_verificationPipeline.pendingMessages(); });
+
+        m_metricsFile = config.metricsFile;
+        m_metricsInterval = config.metricsIntervalMs;
+        if(!m_metricsFile.empty() && m_metricsInterval > 0)
+            metricsRound();
+    }
+
+    void metricsRound()
+    {
+        m_network.registerTimeout(m_metricsInterval, [this](auto){ metricsRound(); });
+
+        metrics(); // Updates the totals kept by the components
+        if(!m_metrics->writeFile(m_metricsFile))
+            printf("Error writing metrics to %s\n", m_metricsFile.c_str());
+    }
+
+    // Measure the rtt with a few members, in turn
+    void probeRound()
+    {
+        m_probeTimeout = m_network.registerTimeout(m_probeInterval,
+            [this](auto){ m_probeTimeout = {}; probeRound(); });
+
+        const auto members = state->members().indexes();
+        for(size_t probe = 0; probe < PROBES_PER_ROUND && probe + 1 < members.size(); ++probe)
+        {
+            m_nextProbed = (m_nextProbed + 1) % members.size();
+            if(members[m_nextProbed] == state->index())
+                m_nextProbed = (m_nextProbed + 1) % members.size();
+
+            sendProbe(state->members().name(members[m_nextProbed]), false,
+                RttEstimator::timestamp(m_network.now()));
+        }
+    }
+
+    void sendProbe(const std::string & member, bool reply, uint64_t timestamp)
+    {
+        DDSMessage msg = {
+            .content = { (ProbeMessage) {
+                .senderId = m_selfId,
+                .reply = reply,
+                .timestamp = timestamp
+            }}
+        };
+
+        m_network.send(member, marshalToBytes(msg));
+    }
+
+    void handleProbe(const ProbeMessage & message)
+    {
+        if(!state || !state->members().contains(message.senderId) || message.senderId == m_selfId)
+            return; // Only answer members
+
+        const std::string sender{message.senderId.begin(), message.senderId.end()};
+        if(!message.reply)
+            sendProbe(sender, true, message.timestamp);
+        else if(const uint64_t now = RttEstimator::timestamp(m_network.now()); message.timestamp <= now)
+            m_rttEstimator.sample(sender, (now - message.timestamp) / 1000.0);
+    }
+
+    // Byzantine members tolerated by the CAC
+    size_t faultyMembers() const
+    {
+        const size_t n = state->members().size();
+        return n > CAC_K ? (n - CAC_K) / 5 : 0;
+    }
+
+    // Timeouts wait for the members needed to reach a CAC quorum
+    void updateRttQuorum()
+    {
+        m_rttEstimator.setQuorum(state->members().size() - faultyMembers() - 1); // Self excluded
+    }
+
+    // Messages of a later epoch arrive while the commit of the current one is
+    //  missing: unless consensus delivers it meanwhile, it is fetched from the
+    //  commit logs of other members
+    void noticeLag()
+    {
+        if(!state || m_commitLogEpochs == 0 || m_catchUpTimeout
+            || m_catchUpAttempt > state->members().size())
+            return;
+
+        const auto epoch = state->epoch();
+        m_catchUpTimeout = m_network.registerTimeout(CATCH_UP_DELAY_RTTS * rtt(), [this, epoch](auto)
+        {
+            m_catchUpTimeout = {};
+            if(state->epoch() == epoch)
+                requestCatchUp();
+        });
+    }
+
+    // One member sends the commits, the others only their attestations: a
+    //  commit attested by t + 1 members was decided, one of them is correct
+    void requestCatchUp()
+    {
+        std::vector<mls::LeafIndex> members;
+        for(const auto & member : state->members().indexes())
+            if(member != state->index())
+                members.emplace_back(member);
+
+        if(members.empty())
+            return;
+
+        if(m_catchUpAttempt++ >= members.size())
+        {
+            printf("Catch-up: epoch %lu is not in the commit logs of the members\n", state->epoch());
+            return;
+        }
+
+        const size_t quorum = std::min(faultyMembers() + 1, members.size());
+        const size_t first = ((m_catchUpAttempt - 1) * quorum) % members.size();
+        m_catchUpRequests.clear(); // Late answers of the previous round are dropped
+        for(size_t idx = 0; idx < quorum; ++idx)
+            sendCatchUpRequest(members[(first + idx) % members.size()], idx == 0);
+
+        const auto epoch = state->epoch();
+        m_catchUpTimeout = m_network.registerTimeout(2 * rtt(), [this, epoch](auto)
+        {
+            m_catchUpTimeout = {};
+            if(state->epoch() == epoch)
+                requestCatchUp();
+        });
+    }
+
+    void sendCatchUpRequest(mls::LeafIndex member, bool full)
+    {
+        DDSMessage msg = {
+            .content = { (CatchUpMessage) {
+                .content = { (CatchUpRequest) {
+                    .requesterId = m_selfId,
+                    .epoch = state->epoch(),
+                    .full = full
+                }}
+            }}
+        };
+
+        m_network.send(state->members().name(member), marshalToBytes(msg));
+        m_catchUpRequests[member.val] = full;
+    }
+
+    void handleCatchUp(const CatchUpMessage & message)
+    {
+        if(!state || m_commitLogEpochs == 0)
+            return;
+
+        if(message.isRequest())
+        {
+            const auto & request = message.request();
+
+            if(!state->members().contains(request.requesterId) || request.requesterId == m_selfId)
+                return; // Only answer members
+
+            CatchUpResponse response = { .responderId = m_selfId };
+            for(const auto & logged : m_commitLog)
+            {
+                if(logged.epoch < request.epoch || response.attestations.size() >= CATCH_UP_MAX_EPOCHS)
+                    continue;
+
+                if(request.full)
+                    response.commits.emplace_back(logged.decided);
+                response.attestations.emplace_back(logged.attestation);
+            }
+
+            if(response.attestations.empty())
+                return;
+
+            DDSMessage msg = {
+                .content = { (CatchUpMessage) {
+                    .content = { response }
+                }}
+            };
+            m_network.send({request.requesterId.begin(), request.requesterId.end()},
+                marshalToBytes(msg));
+        }
+        else
+        {
+            // Once from each member asked in the last round, for the epochs a
+            //  response may hold: a commit per epoch from the member asked
+            //  for them, and its own attestation per epoch from each one
+            const auto & response = message.response();
+            const auto responder = state->members().find(response.responderId);
+            const auto requestIt = responder ? m_catchUpRequests.find(responder->val)
+                : m_catchUpRequests.end();
+            if(requestIt == m_catchUpRequests.end())
+                return;
+
+            const bool full = requestIt->second;
+            m_catchUpRequests.erase(requestIt);
+
+            const mls::epoch_t first = state->epoch(), end = first + CATCH_UP_MAX_EPOCHS;
+            std::set<mls::epoch_t> received;
+            for(const auto & decided : response.commits)
+            {
+                const auto epoch = decided.commit.epoch();
+                if(full && epoch >= first && epoch < end && received.insert(epoch).second
+                    && m_catchUpCommits[epoch].size() < CATCH_UP_MAX_CANDIDATES)
+                    m_catchUpCommits[epoch].emplace_back(decided);
+            }
+
+            for(const auto & attestation : response.attestations)
+            {
+                // Signatures are only verified once their epoch is reached
+                const auto epoch = attestation.epoch;
+                if(attestation.type == CONTROL_DECIDED && attestation.signer == responder->val
+                    && epoch >= first && epoch < end)
+                    m_attestations[epoch].try_emplace(attestation.signer, attestation);
+            }
+
+            tryCatchUp();
+        }
+    }
+
+    // Replay the commits attested by enough members of their epoch
+    void tryCatchUp()
+    {
+        bool progressed = false;
+        while(true)
+        {
+            const auto candidatesIt = m_catchUpCommits.find(state->epoch());
+            if(candidatesIt == m_catchUpCommits.end())
+                break;
+
+            // Signatures are of the epoch they attest, verified once it is reached
+            std::map<MessageRef, std::set<uint32_t>> attesters;
+            for(const auto & [signer, attestation] : m_attestations[state->epoch()])
+                if(state->verify(attestation))
+                    attesters[attestation.reference].insert(signer);
+
+            std::optional<DecidedCommit> decided = {};
+            for(const auto & candidate : candidatesIt->second)
+                if(attesters[CachedMLSMessage{candidate.commit}.ref(state->cipher_suite())].size()
+                    > faultyMembers())
+                    decided = candidate;
+
+            if(!decided || !replayCommit(decided.value()))
+                break;
+
+            progressed = true;
+        }
+
+        // Later epochs are still missing: ask again without waiting
+        if(progressed && !m_catchUpTimeout && m_futureCascadeConsensus.size() > 0)
+            requestCatchUp();
+    }
+
+    bool replayCommit(const DecidedCommit & decided)
+    {
+        for(const auto & proposal : decided.proposals)
+            if(proposal.epoch() == state->epoch())
+                handleProposal(proposal);
+
+        const CachedMLSMessage commit{decided.commit};
+        const auto referenced = state->isValidCommit(commit.message());
+        if(!referenced || !std::includes(m_receivedProposals.begin(), m_receivedProposals.end(),
+            referenced->begin(), referenced->end()))
+        {
+            printf("Catch-up: attested commit of epoch %lu can't be applied\n", state->epoch());
+            m_catchUpCommits.erase(state->epoch());
+            return false;
+        }
+
+        m_caughtUpEpochs++;
+        METRIC(m_metrics, count(Counter::CAUGHT_UP_EPOCHS));
+        handleConsensusDelivery(commit);
+
+        return true;
+    }
+
+    // Kept with an attestation of this member, for members lagging behind
+    void logCommit(const CachedMLSMessage & message)
+    {
+        if(m_commitLogEpochs == 0)
+            return;
+
+        DecidedCommit decided = { .commit = message.message() };
+        for(const auto & [_, proposal] : m_proposalMessages)
+            decided.proposals.emplace_back(proposal);
+
+        m_commitLog.push_back({ state->epoch(), std::move(decided),
+            state->signControl(CONTROL_DECIDED, 0, message.ref(state->cipher_suite())) });
+        while(m_commitLog.size() > m_commitLogEpochs)
+            m_commitLog.pop_front();
+    }
+
+    void handleCompleteCommit(const CachedMLSMessage & message)
     {
         // TODO We might as well check that the proposal list is valid
 
         m_cascadeConsensus.validateCommit(message);
     }
 
-    const mls::MLSMessage & chooseCommit(const std::vector<mls::MLSMessage> & commits)
+    const CachedMLSMessage & chooseCommit(const std::vector<CachedMLSMessage> & commits)
     {
         // We choose the commit with most proposals and tie break on smallest sender id
         // TODO Investigate other use, for example to ensure a remove proposal is indeed commited
-        const mls::MLSMessage * bestCommit = &commits[0];
-        auto [bestSender, proposals] = state->getCommitContent(commits[0]);
+        const CachedMLSMessage * bestCommit = &commits[0];
+        auto [bestSender, proposals] = state->getCommitContent(commits[0].message());
         size_t bestCount = proposals.size();
 
         for(const auto & commit : commits)
         {
-            auto [sender, proposals] = state->getCommitContent(commit);
+            auto [sender, proposals] = state->getCommitContent(commit.message());
 
             if(proposals.size() > bestCount
                 || (proposals.size() == bestCount && bestSender.val > sender.val))
@@ -282,21 +918,30 @@ protected:
         return *bestCommit;
     }
 
-    void handleConsensusDelivery(const mls::MLSMessage & message)
+    void handleConsensusDelivery(const CachedMLSMessage & message)
     {
-        const auto [added, removed] = state->getCommitMembershipChanges(message);
+        const auto [added, removed] = state->getCommitMembershipChanges(message.message());
+        logCommit(message);
 
         state = m_deliverCommit(message);
+        METRIC(m_metrics, observeSince(Histogram::EPOCH, m_epochStartedAt));
+        m_epochStartedAt = {};
         
-        if(m_proposedCommit
-            && state->cipher_suite().ref(message) == state->cipher_suite().ref(m_proposedCommit.value()) && !added.empty())
+        if(m_proposedCommit && !added.empty()
+            && message.ref(state->cipher_suite()) == m_proposedCommit->ref(state->cipher_suite()))
         {
             sendWelcome(added, m_associatedWelcome.value());
         }
 
         m_gossipBcast.newEpoch(*state, removed);
+        m_relayTree.newEpoch(*state);
+        m_compressor.newEpoch(state->group_id(), state->epoch());
+        m_verificationPipeline.newEpoch(state);
         m_cascadeConsensus.newEpoch(state);
 
+        for(const auto & member : removed)
+            m_rttEstimator.forget({member.begin(), member.end()});
+
         advanceEpoch();
     }
 
@@ -304,45 +949,46 @@ protected:
     {
         // Garbage collection
         m_receivedProposals.clear();
+        m_proposalMessages.clear();
         m_incompleteCommits.clear();
 
         m_proposedCommit = {};
         m_associatedWelcome = {};
 
-        // Unlock future proposals and future cascade consensus messages
-        for(auto proposalIt = m_futureProposals.begin(); proposalIt != m_futureProposals.end(); )
-        {
-            if(proposalIt->epoch() == state->epoch())
-            {
-                handleProposal(*proposalIt);
-                proposalIt = m_futureProposals.erase(proposalIt);
-            }
-            else if(proposalIt->epoch() < state->epoch())
-                proposalIt = m_futureProposals.erase(proposalIt);
-            else
-                proposalIt++;
-        }
+        updateRttQuorum();
+        METRIC(m_metrics, mark(m_epochStartedAt));
 
-        for(auto ccMessageIt = m_futureCascadeConsensus.begin();
-            ccMessageIt != m_futureCascadeConsensus.end(); )
+        const mls::epoch_t epoch = state->epoch();
+        if(m_catchUpTimeout)
         {
-            if(ccMessageIt->epoch() == state->epoch())
-            {
-                handleCascadeConsensusMessage(*ccMessageIt);
-                ccMessageIt = m_futureCascadeConsensus.erase(ccMessageIt);
-            }
-            else if(ccMessageIt->epoch() < state->epoch())
-                ccMessageIt = m_futureCascadeConsensus.erase(ccMessageIt);
-            else
-                ccMessageIt++;
+            m_network.unregisterTimeout(m_catchUpTimeout.value());
+            m_catchUpTimeout = {};
         }
+        m_catchUpAttempt = 0;
+        m_catchUpCommits.erase(m_catchUpCommits.begin(), m_catchUpCommits.lower_bound(epoch));
+        m_attestations.erase(m_attestations.begin(), m_attestations.lower_bound(epoch));
+
+        // Unlock future proposals and future cascade consensus messages, the
+        //  older ones are dropped. Stops if one of them leads to another epoch,
+        //  the nested call having handled the next one
+        for(const auto & proposal : m_futureProposals.release(epoch))
+            if(state->epoch() == epoch)
+                handleProposal(proposal);
+
+        for(const auto & ccMessage : m_futureCascadeConsensus.release(epoch))
+            if(state->epoch() == epoch)
+                handleCascadeConsensusMessage(ccMessage);
     }
 
 private:
     Network & m_network;
+    const int m_networkRtt;
+    RttEstimator m_rttEstimator;
+    const mls::bytes_ns::bytes m_selfId;
 
     const welcomeCallback m_deliverWelcome;
-    const messageCallback m_deliverProposalOrMessage;
+    const messageCallback m_deliverProposal;
+    const applicationCallback m_deliverApplication;
     const commitCallback m_deliverCommit;
     
     GossipBcast m_gossipBcast;
@@ -350,20 +996,56 @@ private:
 
     ExtendedMLSState * state = nullptr;
 
-    std::optional<mls::MLSMessage> m_proposedCommit = {};
+    std::optional<CachedMLSMessage> m_proposedCommit = {};
     std::optional<mls::Welcome> m_associatedWelcome = {};
 
-    std::vector<mls::MLSMessage> m_futureProposals;
-    std::vector<mls::MLSMessage> m_futureCascadeConsensus;
+    EpochBuffer<mls::MLSMessage> m_futureProposals;
+    EpochBuffer<mls::MLSMessage> m_futureCascadeConsensus;
 
     std::set<mls::ProposalRef> m_receivedProposals;
+    std::map<mls::ProposalRef, mls::MLSMessage> m_proposalMessages; // To answer fetch requests
+
+    // Ordered on the memoized serialization of the commits
+    std::map<CachedMLSMessage, std::set<mls::ProposalRef>> m_incompleteCommits;
+
+    VerificationPipeline m_verificationPipeline; // Hands messages to m_cascadeConsensus
+    RelayTree m_relayTree;
+    PayloadCompressor m_compressor; // Read from every member, used to send if enabled
 
-    struct MessageCompare // Required for std::map
+    static constexpr size_t PROBES_PER_ROUND = 4;
+    int m_probeInterval = 0; // Disabled
+    std::optional<timeoutID> m_probeTimeout = {};
+    size_t m_nextProbed = 0;
+
+    size_t m_batchMessages = DEFAULT_BATCH_MESSAGES;
+    size_t m_batchBytesLimit = DEFAULT_BATCH_BYTES;
+    int m_batchDelay = DEFAULT_BATCH_DELAY_MS;
+    ApplicationBatch m_batch;          // Payloads waiting to be sent
+    size_t m_batchedBytes = 0;
+    std::optional<timeoutID> m_batchTimeout = {};
+
+    struct LoggedCommit
     {
-        bool operator()(const mls::MLSMessage & lhs, const mls::MLSMessage & rhs) const
-        { return mls::tls::marshal(lhs) < mls::tls::marshal(rhs); };
+        mls::epoch_t epoch;
+        DecidedCommit decided;
+        ControlSignature attestation; // CONTROL_DECIDED on the commit
     };
-    std::map<mls::MLSMessage, std::set<mls::ProposalRef>, MessageCompare> m_incompleteCommits;
+
+    static constexpr int CATCH_UP_DELAY_RTTS = 4;       // Lag noticed to request
+    static constexpr size_t CATCH_UP_MAX_CANDIDATES = 4; // Commits kept per epoch
+    size_t m_commitLogEpochs = DEFAULT_COMMIT_LOG_EPOCHS; // 0 disables catch-up
+    std::deque<LoggedCommit> m_commitLog;              // Oldest first
+    std::map<mls::epoch_t, std::vector<DecidedCommit>> m_catchUpCommits;
+    std::map<mls::epoch_t, std::map<uint32_t, ControlSignature>> m_attestations; // By signer
+    std::map<uint32_t, bool> m_catchUpRequests;        // Members asked, whether for the commits
+    std::optional<timeoutID> m_catchUpTimeout = {};
+    size_t m_catchUpAttempt = 0;
+    size_t m_caughtUpEpochs = 0;
+
+    std::unique_ptr<Metrics> m_metrics; // Only when built with DDS_METRICS
+    std::optional<Metrics::Clock::time_point> m_epochStartedAt = {};
+    std::string m_metricsFile;
+    int m_metricsInterval = 0;
 
 };
 
@@ -0,0 +1,172 @@
+/**
+ * @file epoch_buffer.hpp
+ * @author Ludovic PAILLAT (Ludovic.PAILLAT@hivenet.com)
+ * @brief Bounded buffer of the messages received ahead of time (future epoch
+ *  or future view), bucketed by epoch
+ *
+ * The buffered bytes are accounted globally and per origin (signer of the
+ *  message, when it is known) against a budget, and messages too far ahead are
+ *  refused. When full, the furthest messages are evicted first: they are the
+ *  least likely to be useful soon. Releasing an epoch drops the older buckets
+ *  and only costs the messages it hands over.
+ */
+
+#ifndef __EPOCH_BUFFER_HPP__
+#define __EPOCH_BUFFER_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <iterator>
+#include <map>
+#include <optional>
+#include <utility>
+#include <vector>
+
+static constexpr size_t DEFAULT_BUFFER_BUDGET = 16 * 1024 * 1024;
+static constexpr size_t DEFAULT_BUFFER_ORIGIN_BUDGET = 1024 * 1024;
+static constexpr uint64_t DEFAULT_BUFFER_HORIZON = 8; // Epochs (or views) ahead
+
+// Counters of the buffered messages of a client
+struct BufferStats
+{
+    size_t futureBytes = 0;         // Future epochs and views
+    size_t futureMessages = 0;
+    size_t gossipBytes = 0;         // Gossip messages kept for anti-entropy
+    size_t dropped = 0;             // Refused or evicted since the start
+};
+
+template <typename T, typename Origin = uint32_t>
+class EpochBuffer
+{
+public:
+    EpochBuffer(size_t budget = DEFAULT_BUFFER_BUDGET,
+        size_t originBudget = DEFAULT_BUFFER_ORIGIN_BUDGET,
+        uint64_t horizon = DEFAULT_BUFFER_HORIZON)
+        : m_budget(budget), m_originBudget(originBudget), m_horizon(horizon)
+    { }
+
+    void setBudget(size_t budget, size_t originBudget)
+    {
+        m_budget = budget;
+        m_originBudget = originBudget;
+    }
+
+    void setHorizon(uint64_t horizon)
+    {
+        m_horizon = horizon;
+    }
+
+    // Returns false if the message was refused, current is the epoch being
+    //  processed if there is one. Messages of unknown origin only count globally
+    bool push(std::optional<uint64_t> current, uint64_t epoch,
+        const std::optional<Origin> & origin, const T & value, size_t size)
+    {
+        if((current && epoch > current.value() + m_horizon) || size > m_budget
+            || (origin && originBytes(origin.value()) + size > m_originBudget))
+        {
+            m_dropped++;
+            return false;
+        }
+
+        // Make room by evicting messages further than this one
+        while(m_bytes + size > m_budget)
+        {
+            auto furthest = std::prev(m_buckets.end());
+            if(furthest->first <= epoch)
+            {
+                m_dropped++;
+                return false;
+            }
+
+            forget(furthest->second.back());
+            furthest->second.pop_back();
+            m_dropped++;
+
+            if(furthest->second.empty())
+                m_buckets.erase(furthest);
+        }
+
+        m_bytes += size;
+        if(origin)
+            m_originBytes[origin.value()] += size;
+        m_buckets[epoch].push_back({value, origin, size});
+
+        return true;
+    }
+
+    // Messages of the given epoch in order of arrival, older ones are dropped
+    std::vector<T> release(uint64_t epoch)
+    {
+        std::vector<T> released;
+
+        while(!m_buckets.empty() && m_buckets.begin()->first <= epoch)
+        {
+            const bool isReleased = m_buckets.begin()->first == epoch;
+            for(auto & entry : m_buckets.begin()->second)
+            {
+                forget(entry);
+                if(isReleased)
+                    released.emplace_back(std::move(entry.value));
+            }
+
+            m_buckets.erase(m_buckets.begin());
+        }
+
+        return released;
+    }
+
+    void clear()
+    {
+        m_buckets.clear();
+        m_originBytes.clear();
+        m_bytes = 0;
+    }
+
+    size_t bytes() const { return m_bytes; }
+    size_t dropped() const { return m_dropped; }
+
+    size_t size() const
+    {
+        size_t count = 0;
+        for(const auto & [_, bucket] : m_buckets)
+            count += bucket.size();
+        return count;
+    }
+
+private:
+    struct Entry
+    {
+        T value;
+        std::optional<Origin> origin;
+        size_t size;
+    };
+
+    size_t originBytes(const Origin & origin) const
+    {
+        const auto originIt = m_originBytes.find(origin);
+        return originIt == m_originBytes.end() ? 0 : originIt->second;
+    }
+
+    void forget(const Entry & entry)
+    {
+        m_bytes -= entry.size;
+        if(entry.origin)
+        {
+            auto originIt = m_originBytes.find(entry.origin.value());
+            originIt->second -= entry.size;
+            if(originIt->second == 0)
+                m_originBytes.erase(originIt);
+        }
+    }
+
+    size_t m_budget, m_originBudget;
+    uint64_t m_horizon;
+
+    std::map<uint64_t, std::deque<Entry>> m_buckets;
+    std::map<Origin, size_t> m_originBytes;
+    size_t m_bytes = 0;
+    size_t m_dropped = 0;
+};
+
+#endif
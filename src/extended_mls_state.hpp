@@ -9,11 +9,16 @@
 
 #include <mls/state.h>
 
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
 #include <exception>
 #include <map>
+#include <memory>
 #include <optional>
 #include <set>
+#include <span>
+#include <unordered_map>
 #include <utility>
 #include <variant>
 #include <vector>
@@ -24,27 +29,52 @@
 #include <mls/core_types.h>
 #include <mls/credential.h>
 #include <mls/crypto.h>
+#include <mls/key_schedule.h>
 #include <mls/messages.h>
 #include <mls/tree_math.h>
 #include "tls/tls_syntax.h"
 
+#include "control_signature.hpp"
+#include "membership_index.hpp"
 #include "message.hpp"
 
 using MessageRef = mls::bytes_ns::bytes;
-using AuthContentRef = mls::bytes_ns::bytes;
+using AuthContentRef = mls::bytes_ns::bytes; // Signature of a control statement
 
 #define MLS_UTIL_HASH(S, M) (*((uint32_t *) &(S).cipher_suite().ref(M).data()[5]))
 #define MLS_UTIL_HASH_STATE(S) (*((uint32_t *) &(S).epoch_authenticator().data()[5]))
 #define MLS_UTIL_HASH_REF(R) (*((uint32_t *) &(R).data()[5]))
 
+// Signatures are uniformly distributed, their first bytes are a good hash
+struct SignatureHash
+{
+    size_t operator()(const mls::bytes_ns::bytes & signature) const
+    {
+        size_t hash = 0;
+        memcpy(&hash, signature.data(), std::min(sizeof(hash), signature.size()));
+        return hash;
+    }
+};
+
 class ExtendedMLSState
     : public mls::State
 {
 public:
     ExtendedMLSState(const mls::State & state)
-        : mls::State(state)
+        : mls::State(state),
+            m_verifiedSignatures(std::make_shared<VerifiedSignatures>())
     { }
 
+    // State of the next epoch, membership index derived from the previous one
+    ExtendedMLSState(const mls::State & state, const ExtendedMLSState & previous,
+        const std::vector<mls::bytes_ns::bytes> & added,
+        const std::vector<mls::bytes_ns::bytes> & removed)
+        : ExtendedMLSState(state)
+    {
+        deriveMembers(previous.members(), added, removed);
+        m_verifiedBefore = previous.verifiedSignatures();
+    }
+
     /** Returns proposal reference if valid */
     std::optional<mls::ProposalRef> isValidProposal(const mls::MLSMessage & message)
     {
@@ -80,7 +110,7 @@ public:
             return {};
     }
 
-    /** Returns message content if valid */
+    /** Returns message content if valid, the message cannot be read again */
     std::optional<mls::bytes_ns::bytes> isValidApplicationMessage(const mls::MLSMessage & message)
     {
         if(message.epoch() != epoch())
@@ -89,56 +119,57 @@ public:
         auto optContent = checkAndExtractContent(message, mls::ContentType::application);
         if(optContent)
         {
-            return {var::get<mls::ApplicationData>(optContent->content.content).data};
+            return {applicationData(optContent.value())};
         }
         else
             return {};
     }
 
+    // Built on first use, or derived from the previous epoch with deriveMembers()
+    const MembershipIndex & members() const
+    {
+        if(!m_members)
+            m_members = std::make_shared<const MembershipIndex>(tree());
+
+        return *m_members;
+    }
+
+    // Changes are the ones of getCommitMembershipChanges() on the previous state
+    void deriveMembers(const MembershipIndex & previous,
+        const std::vector<mls::bytes_ns::bytes> & added,
+        const std::vector<mls::bytes_ns::bytes> & removed)
+    {
+        m_members = std::make_shared<const MembershipIndex>(previous.next(tree(), added, removed));
+    }
+
+    // Sorted
     std::vector<mls::bytes_ns::bytes> getMembersIdentity(bool excludeSelf = false) const
     {
-        std::vector<mls::bytes_ns::bytes> identities;
+        std::vector<mls::bytes_ns::bytes> identities = members().identities();
 
-        tree().all_leaves([&](auto index, const mls::LeafNode& leaf)
+        if(excludeSelf)
         {
-            if(!excludeSelf || index != this->index())
-                identities.emplace_back(leaf.credential.get<mls::BasicCredential>().identity);
-            return true;
-        });
+            const auto selfIt = std::lower_bound(identities.begin(), identities.end(),
+                members().identity(index()));
+            if(selfIt != identities.end())
+                identities.erase(selfIt);
+        }
 
         return identities;
     }
 
     std::vector<mls::LeafIndex> getMembersIndexes() const
     {
-        std::vector<mls::LeafIndex> indexes;
-
-        tree().all_leaves([&](auto index, auto)
-        {
-            indexes.emplace_back(index);
-            return true;
-        });
-        return indexes;
+        return members().indexes();
     }
 
     std::optional<mls::MLSMessage> remove(const mls::bytes_ns::bytes & identity,
         const mls::MessageOpts & msg_opts)
     {
-        mls::LeafIndex toRemoveIdx;
-
-        bool found = tree().any_leaf([&](auto idx, const mls::LeafNode& leaf)
-        {
-            if(leaf.credential.get<mls::BasicCredential>().identity == identity)
-            {
-                toRemoveIdx = idx;
-                return true;
-            }
-            else
-                return false;
-        });
+        const auto toRemoveIdx = members().find(identity);
 
-        if(found)
-            return {State::remove(toRemoveIdx, msg_opts)};
+        if(toRemoveIdx)
+            return {State::remove(toRemoveIdx.value(), msg_opts)};
         else
             return {};
     }
@@ -235,10 +266,10 @@ public:
         return std::get<mls::MemberSender>(optContent->content.sender.sender).sender;
     }
 
-    const mls::bytes_ns::bytes getMemberNameByIndex(const mls::LeafIndex & idx)
+    const mls::bytes_ns::bytes & getMemberNameByIndex(const mls::LeafIndex & idx) const
     {
-        return tree().leaf_node(idx)->credential.get<mls::BasicCredential>().identity;
-    } 
+        return members().identity(idx);
+    }
 
     inline bytes freshSecret()
     {
@@ -271,68 +302,188 @@ public:
         return memberSender.sender == index();
     }
 
-    // Allow client to sign any type of content
-    mls::AuthenticatedContent sign(const mls::bytes_ns::bytes & content) const
-    {
-        return mls::State::sign({ mls::MemberSender{ _index } },
-            std::forward<mls::ApplicationData>({ content }), {}, true /** Mandatory to be true even though we only sign */);
-    }
-
     // Expose list of received proposals, to be committed
     const std::list<CachedProposal> & cachedProposals() const
     {
         return _pending_proposals;
     }
 
-    // Just expose the ability of verifying authenticated contents
-    bool verify(const mls::AuthenticatedContent & authContent) const
+    // Sign a consensus control statement with the member's MLS signature key
+    ControlSignature signControl(ControlSignatureType type, uint32_t sequence,
+        const mls::bytes_ns::bytes & reference) const
+    {
+        ControlSignature sig = {
+            .type = type,
+            .signer = _index.val,
+            .epoch = epoch(),
+            .sequence = sequence,
+            .reference = reference
+        };
+        sig.signature = _identity_priv.sign(_suite, CONTROL_SIGNATURE_LABEL,
+            controlSignatureContent(sig));
+
+        return sig;
+    }
+
+    // Verify a control statement of the current epoch. The same signatures
+    //  are received many times during an epoch (piggybacked by every CAC
+    //  message, then as proofs), valid ones are remembered
+    bool verify(const ControlSignature & sig) const
+    {
+        if(sig.epoch != epoch() || sig.signer >= tree().size.val)
+            return false;
+
+        mls::bytes_ns::bytes content = controlSignatureContent(sig);
+
+        // The signature alone is not enough, it could be replayed on another content
+        const auto it = m_verifiedSignatures->find(sig.signature);
+        if(it != m_verifiedSignatures->end() && it->second == content)
+            return true;
+
+        const auto leaf = tree().leaf_node(mls::LeafIndex{ sig.signer });
+        if(!leaf || !leaf->signature_key.verify(_suite, CONTROL_SIGNATURE_LABEL,
+            content, sig.signature))
+            return false;
+
+        m_verifiedSignatures->insert_or_assign(sig.signature, std::move(content));
+        return true;
+    }
+
+    // What verify() checks, without access to the state: can run on another
+    //  thread, the result is given back with markVerified()
+    struct DetachedVerification
+    {
+        mls::CipherSuite suite;
+        mls::SignaturePublicKey key;
+        mls::bytes_ns::bytes content, signature;
+
+        bool run() const
+        {
+            return key.verify(suite, CONTROL_SIGNATURE_LABEL, content, signature);
+        }
+    };
+
+    // Nothing if already verified, or rejected by verify() anyway
+    std::optional<DetachedVerification> detachVerification(const ControlSignature & sig) const
+    {
+        if(sig.epoch != epoch() || sig.signer >= tree().size.val)
+            return {};
+
+        mls::bytes_ns::bytes content = controlSignatureContent(sig);
+
+        const auto it = m_verifiedSignatures->find(sig.signature);
+        if(it != m_verifiedSignatures->end() && it->second == content)
+            return {};
+
+        const auto leaf = tree().leaf_node(mls::LeafIndex{ sig.signer });
+        if(!leaf)
+            return {};
+
+        return { (DetachedVerification) {
+            _suite, leaf->signature_key, std::move(content), sig.signature } };
+    }
+
+    // The verification must have succeeded, during this epoch
+    void markVerified(const DetachedVerification & verification)
+    {
+        m_verifiedSignatures->insert_or_assign(verification.signature, verification.content);
+    }
+
+    // Control signatures verified, since the first epoch of this member
+    size_t verifiedSignatures() const
     {
-        return mls::State::verify(authContent);
+        return m_verifiedBefore + m_verifiedSignatures->size();
     }
 
-    template <typename T>
-    std::optional<T> verifyAndExtract(const mls::AuthenticatedContent & authContent)
+    /** Returns message content if valid, decrypted and verified only once:
+     *  application data is consumed (cannot be read again), proposals and
+     *  commits can still be handled */
+    std::optional<mls::AuthenticatedContent> validateAndExtractContent(const mls::MLSMessage & message)
     {
-        if(!verify(authContent)
-            || authContent.content.content_type() != mls::ContentType::application)
+        if(message.epoch() != epoch())
             return {};
 
-        T content;
-        mls::tls::unmarshal(std::get<mls::ApplicationData>(
-            authContent.content.content).data, content);
+        return unprotectContent(message, true);
+    }
 
-        return content;
+    static const mls::bytes_ns::bytes & applicationData(const mls::AuthenticatedContent & authContent)
+    {
+        return std::get<mls::ApplicationData>(authContent.content.content).data;
     }
 
 protected:
     std::optional<mls::AuthenticatedContent> checkAndExtractContent(
         const mls::MLSMessage & message, const mls::ContentType & type)
     {
-        mls::AuthenticatedContent authContent;
+        auto authContent = unprotectContent(message, type == mls::ContentType::application);
+
+        if(!authContent || authContent->content.content_type() != type)
+            return {};
+
+        return authContent;
+    }
+
+    // Decrypting a private message consumes the keys of its sender in the
+    //  secret tree, the rest of the state is left untouched: only these keys
+    //  are saved and restored, unless application data is read for good
+    std::optional<mls::AuthenticatedContent> unprotectContent(
+        const mls::MLSMessage & message, bool consumeApplication)
+    {
+        std::optional<mls::GroupKeySource> savedKeys;
+        if(message.wire_format() == mls::WireFormat::mls_private_message)
+            savedKeys = _keys;
 
         try
         {
-            ExtendedMLSState stateCopy = *this;
-            authContent = stateCopy.unprotect_to_content_auth(message);
+            auto authContent = unprotect_to_content_auth(message);
+
+            if(savedKeys && !(consumeApplication
+                && authContent.content.content_type() == mls::ContentType::application))
+                _keys = std::move(savedKeys.value());
+
+            return authContent;
         }
         catch (std::exception& e)
         {
+            if(savedKeys)
+                _keys = std::move(savedKeys.value());
+
             printf("MLS Read Exception: %s\n", e.what());
             return {};
         }
+    }
 
-        if(authContent.content.content_type() != type)
-            return {};
 
-        return authContent;
+private:
+    static constexpr const char * CONTROL_SIGNATURE_LABEL = "DDS Control Signature";
+
+    mls::bytes_ns::bytes controlSignatureContent(const ControlSignature & sig) const
+    {
+        return mls::tls::marshal((ControlSignatureContent) {
+            .groupId = group_id(),
+            .type = sig.type,
+            .signer = sig.signer,
+            .epoch = sig.epoch,
+            .sequence = sig.sequence,
+            .reference = sig.reference
+        });
     }
 
+    // Signature -> signed content
+    using VerifiedSignatures = std::unordered_map<mls::bytes_ns::bytes,
+        mls::bytes_ns::bytes, SignatureHash>;
+
+    // Shared by copies of the state, they have the same epoch and tree
+    std::shared_ptr<VerifiedSignatures> m_verifiedSignatures;
+    size_t m_verifiedBefore = 0; // During the previous epochs
+    mutable std::shared_ptr<const MembershipIndex> m_members;
 };
 
+// tls::istream owns its input, this is the only copy of a received frame
 template <typename T>
-static void unmarshal(const Bytes & bytes, T & message)
+static void unmarshal(std::span<const uint8_t> bytes, T & message)
 {
-    std::vector<uint8_t> messageBytes{bytes.content, bytes.content + bytes.size};
+    std::vector<uint8_t> messageBytes{bytes.begin(), bytes.end()};
     mls::tls::unmarshal(messageBytes, message);
 }
 
@@ -344,11 +495,11 @@ static Bytes toBytes(const mls::bytes_ns::bytes & bytes)
     return res;
 }
 
+// Adopts the serializer output, no copy
 template <typename T>
 static Bytes marshalToBytes(const T & message)
 {
-    mls::bytes_ns::bytes marshaledMessage = mls::tls::marshal(message);
-    return toBytes(marshaledMessage);
+    return Bytes{mls::tls::marshal(message)};
 }
 
 #endif
@@ -6,7 +6,14 @@
  *  Cascade Consensus protocol
  *
  *  Simplification: no checkpoints, no sequence, consensus instance allow to
- *      decide on one commit and is then reset
+ *      decide on one commit and is then reset. There is no new-view message:
+ *      a view starts once 2f + 1 view changes target it, each carrying the
+ *      value its signer prepared in the highest view, which the new leader
+ *      pre-prepares at once, and the only one the members prepare in turn.
+ *      A member joins the smallest later view that f + 1
+ *      others moved to, and may skip views led by members suspected to be
+ *      down. A view not started in time is given up for the next one, each
+ *      time waiting twice as long, until a decision
  *  TODO: To optimize bandwidth, the actual message is not sent during
  *      every phase, but referred to using a hash most of the time. It is
  *      possible to reach a decision to deliver this message without having
@@ -24,20 +31,26 @@
 
 #include <algorithm>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <functional>
 #include <map>
 #include <optional>
-#include <queue>
 #include <set>
+#include <string>
 #include <vector>
 
 #include "mls/messages.h"
 #include "mls/tree_math.h"
 #include "tls/tls_syntax.h"
 
+#include "control_signature.hpp"
 #include "dds_message.hpp"
+#include "epoch_buffer.hpp"
 #include "extended_mls_state.hpp"
+#include "metrics.hpp"
 #include "network.hpp"
+#include "rtt_estimator.hpp"
 
 template <typename T>
 class FullConsensus
@@ -54,17 +67,81 @@ public:
             m_send(sendCallback), m_deliver(deliverCallback)
     { }
 
+    void setBufferBudget(size_t budget)
+    {
+        m_futureMessages.setBudget(budget, budget / MAX_BUFFERED_SIGNERS);
+    }
+    // Views ahead of the current one whose messages are buffered
+    void setBufferHorizon(uint64_t views)
+    {
+        m_futureMessages.setHorizon(views);
+    }
+
+    // Timeouts follow the measured rtt instead of the configured one
+    void setRttEstimator(const RttEstimator * estimator)
+    {
+        m_rttEstimator = estimator;
+    }
+
+    // Views led by members whose last view failed are skipped until one of
+    //  their votes is received, in this epoch or a later one
+    void setSkipSuspectedLeaders(bool enabled)
+    {
+        m_skipSuspectedLeaders = enabled;
+    }
+
+    // View changes are counted when given metrics
+    void setMetrics(Metrics * metrics)
+    {
+        m_metrics = metrics;
+    }
+
+    size_t bufferedBytes() const { return m_futureMessages.bytes(); }
+    size_t bufferedMessages() const { return m_futureMessages.size(); }
+    size_t droppedMessages() const { return m_futureMessages.dropped(); }
+
+    static constexpr size_t MAX_BUFFERED_SIGNERS = 16; // Or more with a smaller share each
+    static constexpr uint MAX_VIEW_CHANGE_BACKOFF = 6;  // Timeout of 2 rtt << 6 at most
+
+    // Views given up, and views skipped as led by suspected members
+    size_t viewChanges() const { return m_viewChangeCount; }
+    size_t skippedViews() const { return m_skippedViews; }
+    // Pre-prepares of another value than the one prepared in an earlier view
+    size_t rejectedPrePrepares() const { return m_rejectedPrePrepares; }
+
+#ifdef TEST
+    // Value pre-prepared instead of the proposed one when TEST_FC_EQUIVOCATE
+    //  is set and this member leads the first view change
+    void setEquivocation(const std::function<T(const T &)> & equivocate)
+    {
+        m_equivocate = equivocate;
+    }
+#endif
+
     void newEpoch(ExtendedMLSState * state)
     {
         m_state = state;
 
-        const uint n = m_state->getMembersIdentity(false).size(); // TODO Not very efficient
+        m_members = m_state->getMembersIndexes(); // Sorted, leaders of the views in turn
+        const uint n = m_members.size();
         f = (n - 1) / 3;
 
+        std::set<std::string> suspected;
+        for(const auto & member : m_members)
+            if(m_suspected.contains(m_state->members().name(member)))
+                suspected.insert(m_state->members().name(member));
+        m_suspected = std::move(suspected);
+
         m_futureMessages.clear();
         m_messages.clear(); // We assume it won't get too big so no need to clear between views
+        m_viewChanges.clear();
+        m_prepared = {};
+        m_sentViewChange = {};
+        cancelViewChangeTimeout();
+        m_viewChangeAttempts = 0;
 
         m_proposedMessage = {};
+        m_currentView = 0;
         newView(0);
     }
 
@@ -87,13 +164,13 @@ public:
             if(propose.view == m_currentView)
                 handlePropose(propose.content);
             else if(propose.view > m_currentView)
-                m_futureMessages[propose.view].push(message);
+                bufferFutureMessage(propose.view, {}, message);
         }
         else if(message.type() == ConsensusMessageType::CONSENSUS_PRE_PREPARE)
         {
             const auto prePrepare = message.prePrepareMessage();
             const auto content = getContentIfReady(prePrepare.signedContent,
-                message);
+                CONTROL_FC_PRE_PREPARE, message);
 
             if(content)
                 handlePrePrepare(content->first, content->second,
@@ -103,67 +180,71 @@ public:
         {
             const auto prepare = message.prepareMessage();
             const auto content = getContentIfReady(prepare.signedContent,
-                message);
+                CONTROL_FC_PREPARE, message);
 
             if(content)
-                handlePrepare(content->first, content->second);
+                handlePrepare(content->first, content->second, prepare.signedContent);
         }
         else if(message.type() == ConsensusMessageType::CONSENSUS_COMMIT)
         {
             const auto commit = message.commitMessage();
             const auto content = getContentIfReady(commit.signedContent,
-                message);
+                CONTROL_FC_COMMIT, message);
 
             if(content)
                 handleCommit(content->first, content->second);
         }
         else if(message.type() == ConsensusMessageType::CONSENSUS_VIEW_CHANGE)
         {
-            const auto viewChange = message.viewChange();
-            
-            if(viewChange.content.sender.sender_type() != mls::SenderType::member)
-                return;
+            const auto & viewChange = message.viewChange();
 
-            const auto sender = std::get<mls::MemberSender>(
-                viewChange.content.sender.sender).sender;
+            // Kept whatever the later view, until 2f + 1 members target the same
+            if(viewChange.signedContent.sequence <= m_currentView || !isValid(viewChange))
+                return;
 
-            const auto content = m_state->verifyAndExtract<ViewChangeMessageContent>(viewChange);
-            if(content)
-            {
-                if(content->view == m_currentView + 1)
-                    handleViewChange(sender, content->view);
-                else if(content->view > m_currentView)
-                    m_futureMessages[content->view].push(message);
-            }
+            heardFrom(mls::LeafIndex{ viewChange.signedContent.signer });
+            handleViewChange(viewChange);
         }
     }
 
 protected:
     void newView(uint32_t view)
     {
+        if(view > 0)
+        {
+            METRIC(m_metrics, count(Counter::VIEW_CHANGES));
+            METRIC(m_metrics, count(Counter::VIEWS_SKIPPED, view - m_currentView - 1));
+            m_viewChangeCount++, m_skippedViews += view - m_currentView - 1;
+            suspect(m_currentLeader); // Its view did not decide
+        }
         m_currentView = view;
+        if(!m_sentViewChange || m_sentViewChange.value() <= view)
+            cancelViewChangeTimeout(); // The view this member moved to started
 
         // Determine new leader deterministically (using epoch number to change leader periodically)
-        auto members = m_state->getMembersIndexes();
-        std::sort(members.begin(), members.end());
-        const uint leader = (view + m_state->epoch()) % members.size();
-        m_currentLeaderIdx = members[leader];
-        const auto name = m_state->getMemberNameByIndex(m_currentLeaderIdx);
-        m_currentLeader = std::string{name.data(), name.data() + name.size()};
+        m_currentLeaderIdx = leader(view);
+        m_currentLeader = m_state->members().name(m_currentLeaderIdx);
 
         m_prePreparedMessage = {};
         m_hasSentPrePrepare = false, m_hasSentPrepare = false, m_hasSentCommit = false;
         m_signedPrepare.clear(), m_signedCommit.clear();
-        m_signedNewView.clear();
 
-        resetTimers();
-
-        while(!m_futureMessages[view].empty())
+        // A value may have been decided in an earlier view: it is the only one
+        //  which can be proposed in this one
+        m_required = {};
+        if(auto prepared = highestPrepared(view))
         {
-            auto message = m_futureMessages[view].front();
-            m_futureMessages[view].pop();
-            receiveMessage(message);
+            m_required = m_state->cipher_suite().ref(prepared.value());
+            m_proposedMessage = std::move(prepared);
         }
+        std::erase_if(m_viewChanges, [view](const auto & entry)
+            { return entry.second.signedContent.sequence <= view; });
+
+        resetTimers();
+
+        for(const auto & message : m_futureMessages.release(view))
+            if(m_currentView == view)
+                receiveMessage(message);
 
         if(m_proposedMessage && !m_hasSentPrepare && !m_hasSentPrePrepare)
             proposeCurrentValue();
@@ -175,6 +256,10 @@ protected:
         {
             handlePropose(m_proposedMessage.value());
         }
+        else if(m_skipSuspectedLeaders && m_suspected.contains(m_currentLeader))
+        {
+            sendViewChange(nextView()); // Without waiting for the leader to time out
+        }
         else
         {
             ConsensusMessage<T> message = {
@@ -185,7 +270,7 @@ protected:
             };
             m_send(message, m_currentLeader);
 
-            m_timeout = m_network.registerTimeout(m_networkRTT,
+            m_timeout = m_network.registerTimeout(rtt(),
                 [this](auto){ m_timeout = {}, handleProposeTimeout(); });
         }
     }
@@ -201,18 +286,85 @@ protected:
         };
         m_broadcast(message);
 
-        m_forwardTimeout = m_network.registerTimeout(m_networkRTT,
+        m_forwardTimeout = m_network.registerTimeout(rtt(),
             [this](auto){ m_forwardTimeout = {}; handleForwardTimeout(); });
     }
 
     void handleForwardTimeout()
     {
+        sendViewChange(nextView());
+    }
+
+    // The view moved to did not start: the following one is tried
+    void armViewChangeTimeout(uint32_t view)
+    {
+        cancelViewChangeTimeout();
+
+        const int delay = (2 * rtt()) << std::min(m_viewChangeAttempts++, MAX_VIEW_CHANGE_BACKOFF);
+        m_viewChangeTimeout = m_network.registerTimeout(delay, [this, view](auto)
+        {
+            m_viewChangeTimeout = {};
+            sendViewChange(nextView(view));
+        });
+    }
+
+    void cancelViewChangeTimeout()
+    {
+        if(m_viewChangeTimeout)
+        {
+            m_network.unregisterTimeout(m_viewChangeTimeout.value());
+            m_viewChangeTimeout = {};
+        }
+    }
+
+    // With the value prepared in the highest view, if any
+    void sendViewChange(uint32_t view)
+    {
+        if(m_sentViewChange && m_sentViewChange.value() >= view)
+            return;
+        m_sentViewChange = view;
+
+        ConsensusViewChangeMessage<T> viewChange = {
+            .signedContent = m_state->signControl(CONTROL_FC_VIEW_CHANGE, view,
+                m_prepared ? m_prepared->reference : MessageRef{})
+        };
+        if(m_prepared)
+        {
+            viewChange.prepared = m_prepared->prepares;
+            viewChange.preparedMessage = m_messages.at(m_prepared->reference);
+        }
+
         ConsensusMessage<T> message = {
-            .content = m_state->sign(mls::tls::marshal((ViewChangeMessageContent) {
-                .view = m_currentView + 1
-            }))
+            .content = viewChange
         };
         m_broadcast(message);
+        armViewChangeTimeout(view);
+
+        handleViewChange(viewChange); // Counted with the others
+    }
+
+    uint32_t nextView() const
+    {
+        return nextView(m_currentView);
+    }
+
+    // Following view, or the first one led by a member not suspected
+    uint32_t nextView(uint32_t after) const
+    {
+        uint32_t view = after + 1;
+        if(!m_skipSuspectedLeaders)
+            return view;
+
+        for(size_t skipped = 0; skipped + 1 < m_members.size()
+            && m_suspected.contains(m_state->members().name(leader(view))); ++skipped)
+            view++;
+
+        return view;
+    }
+
+    mls::LeafIndex leader(uint32_t view) const
+    {
+        return m_members[(view + m_state->epoch()) % m_members.size()];
     }
 
     void handlePropose(const T & proposed)
@@ -223,12 +375,31 @@ protected:
         {
             m_hasSentPrePrepare = true;
 
+#ifdef TEST
+            // Allow to test a leader pre-preparing another value than the
+            //  one prepared before the view change
+            if(std::getenv("TEST_FC_EQUIVOCATE") && m_currentView == 1 && m_equivocate)
+            {
+                printf("TEST_FC_EQUIVOCATE: Equivocate\n");
+                const T altered = m_equivocate(proposed);
+                m_messages[m_state->cipher_suite().ref(altered)] = altered;
+
+                ConsensusMessage<T> message = {
+                    .content = (ConsensusPrePrepareMessage<T>) {
+                        .signedContent = m_state->signControl(CONTROL_FC_PRE_PREPARE,
+                            m_currentView, m_state->cipher_suite().ref(altered)),
+                        .proposedMessage = altered
+                    }
+                };
+                m_broadcast(message);
+                return;
+            }
+#endif
+
             ConsensusMessage<T> message = {
                 .content = (ConsensusPrePrepareMessage<T>) {
-                    .signedContent = m_state->sign(mls::tls::marshal((ConsensusMessageContent) {
-                        .view = m_currentView,
-                        .consensusMessage = m_state->cipher_suite().ref(proposed)
-                    })),
+                    .signedContent = m_state->signControl(CONTROL_FC_PRE_PREPARE,
+                        m_currentView, m_state->cipher_suite().ref(proposed)),
                     .proposedMessage = proposed
                 }
             };
@@ -244,7 +415,7 @@ protected:
             };
             m_send(message, m_currentLeader);
 
-            m_forwardTimeout = m_network.registerTimeout(m_networkRTT,
+            m_forwardTimeout = m_network.registerTimeout(rtt(),
             [this](auto){ m_forwardTimeout = {}; handleForwardTimeout(); });
         }
     }
@@ -256,7 +427,19 @@ protected:
             || sender != m_currentLeaderIdx)
             return;
 
-        m_messages[m_state->cipher_suite().ref(proposed)] = proposed;
+        // The value signed, and the one prepared in an earlier view if any:
+        //  the timers are kept for the view to be given up
+        const MessageRef reference = m_state->cipher_suite().ref(proposed);
+        if(reference != content.consensusMessage)
+            return;
+        if(m_required && reference != m_required.value())
+        {
+            METRIC(m_metrics, count(Counter::PRE_PREPARES_REJECTED));
+            m_rejectedPrePrepares++;
+            return;
+        }
+
+        m_messages[reference] = proposed;
         resetTimers();
 
         if(!m_hasSentPrepare)
@@ -264,15 +447,13 @@ protected:
             m_hasSentPrepare = true;
             m_proposedMessage = proposed;
 
-            m_timeout = m_network.registerTimeout(m_networkRTT, [this](auto)
+            m_timeout = m_network.registerTimeout(rtt(), [this](auto)
             { m_timeout = {}; handleProposeTimeout(); });
 
             ConsensusMessage<T> message = {
                 .content = (ConsensusPrepareMessage) {
-                    .signedContent = m_state->sign(mls::tls::marshal((ConsensusMessageContent) {
-                        .view = m_currentView,
-                        .consensusMessage = content.consensusMessage
-                    }))
+                    .signedContent = m_state->signControl(CONTROL_FC_PREPARE,
+                        m_currentView, content.consensusMessage)
                 }
             };
             m_broadcast(message);
@@ -280,22 +461,39 @@ protected:
     }
 
     void handlePrepare(const mls::LeafIndex & sender,
-        const ConsensusMessageContent & content)
+        const ConsensusMessageContent & content, const ControlSignature & signature)
     {
-        m_signedPrepare[content.consensusMessage].insert(sender);
+        auto & prepares = m_signedPrepare[content.consensusMessage];
+        prepares.emplace(sender, signature);
 
-        if(m_signedPrepare[content.consensusMessage].size() >= 2*f + 1
-            && !m_hasSentCommit)
+        if(prepares.size() >= 2*f + 1 && !m_hasSentCommit)
         {
             m_hasSentCommit = true;
             resetTimers();
 
+            // Carried by the next view changes, unless the value is unknown
+            if(m_messages.contains(content.consensusMessage))
+            {
+                m_prepared = { m_currentView, content.consensusMessage, {} };
+                for(const auto & [_, prepare] : prepares)
+                    m_prepared->prepares.push_back(prepare);
+            }
+
+#ifdef TEST
+            // Allow to test a value prepared in the first view and carried
+            //  by the view changes, without being committed in it
+            if(std::getenv("TEST_FC_GIVE_UP_PREPARED") && m_currentView == 0 && m_prepared)
+            {
+                printf("TEST_FC_GIVE_UP_PREPARED: View change\n");
+                sendViewChange(nextView());
+                return;
+            }
+#endif
+
             ConsensusMessage<T> message = {
                 .content = (ConsensusCommitMessage) {
-                    .signedContent = m_state->sign(mls::tls::marshal((ConsensusMessageContent) {
-                        .view = m_currentView,
-                        .consensusMessage = content.consensusMessage
-                    }))
+                    .signedContent = m_state->signControl(CONTROL_FC_COMMIT,
+                        m_currentView, content.consensusMessage)
                 }
             };
             m_broadcast(message);
@@ -311,13 +509,104 @@ protected:
             m_deliver(m_messages[content.consensusMessage]);
     }
 
-    void handleViewChange(const mls::LeafIndex & sender,
-        uint32_t view)
+    // Only the latest view change of each member is kept
+    void handleViewChange(const ConsensusViewChangeMessage<T> & viewChange)
     {
-        m_signedNewView.insert(sender);
+        const mls::LeafIndex signer{ viewChange.signedContent.signer };
+        const uint32_t view = viewChange.signedContent.sequence;
+
+        const auto it = m_viewChanges.find(signer);
+        if(it != m_viewChanges.end() && it->second.signedContent.sequence >= view)
+            return;
+        m_viewChanges.insert_or_assign(signer, viewChange);
+
+        if(viewChange.preparedMessage)
+            m_messages[viewChange.signedContent.reference] = viewChange.preparedMessage.value();
+
+        // Other members moving past the view this member is in or moved to
+        const uint32_t given = m_sentViewChange.value_or(m_currentView);
+        size_t sameView = 0, later = 0;
+        std::optional<uint32_t> smallest = {};
+        for(const auto & [member, other] : m_viewChanges)
+        {
+            const uint32_t otherView = other.signedContent.sequence;
+            sameView += otherView == view;
+
+            if(member != m_state->index() && otherView > given)
+            {
+                later++;
+                smallest = std::min(smallest.value_or(otherView), otherView);
+            }
+        }
 
-        if(m_signedNewView.size() >= 2*f + 1)
+        if(sameView >= 2*f + 1)
             newView(view);
+        else if(later >= f + 1)
+            sendViewChange(smallest.value()); // At least one correct member gave up the view
+    }
+
+    // The signed reference is the prepared value, proven by 2f + 1 prepares of
+    //  a single earlier view
+    bool isValid(const ConsensusViewChangeMessage<T> & viewChange) const
+    {
+        const auto & signedContent = viewChange.signedContent;
+        if(signedContent.type != CONTROL_FC_VIEW_CHANGE || !m_state->verify(signedContent))
+            return false;
+
+        if(signedContent.reference.empty())
+            return viewChange.prepared.empty() && !viewChange.preparedMessage;
+
+        if(!viewChange.preparedMessage || viewChange.prepared.empty()
+            || m_state->cipher_suite().ref(viewChange.preparedMessage.value()) != signedContent.reference)
+            return false;
+
+        const uint32_t preparedView = viewChange.prepared.front().sequence;
+        std::set<uint32_t> signers;
+        for(const auto & prepare : viewChange.prepared)
+            if(prepare.type != CONTROL_FC_PREPARE || prepare.sequence != preparedView
+                || preparedView >= signedContent.sequence
+                || prepare.reference != signedContent.reference
+                || !signers.insert(prepare.signer).second || !m_state->verify(prepare))
+                return false;
+
+        return signers.size() >= 2*f + 1;
+    }
+
+    // Among the view changes to the view, own prepared value included
+    std::optional<T> highestPrepared(uint32_t view) const
+    {
+        const MessageRef * reference = nullptr;
+        std::optional<uint32_t> highest = {};
+
+        if(m_prepared)
+            reference = &m_prepared->reference, highest = m_prepared->view;
+
+        for(const auto & [_, viewChange] : m_viewChanges)
+        {
+            if(viewChange.signedContent.sequence != view || !viewChange.preparedMessage)
+                continue;
+
+            const uint32_t preparedView = viewChange.prepared.front().sequence;
+            if(!highest || preparedView > highest.value())
+                reference = &viewChange.signedContent.reference, highest = preparedView;
+        }
+
+        if(!reference)
+            return {};
+
+        return m_messages.at(*reference);
+    }
+
+    void suspect(const std::string & member)
+    {
+        if(member != m_state->members().name(m_state->index()))
+            m_suspected.insert(member);
+    }
+
+    void heardFrom(const mls::LeafIndex & member)
+    {
+        if(!m_suspected.empty())
+            m_suspected.erase(m_state->members().name(member));
     }
 
     void resetTimers()
@@ -334,51 +623,91 @@ protected:
         }
     }
 
+    // The signer is known once the signature is verified, proposes are only
+    //  bounded by the global budget
+    void bufferFutureMessage(uint32_t view, std::optional<uint32_t> signer,
+        const ConsensusMessage<T> & message)
+    {
+        m_futureMessages.push(m_currentView, view, signer, message,
+            mls::tls::marshal(message).size());
+    }
+
     std::optional<std::pair<mls::LeafIndex, ConsensusMessageContent>>
-    getContentIfReady(const mls::AuthenticatedContent & authContent,
+    getContentIfReady(const ControlSignature & signedContent, ControlSignatureType type,
         const ConsensusMessage<T> & message)
     {
-        if(authContent.content.sender.sender_type() != mls::SenderType::member)
+        // The type is signed: a vote cannot be replayed as a vote of another phase
+        if(signedContent.type != type || !m_state->verify(signedContent))
             return {};
 
-        auto sender = std::get<mls::MemberSender>(
-            authContent.content.sender.sender).sender;
+        const ConsensusMessageContent content = {
+            .view = signedContent.sequence,
+            .consensusMessage = signedContent.reference
+        };
 
-        auto content = m_state->verifyAndExtract<ConsensusMessageContent>(authContent);
-        if(content)
-        {
-            if(content->view == m_currentView)
-                return {{sender, content.value()}};
-            else if(content->view > m_currentView)
-                m_futureMessages[content->view].push(message);
-        }
+        heardFrom(mls::LeafIndex{ signedContent.signer });
+
+        if(content.view == m_currentView)
+            return {{mls::LeafIndex{ signedContent.signer }, content}};
+        else if(content.view > m_currentView)
+            bufferFutureMessage(content.view, signedContent.signer, message);
 
         return {};
     }
 
+    int rtt() const
+    {
+        return m_rttEstimator ? m_rttEstimator->rtt() : m_networkRTT;
+    }
+
 private:
     Network & m_network;
     const int m_networkRTT;
+    const RttEstimator * m_rttEstimator = nullptr;
+    Metrics * m_metrics = nullptr;
     ExtendedMLSState * m_state = nullptr;
 
     const BroadcastCallback m_broadcast;
     const SendCallback m_send;
     const DeliverCallback m_deliver;
 
-    uint32_t m_currentView;
+    // Value prepared by this member in the highest view, with the prepares
+    struct PreparedCertificate
+    {
+        uint32_t view;
+        MessageRef reference;
+        std::vector<ControlSignature> prepares;
+    };
+
+    bool m_skipSuspectedLeaders = false;
+    std::vector<mls::LeafIndex> m_members; // Sorted
+    std::set<std::string> m_suspected;     // Kept between epochs
+
+    uint32_t m_currentView = 0;
     std::string m_currentLeader;
     mls::LeafIndex m_currentLeaderIdx;
     uint f;
 
-    std::map<uint32_t, std::queue<ConsensusMessage<T>>> m_futureMessages;
+    EpochBuffer<ConsensusMessage<T>> m_futureMessages; // By view
     bool m_hasSentPrePrepare, m_hasSentPrepare, m_hasSentCommit;
-    std::map<MessageRef, std::set<mls::LeafIndex>> m_signedPrepare, m_signedCommit;
-    std::set<mls::LeafIndex> m_signedNewView;
+    std::map<MessageRef, std::map<mls::LeafIndex, ControlSignature>> m_signedPrepare;
+    std::map<MessageRef, std::set<mls::LeafIndex>> m_signedCommit;
+    std::map<mls::LeafIndex, ConsensusViewChangeMessage<T>> m_viewChanges; // Later views
+    std::optional<PreparedCertificate> m_prepared = {};
+    std::optional<MessageRef> m_required = {}; // The only value of the view
+    std::optional<uint32_t> m_sentViewChange = {};
     std::map<MessageRef, T> m_messages;
 
     std::optional<T> m_proposedMessage = {}, m_prePreparedMessage = {};
     std::optional<timeoutID> m_timeout = {}, m_forwardTimeout = {};
 
+    std::optional<timeoutID> m_viewChangeTimeout = {};
+    uint m_viewChangeAttempts = 0;   // View changes since the epoch started
+    size_t m_viewChangeCount = 0, m_skippedViews = 0, m_rejectedPrePrepares = 0;
+#ifdef TEST
+    std::function<T(const T &)> m_equivocate;
+#endif
+
 };
 
 #endif
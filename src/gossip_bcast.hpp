@@ -3,17 +3,23 @@
  * @author Ludovic PAILLAT (Ludovic.PAILLAT@hivenet.com)
  * @brief Handling of Gossip Broadcast instance to deliver proposals and app messages
  *  Uses the Murmur protocol from 'R. Guerraoui et al. Scalable Byzantine Reliable Broadcast'
+ *  completed by push-pull anti-entropy: digests of the received references are
+ *  periodically exchanged with the sample, and peers who stay quiet are replaced
  */
 
 #ifndef __GOSSIP_BCAST_HPP__
 #define __GOSSIP_BCAST_HPP__
 
 #include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <functional>
 #include <iterator>
+#include <map>
+#include <optional>
 #include <random>
 #include <set>
 #include <string>
@@ -23,12 +29,18 @@
 #include "bytes/bytes.h"
 #include "mls/crypto.h"
 
+#include "cached_message.hpp"
 #include "dds_message.hpp"
 #include "extended_mls_state.hpp"
+#include "metrics.hpp"
 #include "network.hpp"
 
 using DeliverCallback = std::function<void(const mls::MLSMessage & msg)>;
 
+static constexpr int DEFAULT_GOSSIP_FANOUT_CONSTANT = 2;
+static constexpr int DEFAULT_GOSSIP_DIGEST_INTERVAL_MS = 1000;
+static constexpr size_t DEFAULT_GOSSIP_STORE_BUDGET = 16 * 1024 * 1024;
+
 class GossipBcast
 {
 public:
@@ -37,15 +49,64 @@ public:
         : m_network(network), m_selfId(selfId), m_suite(suite), m_deliver(deliver)
     { }
 
+    // Sample size (fan-out) is ln(n) + constant
+    void setFanoutConstant(int constant)
+    {
+        m_fanoutConstant = constant;
+    }
+
+    // Bytes of the frames kept in an epoch to be pushed by anti-entropy
+    void setStoreBudget(size_t budget)
+    {
+        m_storeBudget = budget;
+    }
+
+    size_t storedBytes() const { return m_storedBytes; }
+    size_t droppedFrames() const { return m_droppedFrames; }
+
+    // Sampling is reproducible for a given seed
+    void setSeed(uint32_t seed)
+    {
+        m_random.seed(seed);
+    }
+
+    void setMetrics(Metrics * metrics)
+    {
+        m_metrics = metrics;
+
+        metrics->setGauge(Gauge::GOSSIP_STORE_BYTES, [this](){ return m_storedBytes; });
+        metrics->setGauge(Gauge::GOSSIP_DUPLICATE_RATIO, [metrics]()
+        {
+            const uint64_t received = metrics->counter(Counter::GOSSIP_RECEIVED);
+            return received > 0 ? (double) metrics->counter(Counter::GOSSIP_DUPLICATES) / received : 0;
+        });
+    }
+
+    // Period of the anti-entropy rounds, 0 to disable them
+    void setDigestInterval(int msInterval)
+    {
+        m_digestInterval = msInterval;
+    }
+
     void init(const ExtendedMLSState & state)
     {
+        m_state = &state;
+
         updateSample(state);
         computeSample();
+
+        if(m_digestInterval > 0 && !m_digestTimeout)
+            m_digestTimeout = m_network.registerTimeout(m_digestInterval,
+                [this](auto){ m_digestTimeout = {}; antiEntropyRound(); });
     }
 
     void newEpoch(const ExtendedMLSState & state, const std::vector<mls::bytes_ns::bytes> & removed)
     {
+        m_state = &state;
         m_received.clear();
+        m_stored.clear();
+        m_storedBytes = 0;
+        m_quietPeers.clear();
 
         bool updated = false;
         for(const auto & id : removed)
@@ -53,6 +114,7 @@ public:
             {
                 updated = true;
                 m_idsSample.erase(id);
+                m_lastHeard.erase(id);
             }
 
         if(updateSample(state) || updated)
@@ -63,10 +125,14 @@ public:
     {
         if(msg.isGossip())
         {
-            if(!m_received.contains(m_suite.ref(msg.bcastMessage())))
+            const CachedMLSMessage message{msg.bcastMessage()};
+            METRIC(m_metrics, count(Counter::GOSSIP_RECEIVED));
+            if(!m_received.contains(message.ref(m_suite)))
             {
-                dispatchMessage(msg.bcastMessage()); // Dispatch includes delivery to client
+                dispatchMessage(message); // Dispatch includes delivery to client
             }
+            else
+                METRIC(m_metrics, count(Counter::GOSSIP_DUPLICATES));
         }
         else if(msg.isSubscribe())
         {
@@ -76,57 +142,84 @@ public:
                     msg.subscriberId().data() + msg.subscriberId().size()};
                 
                 m_idsSample.insert(msg.subscriberId());
+                m_lastHeard[msg.subscriberId()] = m_network.now();
                 m_computedSample.emplace_back(strId);
 
-                for(const auto & msg : m_received)
-                    m_network.send(strId, msg.second);
+                // The subscriber pushes back its digest, and only gets what it misses
+                sendDigest(strId, false);
             }
         }
+        else if(msg.isDigest())
+        {
+            handleDigest(msg.digest());
+        }
     }
 
-    void dispatchMessage(const mls::MLSMessage & msg)
+    void dispatchMessage(const CachedMLSMessage & msg)
     {
         DDSMessage ddsMsg = {
             .content = { (GossipBcastMessage) {
-                .content = { msg }
+                .content = { msg.message() }
             }}
         };
 
-        Bytes messageBytes = marshalToBytes(ddsMsg);
-        m_received.insert({m_suite.ref(msg), messageBytes});
+        SharedBytes messageBytes = marshalToBytes(ddsMsg);
+        m_received.insert(msg.ref(m_suite));
+        if(m_storedBytes + messageBytes.size() <= m_storeBudget)
+        {
+            m_stored.insert({msg.ref(m_suite), messageBytes});
+            m_storedBytes += messageBytes.size();
+        }
+        else
+            m_droppedFrames++; // Still delivered and forwarded, not served to late peers
         m_network.broadcastSample(m_computedSample, messageBytes);
 
-        m_deliver(msg);
+        m_deliver(msg.message());
     }
 
-    static constexpr int MINIMUM_PEERS = 6;
+    static constexpr int QUIET_ROUNDS = 3; // Full rounds without digest before a peer is replaced
 
 protected:
+    size_t fanout(size_t memberCount) const
+    {
+        const int expected = std::ceil(std::log(std::max<size_t>(memberCount, 1)))
+            + m_fanoutConstant;
+        return std::max(expected, 1);
+    }
+
     bool updateSample(const ExtendedMLSState & state)
     {
-        const auto members = state.getMembersIdentity(true);
-        const size_t expectedMin = std::max<int>(
-            std::log10(members.size()), MINIMUM_PEERS);
+        const auto members = state.getMembersIdentity(true); // Sorted, as set_difference requires
+
+        const size_t expectedMin = fanout(members.size() + 1);
 
         if(m_idsSample.size() < expectedMin && m_idsSample.size() < members.size())
         {
-            std::set<mls::bytes_ns::bytes> difference, sample;
+            std::vector<mls::bytes_ns::bytes> difference, candidates, sample;
 
             // Who is not in my sample
             std::set_difference(members.begin(), members.end(),
                 m_idsSample.begin(), m_idsSample.end(),
-                std::inserter(difference, difference.begin()));
+                std::back_inserter(difference));
+
+            // Quiet peers are only sampled again if nobody else is left
+            std::set_difference(difference.begin(), difference.end(),
+                m_quietPeers.begin(), m_quietPeers.end(),
+                std::back_inserter(candidates));
+            if(candidates.empty())
+                candidates = std::move(difference);
 
             // Sample through those candidates
-            std::sample(difference.begin(), difference.end(),
-                std::inserter(sample, sample.begin()),
-                std::min(difference.size(), expectedMin - m_idsSample.size()),
-                std::mt19937{std::random_device{}()});
+            std::sample(candidates.begin(), candidates.end(),
+                std::back_inserter(sample),
+                std::min(candidates.size(), expectedMin - m_idsSample.size()),
+                m_random);
 
             for(const auto & sampled : sample)
             {
                 subscribe(sampled);
                 m_idsSample.insert(sampled);
+                m_lastHeard[sampled] = m_network.now();
             }
 
             return true;
@@ -154,17 +247,118 @@ protected:
                 std::string{(const char *) id.data(), id.size()});
     }
 
+    // One peer of the sample per round, in turn: digests are exchanged and both
+    //  sides push the messages the other is missing
+    void antiEntropyRound()
+    {
+        m_digestTimeout = m_network.registerTimeout(m_digestInterval,
+            [this](auto){ m_digestTimeout = {}; antiEntropyRound(); });
+
+        if(m_idsSample.empty())
+            return;
+
+        // Replace the peers that did not answer a digest for a few full rounds
+        const auto deadline = m_network.now() - std::chrono::milliseconds{
+            QUIET_ROUNDS * m_digestInterval * (int) m_idsSample.size()};
+
+        bool updated = false;
+        for(auto idIt = m_idsSample.begin(); idIt != m_idsSample.end(); )
+        {
+            if(m_lastHeard[*idIt] < deadline)
+            {
+                m_quietPeers.insert(*idIt);
+                m_lastHeard.erase(*idIt);
+                idIt = m_idsSample.erase(idIt);
+                updated = true;
+            }
+            else
+                idIt++;
+        }
+        if(updated)
+        {
+            updateSample(*m_state);
+            computeSample();
+
+            if(m_idsSample.empty())
+                return;
+        }
+
+        auto next = m_idsSample.upper_bound(m_lastProbed);
+        if(next == m_idsSample.end())
+            next = m_idsSample.begin();
+        m_lastProbed = *next;
+
+        sendDigest({(const char *) next->data(), next->size()}, false);
+    }
+
+    void sendDigest(const std::string & id, bool reply)
+    {
+        GossipDigest digest = {
+            .senderId = m_selfId,
+            .epoch = m_state ? m_state->epoch() : 0,
+            .reply = reply
+        };
+        digest.refs.assign(m_received.begin(), m_received.end());
+
+        DDSMessage msg = {
+            .content = { (GossipBcastMessage) {
+                .content = { digest }
+            }}
+        };
+
+        m_network.send(id, marshalToBytes(msg));
+    }
+
+    void handleDigest(const GossipDigest & digest)
+    {
+        if(!m_idsSample.contains(digest.senderId))
+            return; // Only exchange with the sample, the sender is not authenticated
+
+        m_lastHeard[digest.senderId] = m_network.now();
+
+        const std::string strId{(const char *) digest.senderId.data(), digest.senderId.size()};
+
+        // Not the same set of messages
+        if(m_state && digest.epoch == m_state->epoch())
+        {
+            const std::set<MessageRef> known{digest.refs.begin(), digest.refs.end()};
+            for(const auto & [ref, messageBytes] : m_stored)
+                if(!known.contains(ref))
+                    m_network.send(strId, messageBytes);
+        }
+
+        if(!digest.reply)
+            sendDigest(strId, true);
+    }
+
 private:
     Network & m_network;
     const mls::bytes_ns::bytes m_selfId;
     const mls::CipherSuite & m_suite;
     const DeliverCallback m_deliver;
 
+    const ExtendedMLSState * m_state = nullptr;
+
+    int m_fanoutConstant = DEFAULT_GOSSIP_FANOUT_CONSTANT;
+    int m_digestInterval = DEFAULT_GOSSIP_DIGEST_INTERVAL_MS;
+    std::optional<timeoutID> m_digestTimeout = {};
+
     std::vector<std::string> m_computedSample;
     std::set<mls::bytes_ns::bytes> m_idsSample;
 
-    std::map<MessageRef, Bytes> m_received;
+    // Liveness of the sample, from the digests
+    std::map<mls::bytes_ns::bytes, timePoint> m_lastHeard;
+    std::set<mls::bytes_ns::bytes> m_quietPeers;
+    mls::bytes_ns::bytes m_lastProbed;
+
+    std::set<MessageRef> m_received;
+    std::map<MessageRef, SharedBytes> m_stored; // Frames pushed to peers missing them
+    size_t m_storedBytes = 0, m_storeBudget = DEFAULT_GOSSIP_STORE_BUDGET;
+    size_t m_droppedFrames = 0;
+
+    std::mt19937 m_random{std::random_device{}()};
 
+    Metrics * m_metrics = nullptr;
 };
 
 #endif
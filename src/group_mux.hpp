@@ -0,0 +1,343 @@
+/**
+ * @file group_mux.hpp
+ * @author Ludovic PAILLAT (Ludovic.PAILLAT@hivenet.com)
+ * @brief Several groups hosted by a single client process, over one network
+ *  and event loop
+ *
+ * Each group is served by its own DDS instance, given a GroupChannel as its
+ *  network. Channels share the connections, the PKI address cache and the
+ *  timer queue of the underlying network: frames are tagged with the id of
+ *  their group and routed to the channel bound to it. A peer stays connected
+ *  while it is a member of at least one hosted group. Frames of a group no
+ *  channel is bound to yet, e.g. sent by its members before the welcome
+ *  arrives, are kept until a channel is bound to it, and the application
+ *  decides which channel joins the group from these frames, then binds it
+ *  to the group actually joined.
+ */
+
+#ifndef __GROUP_MUX_HPP__
+#define __GROUP_MUX_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <list>
+#include <optional>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "bytes/bytes.h"
+
+#include "message.hpp"
+#include "network.hpp"
+
+// Above the DDS message types, frames are [GROUP_FRAME][tag size][tag][DDS frame]
+static constexpr uint8_t GROUP_FRAME = 0xFE;
+static constexpr size_t MAX_GROUP_TAG = UINT8_MAX;
+static constexpr size_t MAX_UNBOUND_FRAMES = 1024;
+
+class GroupMux;
+
+// Metrics given to a channel count the traffic and timers of its group, the
+//  shared connections are not counted
+class GroupChannel
+    : public Network
+{
+public:
+    GroupChannel(GroupMux & mux, Network & network)
+        : m_mux(mux), m_network(network)
+    { }
+
+    GroupChannel(const GroupChannel &) = delete;
+    GroupChannel & operator=(const GroupChannel &) = delete;
+
+    // Id of the group served, nothing until created or joined
+    const std::optional<std::string> & tag() const
+    {
+        return m_tag;
+    }
+
+    timePoint now() const override
+    {
+        return m_network.now();
+    }
+
+    timeoutID registerTimeout(int msDelay, timeoutCallback callback) override
+    {
+        METRIC(m_metrics, count(Counter::TIMEOUTS_REGISTERED));
+        return m_network.registerTimeout(msDelay, [this, callback = std::move(callback)](const timeoutID & id)
+        {
+            METRIC(m_metrics, count(Counter::TIMEOUTS_FIRED));
+            callback(id);
+        });
+    }
+
+    void unregisterTimeout(timeoutID id) override
+    {
+        METRIC(m_metrics, count(Counter::TIMEOUTS_CANCELLED));
+        m_network.unregisterTimeout(id);
+    }
+
+    void post(std::function<void()> task) override
+    {
+        m_network.post(std::move(task));
+    }
+
+    void setHandleMessage(const MessageHandler & handleMessage) override
+    {
+        if(!m_handleMessage)
+            m_handleMessage = handleMessage;
+    }
+
+    void connect(const std::string & id) override
+    {
+        connect(std::vector<std::string>{id});
+    }
+
+    void connect(const std::vector<std::string> & ids) override;
+    void disconnect(const std::string & id) override;
+
+    // To every member of the group
+    void broadcast(const SharedBytes & message) override
+    {
+        if(!m_tag)
+            return;
+
+        const SharedBytes frame = tagged(message);
+        for(const auto & id : m_members)
+            m_network.send(id, frame);
+    }
+
+    void broadcastSample(const std::vector<std::string> & sample,
+        const SharedBytes & message) override
+    {
+        if(m_tag)
+            m_network.broadcastSample(sample, tagged(message));
+    }
+
+    void send(const std::string & id, const SharedBytes & message) override
+    {
+        if(m_tag)
+            m_network.send(id, tagged(message));
+    }
+
+    std::optional<uint8_t> peerFeatures(const std::string & id) const override
+    {
+        return m_network.peerFeatures(id);
+    }
+
+    // DDS frame, without its tag
+    void deliver(std::span<const uint8_t> frame)
+    {
+        METRIC(m_metrics, received(frame));
+        if(m_handleMessage)
+            m_handleMessage(frame);
+    }
+
+protected:
+    friend class GroupMux;
+
+    SharedBytes tagged(const SharedBytes & message) const
+    {
+        METRIC(m_metrics, sent(message.span()));
+
+        const std::string & tag = m_tag.value();
+        Bytes frame(2 + tag.size() + message.size());
+        frame.content[0] = GROUP_FRAME;
+        frame.content[1] = (uint8_t) tag.size();
+        memcpy(frame.content + 2, tag.data(), tag.size());
+        memcpy(frame.content + 2 + tag.size(), message.data(), message.size());
+
+        return SharedBytes{std::move(frame)};
+    }
+
+private:
+    GroupMux & m_mux;
+    Network & m_network;
+    std::optional<std::string> m_tag = {};
+    MessageHandler m_handleMessage = {};
+    std::unordered_set<std::string> m_members = {}; // Connected by this group
+};
+
+class GroupMux
+{
+public:
+    // Frame of a group no channel is bound to, returns the channel joining it
+    //  or nullptr to keep the frame until one is bound
+    using UnboundHandler = std::function<GroupChannel * (std::span<const uint8_t>)>;
+
+    explicit GroupMux(Network & network)
+        : m_network(network)
+    {
+        m_network.setHandleMessage([this](std::span<const uint8_t> frame){ route(frame); });
+    }
+
+    GroupMux(const GroupMux &) = delete;
+    GroupMux & operator=(const GroupMux &) = delete;
+
+    GroupChannel & addChannel()
+    {
+        return m_channels.emplace_back(*this, m_network);
+    }
+
+    void setUnboundHandler(const UnboundHandler & handleUnbound)
+    {
+        m_handleUnbound = handleUnbound;
+    }
+
+    // Once the channel created or joined the group, its frames kept so far
+    //  are then delivered. The tag of a welcome is not authenticated: the
+    //  channel joining from it is bound again to the id of the group joined.
+    //  False if the tag is held by another channel or too long, the channel
+    //  then keeps its tag if it had one
+    bool bind(GroupChannel & channel, const mls::bytes_ns::bytes & groupId)
+    {
+        return bind(channel, std::string{groupId.begin(), groupId.end()});
+    }
+
+    bool bind(GroupChannel & channel, const std::string & tag)
+    {
+        if(channel.m_tag == tag)
+            return true;
+
+        const std::optional<std::string> previous = std::exchange(channel.m_tag, std::nullopt);
+        if(!attach(channel, tag))
+        {
+            channel.m_tag = previous;
+            return false;
+        }
+
+        if(previous)
+        {
+            printf("Group joined is not the one of its welcome frame\n");
+            m_bound.erase(previous.value());
+        }
+
+        flush(channel);
+        return true;
+    }
+
+    size_t bufferedFrames() const
+    {
+        return m_unbound.size();
+    }
+
+protected:
+    friend class GroupChannel;
+
+    bool attach(GroupChannel & channel, const std::string & tag)
+    {
+        if(channel.m_tag || m_bound.contains(tag) || tag.size() > MAX_GROUP_TAG)
+            return false;
+
+        channel.m_tag = tag;
+        m_bound[tag] = &channel;
+        return true;
+    }
+
+    void flush(GroupChannel & channel)
+    {
+        const std::string & tag = channel.m_tag.value();
+
+        std::deque<std::pair<std::string, Bytes>> unbound;
+        std::swap(unbound, m_unbound);
+        for(auto & [frameTag, frame] : unbound)
+        {
+            if(frameTag == tag)
+                channel.deliver(frame.span());
+            else
+                m_unbound.emplace_back(std::move(frameTag), std::move(frame));
+        }
+    }
+
+    void route(std::span<const uint8_t> frame)
+    {
+        if(frame.size() < 2 || frame[0] != GROUP_FRAME || frame.size() < 2 + (size_t) frame[1])
+        {
+            printf("Received frame without group\n");
+            return;
+        }
+
+        const std::string tag{(const char *) frame.data() + 2, frame[1]};
+        const auto payload = frame.subspan(2 + tag.size());
+
+        const auto bound = m_bound.find(tag);
+        if(bound != m_bound.end())
+        {
+            bound->second->deliver(payload);
+            return;
+        }
+
+        GroupChannel * joining = m_handleUnbound ? m_handleUnbound(payload) : nullptr;
+        if(joining && attach(*joining, tag))
+        {
+            joining->deliver(payload); // Before the frames kept, e.g. the welcome
+            if(joining->m_tag)
+                flush(*joining);
+            return;
+        }
+
+        if(m_unbound.size() >= MAX_UNBOUND_FRAMES)
+            m_unbound.pop_front();
+
+        Bytes copy(payload.size());
+        memcpy(copy.content, payload.data(), payload.size());
+        m_unbound.emplace_back(tag, std::move(copy));
+    }
+
+    // Peers stay connected while they are members of a hosted group
+    void pin(const std::vector<std::string> & ids)
+    {
+        std::vector<std::string> pinned;
+        for(const auto & id : ids)
+            if(m_pins[id]++ == 0)
+                pinned.push_back(id);
+
+        if(!pinned.empty())
+            m_network.connect(pinned);
+    }
+
+    void unpin(const std::string & id)
+    {
+        const auto it = m_pins.find(id);
+        if(it == m_pins.end() || --it->second > 0)
+            return;
+
+        m_pins.erase(it);
+        m_network.disconnect(id);
+    }
+
+private:
+    Network & m_network;
+    std::list<GroupChannel> m_channels = {}; // Stable addresses
+    std::unordered_map<std::string, GroupChannel *> m_bound = {};
+    std::unordered_map<std::string, size_t> m_pins = {};
+
+    UnboundHandler m_handleUnbound = {};
+    std::deque<std::pair<std::string, Bytes>> m_unbound = {}; // Oldest dropped first
+};
+
+inline void GroupChannel::connect(const std::vector<std::string> & ids)
+{
+    std::vector<std::string> added;
+    for(const auto & id : ids)
+        if(m_members.insert(id).second)
+            added.push_back(id);
+
+    m_mux.pin(added);
+}
+
+inline void GroupChannel::disconnect(const std::string & id)
+{
+    if(m_members.erase(id))
+        m_mux.unpin(id);
+}
+
+#endif
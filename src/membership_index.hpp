@@ -0,0 +1,161 @@
+/**
+ * @file membership_index.hpp
+ * @author Ludovic PAILLAT (Ludovic.PAILLAT@hivenet.com)
+ * @brief Index of the members of an epoch: sorted identities, identity to
+ *  LeafIndex and LeafIndex to identity (and name used by the network)
+ *
+ * Built by walking the ratchet tree once, then derived from the previous
+ *  epoch using the Add/Remove deltas of each commit. Added members take the
+ *  leftmost blank leaves in order (RFC 9420, 12.1.1), the placement is checked
+ *  against the new tree and the index is rebuilt if it does not match.
+ */
+
+#ifndef __MEMBERSHIP_INDEX_HPP__
+#define __MEMBERSHIP_INDEX_HPP__
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "bytes/bytes.h"
+#include "mls/credential.h"
+#include "mls/tree_math.h"
+#include "mls/treekem.h"
+
+class MembershipIndex
+{
+public:
+    explicit MembershipIndex(const mls::TreeKEMPublicKey & tree)
+    {
+        build(tree);
+    }
+
+    // Index of the epoch following a commit adding and removing these members
+    MembershipIndex next(const mls::TreeKEMPublicKey & tree,
+        const std::vector<mls::bytes_ns::bytes> & added,
+        const std::vector<mls::bytes_ns::bytes> & removed) const
+    {
+        MembershipIndex index = *this;
+
+        for(const auto & identity : removed)
+            index.erase(identity);
+
+        uint32_t leaf = 0;
+        for(const auto & identity : added)
+        {
+            while(index.m_members.contains(mls::LeafIndex{ leaf }))
+                ++leaf;
+
+            const auto leafNode = leaf < tree.size.val
+                ? tree.leaf_node(mls::LeafIndex{ leaf }) : std::nullopt;
+            if(!leafNode || identityOf(leafNode.value()) != identity)
+                return MembershipIndex{tree}; // Not where expected, start over
+
+            index.insert(mls::LeafIndex{ leaf }, identity);
+        }
+
+        return index;
+    }
+
+    size_t size() const { return m_identities.size(); }
+
+    // Sorted
+    const std::vector<mls::bytes_ns::bytes> & identities() const { return m_identities; }
+
+    // By increasing LeafIndex
+    std::vector<mls::LeafIndex> indexes() const
+    {
+        std::vector<mls::LeafIndex> indexes;
+        indexes.reserve(m_members.size());
+        for(const auto & [index, _] : m_members)
+            indexes.emplace_back(index);
+
+        return indexes;
+    }
+
+    bool contains(const mls::bytes_ns::bytes & identity) const
+    {
+        return m_leaves.contains(identity);
+    }
+
+    std::optional<mls::LeafIndex> find(const mls::bytes_ns::bytes & identity) const
+    {
+        const auto leafIt = m_leaves.find(identity);
+        if(leafIt == m_leaves.end())
+            return {};
+
+        return leafIt->second;
+    }
+
+    // The index must be the one of a member
+    const mls::bytes_ns::bytes & identity(const mls::LeafIndex & index) const
+    {
+        return m_members.at(index).identity;
+    }
+
+    const std::string & name(const mls::LeafIndex & index) const
+    {
+        return m_members.at(index).name;
+    }
+
+private:
+    struct Member
+    {
+        mls::bytes_ns::bytes identity;
+        std::string name; // Identity as used by the network
+    };
+
+    static const mls::bytes_ns::bytes & identityOf(const mls::LeafNode & leaf)
+    {
+        return leaf.credential.get<mls::BasicCredential>().identity;
+    }
+
+    void build(const mls::TreeKEMPublicKey & tree)
+    {
+        m_identities.clear(), m_leaves.clear(), m_members.clear();
+
+        tree.all_leaves([&](auto index, const mls::LeafNode & leaf)
+        {
+            const auto & identity = identityOf(leaf);
+            m_identities.emplace_back(identity);
+            m_leaves.emplace(identity, index);
+            m_members.emplace(index, (Member) {
+                identity, std::string{identity.begin(), identity.end()} });
+            return true;
+        });
+
+        std::sort(m_identities.begin(), m_identities.end());
+    }
+
+    void insert(const mls::LeafIndex & index, const mls::bytes_ns::bytes & identity)
+    {
+        m_identities.insert(std::lower_bound(m_identities.begin(), m_identities.end(), identity),
+            identity);
+        m_leaves.emplace(identity, index);
+        m_members.emplace(index, (Member) {
+            identity, std::string{identity.begin(), identity.end()} });
+    }
+
+    void erase(const mls::bytes_ns::bytes & identity)
+    {
+        const auto leafIt = m_leaves.find(identity);
+        if(leafIt == m_leaves.end())
+            return;
+
+        m_members.erase(leafIt->second);
+        m_leaves.erase(leafIt);
+
+        const auto identityIt = std::lower_bound(m_identities.begin(), m_identities.end(), identity);
+        if(identityIt != m_identities.end() && *identityIt == identity)
+            m_identities.erase(identityIt);
+    }
+
+    std::vector<mls::bytes_ns::bytes> m_identities;
+    std::map<mls::bytes_ns::bytes, mls::LeafIndex> m_leaves;
+    std::map<mls::LeafIndex, Member> m_members;
+};
+
+#endif
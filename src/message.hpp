@@ -8,6 +8,7 @@
 #define __MESSAGE_HPP__
 
 #include <arpa/inet.h>
+#include <cerrno>
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
@@ -15,9 +16,15 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <memory>
+#include <span>
 #include <string>
+#include <utility>
+#include <vector>
 
 /** Generic/network order functions */
 
@@ -52,44 +59,211 @@ static inline T hton(const T &input)
 
 /** Common types */
 
+/**
+ * Thread-local free lists of power of two blocks (64 B to 1 MiB) used for
+ *  Bytes storage, larger blocks go straight to malloc
+ */
+class BytesPool
+{
+public:
+    static uint8_t * allocate(size_t size, size_t & capacity)
+    {
+        const int sizeClass = classOf(size);
+        if(sizeClass < 0)
+        {
+            capacity = size;
+            return allocateRaw(size);
+        }
+
+        capacity = MIN_BLOCK << sizeClass;
+
+        auto & freeList = local().freeLists[sizeClass];
+        if(freeList.empty())
+            return allocateRaw(capacity);
+
+        uint8_t * block = freeList.back();
+        freeList.pop_back();
+        return block;
+    }
+
+    static void deallocate(uint8_t * block, size_t capacity)
+    {
+        const int sizeClass = classOf(capacity);
+
+        auto & freeList = local().freeLists[sizeClass >= 0 ? sizeClass : 0];
+        if(sizeClass < 0 || freeList.size() >= MAX_CACHED_BLOCKS)
+            std::free(block);
+        else
+            freeList.push_back(block);
+    }
+
+    static constexpr size_t MIN_BLOCK = 64, MAX_BLOCK = 1024 * 1024;
+    static constexpr size_t CLASS_COUNT = 15; // log2(MAX_BLOCK / MIN_BLOCK) + 1
+    static constexpr size_t MAX_CACHED_BLOCKS = 64;
+
+protected:
+    struct FreeLists
+    {
+        std::vector<uint8_t *> freeLists[CLASS_COUNT];
+
+        ~FreeLists()
+        {
+            for(auto & freeList : freeLists)
+                for(uint8_t * block : freeList)
+                    std::free(block);
+        }
+    };
+
+    static FreeLists & local()
+    {
+        static thread_local FreeLists lists;
+        return lists;
+    }
+
+    static int classOf(size_t size)
+    {
+        if(size > MAX_BLOCK)
+            return -1;
+
+        int sizeClass = 0;
+        while((MIN_BLOCK << sizeClass) < size)
+            ++sizeClass;
+        return sizeClass;
+    }
+
+    static uint8_t * allocateRaw(size_t size)
+    {
+        uint8_t * block = (uint8_t *) malloc(std::max<size_t>(size, 1));
+        if(!block)
+        {
+            perror("Allocating bytes failed");
+            exit(EXIT_FAILURE);
+        }
+        return block;
+    }
+};
+
+/**
+ * Move-only owning buffer. Storage either comes from BytesPool or is an
+ *  adopted vector (e.g. the output of tls::marshal), avoiding any copy
+ */
 struct Bytes
 {
     Bytes(size_t size_ = 0): size(size_)
     {
-        content = new uint8_t[size];
+        content = BytesPool::allocate(size, capacity);
+    }
+
+    Bytes(std::vector<uint8_t> && adopted)
+        : size(adopted.size()), adopted(std::move(adopted))
+    {
+        content = this->adopted.data();
     }
 
-    Bytes(const Bytes & bs)
-        : size(bs.size)
+    Bytes(Bytes && bs)
+        : size(bs.size), content(bs.content), capacity(bs.capacity),
+            adopted(std::move(bs.adopted))
     {
-        content = new uint8_t[size];
-        memcpy(content, bs.content, size);
+        bs.size = 0, bs.content = nullptr, bs.capacity = 0;
     }
 
-    Bytes& operator=(const Bytes& other)
+    Bytes & operator=(Bytes && other)
     {
-        size = other.size;
-        content = new uint8_t[size];
-        memcpy(content, other.content, size);
+        if(this != &other)
+        {
+            release();
+
+            size = other.size, content = other.content, capacity = other.capacity;
+            adopted = std::move(other.adopted);
+            other.size = 0, other.content = nullptr, other.capacity = 0;
+        }
 
         return *this;
     }
 
+    Bytes(const Bytes &) = delete;
+    Bytes & operator=(const Bytes &) = delete;
+
     ~Bytes()
     {
-        delete[] content;
+        release();
+    }
+
+    // Explicit deep copy
+    Bytes clone() const
+    {
+        Bytes copy{size};
+        memcpy(copy.content, content, size);
+        return copy;
+    }
+
+    std::span<const uint8_t> span() const
+    {
+        return { content, size };
     }
 
     uint32_t size;
     uint8_t * content;
+
+private:
+    void release()
+    {
+        if(content && capacity)
+            BytesPool::deallocate(content, capacity);
+    }
+
+    size_t capacity = 0; // Zero when storage is adopted
+    std::vector<uint8_t> adopted;
+};
+
+/**
+ * Cheap, shared and immutable view on a Bytes, e.g. a message queued for
+ *  several peers or kept for later retransmission
+ */
+class SharedBytes
+{
+public:
+    SharedBytes() = default;
+
+    SharedBytes(Bytes && bytes)
+        : m_bytes(std::make_shared<const Bytes>(std::move(bytes)))
+    { }
+
+    const uint8_t * data() const { return m_bytes->content; }
+    uint32_t size() const { return m_bytes->size; }
+    std::span<const uint8_t> span() const { return m_bytes->span(); }
+
+    const Bytes & operator*() const { return *m_bytes; }
+    const Bytes * operator->() const { return m_bytes.get(); }
+
+private:
+    std::shared_ptr<const Bytes> m_bytes;
+};
+
+/**
+ * In memory streams, the netRead/netWrite overloads below accept them in place
+ *  of a socket so that the same (de)serialization serves non-blocking sockets
+ */
+struct ByteReader
+{
+    std::span<const uint8_t> data;
+    size_t offset = 0;
+    bool truncated = false; // Set when a read went past the available data
+};
+
+struct ByteWriter
+{
+    std::vector<uint8_t> & out;
 };
 
 /** Network read */
 
+// Reads fail once the peer closed the connection (recv returns 0)
+
 static bool netRead(int s, uint8_t & value)
 {
     ssize_t n;
-    while((n = recv(s, &value, 1, 0)) == 0)
+    while((n = recv(s, &value, 1, 0)) == -1 && errno == EINTR)
         ;
 
     return n == 1;
@@ -97,11 +271,18 @@ static bool netRead(int s, uint8_t & value)
 
 static bool netRead(int s, uint8_t * bytes, size_t size)
 {
-    ssize_t n;
-    while((n = recv(s, (void *) bytes, size, 0)) >= 0 && n < size)
+    while(size > 0)
+    {
+        ssize_t n = recv(s, (void *) bytes, size, 0);
+        if(n == -1 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+
         bytes += n, size -= n;
+    }
 
-    return n != -1;
+    return true;
 }
 
 template <typename T>
@@ -119,7 +300,7 @@ static bool netRead(int s, T & value)
 static bool netRead(int s, std::string& str)
 {
     str = "";
-    uint8_t c;
+    uint8_t c = 0xFF;
     while(netRead(s, c) && c != '\0')
         str += c;
 
@@ -141,6 +322,68 @@ static bool netRead(int s, Bytes& bs)
 }
 
 
+static bool netRead(ByteReader & r, uint8_t * bytes, size_t size)
+{
+    if(r.data.size() - r.offset < size)
+    {
+        r.truncated = true;
+        return false;
+    }
+
+    memcpy(bytes, r.data.data() + r.offset, size);
+    r.offset += size;
+    return true;
+}
+
+static bool netRead(ByteReader & r, uint8_t & value)
+{
+    return netRead(r, &value, 1);
+}
+
+template <typename T>
+static bool netRead(ByteReader & r, T & value)
+{
+    union { T intVal; uint8_t data[sizeof(T)]; };
+
+    if(!netRead(r, data, sizeof(T)))
+        return false;
+
+    value = ntoh(intVal);
+    return true;
+}
+
+static bool netRead(ByteReader & r, std::string & str)
+{
+    const auto remaining = r.data.subspan(r.offset);
+    const auto end = std::find(remaining.begin(), remaining.end(), '\0');
+    if(end == remaining.end())
+    {
+        r.truncated = true;
+        return false;
+    }
+
+    str.assign(remaining.begin(), end);
+    r.offset += str.size() + 1;
+    return true;
+}
+
+static bool netRead(ByteReader & r, Bytes & bs)
+{
+    uint32_t size;
+    if(!netRead(r, size))
+        return false;
+
+    // Do not allocate for content that is not there yet
+    if(r.data.size() - r.offset < size)
+    {
+        r.truncated = true;
+        return false;
+    }
+
+    bs = Bytes(size);
+    return netRead(r, bs.content, size);
+}
+
 /** Network write */
 
 static bool netWrite(int s, uint8_t value)
@@ -179,10 +422,74 @@ static bool netWrite(int s, const std::string& str)
 
 static bool netWrite(int s, const Bytes & bs)
 {
-    if(!netWrite(s, bs.size))
-        return false;
+    // Size prefix and content in a single syscall
+    uint32_t header = hton(bs.size);
+    struct iovec iov[2] = {
+        { &header, sizeof(header) },
+        { bs.content, bs.size }
+    };
+
+    struct msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    size_t total = sizeof(header) + bs.size, written = 0;
+    while(written < total)
+    {
+        ssize_t n = sendmsg(s, &msg, MSG_NOSIGNAL);
+        if(n == -1)
+            return false;
+        written += n;
+
+        // Partial write: skip what was already sent
+        while(n > 0 && msg.msg_iovlen > 0)
+        {
+            if((size_t) n >= msg.msg_iov->iov_len)
+            {
+                n -= msg.msg_iov->iov_len;
+                ++msg.msg_iov, --msg.msg_iovlen;
+            }
+            else
+            {
+                msg.msg_iov->iov_base = (uint8_t *) msg.msg_iov->iov_base + n;
+                msg.msg_iov->iov_len -= n;
+                n = 0;
+            }
+        }
+    }
+
+    return true;
+}
+
+static bool netWrite(ByteWriter & w, const uint8_t * bytes, size_t size)
+{
+    w.out.insert(w.out.end(), bytes, bytes + size);
+    return true;
+}
+
+static bool netWrite(ByteWriter & w, uint8_t value)
+{
+    w.out.push_back(value);
+    return true;
+}
+
+template <typename T>
+static bool netWrite(ByteWriter & w, T value)
+{
+    union { T intVal; uint8_t data[sizeof(T)]; };
+    intVal = hton(value);
+
+    return netWrite(w, data, sizeof(T));
+}
 
-    return netWrite(s, bs.content, bs.size);
+static bool netWrite(ByteWriter & w, const std::string & str)
+{
+    return netWrite(w, (const uint8_t *) str.c_str(), str.size()+1);
+}
+
+static bool netWrite(ByteWriter & w, const Bytes & bs)
+{
+    return netWrite(w, bs.size) && netWrite(w, bs.content, bs.size);
 }
 
 #endif
@@ -0,0 +1,337 @@
+/**
+ * @file metrics.hpp
+ * @author Ludovic PAILLAT (Ludovic.PAILLAT@hivenet.com)
+ * @brief Counters, gauges and latency histograms of a client, exported in the
+ *  Prometheus text format
+ *
+ * Metrics are only collected when built with -DDDS_METRICS (make METRICS=1):
+ *  otherwise METRIC() expands to nothing and no component is given a Metrics
+ *  instance. Components update them from the event loop thread only.
+ */
+
+#ifndef __METRICS_HPP__
+#define __METRICS_HPP__
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <optional>
+#include <span>
+#include <string>
+#include <type_traits>
+
+#ifdef DDS_METRICS
+#   define METRIC(metrics, ...) do { if(metrics) (metrics)->__VA_ARGS__; } while(0)
+#else
+#   define METRIC(metrics, ...) do { } while(0)
+#endif
+
+static constexpr int DEFAULT_METRICS_INTERVAL_MS = 10 * 1000;
+
+enum class Counter : size_t
+{
+    SIGNATURES_VERIFIED,
+    CAC_SIGNATURES_RECEIVED,
+    CAC_SIGNATURES_DUPLICATE,
+    GOSSIP_RECEIVED,
+    GOSSIP_DUPLICATES,
+    FAST_PATH,
+    CAC1,
+    RESTRAINED,
+    RESTRAINED_TIMEOUTS,
+    CAC2,
+    FULL_CONSENSUS,
+    VIEW_CHANGES,
+    VIEWS_SKIPPED,
+    PRE_PREPARES_REJECTED,
+    TIMEOUTS_REGISTERED,
+    TIMEOUTS_CANCELLED,
+    TIMEOUTS_FIRED,
+    FRAMES_DROPPED,
+    CAUGHT_UP_EPOCHS,
+    COUNT
+};
+
+enum class Gauge : size_t
+{
+    EPOCH,
+    RTT_MS,
+    SEND_QUEUE_BYTES,
+    PENDING_TIMEOUTS,
+    CONNECTIONS,
+    FUTURE_BUFFER_BYTES,
+    FUTURE_BUFFER_MESSAGES,
+    GOSSIP_STORE_BYTES,
+    GOSSIP_DUPLICATE_RATIO,
+    PENDING_VERIFICATIONS,
+    COUNT
+};
+
+enum class Histogram : size_t
+{
+    CAC_WITNESS_TO_READY,   // First witness signature to own ready signature
+    CAC_READY_TO_DELIVER,
+    CAC_DELIVER,            // First witness signature to delivery
+    RESTRAINED_CONSENSUS,   // Start to decision or timeout
+    FULL_CONSENSUS,         // Proposal to decision
+    EPOCH,                  // Between two commits delivered
+    COUNT
+};
+
+class Metrics
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Labels every exported sample, to tell the clients apart
+    void setClient(const std::string & client)
+    {
+        m_client = client;
+    }
+
+    void setClock(const std::function<Clock::time_point()> & clock)
+    {
+        m_clock = clock;
+    }
+
+    Clock::time_point now() const
+    {
+        return m_clock ? m_clock() : Clock::now();
+    }
+
+    void count(Counter counter, uint64_t increment = 1)
+    {
+        m_counters[(size_t) counter] += increment;
+    }
+
+    // For totals already kept by a component
+    void set(Counter counter, uint64_t value)
+    {
+        m_counters[(size_t) counter] = value;
+    }
+
+    uint64_t counter(Counter counter) const
+    {
+        return m_counters[(size_t) counter];
+    }
+
+    // Gauges are sampled when exported
+    void setGauge(Gauge gauge, const std::function<double()> & sample)
+    {
+        m_gauges[(size_t) gauge] = sample;
+    }
+
+    void observe(Histogram histogram, double ms)
+    {
+        auto & buckets = m_histograms[(size_t) histogram];
+        size_t bucket = 0;
+        while(bucket < HISTOGRAM_BOUNDS.size() && ms > HISTOGRAM_BOUNDS[bucket])
+            bucket++;
+
+        buckets.counts[bucket]++;
+        buckets.sum += ms;
+    }
+
+    // Ignored if the start was not marked
+    void observeSince(Histogram histogram, const std::optional<Clock::time_point> & start)
+    {
+        if(start)
+            observe(histogram, std::chrono::duration<double, std::milli>{now() - start.value()}.count());
+    }
+
+    // Keep the first time an event happened
+    void mark(std::optional<Clock::time_point> & at) const
+    {
+        if(!at)
+            at = now();
+    }
+
+    // Frames start with their DDSMessageType
+    void sent(std::span<const uint8_t> frame)
+    {
+        auto & traffic = m_sent[messageType(frame)];
+        traffic.messages++, traffic.bytes += frame.size();
+    }
+
+    void received(std::span<const uint8_t> frame)
+    {
+        auto & traffic = m_received[messageType(frame)];
+        traffic.messages++, traffic.bytes += frame.size();
+    }
+
+    std::string prometheus() const
+    {
+        std::string out;
+        const std::string client = "client=\"" + m_client + "\"";
+
+        const auto traffic = [&](const char * name, const char * help, bool bytes)
+        {
+            out += std::string{"# HELP "} + name + " " + help + "\n";
+            out += std::string{"# TYPE "} + name + " counter\n";
+            for(const auto * direction : {&m_sent, &m_received})
+                for(size_t type = 0; type < MESSAGE_TYPES.size(); ++type)
+                    out += sample(name, client + ",direction=\"" + (direction == &m_sent ? "out" : "in")
+                        + "\",type=\"" + MESSAGE_TYPES[type] + "\"",
+                        bytes ? (*direction)[type].bytes : (*direction)[type].messages);
+        };
+        traffic("dds_messages_total", "Frames sent and received, by DDS message type", false);
+        traffic("dds_bytes_total", "Bytes of the frames sent and received, by DDS message type", true);
+
+        for(size_t idx = 0; idx < COUNTERS.size(); ++idx)
+        {
+            const std::string name = std::string{"dds_"} + COUNTERS[idx].name + "_total";
+            out += "# HELP " + name + " " + COUNTERS[idx].help + "\n";
+            out += "# TYPE " + name + " counter\n";
+            out += sample(name, client, m_counters[idx]);
+        }
+
+        for(size_t idx = 0; idx < GAUGES.size(); ++idx)
+        {
+            if(!m_gauges[idx])
+                continue; // Not provided by this client
+
+            const std::string name = std::string{"dds_"} + GAUGES[idx].name;
+            out += "# HELP " + name + " " + GAUGES[idx].help + "\n";
+            out += "# TYPE " + name + " gauge\n";
+            out += sample(name, client, m_gauges[idx]());
+        }
+
+        for(size_t idx = 0; idx < HISTOGRAMS.size(); ++idx)
+        {
+            const std::string name = std::string{"dds_"} + HISTOGRAMS[idx].name + "_ms";
+            const auto & buckets = m_histograms[idx];
+            out += "# HELP " + name + " " + HISTOGRAMS[idx].help + "\n";
+            out += "# TYPE " + name + " histogram\n";
+
+            uint64_t cumulated = 0;
+            for(size_t bucket = 0; bucket <= HISTOGRAM_BOUNDS.size(); ++bucket)
+            {
+                cumulated += buckets.counts[bucket];
+                const std::string bound = bucket < HISTOGRAM_BOUNDS.size()
+                    ? std::to_string((int) HISTOGRAM_BOUNDS[bucket]) : "+Inf";
+                out += sample(name + "_bucket", client + ",le=\"" + bound + "\"", cumulated);
+            }
+            out += sample(name + "_sum", client, buckets.sum);
+            out += sample(name + "_count", client, cumulated);
+        }
+
+        return out;
+    }
+
+    // Replaced atomically, for collectors reading text files (node_exporter)
+    bool writeFile(const std::string & path) const
+    {
+        const std::string tmpPath = path + ".tmp";
+        FILE * file = fopen(tmpPath.c_str(), "w");
+        if(!file)
+            return false;
+
+        const std::string text = prometheus();
+        const bool written = fwrite(text.data(), 1, text.size(), file) == text.size();
+        if(fclose(file) != 0 || !written)
+            return false;
+
+        return rename(tmpPath.c_str(), path.c_str()) == 0;
+    }
+
+private:
+    struct Description
+    {
+        const char * name;
+        const char * help;
+    };
+
+    static constexpr std::array<Description, (size_t) Counter::COUNT> COUNTERS = {{
+        { "signatures_verified", "Signatures verified since joining the group" },
+        { "cac_signatures_received", "New CAC signatures received" },
+        { "cac_signatures_duplicate", "CAC signatures received again" },
+        { "gossip_received", "Gossiped messages received" },
+        { "gossip_duplicates", "Gossiped messages received again" },
+        { "fast_path", "Epochs decided by the CAC fast path" },
+        { "cac1", "Epochs decided by the CAC ready quorum" },
+        { "restrained", "Restrained consensus decisions" },
+        { "restrained_timeouts", "Restrained consensus ended without decision" },
+        { "cac2", "Epochs decided by the second CAC" },
+        { "full_consensus", "Epochs decided by the full consensus" },
+        { "view_changes", "Full consensus view changes" },
+        { "views_skipped", "Full consensus views skipped by a view change" },
+        { "pre_prepares_rejected", "Full consensus pre-prepares of another value than the one prepared" },
+        { "timeouts_registered", "Timeouts registered" },
+        { "timeouts_cancelled", "Timeouts cancelled" },
+        { "timeouts_fired", "Timeouts fired" },
+        { "frames_dropped", "Frames dropped above the send high-water mark" },
+        { "caught_up_epochs", "Commits replayed from the commit logs of other members" }
+    }};
+
+    static constexpr std::array<Description, (size_t) Gauge::COUNT> GAUGES = {{
+        { "epoch", "Current epoch" },
+        { "rtt_ms", "Round trip time the timeouts are based on" },
+        { "send_queue_bytes", "Bytes queued to be sent, all peers" },
+        { "pending_timeouts", "Timeouts registered and not fired yet" },
+        { "connections", "Open connections, to members and cached peers" },
+        { "future_buffer_bytes", "Bytes buffered for later epochs and views" },
+        { "future_buffer_messages", "Messages buffered for later epochs and views" },
+        { "gossip_store_bytes", "Bytes of gossiped frames kept for anti-entropy" },
+        { "gossip_duplicate_ratio", "Share of the gossiped messages received again" },
+        { "pending_verifications", "Consensus messages waiting for their signatures to be verified" }
+    }};
+
+    static constexpr std::array<Description, (size_t) Histogram::COUNT> HISTOGRAMS = {{
+        { "cac_witness_to_ready", "First CAC witness signature to own ready signature" },
+        { "cac_ready_to_deliver", "Own CAC ready signature to delivery" },
+        { "cac_deliver", "First CAC witness signature to delivery" },
+        { "restrained_consensus", "Restrained consensus duration" },
+        { "full_consensus", "Full consensus proposal to decision" },
+        { "epoch", "Duration of the epochs" }
+    }};
+
+    // By DDSMessageType (dds_message.hpp), 0 for anything else
+    static constexpr std::array<const char *, 8> MESSAGE_TYPES = {
+        "other", "welcome", "gossip", "cascade_consensus", "fetch", "probe", "catch_up", "relay"
+    };
+
+    static constexpr std::array<double, 14> HISTOGRAM_BOUNDS = {
+        1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 30000
+    };
+
+    struct Traffic
+    {
+        uint64_t messages = 0, bytes = 0;
+    };
+
+    struct Buckets
+    {
+        std::array<uint64_t, HISTOGRAM_BOUNDS.size() + 1> counts = {}; // Last one unbounded
+        double sum = 0;
+    };
+
+    static size_t messageType(std::span<const uint8_t> frame)
+    {
+        return !frame.empty() && frame[0] < MESSAGE_TYPES.size() ? frame[0] : 0;
+    }
+
+    template <typename T>
+    static std::string sample(const std::string & name, const std::string & labels, T value)
+    {
+        char formatted[32];
+        if constexpr(std::is_floating_point_v<T>)
+            snprintf(formatted, sizeof(formatted), "%g", value);
+        else
+            snprintf(formatted, sizeof(formatted), "%lu", (unsigned long) value);
+
+        return name + "{" + labels + "} " + formatted + "\n";
+    }
+
+    std::string m_client;
+    std::function<Clock::time_point()> m_clock;
+
+    std::array<uint64_t, (size_t) Counter::COUNT> m_counters = {};
+    std::array<std::function<double()>, (size_t) Gauge::COUNT> m_gauges;
+    std::array<Buckets, (size_t) Histogram::COUNT> m_histograms;
+    std::array<Traffic, MESSAGE_TYPES.size()> m_sent, m_received;
+};
+
+#endif
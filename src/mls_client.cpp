@@ -3,13 +3,15 @@
  * @author Ludovic PAILLAT (Ludovic.PAILLAT@hivenet.com)
  * @brief MLS Client for benchmarks
  * 
- * Usage: ./mls_client <identity> <pki-addr> <network-rtt>
+ * Usage: ./mls_client <identity> <pki-addr> <network-rtt> [--option=value...]
  *  - identity:    unique string identifier for the client
  *  - pki-addr:    address of the pki to be used
  *  - network-rtt: rtt with the farthest client in the network (in ms)
  *      -> after submitting proposal and waiting one rtt, client will commit
+ *  - options:     tunable parameters, see config.hpp
  * 
  * Commands:
+ *  - Group <index>, the group the next commands apply to (--groups)
  *  - Create
  *  - Update
  *  - Add <identity>
@@ -25,367 +27,45 @@
 #include <ctime>
 #include <functional>
 #include <iostream>
+#include <memory>
 #include <netinet/in.h>
 #include <optional>
+#include <span>
 #include <sstream>
 #include <string>
 #include <sys/socket.h>
-#include <variant>
 #include <vector>
 
 #include "bytes/bytes.h"
-#include "mls/common.h"
-#include "mls/core_types.h"
-#include "mls/credential.h"
-#include "mls/crypto.h"
 #include "mls/messages.h"
-#include "mls/state.h"
-#include "mls/tree_math.h"
-#include "tls/tls_syntax.h"
 
 #include "check.hpp"
-#include "distributed_ds.hpp"
-#include "extended_mls_state.hpp"
-#include "gossip_bcast.hpp"
+#include "config.hpp"
+#include "dds_message.hpp"
+#include "group_mux.hpp"
 #include "message.hpp"
+#include "mls_client.hpp"
 #include "network.hpp"
 #include "pki.hpp"
 #include "pki_client.hpp"
 
-const mls::bytes_ns::bytes GROUP_ID = {0xAB, 0xCD};
-const mls::CipherSuite SUITE { mls::CipherSuite::ID::X448_AES256GCM_SHA512_Ed448 };
-
-const mls::MessageOpts securedMessageOptions{ true, {}, 0 };
-
-class MLSClient
-{
-public:
-    MLSClient(const mls::CipherSuite & suite, const mls::bytes_ns::bytes & id,
-        Network & network, const char * pkiAddress, int networkRtt)
-        : initKey(mls::HPKEPrivateKey::generate(suite)),
-            leafKey(mls::HPKEPrivateKey::generate(suite)),
-            identityKey(mls::SignaturePrivateKey::generate(suite)),
-            leafNode(suite, leafKey.public_key, identityKey.public_key,
-                mls::Credential::basic(id), mls::Capabilities::create_default(),
-                mls::Lifetime::create_default(), {}, identityKey),
-            keyPackage(suite, initKey.public_key, leafNode, {}, identityKey),
-            network(network), pkiAddress(pkiAddress), networkRtt(networkRtt),
-            dds(network, networkRtt,
-                std::bind(&MLSClient::handleWelcome, this, std::placeholders::_1),
-                std::bind(&MLSClient::handleProposalOrMessage, this, std::placeholders::_1),
-                std::bind(&MLSClient::handleCommit, this, std::placeholders::_1), id, suite)
-    { }
-
-    void create(const mls::bytes_ns::bytes & groupId)
-    {
-        if(state)
-            return;
-
-        state = {{mls::State{groupId, keyPackage.cipher_suite, leafKey, identityKey, leafNode, {}}}};
-
-        dds.init(&state.value());
-
-        // TODO Initial credentials should be deleted (for Forward Secrecy)
-    }
-
-    void add(const std::string & ids)
-    {
-        // Split string to allow multiple adds (using ',')
-
-        std::istringstream iss(ids);
-
-        std::string id;
-        while(std::getline(iss, id, ','))
-        {
-            PKIQueryResponse resp = queryPKI(pkiAddress, id);
-            if(!resp.success)
-                printf("User not found: %s\n", id.c_str());
-            else
-            {
-                std::vector<uint8_t> packageBytes = {resp.preKey.content, resp.preKey.content + resp.preKey.size};
-
-                mls::KeyPackage keyPackage;
-                mls::tls::unmarshal(packageBytes, keyPackage);
-
-                mls::MLSMessage proposal = state->add(keyPackage, securedMessageOptions);
-                dds.broadcastProposalOrMessage(proposal);
-            }
-        }
-    }
-
-    void remove(const std::string & id)
-    {
-        std::vector<uint8_t> idBytes{id.begin(), id.end()};
-        const auto proposal = state->remove(idBytes, securedMessageOptions);
-
-        if(proposal)
-        {
-            dds.broadcastProposalOrMessage(proposal.value());
-        }
-    }
-
-    void update()
-    {
-        const auto proposal = state->update(mls::HPKEPrivateKey::generate(state->cipher_suite()), {}, securedMessageOptions);
-
-        dds.broadcastProposalOrMessage(proposal);
-    }
-
-    void message(const std::string & message)
-    {
-        std::vector<uint8_t> messageBytes{message.begin(), message.end()};
-        const auto protectedMessage = state->protect({}, messageBytes, 0);
-
-        dds.broadcastProposalOrMessage(protectedMessage);
-    }
-
-    void commit()
-    {
-        if(!dds.canProposeCommit())
-            return; // Too late to propose commit, don't make to effort to create one
-
-        // Copy the state to avoid side-effects of removeSelfUpdate()
-        ExtendedMLSState copyState = state.value();
-        copyState.removeSelfUpdate();
-
-        auto [commit, welcome, newState] = copyState.commit(copyState.freshSecret(), 
-            mls::CommitOpts{ {}, true, true, {} }, securedMessageOptions);
-
-        m_proposedCommit = { commit };
-        m_associatedState = { newState };
-        
-        dds.proposeCommit(commit, welcome);
-    }
-
-    ExtendedMLSState * handleWelcome(const mls::Welcome & welcome)
-    {
-        if(state)
-            return nullptr;
-
-        state = {{mls::State{initKey, leafKey, identityKey, keyPackage, welcome, std::nullopt, {}}}};
-
-        for(const auto & member : state->getMembersIdentity())
-        {
-            std::string memberId{(const char *) member.data(), member.size()};
-            network.connect(memberId);
-        }
-
-        printf("Joined group epoch %ld\n", state->epoch());
-        fflush(stdout);
-
-        // TODO Initial credentials should be deleted (for Forward Secrecy)
-
-        return &state.value();
-    }
-
-    void handleProposalOrMessage(const mls::MLSMessage & message)
-    {
-        const auto appMessage = state->isValidApplicationMessage(message);
-        if(appMessage)
-        {
-            auto [authData, messageBytes] = state->unprotect(message);
-            printf("Message: %.*s\n", (int) messageBytes.size(), messageBytes.data());
-            fflush(stdout);
-        }
-        else if(state->isValidProposal(message))
-        {
-            state->handle(message);
-
-            if(!m_chooseCommitterTimeout)
-            {
-                m_chooseCommitterTimeout = network.registerTimeout(networkRtt, [this](const auto &)
-                {
-                    m_chooseCommitterTimeout = {};
-                    auto committer = determineCommitter();
-                    if(committer == state->index())
-                        commit();
-                    else
-                    {
-                        m_forceCommitTimeout = network.registerTimeout(networkRtt,
-                        [this](const auto &)
-                        {
-                            m_forceCommitTimeout = {};
-                            commit();
-                        });
-                    }
-                });
-            }
-        }
-    }
-
-    ExtendedMLSState * handleCommit(const mls::MLSMessage & message)
-    {
-        if(state->isValidCommit(message))
-        {
-            auto [added, removed] = state->getCommitMembershipChanges(message);
-
-            // printf("Accepted commit %u\n", MLS_UTIL_HASH(*state, message));
-
-            // const auto [sender, proposals] = state->getCommitContent(message);
-            // printf("Commit by %d:", sender.val);
-            // for(const auto & proposal : proposals)
-            //     std::visit(mls::overloaded{
-            //         [](const mls::Add & add)
-            //         {
-            //             const auto id = add.key_package.leaf_node.credential.get<mls::BasicCredential>().identity;
-            //             printf("\tAdd %.*s", id.size(), id.data());
-            //         },
-            //         [](const mls::Remove & remove)
-            //         {
-            //             printf("\tRemove %d", remove.removed.val);
-            //         },
-            //         [](const mls::Update & update)
-            //         {
-            //             const auto id = update.leaf_node.credential.get<mls::BasicCredential>().identity;
-            //             printf("\tUpdate %.*s", id.size(), id.data());
-            //         },
-            //         [](const mls::PreSharedKey &){ return; },
-            //         [](const mls::ReInit &){ return; },
-            //         [](const mls::ExternalInit &){ return; },
-            //         [](const mls::GroupContextExtensions &){ return; }
-            //     }, proposal.content);
-            // printf("\n");
-
-            for(const auto & addedId : added)
-            {
-                printf("Added: %.*s\n", (int) addedId.size(), addedId.data());
-                network.connect(std::string{(const char *) addedId.data(), addedId.size()});
-            }
-
-            for(const auto & removedId : removed)
-            {
-                printf("Removed %.*s\n", (int) removedId.size(), removedId.data());
-                network.disconnect(std::string{(const char *) removedId.data(), removedId.size()});
-            }
-
-            if(m_proposedCommit
-                && state->cipher_suite().ref(message) == state->cipher_suite().ref(m_proposedCommit.value()))
-            {
-                state = m_associatedState;
-                printf("Local commit new epoch %ld id %u\n", state->epoch(),
-                    MLS_UTIL_HASH_STATE(*state));
-            }
-            else
-            {
-                auto newState = state->handle(message);
-                if(!newState)
-                    sys_error("Invalid commit\n");
-
-                state = ExtendedMLSState{newState.value()};
-                printf("Remote commit new epoch %ld id %u\n", state->epoch(),
-                    MLS_UTIL_HASH_STATE(*state));
-            }
-            fflush(stdout);
-            
-            // Clean the state
-            m_proposedCommit = {};
-            m_associatedState = {};
-            if(m_chooseCommitterTimeout)
-            {
-                network.unregisterTimeout(m_chooseCommitterTimeout.value());
-                m_chooseCommitterTimeout = {};
-            }
-            if(m_forceCommitTimeout)
-            {
-                network.unregisterTimeout(m_forceCommitTimeout.value());
-                m_forceCommitTimeout = {};
-            }
-
-            return &state.value();
-        }
-
-        return nullptr;
-    }
-
-    void handleMessage(Bytes & rawMessage)
-    {
-        dds.receiveNetworkMessage(rawMessage);
-    }
-
-    mls::KeyPackage getKeyPackage()
-    {
-        return keyPackage;
-    }
-
-protected:
-    // Based on the current proposals, determine the best member to commit
-    mls::LeafIndex determineCommitter()
-    {
-        // Choose in priority a member who sent an Update proposal, and pick the committer
-        //  randomly using the epoch number to keep it deterministic
-        auto epochMod = state->epoch() % state->getMembersIdentity().size();
-
-        auto proposalsIt = state->cachedProposals().begin();
-
-        mls::LeafIndex bestIdx = proposalsIt->sender.value();
-        auto bestDist = bestIdx.val +
-            (bestIdx.val < epochMod ? state->getMembersIdentity().size() : 0) - epochMod;
-        bool isBestUpdate = proposalsIt->proposal.proposal_type() == mls::ProposalType::update;
-        ++proposalsIt;
-
-        for(; proposalsIt != state->cachedProposals().end(); ++proposalsIt)
-        {
-            if(!isBestUpdate
-                && proposalsIt->proposal.proposal_type() == mls::ProposalType::update)
-            {
-                isBestUpdate = true;
-                bestIdx = proposalsIt->sender.value();
-                bestDist = bestIdx.val +
-                    (bestIdx.val < epochMod ? state->getMembersIdentity().size() : 0)
-                    - epochMod;
-            }
-            else if(!isBestUpdate || (isBestUpdate
-                && proposalsIt->proposal.proposal_type() == mls::ProposalType::update))
-            {
-                auto dist = proposalsIt->sender.value().val +
-                    (bestIdx.val < epochMod ? state->getMembersIdentity().size() : 0) - epochMod;
-
-                if(dist < bestDist)
-                {
-                    bestDist = dist;
-                    bestIdx = proposalsIt->sender.value();
-                }
-            }
-        }
-
-        return bestIdx;
-    }
-
-private:
-    mls::HPKEPrivateKey initKey, leafKey;
-    mls::SignaturePrivateKey identityKey;
-    mls::LeafNode leafNode;
-    mls::KeyPackage keyPackage;
-
-    Network & network;
-    const char * pkiAddress;
-    const int networkRtt;
-
-    DistributedDeliveryService dds;
-
-    std::optional<mls::MLSMessage> m_proposedCommit = {};
-    std::optional<ExtendedMLSState> m_associatedState = {};
-
-    std::optional<timeoutID> m_chooseCommitterTimeout = {},
-        m_forceCommitTimeout = {};
-
-    std::optional<ExtendedMLSState> state;
-};
-
 int main(int argc, char * argv[])
 {
     if(argc < 4)
     {
-        fprintf(stderr, "usage: %s <identity> <pki-addr> <network-rtt>\n", argv[0]);
+        fprintf(stderr, "usage: %s <identity> <pki-addr> <network-rtt> [--option=value...]\n", argv[0]);
+        printClientOptions(stderr);
         exit(EXIT_FAILURE);
     }
 
     const char * clientIdentity = argv[1];
     const char * pkiAddress = argv[2];
     const int networkRtt = atoi(argv[3]);
+    const ClientConfig config = parseClientOptions(argc, argv, 4);
 
-    // TODO We may set a seed, gossip communications relies on rand() for sampling
-    srand(time(0) + std::hash<const char *>()(clientIdentity));
+    // Gossip samples are drawn from --seed by the DDS, rand() is left to the
+    //  simulated crashes, seeded alike so that runs can be replayed
+    srand(config.seed ? config.seed.value() : time(0) + std::hash<const char *>()(clientIdentity));
 
     int server = socket(AF_INET, SOCK_STREAM, 0);
     PCHECK(server);
@@ -409,20 +89,99 @@ int main(int argc, char * argv[])
 
     mls::bytes_ns::bytes clientIdBytes{{clientIdentity, clientIdentity + strlen(clientIdentity)}};
 
-    Network net(pkiAddress, server);
+    SocketNetwork net(pkiAddress, server, {clientIdentity, strlen(clientIdentity)});
+    net.setSendHighWaterMark(config.sendHighWaterMark);
+    net.setAddressCacheTtl(config.addressCacheTtlMs);
+    net.setConnectionCache(config.connectionCache);
+    net.setFeatures(LOCAL_FEATURES);
+
+    const KeyPackageLookup lookup = [&net](const std::vector<std::string> & ids)
+    {
+        std::vector<std::optional<mls::KeyPackage>> keyPackages;
+        for(const auto & resp : net.pki().query(ids))
+        {
+            if(!resp.success)
+            {
+                keyPackages.emplace_back();
+                continue;
+            }
+
+            mls::KeyPackage keyPackage;
+            unmarshal(resp.preKey.span(), keyPackage);
+            keyPackages.emplace_back(std::move(keyPackage));
+        }
+
+        return keyPackages;
+    };
+
+    // One client and key package per group, over the same connections
+    GroupMux mux{net};
+    std::vector<GroupChannel *> channels;
+    std::vector<std::unique_ptr<MLSClient>> clients;
+    std::vector<Bytes> keyPackages;
 
-    MLSClient client{ SUITE, clientIdBytes, net, pkiAddress, networkRtt };
-    net.setHandleMessage([&](Bytes & message)
+    // Shared by the clients as the network, their threads are joined first
+    WorkerPool commitWorkers{config.pipelineCommits ? 1u : 0u};
+    WorkerPool verificationWorkers{config.cryptoThreads};
+
+    for(size_t slot = 0; slot < config.groups; ++slot)
     {
-        client.handleMessage(message);
+        ClientConfig slotConfig = config;
+        if(slot > 0 && !slotConfig.metricsFile.empty())
+            slotConfig.metricsFile += "." + std::to_string(slot);
+
+        GroupChannel & channel = mux.addChannel();
+        channels.push_back(&channel);
+        clients.emplace_back(std::make_unique<MLSClient>(SUITE, clientIdBytes, channel, lookup,
+            networkRtt, slotConfig));
+
+        MLSClient & slotClient = *clients.back();
+        slotClient.setWorkerPools(config.pipelineCommits ? &commitWorkers : nullptr,
+            config.cryptoThreads > 0 ? &verificationWorkers : nullptr);
+        channel.setHandleMessage([&slotClient, &channel, &mux](std::span<const uint8_t> message)
+        {
+            const bool joined = slotClient.groupState() != nullptr;
+            slotClient.handleMessage(message);
+
+            // Bound to the tag of the welcome until then
+            if(!joined && slotClient.groupState()
+                && !mux.bind(channel, slotClient.groupState()->group_id()))
+                printf("Error: the group joined is already hosted by another group slot,"
+                    " its frames stay routed by the tag of the welcome\n");
+        });
+        keyPackages.emplace_back(marshalToBytes(slotClient.getKeyPackage()));
+    }
+
+    // A group is joined by the client whose key package its welcome is encrypted to
+    mux.setUnboundHandler([&](std::span<const uint8_t> frame) -> GroupChannel *
+    {
+        if(frame.empty() || frame[0] != DDS_WELCOME)
+            return nullptr;
+
+        try
+        {
+            DDSMessage message;
+            unmarshal(frame, message);
+
+            for(size_t slot = 0; slot < clients.size(); ++slot)
+                if(!channels[slot]->tag() && message.welcome().find(clients[slot]->getKeyPackage()))
+                    return channels[slot];
+        }
+        catch(const std::exception & e)
+        {
+            printf("Received incorrect message: %s\n", e.what());
+        }
+
+        return nullptr;
     });
 
-    auto keyPackageBytes = marshalToBytes(client.getKeyPackage());
-    publishToPKI(pkiAddress, addr, std::string{clientIdentity, strlen(clientIdentity)}, keyPackageBytes);
+    net.pki().publish(addr, std::string{clientIdentity, strlen(clientIdentity)}, std::move(keyPackages));
+
+    size_t selected = 0;
 
-    printf("Client is running, you can now use the commands: create, add, remove, update and message\n");
+    printf("Client is running, you can now use the commands: group, create, add, remove, update, message, stats and metrics\n");
 
-    net.runSelect([&]()
+    net.runEventLoop([&]()
     {
         std::string line;
         std::getline(std::cin, line);
@@ -433,8 +192,30 @@ int main(int argc, char * argv[])
         iss >> command >> std::ws;
         std::getline(iss, arg);
 
-        if(command == "create")
-            client.create(GROUP_ID);
+        MLSClient & client = *clients[selected];
+
+        if(command == "group")
+        {
+            const size_t slot = std::strtoul(arg.c_str(), nullptr, 10);
+            if(arg.empty() || slot >= clients.size())
+                printf("Error: group must be between 0 and %zu\n", clients.size() - 1);
+            else
+                selected = slot;
+        }
+        else if(command == "create")
+        {
+            // Unique to the client and slot, frames are routed by group id
+            mls::bytes_ns::bytes groupId = GROUP_ID;
+            groupId += clientIdBytes;
+            groupId.push_back((uint8_t) selected);
+
+            if(!channels[selected]->tag())
+            {
+                client.create(groupId);
+                if(!mux.bind(*channels[selected], groupId))
+                    printf("Error: group id already hosted by another group slot\n");
+            }
+        }
         else if(command == "add" || command == "remove" || command == "message")
         {
             if(arg.empty())
@@ -451,6 +232,10 @@ int main(int argc, char * argv[])
         }
         else if(command == "update")
             client.update();
+        else if(command == "stats")
+            client.stats();
+        else if(command == "metrics")
+            client.metrics();
         else if(command == "stop")
             return false;
         else
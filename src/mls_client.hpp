@@ -0,0 +1,551 @@
+/**
+ * @file mls_client.hpp
+ * @author Ludovic PAILLAT (Ludovic.PAILLAT@hivenet.com)
+ * @brief MLS Client using the Distributed Delivery Service, run over sockets by
+ *  mls_client.cpp and in process by dds_sim.cpp
+ */
+
+#ifndef __MLS_CLIENT_HPP__
+#define __MLS_CLIENT_HPP__
+
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <span>
+#include <sstream>
+#include <string>
+#include <variant>
+#include <vector>
+
+#include "bytes/bytes.h"
+#include "mls/common.h"
+#include "mls/core_types.h"
+#include "mls/credential.h"
+#include "mls/crypto.h"
+#include "mls/messages.h"
+#include "mls/state.h"
+#include "mls/tree_math.h"
+#include "tls/tls_syntax.h"
+
+#include "cached_message.hpp"
+#include "check.hpp"
+#include "config.hpp"
+#include "distributed_ds.hpp"
+#include "extended_mls_state.hpp"
+#include "network.hpp"
+#include "worker_pool.hpp"
+
+const mls::bytes_ns::bytes GROUP_ID = {0xAB, 0xCD};
+const mls::CipherSuite SUITE { mls::CipherSuite::ID::X448_AES256GCM_SHA512_Ed448 };
+
+const mls::MessageOpts securedMessageOptions{ true, {}, 0 };
+
+// Key packages of the given clients, nothing for the unknown ones
+using KeyPackageLookup = std::function<std::vector<std::optional<mls::KeyPackage>>(
+    const std::vector<std::string> &)>;
+
+class MLSClient
+{
+public:
+    MLSClient(const mls::CipherSuite & suite, const mls::bytes_ns::bytes & id,
+        Network & network, const KeyPackageLookup & lookup, int networkRtt,
+        const ClientConfig & config)
+        : initKey(mls::HPKEPrivateKey::generate(suite)),
+            leafKey(mls::HPKEPrivateKey::generate(suite)),
+            identityKey(mls::SignaturePrivateKey::generate(suite)),
+            leafNode(suite, leafKey.public_key, identityKey.public_key,
+                mls::Credential::basic(id), mls::Capabilities::create_default(),
+                mls::Lifetime::create_default(), {}, identityKey),
+            keyPackage(suite, initKey.public_key, leafNode, {}, identityKey),
+            network(network), lookup(lookup), networkRtt(networkRtt),
+            dds(network, networkRtt,
+                std::bind(&MLSClient::handleWelcome, this, std::placeholders::_1),
+                std::bind(&MLSClient::handleProposal, this, std::placeholders::_1, std::placeholders::_2),
+                std::bind(&MLSClient::handleApplicationMessage, this, std::placeholders::_1, std::placeholders::_2),
+                std::bind(&MLSClient::handleCommit, this, std::placeholders::_1), id, suite),
+            m_commitQuorum(config.commitQuorum)
+    {
+        dds.configure(config);
+    }
+
+    // Pools shared by the groups of the process, their threads are to be
+    //  joined before the client is destroyed. Commits are built in advance
+    //  on the first one (--commit-pipeline), signatures are verified on the
+    //  second one (--crypto-threads), each option is disabled without its pool
+    void setWorkerPools(WorkerPool * commitWorkers, WorkerPool * verificationWorkers)
+    {
+        m_workers = commitWorkers;
+        dds.setVerificationPool(verificationWorkers);
+    }
+
+    void create(const mls::bytes_ns::bytes & groupId)
+    {
+        if(state)
+            return;
+
+        state = {{mls::State{groupId, keyPackage.cipher_suite, leafKey, identityKey, leafNode, {}}}};
+
+        dds.init(&state.value());
+
+        // TODO Initial credentials should be deleted (for Forward Secrecy)
+    }
+
+    void add(const std::string & ids)
+    {
+        // Split string to allow multiple adds (using ',')
+
+        std::istringstream iss(ids);
+
+        std::vector<std::string> idList;
+        std::string id;
+        while(std::getline(iss, id, ','))
+            idList.push_back(id);
+
+        const auto keyPackages = lookup(idList);
+        for(size_t idx = 0; idx < idList.size(); ++idx)
+        {
+            if(!keyPackages[idx])
+                printf("User not found: %s\n", idList[idx].c_str());
+            else
+            {
+                mls::MLSMessage proposal = state->add(keyPackages[idx].value(), securedMessageOptions);
+                dds.broadcastProposalOrMessage(proposal);
+            }
+        }
+    }
+
+    void remove(const std::string & id)
+    {
+        std::vector<uint8_t> idBytes{id.begin(), id.end()};
+        const auto proposal = state->remove(idBytes, securedMessageOptions);
+
+        if(proposal)
+        {
+            dds.broadcastProposalOrMessage(proposal.value());
+        }
+    }
+
+    void update()
+    {
+        const auto proposal = state->update(mls::HPKEPrivateKey::generate(state->cipher_suite()), {}, securedMessageOptions);
+
+        dds.broadcastProposalOrMessage(proposal);
+    }
+
+    // Batched with the next messages when --batch-messages is above 1
+    void message(const std::string & message)
+    {
+        dds.sendApplicationMessage({message.begin(), message.end()});
+    }
+
+    size_t receivedMessages() const { return m_receivedMessages; }
+
+    void stats() const
+    {
+        const BufferStats stats = dds.bufferStats();
+        printf("Buffered: %zu future messages (%zu bytes), %zu gossip bytes, %zu dropped\n",
+            stats.futureMessages, stats.futureBytes, stats.gossipBytes, stats.dropped);
+
+        const ConsensusStats consensus = dds.consensusStats();
+        printf("Decided: %zu fast path, %zu CAC 1, %zu CAC 2, %zu full consensus"
+            " (%zu restrained consensus, %zu without decision), rtt %d ms\n",
+            consensus.fastPath, consensus.cac1, consensus.cac2, consensus.fullConsensus,
+            consensus.restrained, consensus.restrainedTimeouts, dds.rtt());
+        printf("Caught up: %zu epochs from the commit logs of other members\n", dds.caughtUpEpochs());
+        fflush(stdout);
+    }
+
+    void metrics()
+    {
+        const std::string metrics = dds.metrics();
+        if(metrics.empty())
+            printf("Metrics are not collected, build with METRICS=1\n");
+        else
+            printf("%s", metrics.c_str());
+        fflush(stdout);
+    }
+
+    void commit()
+    {
+        if(!dds.canProposeCommit())
+            return; // Too late to propose commit, don't make to effort to create one
+
+        // Built in advance for the current proposals, otherwise missing some
+        if(m_speculativeCommit && m_speculativeCommit->epoch == state->epoch()
+            && m_speculativeCommit->proposalCount == state->cachedProposals().size())
+        {
+            m_proposedCommit = { m_speculativeCommit->commit };
+            m_associatedState = { m_speculativeCommit->newState };
+            const auto welcome = m_speculativeCommit->welcome;
+            m_speculativeCommit = {};
+            m_speculativeCommits++;
+
+            dds.proposeCommit(m_proposedCommit.value(), welcome);
+            return;
+        }
+        if(m_speculativeCommit)
+        {
+            m_speculativeCommit = {};
+            m_staleSpeculativeCommits++;
+        }
+
+        // Copy the state to avoid side-effects of removeSelfUpdate()
+        ExtendedMLSState copyState = state.value();
+        copyState.removeSelfUpdate();
+
+        auto [commit, welcome, newState] = copyState.commit(copyState.freshSecret(), 
+            mls::CommitOpts{ {}, true, true, {} }, securedMessageOptions);
+
+        m_proposedCommit = { commit };
+        m_associatedState = { newState };
+        
+        dds.proposeCommit(m_proposedCommit.value(), welcome);
+    }
+
+    ExtendedMLSState * handleWelcome(const mls::Welcome & welcome)
+    {
+        if(state)
+            return nullptr;
+
+        state = {{mls::State{initKey, leafKey, identityKey, keyPackage, welcome, std::nullopt, {}}}};
+
+        std::vector<std::string> memberIds;
+        for(const auto & member : state->members().identities())
+            memberIds.emplace_back((const char *) member.data(), member.size());
+        network.connect(memberIds);
+
+        printf("Joined group epoch %ld\n", state->epoch());
+        fflush(stdout);
+
+        // TODO Initial credentials should be deleted (for Forward Secrecy)
+
+        return &state.value();
+    }
+
+    // Content already decrypted and verified by the DDS, a batch is handed
+    //  over payload by payload
+    void handleApplicationMessage(const mls::AuthenticatedContent & content,
+        const mls::bytes_ns::bytes & payload)
+    {
+        (void) content;
+
+        m_receivedMessages++;
+        printf("Message: %.*s\n", (int) payload.size(), (const char *) payload.data());
+        fflush(stdout);
+    }
+
+    void handleProposal(const mls::MLSMessage & message,
+        const mls::AuthenticatedContent & content)
+    {
+        if(content.content.content_type() == mls::ContentType::proposal)
+        {
+            state->handle(message);
+
+            if(m_workers)
+                speculateCommit();
+
+            // Enough proposals observed, no need to wait for others
+            if(m_commitQuorum > 0 && !m_quorumReached
+                && state->cachedProposals().size() >= m_commitQuorum)
+            {
+                m_quorumReached = true;
+                if(m_chooseCommitterTimeout)
+                {
+                    network.unregisterTimeout(m_chooseCommitterTimeout.value());
+                    m_chooseCommitterTimeout = {};
+                }
+
+                chooseCommitter();
+            }
+            else if(!m_chooseCommitterTimeout && !m_quorumReached)
+            {
+                m_chooseCommitterTimeout = network.registerTimeout(dds.rtt(), [this](const auto &)
+                {
+                    m_chooseCommitterTimeout = {};
+                    chooseCommitter();
+                });
+            }
+        }
+    }
+
+    ExtendedMLSState * handleCommit(const CachedMLSMessage & commit)
+    {
+        const mls::MLSMessage & message = commit.message();
+
+        if(state->isValidCommit(message))
+        {
+            auto [added, removed] = state->getCommitMembershipChanges(message);
+
+            // printf("Accepted commit %u\n", MLS_UTIL_HASH(*state, message));
+
+            // const auto [sender, proposals] = state->getCommitContent(message);
+            // printf("Commit by %d:", sender.val);
+            // for(const auto & proposal : proposals)
+            //     std::visit(mls::overloaded{
+            //         [](const mls::Add & add)
+            //         {
+            //             const auto id = add.key_package.leaf_node.credential.get<mls::BasicCredential>().identity;
+            //             printf("\tAdd %.*s", id.size(), id.data());
+            //         },
+            //         [](const mls::Remove & remove)
+            //         {
+            //             printf("\tRemove %d", remove.removed.val);
+            //         },
+            //         [](const mls::Update & update)
+            //         {
+            //             const auto id = update.leaf_node.credential.get<mls::BasicCredential>().identity;
+            //             printf("\tUpdate %.*s", id.size(), id.data());
+            //         },
+            //         [](const mls::PreSharedKey &){ return; },
+            //         [](const mls::ReInit &){ return; },
+            //         [](const mls::ExternalInit &){ return; },
+            //         [](const mls::GroupContextExtensions &){ return; }
+            //     }, proposal.content);
+            // printf("\n");
+
+            std::vector<std::string> addedIds;
+            for(const auto & addedId : added)
+            {
+                printf("Added: %.*s\n", (int) addedId.size(), addedId.data());
+                addedIds.emplace_back((const char *) addedId.data(), addedId.size());
+            }
+            network.connect(addedIds);
+
+            for(const auto & removedId : removed)
+            {
+                printf("Removed %.*s\n", (int) removedId.size(), removedId.data());
+                network.disconnect(std::string{(const char *) removedId.data(), removedId.size()});
+            }
+
+            if(m_proposedCommit
+                && commit.ref(state->cipher_suite()) == m_proposedCommit->ref(state->cipher_suite()))
+            {
+                state = ExtendedMLSState{m_associatedState.value(), state.value(), added, removed};
+                printf("Local commit new epoch %ld id %u\n", state->epoch(),
+                    MLS_UTIL_HASH_STATE(*state));
+            }
+            else
+            {
+                auto newState = state->handle(message);
+                if(!newState)
+                    sys_error("Invalid commit\n");
+
+                state = ExtendedMLSState{newState.value(), state.value(), added, removed};
+                printf("Remote commit new epoch %ld id %u\n", state->epoch(),
+                    MLS_UTIL_HASH_STATE(*state));
+            }
+            fflush(stdout);
+            
+            // Clean the state
+            m_proposedCommit = {};
+            m_associatedState = {};
+            m_speculativeCommit = {};
+            m_speculateAgain = false;
+            m_quorumReached = false;
+            if(m_chooseCommitterTimeout)
+            {
+                network.unregisterTimeout(m_chooseCommitterTimeout.value());
+                m_chooseCommitterTimeout = {};
+            }
+            if(m_forceCommitTimeout)
+            {
+                network.unregisterTimeout(m_forceCommitTimeout.value());
+                m_forceCommitTimeout = {};
+            }
+
+            return &state.value();
+        }
+
+        return nullptr;
+    }
+
+    void handleMessage(std::span<const uint8_t> rawMessage)
+    {
+        dds.receiveNetworkMessage(rawMessage);
+    }
+
+    mls::KeyPackage getKeyPackage()
+    {
+        return keyPackage;
+    }
+
+    // Current epoch, if in a group
+    const ExtendedMLSState * groupState() const
+    {
+        return state ? &state.value() : nullptr;
+    }
+
+    const DistributedDeliveryService & deliveryService() const
+    {
+        return dds;
+    }
+
+    // Commits built in advance and proposed, and those dropped as the
+    //  proposals changed meanwhile
+    size_t speculativeCommits() const { return m_speculativeCommits; }
+    size_t staleSpeculativeCommits() const { return m_staleSpeculativeCommits; }
+
+protected:
+    // Commit built in advance for the proposals received so far
+    struct SpeculativeCommit
+    {
+        mls::epoch_t epoch;
+        size_t proposalCount; // Proposals are only added during an epoch
+        CachedMLSMessage commit;
+        std::optional<mls::Welcome> welcome;
+        mls::State newState;
+    };
+
+    void chooseCommitter()
+    {
+        auto committer = determineCommitter();
+        if(committer == state->index())
+            commit();
+        else
+        {
+            m_forceCommitTimeout = network.registerTimeout(dds.rtt(),
+            [this](const auto &)
+            {
+                m_forceCommitTimeout = {};
+                commit();
+            });
+        }
+    }
+
+    // Build the commit of the current proposals (path encryption included) on
+    //  a worker thread, so that it is ready if this member is chosen. Only one
+    //  is built at a time, the latest proposals are taken once it is done
+    void speculateCommit()
+    {
+        if(m_speculating)
+        {
+            m_speculateAgain = true;
+            return;
+        }
+        m_speculating = true, m_speculateAgain = false;
+
+        // The worker owns its copy of the state
+        auto copyState = std::make_shared<ExtendedMLSState>(state.value());
+        copyState->removeSelfUpdate();
+        const auto secret = copyState->freshSecret();
+        const mls::epoch_t epoch = state->epoch();
+        const size_t proposalCount = state->cachedProposals().size();
+
+        m_workers->submit([this, copyState, secret, epoch, proposalCount]()
+        {
+            std::optional<SpeculativeCommit> speculative = {};
+            try
+            {
+                auto result = copyState->commit(secret,
+                    mls::CommitOpts{ {}, true, true, {} }, securedMessageOptions);
+
+                const CachedMLSMessage commit{std::move(std::get<0>(result))};
+                commit.ref(copyState->cipher_suite()); // Hashed here too
+
+                speculative = { epoch, proposalCount, commit,
+                    std::move(std::get<1>(result)), std::move(std::get<2>(result)) };
+            }
+            catch(const std::exception & e)
+            {
+                printf("Speculative commit failed: %s\n", e.what());
+            }
+
+            network.post([this, speculative = std::move(speculative)]()
+            {
+                handleSpeculativeCommit(speculative);
+            });
+        });
+    }
+
+    void handleSpeculativeCommit(const std::optional<SpeculativeCommit> & speculative)
+    {
+        m_speculating = false;
+
+        if(!state || (speculative && speculative->epoch != state->epoch()))
+            return; // Too late
+
+        if(speculative && speculative->proposalCount != state->cachedProposals().size())
+            m_staleSpeculativeCommits++;
+        else if(speculative && !m_proposedCommit)
+            m_speculativeCommit = speculative;
+
+        if(m_speculateAgain)
+            speculateCommit();
+    }
+
+    // Based on the current proposals, determine the best member to commit
+    mls::LeafIndex determineCommitter()
+    {
+        // Choose in priority a member who sent an Update proposal, and pick the committer
+        //  randomly using the epoch number to keep it deterministic
+        const size_t memberCount = state->members().size();
+        auto epochMod = state->epoch() % memberCount;
+
+        auto proposalsIt = state->cachedProposals().begin();
+
+        mls::LeafIndex bestIdx = proposalsIt->sender.value();
+        auto bestDist = bestIdx.val +
+            (bestIdx.val < epochMod ? memberCount : 0) - epochMod;
+        bool isBestUpdate = proposalsIt->proposal.proposal_type() == mls::ProposalType::update;
+        ++proposalsIt;
+
+        for(; proposalsIt != state->cachedProposals().end(); ++proposalsIt)
+        {
+            if(!isBestUpdate
+                && proposalsIt->proposal.proposal_type() == mls::ProposalType::update)
+            {
+                isBestUpdate = true;
+                bestIdx = proposalsIt->sender.value();
+                bestDist = bestIdx.val +
+                    (bestIdx.val < epochMod ? memberCount : 0)
+                    - epochMod;
+            }
+            else if(!isBestUpdate || (isBestUpdate
+                && proposalsIt->proposal.proposal_type() == mls::ProposalType::update))
+            {
+                auto dist = proposalsIt->sender.value().val +
+                    (bestIdx.val < epochMod ? memberCount : 0) - epochMod;
+
+                if(dist < bestDist)
+                {
+                    bestDist = dist;
+                    bestIdx = proposalsIt->sender.value();
+                }
+            }
+        }
+
+        return bestIdx;
+    }
+
+private:
+    mls::HPKEPrivateKey initKey, leafKey;
+    mls::SignaturePrivateKey identityKey;
+    mls::LeafNode leafNode;
+    mls::KeyPackage keyPackage;
+
+    Network & network;
+    const KeyPackageLookup lookup;
+    const int networkRtt;
+
+    DistributedDeliveryService dds;
+
+    std::optional<CachedMLSMessage> m_proposedCommit = {};
+    std::optional<ExtendedMLSState> m_associatedState = {};
+
+    std::optional<timeoutID> m_chooseCommitterTimeout = {},
+        m_forceCommitTimeout = {};
+
+    std::optional<ExtendedMLSState> state;
+    size_t m_receivedMessages = 0;
+
+    // Commit pipelining
+    WorkerPool * m_workers = nullptr;
+    const size_t m_commitQuorum;
+    bool m_quorumReached = false;
+    bool m_speculating = false, m_speculateAgain = false;
+    std::optional<SpeculativeCommit> m_speculativeCommit = {};
+    size_t m_speculativeCommits = 0, m_staleSpeculativeCommits = 0;
+};
+
+#endif
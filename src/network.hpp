@@ -2,24 +2,33 @@
  * @file network.hpp
  * @author Ludovic PAILLAT (Ludovic.PAILLAT@hivenet.com)
  * @brief Handle low level network operations for clients
+ *
+ * The protocols only see the Network interface: reliable links between
+ *  members, timeouts and tasks run on the event loop. SocketNetwork
+ *  implements it over TCP, the simulator of dds_sim.cpp over a virtual clock.
  */
 
 #ifndef __NETWORK_HPP__
 #define __NETWORK_HPP__
 
 #include <algorithm>
-#include <bits/chrono.h>
-#include <bits/types/struct_timeval.h>
 #include <cassert>
+#include <cerrno>
 #include <chrono>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <fcntl.h>
 #include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <queue>
+#include <span>
 #include <string>
-#include <sys/time.h>
 #include <unistd.h>
 #include <unordered_map>
 #include <unordered_set>
@@ -27,355 +36,1105 @@
 #include <vector>
 
 #include <netinet/in.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #include "check.hpp"
 #include "message.hpp"
+#include "metrics.hpp"
 #include "pki.hpp"
 #include "pki_client.hpp"
 
-using timePoint = std::chrono::time_point<std::chrono::system_clock>;
+using timePoint = std::chrono::time_point<std::chrono::steady_clock>;
 using timeoutID = size_t;
 using timeoutCallback = std::function<void(const timeoutID &)>;
 
+using MessageHandler = std::function<void(std::span<const uint8_t>)>;
+
 static constexpr int BUF_SIZE = 4096;
+static constexpr uint32_t MAX_FRAME_SIZE = 64 * 1024 * 1024;
+static constexpr int MAX_EVENTS = 64;
+static constexpr int MAX_IOVECS = 128;
+static constexpr size_t DEFAULT_SEND_HIGH_WATER_MARK = 64 * 1024 * 1024;
+static constexpr int DEFAULT_ADDRESS_CACHE_TTL_MS = 60 * 1000;
+static constexpr size_t DEFAULT_CONNECTION_CACHE = 64;
+static constexpr uint8_t HELLO_FRAME = 0; // First frame of a connection, DDS message types start at 1
+
+static void setNonBlocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    PCHECK(flags);
+    PCHECK(fcntl(fd, F_SETFL, flags | O_NONBLOCK));
+}
 
-struct Buffer
+/**
+ * Per-connection receive buffer: the socket is read directly into its free
+ *  tail and complete frames are handed out in place as non-owning spans.
+ *  Only the trailing incomplete frame is ever moved, when room is needed
+ */
+class ReceiveBuffer
 {
-    uint8_t * data;
-    size_t curSize, reservedSize;
+public:
+    ReceiveBuffer()
+    {
+        allocate(BUF_SIZE);
+    }
 
-    Buffer(): data(NULL), curSize(0), reservedSize(0) {}
+    ReceiveBuffer(ReceiveBuffer && other)
+        : m_data(other.m_data), m_begin(other.m_begin), m_end(other.m_end),
+            m_capacity(other.m_capacity)
+    {
+        other.m_data = nullptr;
+        other.m_begin = other.m_end = other.m_capacity = 0;
+    }
 
-    Buffer(const Buffer & buf): data(buf.data), curSize(buf.curSize),
-        reservedSize(buf.reservedSize) {}
+    ReceiveBuffer(const ReceiveBuffer &) = delete;
+    ReceiveBuffer & operator=(const ReceiveBuffer &) = delete;
 
-    Buffer & operator=(const Buffer & buf)
+    ~ReceiveBuffer()
     {
-        data = buf.data;
-        curSize = buf.curSize;
-        reservedSize = buf.reservedSize;
+        std::free(m_data);
+    }
+
+    uint8_t * tail() { return m_data + m_end; }
+    size_t tailSpace() const { return m_capacity - m_end; }
+    void commit(size_t size) { m_end += size; }
 
-        return *this;
+    std::span<const uint8_t> readable() const
+    {
+        return { m_data + m_begin, m_end - m_begin };
     }
 
-    void init(size_t size)
+    void consume(size_t size)
     {
-        data = (uint8_t *) malloc(size);
-        if(!data)
-            sys_error("Allocating buffer failed");
+        assert(size <= m_end - m_begin);
+        m_begin += size;
+
+        if(m_begin == m_end)
+        {
+            m_begin = m_end = 0;
 
-        curSize = 0;
-        reservedSize = size;
+            // Give back memory used by a large frame once it has been processed
+            if(m_capacity > SHRINK_THRESHOLD)
+                resize(BUF_SIZE);
+        }
     }
 
-    void free()
+    // Ensure that `size` bytes starting from the first readable byte fit,
+    //  and that some room is left for the next read
+    void reserve(size_t size)
     {
-        if(data)
-            std::free(data);
+        const size_t used = m_end - m_begin;
+        const size_t needed = std::max(size, used + BUF_SIZE);
+
+        if(m_begin > 0 && m_capacity - m_begin < needed)
+        {
+            memmove(m_data, m_data + m_begin, used);
+            m_begin = 0, m_end = used;
+        }
+
+        if(m_capacity - m_begin < needed)
+            resize(std::max(m_capacity * 2, m_begin + needed));
     }
 
-    void realloc(size_t newSizeMin)
+    static constexpr size_t SHRINK_THRESHOLD = 16 * BUF_SIZE;
+
+protected:
+    void allocate(size_t size)
     {
-        const size_t newSize = std::max(reservedSize * 2, newSizeMin);
-        data = (uint8_t *) std::realloc(data, newSize);
+        m_data = (uint8_t *) malloc(size);
+        if(!m_data)
+            sys_error("Allocating buffer failed");
+
+        m_capacity = size;
+    }
+
+    void resize(size_t size)
+    {
+        uint8_t * data = (uint8_t *) std::realloc(m_data, size);
         if(!data)
-            sys_error("Expanding buffer failed");
+            sys_error("Resizing buffer failed");
+
+        m_data = data;
+        m_capacity = size;
+    }
+
+private:
+    uint8_t * m_data = nullptr;
+    size_t m_begin = 0, m_end = 0, m_capacity = 0;
+};
+
+/**
+ * Frames waiting to be written on a non-blocking connection. Payloads
+ *  are shared between every queue they were broadcast to
+ */
+struct SendQueue
+{
+    struct Frame
+    {
+        uint32_t header; // Size prefix, network order
+        SharedBytes payload;
+
+        size_t size() const { return sizeof(header) + payload->size; }
+    };
+
+    std::deque<Frame> frames;
+    size_t offset = 0;      // Bytes of the front frame already written
+    size_t queuedBytes = 0;
+    bool watchingOut = false, broken = false, overflowing = false;
+
+    void push(const SharedBytes & payload)
+    {
+        frames.push_back({ hton(payload->size), payload });
+        queuedBytes += frames.back().size();
+    }
+
+    // Write as many frames as the socket accepts, in a single syscall per batch
+    //  Returns false if the connection is unusable
+    bool flush(int fd)
+    {
+        while(!frames.empty())
+        {
+            struct iovec iov[MAX_IOVECS];
+            int iovCount = 0;
+            size_t skip = offset;
+
+            for(auto it = frames.begin(); it != frames.end() && iovCount + 2 <= MAX_IOVECS; ++it)
+            {
+                const size_t headerSize = sizeof(it->header);
+                if(skip < headerSize)
+                    iov[iovCount++] = { (uint8_t *) &it->header + skip, headerSize - skip };
+
+                const size_t payloadSkip = skip > headerSize ? skip - headerSize : 0;
+                if(payloadSkip < it->payload->size)
+                    iov[iovCount++] = { it->payload->content + payloadSkip,
+                        it->payload->size - payloadSkip };
+
+                skip = 0;
+            }
 
-        reservedSize = newSize;
+            struct msghdr msg = {};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iovCount;
+
+            ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL); // Avoid SIGPIPE on terminated socket
+            if(n == -1 && errno == EINTR)
+                continue;
+            if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return true;
+            if(n == -1)
+                return false;
+
+            size_t written = n;
+            while(written > 0)
+            {
+                const size_t remaining = frames.front().size() - offset;
+                if(written < remaining)
+                {
+                    offset += written;
+                    written = 0;
+                }
+                else
+                {
+                    written -= remaining;
+                    queuedBytes -= frames.front().size();
+                    frames.pop_front();
+                    offset = 0;
+                }
+            }
+        }
 
-        // TODO Should also decrease size when buffer is too big sometimes
+        return true;
     }
+};
 
-    void append(const uint8_t * src, size_t size)
+/**
+ * Binary heap of deadlines with O(log n) registration. Cancellation only
+ *  erases the callback, the stale heap entry is skipped once it reaches the top
+ */
+class TimerQueue
+{
+public:
+    timeoutID registerTimeout(int msDelay, timeoutCallback callback)
     {
-        if(curSize + size > reservedSize)
-            realloc(curSize + size);
+        timeoutID id = m_timeoutCounter++;
+
+        timePoint targetedTime = std::chrono::steady_clock::now()
+            + std::chrono::milliseconds{msDelay};
+        m_timeouts.insert({id, { targetedTime, std::move(callback) }});
+        m_deadlines.push({targetedTime, id});
 
-        memcpy(data + curSize, src, size);
-        curSize += size;
+        return id;
     }
 
-    void pop(uint8_t * dst, size_t size)
+    void unregisterTimeout(timeoutID id)
     {
-        assert(size <= curSize);
+        m_timeouts.erase(id);
 
-        memcpy(dst, data, size);
-        memmove(data, data + size, curSize - size);
-        curSize -= size;
+        // Avoid accumulating cancelled entries in the heap
+        if(m_deadlines.size() > 2 * m_timeouts.size() + 64)
+            compact();
+    }
+
+    // Milliseconds before the closest deadline, -1 if there is none
+    int nextTimeoutMs()
+    {
+        dropCancelled();
+        if(m_deadlines.empty())
+            return -1;
+
+        auto remaining = std::chrono::ceil<std::chrono::milliseconds>(
+            m_deadlines.top().first - std::chrono::steady_clock::now());
+
+        return std::max<int>(0, remaining.count());
+    }
+
+    // Fire every expired timeout (callbacks may register or unregister timeouts),
+    //  returns how many were fired
+    size_t runExpired()
+    {
+        size_t fired = 0;
+        while(true)
+        {
+            dropCancelled();
+            if(m_deadlines.empty()
+                || m_deadlines.top().first > std::chrono::steady_clock::now())
+                return fired;
+
+            const timeoutID id = m_deadlines.top().second;
+            m_deadlines.pop();
+
+            timeoutCallback callback = std::move(m_timeouts[id].second);
+            m_timeouts.erase(id);
+
+            callback(id);
+            fired++;
+        }
+    }
+
+    size_t size() const
+    {
+        return m_timeouts.size();
+    }
+
+protected:
+    using Deadline = std::pair<timePoint, timeoutID>;
+    using DeadlineHeap = std::priority_queue<Deadline, std::vector<Deadline>,
+        std::greater<Deadline>>;
+
+    bool isPending(const Deadline & deadline) const
+    {
+        const auto it = m_timeouts.find(deadline.second);
+        return it != m_timeouts.end() && it->second.first == deadline.first;
+    }
 
-        // TODO Ideally check to reduce buffer size
+    void dropCancelled()
+    {
+        while(!m_deadlines.empty() && !isPending(m_deadlines.top()))
+            m_deadlines.pop();
     }
 
-    Bytes packAndFree()
+    void compact()
     {
-        Bytes buf{curSize};
-        memcpy(buf.content, data, curSize);
+        std::vector<Deadline> pending;
+        pending.reserve(m_timeouts.size());
+        for(const auto & [id, timeout] : m_timeouts)
+            pending.emplace_back(timeout.first, id);
 
-        free();
-        return buf;
+        m_deadlines = DeadlineHeap{std::greater<Deadline>{}, std::move(pending)};
     }
+
+private:
+    timeoutID m_timeoutCounter = 0;
+    std::unordered_map<timeoutID, std::pair<timePoint, timeoutCallback>> m_timeouts;
+    DeadlineHeap m_deadlines;
 };
 
 class Network
 {
+public:
+    virtual ~Network() = default;
+
+    // Clock of the event loop, used by timeouts
+    virtual timePoint now() const = 0;
+
+    virtual timeoutID registerTimeout(int msDelay, timeoutCallback callback) = 0;
+    virtual void unregisterTimeout(timeoutID id) = 0;
+
+    // Run a task on the event loop thread, can be called from any thread
+    virtual void post(std::function<void()> task) = 0;
+
+    virtual void setHandleMessage(const MessageHandler & handleMessage) = 0;
+
+    virtual void connect(const std::string & id) = 0;
+    virtual void connect(const std::vector<std::string> & ids) = 0;
+    virtual void disconnect(const std::string & id) = 0;
+
+    // To every connected peer
+    virtual void broadcast(const SharedBytes & message) = 0;
+    // To the connected peers of the sample
+    virtual void broadcastSample(const std::vector<std::string> & sample,
+        const SharedBytes & message) = 0;
+    virtual void send(const std::string & id, const SharedBytes & message) = 0;
 
+    // Optional features announced by the peer when connecting, unknown until then
+    virtual std::optional<uint8_t> peerFeatures(const std::string & id) const
+    {
+        (void) id;
+        return {};
+    }
+
+    // Traffic and timers are counted when given metrics
+    virtual void setMetrics(Metrics * metrics)
+    {
+        m_metrics = metrics;
+    }
+
+protected:
+    Metrics * m_metrics = nullptr;
+};
+
+/**
+ * A single connection per peer, used in both directions. The dialer opens it
+ *  with a hello frame carrying its features and identity, checked against the
+ *  address the PKI gives for it; the acceptor answers with its own hello.
+ *  Features are optional encodings a peer can read, the ones of a peer are
+ *  unknown until its hello arrives. When two peers dial each other at once, both keep the
+ *  connection dialed by the smallest identity: the other one is retired, its
+ *  frames not started yet move to the kept one and it is shut down once
+ *  flushed. Members are connected to on first use; other peers, only reached
+ *  by gossip or requests, are closed in least recently used order above the
+ *  connection cache
+ */
+class SocketNetwork
+    : public Network
+{
 public:
-    Network(const char * pkiAddress, int server)
-        : m_pkiAddress(pkiAddress), m_server(server)
-    { }
+    SocketNetwork(const char * pkiAddress, int server, const std::string & selfId)
+        : m_pki(pkiAddress), m_server(server), m_selfId(selfId), m_hello(helloFrame(0, selfId))
+    {
+        m_epoll = epoll_create1(EPOLL_CLOEXEC);
+        PCHECK(m_epoll);
+
+        setNonBlocking(m_server);
+        watch(m_server, EPOLLIN | EPOLLET);
+
+        m_wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        PCHECK(m_wakeup);
+        watch(m_wakeup, EPOLLIN);
+
+        // Standard input cannot be watched when redirected from a regular file
+        struct epoll_event event = { .events = EPOLLIN, .data = { .fd = 0 } };
+        if(epoll_ctl(m_epoll, EPOLL_CTL_ADD, 0, &event) == -1 && errno != EPERM)
+            sys_error("Error watching standard input");
+    }
 
-    void runSelect(const std::function<bool(void)> & notifyIn)
+    ~SocketNetwork()
     {
-        bool goon = true;
+        for(const auto & [fd, _] : m_connections)
+            close(fd);
+
+        close(m_wakeup);
+        close(m_epoll);
+    }
 
-        fd_set readSet;
-        int maxFds;
+    void runEventLoop(const std::function<bool(void)> & notifyIn)
+    {
+        bool goon = true;
+        struct epoll_event events[MAX_EVENTS];
 
         while(goon)
         {
-            maxFds = m_server;
+            [[maybe_unused]] const size_t fired = m_timers.runExpired();
+            METRIC(m_metrics, count(Counter::TIMEOUTS_FIRED, fired));
+            dropBrokenPeers();
 
-            timeval * timeout = nullptr;
-            auto closestTimeout = nextTimeout();
-            
-            while(closestTimeout && closestTimeout->first.tv_sec == 0
-                && closestTimeout->first.tv_usec == 0)
+            int count = epoll_wait(m_epoll, events, MAX_EVENTS, m_timers.nextTimeoutMs());
+            if(count == -1 && errno == EINTR)
+                continue;
+            PCHECK(count);
+
+            for(int idx = 0; idx < count && goon; ++idx)
             {
-                auto timeoutID = closestTimeout->second;
+                const int fd = events[idx].data.fd;
+                const uint32_t flags = events[idx].events;
+
+                if(fd == 0)
+                    goon = notifyIn();
+                else if(fd == m_server)
+                    acceptClients();
+                else if(fd == m_wakeup)
+                    runPosted();
+                else if(m_connections.contains(fd))
+                    handleEvents(fd, flags);
+            }
+        }
+    }
 
-                m_timeouts[timeoutID].second(timeoutID);
-                unregisterTimeout(timeoutID);
+    timePoint now() const override
+    {
+        return std::chrono::steady_clock::now();
+    }
 
-                closestTimeout = nextTimeout();
-            }
-            if(closestTimeout)
-                timeout = &closestTimeout->first;
+    timeoutID registerTimeout(int msDelay, timeoutCallback callback) override
+    {
+        METRIC(m_metrics, count(Counter::TIMEOUTS_REGISTERED));
+        return m_timers.registerTimeout(msDelay, std::move(callback));
+    }
+
+    void unregisterTimeout(timeoutID id) override
+    {
+        METRIC(m_metrics, count(Counter::TIMEOUTS_CANCELLED));
+        m_timers.unregisterTimeout(id);
+    }
 
-            FD_ZERO(&readSet);
-            FD_SET(0, &readSet);
-            FD_SET(m_server, &readSet);
+    void post(std::function<void()> task) override
+    {
+        {
+            std::lock_guard lock{m_postedMutex};
+            m_posted.emplace_back(std::move(task));
+        }
 
-            for(const auto& client : m_inboundClients)
-            {
-                FD_SET(client, &readSet);
-                if(client > maxFds)
-                    maxFds = client;
-            }
+        const uint64_t one = 1;
+        if(write(m_wakeup, &one, sizeof(one)) == -1 && errno != EAGAIN)
+            sys_error("Error waking up the event loop");
+    }
 
-            int selectRes = select(maxFds+1, &readSet, NULL, NULL, timeout);
-            PCHECK(selectRes);
+    // Maximum amount of bytes queued for a single peer, new messages to this
+    //  peer are dropped above it (the peer is considered as faulty)
+    void setSendHighWaterMark(size_t bytes)
+    {
+        m_sendHighWaterMark = bytes;
+    }
+    // Duration during which an address returned by the PKI is reused
+    void setAddressCacheTtl(int ms)
+    {
+        m_addressCacheTtl = std::chrono::milliseconds{ms};
+    }
+    // Announced to the peers, before connecting to any of them
+    void setFeatures(uint8_t features)
+    {
+        m_hello = helloFrame(features, m_selfId);
+    }
 
-            if(selectRes == 0 && closestTimeout)
-            {
-                auto timeoutID = closestTimeout->second;
+    std::optional<uint8_t> peerFeatures(const std::string & id) const override
+    {
+        const auto it = m_peerFeatures.find(id);
+        if(it == m_peerFeatures.end())
+            return {};
 
-                m_timeouts[timeoutID].second(timeoutID);
-                unregisterTimeout(timeoutID);
-            }
+        return it->second;
+    }
 
-            if(FD_ISSET(0, &readSet))
-            {
-                goon = notifyIn();
-            }
+    // Connections kept open to peers that are not members
+    void setConnectionCache(size_t connections)
+    {
+        m_connectionCache = connections;
+    }
 
-            if(FD_ISSET(m_server, &readSet))
-            {
-                struct sockaddr_in clientAddr;
-                socklen_t clientLen = sizeof(struct sockaddr_in);
+    PKISession & pki()
+    {
+        return m_pki;
+    }
 
-                int newClient = accept(m_server, (struct sockaddr *) &clientAddr, &clientLen);
-                PCHECK(newClient);
+    void setMetrics(Metrics * metrics) override
+    {
+        Network::setMetrics(metrics);
 
-                Buffer buf;
-                buf.init(BUF_SIZE);
+        metrics->setGauge(Gauge::PENDING_TIMEOUTS, [this](){ return m_timers.size(); });
+        metrics->setGauge(Gauge::CONNECTIONS, [this](){ return m_connections.size(); });
+        metrics->setGauge(Gauge::SEND_QUEUE_BYTES, [this]()
+        {
+            size_t bytes = 0;
+            for(const auto & [_, connection] : m_connections)
+                bytes += connection.queue.queuedBytes;
+            return bytes;
+        });
+    }
 
-                m_inboundClients.insert(newClient);
-                m_incomingSize[newClient] = 0;
-                m_incomingMessage[newClient] = buf;
-            }
+    void setHandleMessage(const MessageHandler & handleMessage) override
+    {
+        if(!m_handleMessage)
+            m_handleMessage = handleMessage;
+    }
 
-            for(auto it = m_inboundClients.begin(); it != m_inboundClients.end(); )
-            {
-                if(FD_ISSET(*it, &readSet) && !readClient(*it))
-                    it = m_inboundClients.erase(it); // Remove if connection terminated
-                else
-                    ++it;
-            }
+    // Dialed on the first frame sent, unless the member dials first
+    void connect(const std::string & id) override
+    {
+        if(m_pinned.insert(id).second)
+            forgetLru(id);
+    }
+
+    // Resolve every unknown address in a single PKI round trip
+    void connect(const std::vector<std::string> & ids) override
+    {
+        std::vector<std::string> unresolved;
+        for(const auto & id : ids)
+            if(!m_peers.count(id) && !cachedAddress(id))
+                unresolved.push_back(id);
+
+        if(!unresolved.empty())
+        {
+            const auto resps = m_pki.queryAddr(unresolved);
+            for(size_t idx = 0; idx < unresolved.size(); ++idx)
+                cacheAddress(unresolved[idx], resps[idx]);
         }
+
+        for(const auto & id : ids)
+            connect(id);
     }
 
-    timeoutID registerTimeout(int msDelay, timeoutCallback callback)
+    void disconnect(const std::string & id) override
     {
-        timeoutID timeoutID = m_timeoutCounter++;
+        m_pinned.erase(id);
 
-        timePoint targetedTime = std::chrono::system_clock::now()
-            + std::chrono::milliseconds{msDelay};
-        m_timeouts.insert({timeoutID, { targetedTime, callback }});
+        if(m_peers.count(id))
+            markBroken(m_peers[id]);
+    }
 
-        return timeoutID;
+    // To every member
+    void broadcast(const SharedBytes & message) override
+    {
+        for(const auto & id : m_pinned)
+            enqueue(connection(id), message);
     }
 
-    void unregisterTimeout(timeoutID id)
+    void broadcastSample(const std::vector<std::string> & sample,
+        const SharedBytes & message) override
     {
-        m_timeouts.erase(id);
+        for(const auto & id : sample)
+            if(m_pinned.count(id) || m_peers.count(id))
+                send(id, message);
     }
 
-    void setHandleMessage(const std::function<void(Bytes &)> & handleMessage)
+    void send(const std::string & id, const SharedBytes & message) override
     {
-        if(!m_handleMessage)
-            m_handleMessage = handleMessage;
+        enqueue(connection(id), message);
+        touchLru(id);
     }
 
-    void connect(const std::string & id)
+protected:
+    struct Connection
     {
-        if(m_outboundClients.count(id))
-            return;
+        std::string id;             // Empty until the hello of an inbound connection
+        bool outbound = false;      // Dialed by this client
+        bool awaitingHello = false;
+        bool connecting = false;    // Non-blocking connect in progress
+        bool redialed = false;      // With a fresh address, after the cached one failed
+        bool retired = false;       // No longer used to send, shut down once flushed
+        bool shutDown = false;
+        ReceiveBuffer incoming;
+        SendQueue queue;
+    };
+
+    static SharedBytes helloFrame(uint8_t features, const std::string & selfId)
+    {
+        Bytes hello(2 + selfId.size());
+        hello.content[0] = HELLO_FRAME;
+        hello.content[1] = features;
+        memcpy(hello.content + 2, selfId.data(), selfId.size());
 
-        PKIQueryResponse resp = queryAddrPKI(m_pkiAddress, id);
+        return SharedBytes{std::move(hello)};
+    }
 
-        int s = socket(AF_INET, SOCK_STREAM, 0);
-        PCHECK(s);
+    void runPosted()
+    {
+        uint64_t count;
+        if(read(m_wakeup, &count, sizeof(count)) == -1 && errno != EAGAIN)
+            sys_error("Error reading event loop wake up");
+
+        std::vector<std::function<void()>> tasks;
+        {
+            std::lock_guard lock{m_postedMutex};
+            tasks.swap(m_posted);
+        }
+
+        for(const auto & task : tasks)
+            task();
+    }
 
+    void watch(int fd, uint32_t events)
+    {
+        struct epoll_event event = { .events = events, .data = { .fd = fd } };
+        PCHECK(epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &event));
+    }
+
+    void modify(int fd, uint32_t events)
+    {
+        struct epoll_event event = { .events = events, .data = { .fd = fd } };
+        PCHECK(epoll_ctl(m_epoll, EPOLL_CTL_MOD, fd, &event));
+    }
+
+    std::optional<struct sockaddr_in> cachedAddress(const std::string & id)
+    {
+        auto it = m_addressCache.find(id);
+        if(it == m_addressCache.end())
+            return std::nullopt;
+
+        if(it->second.second < std::chrono::steady_clock::now())
+        {
+            m_addressCache.erase(it);
+            return std::nullopt;
+        }
+
+        return it->second.first;
+    }
+
+    struct sockaddr_in cacheAddress(const std::string & id, const PKIQueryResponse & resp)
+    {
         struct sockaddr_in addr = {
             .sin_family = AF_INET,
             .sin_port = htons(resp.port),
             .sin_addr = { .s_addr = htonl(resp.ip.s_addr) }
         };
-        PCHECK(::connect(s, (struct sockaddr *) &addr, sizeof(struct sockaddr_in)));
 
-        m_outboundClients[id] = s;
+        if(resp.success)
+            m_addressCache[id] = { addr, std::chrono::steady_clock::now() + m_addressCacheTtl };
+        return addr;
+    }
+
+    std::optional<struct sockaddr_in> resolve(const std::string & id)
+    {
+        auto addr = cachedAddress(id);
+        if(addr)
+            return addr;
+
+        PKIQueryResponse resp = m_pki.queryAddr(id);
+        if(!resp.success)
+            return std::nullopt;
+
+        return cacheAddress(id, resp);
+    }
+
+    // Connection to write to the peer, dialed if there is none (-1 if unknown)
+    int connection(const std::string & id)
+    {
+        const auto it = m_peers.find(id);
+        return it != m_peers.end() ? it->second : dial(id, false);
+    }
+
+    // Non-blocking: frames are queued until the connection completes
+    int dial(const std::string & id, bool redial)
+    {
+        const auto addr = resolve(id);
+        if(!addr)
+        {
+            fprintf(stderr, "No address known for %s\n", id.c_str());
+            return -1;
+        }
+
+        const int s = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        PCHECK(s);
+
+        Connection & connection = m_connections[s];
+        connection.id = id;
+        connection.outbound = connection.connecting = true;
+        connection.redialed = redial;
+        connection.queue.push(m_hello);
+        connection.queue.watchingOut = true; // Writable once connected
+        m_peers[id] = s;
+
+        watch(s, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+        if(::connect(s, (const struct sockaddr *) &addr.value(), sizeof(struct sockaddr_in)) == -1
+            && errno != EINPROGRESS)
+        {
+            connectFailed(s);
+            return m_peers.count(id) ? m_peers[id] : -1;
+        }
+
+        return s;
     }
 
-    void disconnect(const std::string & id)
+    void completeConnect(int fd)
     {
-        if(!m_outboundClients.count(id))
+        int error = 0;
+        socklen_t errorLen = sizeof(error);
+        if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &errorLen) == -1 || error != 0)
+        {
+            connectFailed(fd);
             return;
+        }
 
-        close(m_outboundClients[id]);
-        m_outboundClients.erase(id);
+        m_connections.at(fd).connecting = false;
+        flush(fd);
     }
 
-    void broadcast(const Bytes & message)
+    // The cached address may be outdated, dial once more with a fresh one
+    void connectFailed(int fd)
     {
-        for(const auto & client : m_outboundClients)
-            netWrite(client.second, message);
+        Connection & failed = m_connections.at(fd);
+        const std::string id = failed.id;
+        SendQueue queued = std::move(failed.queue);
+        failed.queue = {};
+        markBroken(fd);
+
+        if(failed.redialed)
+        {
+            fprintf(stderr, "Error connecting to %s, dropping its messages\n", id.c_str());
+            return;
+        }
+
+        m_addressCache.erase(id);
+        const int s = dial(id, true);
+        if(s != -1)
+        {
+            for(const auto & frame : queued.frames)
+                if(!isHello(frame.payload))
+                    m_connections.at(s).queue.push(frame.payload);
+        }
     }
 
-    void broadcastSample(const std::vector<std::string> & sample, const Bytes & message)
+    static bool isHello(const SharedBytes & payload)
     {
-        for(const auto & id : sample)
-            if(m_outboundClients.count(id))
-            {
-                const auto & client = m_outboundClients[id];
-                netWrite(client, message);
-            }
+        return payload.size() > 0 && payload.data()[0] == HELLO_FRAME;
     }
 
-    void send(const std::string & id, const Bytes & message)
+    // The hello of an inbound connection, not used to send if the identity
+    //  does not match the address of the peer
+    void identify(int fd, uint8_t features, const std::string & id)
     {
-        connect(id); // No effect if already connected
+        Connection & connection = m_connections.at(fd);
+        connection.awaitingHello = false;
+
+        connection.queue.push(m_hello);
+        flush(fd);
+
+        struct sockaddr_in peer;
+        socklen_t peerLen = sizeof(peer);
+        const auto addr = resolve(id);
+        if(getpeername(fd, (struct sockaddr *) &peer, &peerLen) == -1
+            || !addr || addr->sin_addr.s_addr != peer.sin_addr.s_addr)
+        {
+            fprintf(stderr, "Connection claiming to be %s not from its address\n", id.c_str());
+            return;
+        }
+        connection.id = id;
+        m_peerFeatures[id] = features;
 
-        const auto & client = m_outboundClients[id];
-        netWrite(client, message);
+        if(m_peers.count(id))
+        {
+            // Both ends keep the connection dialed by the smallest identity
+            const int current = m_peers[id];
+            if(m_connections.at(current).outbound && m_selfId <= id)
+                return;
+
+            m_peers[id] = fd;
+            retire(current, fd);
+        }
+        else
+            m_peers[id] = fd;
+
+        touchLru(id);
     }
 
-protected:
-    bool readClient(int client)
+    // Replaced by `next`, or evicted if -1: the frame being written is
+    //  completed, the following ones go to the new connection
+    void retire(int fd, int next)
     {
-        uint8_t buf[BUF_SIZE];
+        Connection & previous = m_connections.at(fd);
+        previous.retired = true;
+        if(next == -1)
+        {
+            flush(fd);
+            return;
+        }
+
+        auto & frames = previous.queue.frames;
+        const size_t started = previous.queue.offset > 0 ? 1 : 0;
+        for(auto it = frames.begin() + started; it != frames.end(); ++it)
+            if(!isHello(it->payload))
+                m_connections.at(next).queue.push(it->payload);
 
-        ssize_t n = read(client, buf, BUF_SIZE);
-        if(n <= 0)
+        while(frames.size() > started)
         {
-            close(client);
-            m_incomingMessage[client].free();
-            return false;
+            previous.queue.queuedBytes -= frames.back().size();
+            frames.pop_back();
         }
 
-        assert(n > 0);
+        if(previous.connecting)
+            markBroken(fd);
+        else
+            flush(fd);
+
+        flush(next);
+    }
 
-        size_t expected = m_incomingSize[client];
-        Buffer clientBuf = m_incomingMessage[client];
+    // Members are never evicted
+    void touchLru(const std::string & id)
+    {
+        if(m_pinned.count(id) || !m_peers.count(id))
+            return;
 
-        clientBuf.append(buf, n);
+        forgetLru(id);
+        m_lru.push_front(id);
+        m_lruEntries[id] = m_lru.begin();
 
-        while(clientBuf.curSize >= expected)
+        while(m_lru.size() > m_connectionCache)
         {
-            if(expected == 0)
-            {
-                if(clientBuf.curSize < 4)
-                    break;
+            const std::string evicted = m_lru.back();
+            forgetLru(evicted);
 
-                uint32_t msgSize;
-                clientBuf.pop((uint8_t *) &msgSize, 4);
+            const int fd = m_peers[evicted];
+            m_peers.erase(evicted);
+            retire(fd, -1);
+        }
+    }
 
-                expected = ntoh(msgSize);
-            }
-            else
-            {
-                Bytes message(expected);
-                clientBuf.pop(message.content, expected);
+    void forgetLru(const std::string & id)
+    {
+        const auto it = m_lruEntries.find(id);
+        if(it == m_lruEntries.end())
+            return;
 
-                if(m_handleMessage)
-                    m_handleMessage(message);
+        m_lru.erase(it->second);
+        m_lruEntries.erase(it);
+    }
 
-                expected = 0;
-            }
+    void handleEvents(int fd, uint32_t flags)
+    {
+        Connection & connection = m_connections.at(fd);
+        if(connection.queue.broken)
+            return;
+
+        if(connection.connecting)
+        {
+            if(flags & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+                completeConnect(fd);
+            return;
         }
 
-        m_incomingSize[client] = expected;
-        m_incomingMessage[client] = clientBuf;
+        // Read first: the peer may have written before closing
+        if((flags & (EPOLLIN | EPOLLRDHUP)) && !readClient(fd))
+            markBroken(fd);
+        else if(flags & (EPOLLERR | EPOLLHUP))
+            markBroken(fd);
+        else if(flags & EPOLLOUT)
+            flush(fd);
+    }
 
-        return true;
+    void enqueue(int client, const SharedBytes & payload)
+    {
+        if(client == -1)
+            return;
+
+        Connection & connection = m_connections.at(client);
+        SendQueue & queue = connection.queue;
+        if(queue.broken)
+            return;
+
+        if(queue.queuedBytes + payload->size > m_sendHighWaterMark)
+        {
+            if(!queue.overflowing)
+                fprintf(stderr, "Send queue to %s above high-water mark, dropping messages\n",
+                    connection.id.c_str());
+            queue.overflowing = true;
+            METRIC(m_metrics, count(Counter::FRAMES_DROPPED));
+            return;
+        }
+        queue.overflowing = false;
+        METRIC(m_metrics, sent(payload.span()));
+
+        const bool wasEmpty = queue.frames.empty();
+        queue.push(payload);
+
+        if(wasEmpty) // Otherwise already waiting for the socket to be writable
+            flush(client);
     }
 
-    static timeval remainingTimeval(const timePoint & timePoint)
+    void flush(int client)
     {
-        auto now = std::chrono::system_clock::now();
-        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
-            timePoint - now);
+        Connection & connection = m_connections.at(client);
+        SendQueue & queue = connection.queue;
+        if(connection.connecting || queue.broken)
+            return;
+
+        if(!queue.flush(client))
+        {
+            markBroken(client);
+            return;
+        }
 
-        if(remaining.count() <= 0)
+        // Only be notified of writability while there is something to write
+        const bool pending = !queue.frames.empty();
+        if(pending != queue.watchingOut)
         {
-            return (timeval) { .tv_sec = 0, .tv_usec = 0 };
+            modify(client, EPOLLIN | EPOLLRDHUP | EPOLLET | (pending ? (uint32_t) EPOLLOUT : 0u));
+            queue.watchingOut = pending;
         }
-        
-        auto seconds = std::chrono::duration_cast<std::chrono::seconds>(remaining);
-        auto microseconds = std::chrono::duration_cast<std::chrono::microseconds>(
-            remaining - seconds);
 
-        return (timeval) { .tv_sec = seconds.count(), .tv_usec = microseconds.count() };
+        // The peer reads the end of the stream and closes its side
+        if(connection.retired && !pending && !connection.shutDown)
+        {
+            shutdown(client, SHUT_WR);
+            connection.shutDown = true;
+        }
     }
 
-    std::optional<std::pair<timeval, timeoutID>> nextTimeout()
+    // Broken connections are only closed from the event loop, so that callers
+    //  handling a frame from them are not invalidated. They are no longer
+    //  used to send: the next frame to the peer dials a new one
+    void markBroken(int client)
     {
-        if(m_timeouts.empty())
-            return {};
-        else
+        Connection & connection = m_connections.at(client);
+        SendQueue & queue = connection.queue;
+        if(queue.broken)
+            return;
+
+        queue.broken = true;
+        queue.frames.clear();
+        queue.queuedBytes = 0;
+        m_brokenPeers.emplace_back(client);
+
+        if(const auto it = m_peers.find(connection.id); it != m_peers.end() && it->second == client)
         {
-            const auto chosen = std::min_element(
-                m_timeouts.begin(), m_timeouts.end(),
-                [](const auto & lhs, const auto & rhs)
-                { return lhs.second.first < rhs.second.first; });
+            m_peers.erase(it);
+            forgetLru(connection.id);
+        }
+    }
 
-            return {{ remainingTimeval(chosen->second.first), chosen->first }};
+    void dropBrokenPeers()
+    {
+        for(const int client : m_brokenPeers)
+        {
+            close(client);
+            m_connections.erase(client);
         }
+
+        m_brokenPeers.clear();
     }
 
-private:
-    const char * m_pkiAddress;
-    const int m_server;
-    std::unordered_set<int> m_inboundClients;
-    std::unordered_map<std::string, int> m_outboundClients;
+    void acceptClients()
+    {
+        // Edge-triggered: accept until the backlog is empty
+        while(true)
+        {
+            struct sockaddr_in clientAddr;
+            socklen_t clientLen = sizeof(struct sockaddr_in);
 
-    std::function<void(Bytes &)> m_handleMessage;
-    std::unordered_map<int, size_t> m_incomingSize;
-    std::unordered_map<int, Buffer> m_incomingMessage;
+            int newClient = accept4(m_server, (struct sockaddr *) &clientAddr,
+                &clientLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if(newClient == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return;
+            PCHECK(newClient);
 
-    timeoutID m_timeoutCounter = 0;
-    std::unordered_map<timeoutID, std::pair<timePoint, timeoutCallback>> m_timeouts;
+            m_connections[newClient].awaitingHello = true;
+            watch(newClient, EPOLLIN | EPOLLRDHUP | EPOLLET);
+        }
+    }
+
+    bool readClient(int client)
+    {
+        Connection & connection = m_connections.at(client);
+        ReceiveBuffer & clientBuf = connection.incoming;
+
+        // Edge-triggered: drain the socket before going back to epoll
+        while(!connection.queue.broken)
+        {
+            ssize_t n = read(client, clientBuf.tail(), clientBuf.tailSpace());
+            if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return true;
+            if(n == -1 && errno == EINTR)
+                continue;
+
+            if(n <= 0 || !processFrames(client, n))
+                return false;
+        }
+
+        return true;
+    }
+
+    // Hand out every complete frame, returns false on an invalid frame
+    bool processFrames(int client, size_t received)
+    {
+        Connection & connection = m_connections.at(client);
+        ReceiveBuffer & buf = connection.incoming;
+        buf.commit(received);
+
+        while(!connection.queue.broken) // Handlers may disconnect the peer
+        {
+            const auto readable = buf.readable();
+            if(readable.size() < sizeof(uint32_t))
+            {
+                buf.reserve(sizeof(uint32_t));
+                return true;
+            }
+
+            uint32_t msgSize;
+            memcpy(&msgSize, readable.data(), sizeof(uint32_t));
+            msgSize = ntoh(msgSize);
+
+            if(msgSize > MAX_FRAME_SIZE)
+            {
+                fprintf(stderr, "Dropping connection: frame of %u bytes\n", msgSize);
+                return false;
+            }
+
+            const size_t frameSize = sizeof(uint32_t) + msgSize;
+            if(readable.size() < frameSize)
+            {
+                buf.reserve(frameSize); // Next reads complete the frame in place
+                return true;
+            }
+
+            const auto frame = readable.subspan(sizeof(uint32_t), msgSize);
+            if(connection.awaitingHello)
+            {
+                if(frame.size() < 2 || frame[0] != HELLO_FRAME)
+                {
+                    fprintf(stderr, "Dropping connection: no hello frame\n");
+                    return false;
+                }
+
+                identify(client, frame[1], {frame.begin() + 2, frame.end()});
+            }
+            else if(!frame.empty() && frame[0] == HELLO_FRAME)
+            {
+                // Answer of the acceptor
+                if(connection.outbound && frame.size() >= 2)
+                    m_peerFeatures[connection.id] = frame[1];
+            }
+            else
+            {
+                METRIC(m_metrics, received(frame));
+                if(m_handleMessage)
+                    m_handleMessage(frame);
+            }
+
+            buf.consume(frameSize);
+        }
+
+        return true;
+    }
+
+private:
+    PKISession m_pki;
+    std::unordered_map<std::string,
+        std::pair<struct sockaddr_in, std::chrono::steady_clock::time_point>> m_addressCache;
+    std::chrono::milliseconds m_addressCacheTtl{DEFAULT_ADDRESS_CACHE_TTL_MS};
+
+    const int m_server;
+    const std::string m_selfId;
+    SharedBytes m_hello;
+    std::unordered_map<std::string, uint8_t> m_peerFeatures;
+    int m_epoll;
+    int m_wakeup; // eventfd, signaled by post()
+    std::mutex m_postedMutex;
+    std::vector<std::function<void()>> m_posted;
+
+    std::unordered_map<int, Connection> m_connections;
+    std::unordered_map<std::string, int> m_peers;   // Connection used to send to each peer
+    std::unordered_set<std::string> m_pinned;       // Members, connected to on first use
+    std::list<std::string> m_lru;                   // Other peers, most recent first
+    std::unordered_map<std::string, std::list<std::string>::iterator> m_lruEntries;
+    size_t m_connectionCache = DEFAULT_CONNECTION_CACHE;
+    std::vector<int> m_brokenPeers;
+    size_t m_sendHighWaterMark = DEFAULT_SEND_HIGH_WATER_MARK;
+
+    MessageHandler m_handleMessage;
+
+    TimerQueue m_timers;
 };
 
 #endif
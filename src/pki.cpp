@@ -2,22 +2,47 @@
  * @file pki.cpp
  * @author Ludovic PAILLAT (Ludovic.PAILLAT@hivenet.com)
  * @brief Simplified PKI for MLS and DGKA
+ *
+ * Usage: ./pki [threads]
+ *  - threads: number of worker threads (default: one per core), each one
+ *      accepts on its own SO_REUSEPORT socket and runs an epoll loop over
+ *      its keep-alive connections
  */
 
 #include "pki.hpp"
 
-#include <map>
+#include <cerrno>
+#include <cstdlib>
+#include <optional>
 #include <queue>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
+#include <unistd.h>
 
 #include "check.hpp"
 #include "message.hpp"
+#include "sharded_map.hpp"
 
-std::map<std::string, std::queue<Bytes>> prekeys;
-std::map<std::string, struct sockaddr_in> addresses;
+struct PKIEntry
+{
+    struct sockaddr_in address;
+    std::queue<Bytes> prekeys;
+};
+
+ShardedMap<std::string, PKIEntry> directory;
+
+// Connections buffering more than this without a complete request are dropped
+static constexpr size_t MAX_REQUEST_SIZE = 16 * 1024 * 1024;
+static constexpr size_t READ_CHUNK = 4096;
+static constexpr int MAX_EVENTS = 64;
 
 #ifdef PRINT
 #   define print(a) a
@@ -46,87 +71,293 @@ void print_bytes(const char * bytes, uint size)
 }
 #endif
 
-void process(int c, const struct sockaddr_in& addr)
+static PKIQueryResponse lookup(const std::string & id, bool withPreKey)
 {
-    PKIRequest req = PKIRecvRequest(c);
+    PKIQueryResponse resp;
+    resp.success = 0;
+
+    directory.visit(id, [&](PKIEntry & entry)
+    {
+        if(withPreKey && entry.prekeys.empty())
+            return;
+
+        resp.success = 1;
+
+        if(withPreKey)
+        {
+            resp.preKey = std::move(entry.prekeys.front());
+            entry.prekeys.pop();
+        }
+
+        resp.ip = entry.address.sin_addr;
+        resp.port = entry.address.sin_port;
+    });
 
+    return resp;
+}
+
+// Handle one request, its response is appended to out
+void process(PKIRequest & req, const struct sockaddr_in& addr, ByteWriter & out)
+{
     if(req.type == REQUEST_PUBLISH)
     {
         print(printf("Publish request "); print_bin_string(req.pubRequest.id.c_str()); printf(" "); print_bytes((char *) req.pubRequest.keys[0].content, req.pubRequest.keys[0].size); printf("...\n");)
 
-        addresses[req.pubRequest.id] = {
-            .sin_port = ntoh(addr.sin_port),
-            .sin_addr = { .s_addr = ntoh(addr.sin_addr.s_addr) }
+        PKIEntry entry = {
+            .address = {
+                .sin_port = req.pubRequest.port,
+                .sin_addr = { .s_addr = ntoh(addr.sin_addr.s_addr) }
+            }
         };
-        addresses[req.pubRequest.id].sin_port = req.pubRequest.port;
+        for(auto& bs : req.pubRequest.keys)
+            entry.prekeys.emplace(std::move(bs));
 
-        std::queue<Bytes> keys;
-        for(const auto& bs : req.pubRequest.keys)
-            keys.emplace(bs);
-        prekeys[req.pubRequest.id] = keys;
+        directory.modify(req.pubRequest.id, [&](PKIEntry & stored)
+        {
+            stored = std::move(entry);
+        });
 
         PKIPublishResponse resp;
         resp.success = 1;
-        PKISendPublishResponse(c, resp);
+        PKISendPublishResponse(out, resp);
     }
-    else if(req.type == REQUEST_QUERY || req.type == REQUEST_ADDR)
+    else if(req.type == REQUEST_QUERY)
     {
         print(printf("Query request "); print_bin_string(req.queryRequestId.c_str()); printf("\n");)
 
-        PKIQueryResponse resp;
-        if(prekeys.count(req.queryRequestId) > 0
-            && addresses.count(req.queryRequestId) > 0
-            && (req.type == REQUEST_ADDR || prekeys[req.queryRequestId].size() > 0))
+        PKISendQueryResponse(out, lookup(req.queryRequestId, true));
+    }
+    else if(req.type == REQUEST_ADDR)
+    {
+        print(printf("Addr request "); print_bin_string(req.queryRequestId.c_str()); printf("\n");)
+
+        PKISendAddrResponse(out, lookup(req.queryRequestId, false));
+    }
+    else if(req.type == REQUEST_ADDR_BATCH)
+    {
+        print(printf("Addr batch request of %zu ids\n", req.batchRequestIds.size());)
+
+        std::vector<PKIQueryResponse> resps;
+        resps.reserve(req.batchRequestIds.size());
+        for(const auto & id : req.batchRequestIds)
+            resps.emplace_back(lookup(id, false));
+
+        PKISendAddrBatchResponse(out, resps);
+    }
+}
+
+struct Connection
+{
+    struct sockaddr_in addr;
+    std::vector<uint8_t> in, out;
+    size_t outOffset = 0;
+    bool watchingOut = false;
+};
+
+class Worker
+{
+public:
+    Worker()
+    {
+        m_server = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if(m_server == -1)
+            sys_error("Error Opening socket");
+
+        // Every worker listens on the port, the kernel spreads connections
+        const int enable = 1;
+        PCHECK(setsockopt(m_server, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)));
+
+        struct sockaddr_in addr = {
+            .sin_family = AF_INET,
+            .sin_port = htons(PKI_PORT),
+            .sin_addr =
+                { .s_addr = INADDR_ANY }
+        };
+
+        if(bind(m_server, (struct sockaddr *) &addr, sizeof(struct sockaddr_in)) == -1)
+            sys_error("Error binding socket to port");
+
+        if(listen(m_server, 1000) == -1)
+            sys_error("Error listening to socket");
+
+        m_epoll = epoll_create1(EPOLL_CLOEXEC);
+        PCHECK(m_epoll);
+
+        struct epoll_event event = { .events = EPOLLIN, .data = { .fd = m_server } };
+        PCHECK(epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_server, &event));
+    }
+
+    void run()
+    {
+        struct epoll_event events[MAX_EVENTS];
+
+        while(1)
         {
-            resp.success = 1;
+            int count = epoll_wait(m_epoll, events, MAX_EVENTS, -1);
+            if(count == -1 && errno == EINTR)
+                continue;
+            PCHECK(count);
 
-            if(req.type == REQUEST_QUERY)
+            for(int idx = 0; idx < count; ++idx)
             {
-                resp.preKey = prekeys[req.queryRequestId].front();
-                prekeys[req.queryRequestId].pop();
+                const int fd = events[idx].data.fd;
+                if(fd == m_server)
+                {
+                    acceptClients();
+                    continue;
+                }
+
+                Connection & conn = m_connections.at(fd);
+                bool alive = true;
+                if(events[idx].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                    alive = readRequests(fd, conn);
+                if(alive)
+                    alive = flushResponses(fd, conn);
+
+                if(!alive)
+                {
+                    close(fd);
+                    m_connections.erase(fd);
+                }
             }
-            
-            resp.ip = addresses[req.queryRequestId].sin_addr;
-            resp.port = addresses[req.queryRequestId].sin_port;
         }
-        else
-            resp.success = 0;
+    }
+
+protected:
+    void acceptClients()
+    {
+        while(true)
+        {
+            struct sockaddr_in client_addr;
+            socklen_t client_addr_len = sizeof(struct sockaddr_in);
+            int c = accept4(m_server, (struct sockaddr *) &client_addr,
+                &client_addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+            if(c == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return;
+            if(c == -1 && (errno == EINTR || errno == ECONNABORTED))
+                continue;
+            if(c == -1)
+                sys_error("Error accepting client");
 
-        PKISendQueryResponse(c, resp);
+            const int enable = 1;
+            PCHECK(setsockopt(c, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)));
+
+            m_connections[c] = { .addr = client_addr };
+
+            struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP | EPOLLET, .data = { .fd = c } };
+            PCHECK(epoll_ctl(m_epoll, EPOLL_CTL_ADD, c, &event));
+        }
     }
-}
 
-int main()
-{
-    int s = socket(AF_INET, SOCK_STREAM, 0);
-    if(s == -1)
-        sys_error("Error Opening socket");
+    // Drain the socket and answer every complete request,
+    //  returns false once the connection should be closed
+    bool readRequests(int c, Connection & conn)
+    {
+        bool closed = false;
+        while(true)
+        {
+            const size_t size = conn.in.size();
+            conn.in.resize(size + READ_CHUNK);
+
+            ssize_t n = read(c, conn.in.data() + size, READ_CHUNK);
+            conn.in.resize(size + std::max<ssize_t>(n, 0));
+
+            if(n == -1 && errno == EINTR)
+                continue;
+            if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if(n <= 0)
+            {
+                closed = true;
+                break;
+            }
+        }
+
+        ByteReader reader{conn.in};
+        ByteWriter writer{conn.out};
+        while(true)
+        {
+            const size_t start = reader.offset;
+            std::optional<PKIRequest> req = PKIRecvRequest(reader);
+            if(!req)
+            {
+                if(!reader.truncated)
+                    return false; // Malformed request
 
-    struct sockaddr_in addr = {
-        .sin_family = AF_INET,
-        .sin_port = htons(PKI_PORT),
-        .sin_addr =
-            { .s_addr = INADDR_ANY }
-    };
+                reader.offset = start;
+                break;
+            }
+
+            process(req.value(), conn.addr, writer);
+        }
+        conn.in.erase(conn.in.begin(), conn.in.begin() + reader.offset);
 
-    if(bind(s, (struct sockaddr *) &addr, sizeof(struct sockaddr_in)) == -1)
-        sys_error("Error binding socket to port");
+        if(closed)
+        {
+            flushResponses(c, conn); // Best effort
+            return false;
+        }
 
-    if(listen(s, 100) == -1)
-        sys_error("Error listening to socket");
+        return conn.in.size() <= MAX_REQUEST_SIZE;
+    }
 
-    while(1)
+    bool flushResponses(int c, Connection & conn)
     {
-        struct sockaddr_in client_addr;
-        socklen_t client_addr_len = sizeof(struct sockaddr_in);
-        int c = accept(s, (struct sockaddr *) &client_addr, &client_addr_len);
+        while(conn.outOffset < conn.out.size())
+        {
+            ssize_t n = send(c, conn.out.data() + conn.outOffset,
+                conn.out.size() - conn.outOffset, MSG_NOSIGNAL);
+
+            if(n == -1 && errno == EINTR)
+                continue;
+            if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if(n == -1)
+                return false;
 
-        if(c == -1)
-            sys_error("Error accepting client");
+            conn.outOffset += n;
+        }
 
-        process(c, client_addr);
-        close(c);
+        const bool pending = conn.outOffset < conn.out.size();
+        if(!pending)
+        {
+            conn.out.clear();
+            conn.outOffset = 0;
+        }
+
+        // Only wait for writability while responses are pending
+        if(pending != conn.watchingOut)
+        {
+            conn.watchingOut = pending;
+            struct epoll_event event = {
+                .events = EPOLLIN | EPOLLRDHUP | EPOLLET | (pending ? EPOLLOUT : 0u),
+                .data = { .fd = c }
+            };
+            PCHECK(epoll_ctl(m_epoll, EPOLL_CTL_MOD, c, &event));
+        }
+
+        return true;
     }
 
+private:
+    int m_server, m_epoll;
+    std::unordered_map<int, Connection> m_connections;
+};
+
+int main(int argc, char * argv[])
+{
+    unsigned threadCount = argc > 1 ? atoi(argv[1]) : std::thread::hardware_concurrency();
+    if(threadCount == 0)
+        threadCount = 1;
+
+    std::vector<Worker> workers(threadCount);
+
+    std::vector<std::thread> threads;
+    for(unsigned idx = 1; idx < threadCount; ++idx)
+        threads.emplace_back(&Worker::run, &workers[idx]);
+
+    workers[0].run();
+
     return 0;
 }
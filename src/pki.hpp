@@ -21,6 +21,7 @@ Request:
         case PUBLISH: PublishRequest
         case QUERY:   QueryRequest
         case ADDR:    QueryRequest
+        case ADDR_BATCH: BatchQueryRequest
     }
 }
 
@@ -40,6 +41,12 @@ QueryRequest:
     identity: string
 }
 
+BatchQueryRequest:
+{
+    count: u32, (at most PKI_MAX_BATCH)
+    identities: string[count]
+}
+
 Response:
 {
     u8: success,
@@ -52,6 +59,15 @@ Response:
         }
     }
 }
+
+BatchAddrResponse: (answer to ADDR_BATCH, in the order of the identities)
+{
+    count: u32,
+    responses: Response[count] (as for ADDR)
+}
+
+A connection stays open after a response, so that clients can keep a
+session and pipeline their requests
 */
 
 #ifndef __PKI_HPP__
@@ -59,6 +75,7 @@ Response:
 
 #include <cstdint>
 #include <netinet/in.h>
+#include <optional>
 #include <string>
 #include <vector>
 
@@ -69,7 +86,8 @@ enum PKIRequestType: uint32_t
 {
     REQUEST_PUBLISH = 1,
     REQUEST_QUERY,
-    REQUEST_ADDR
+    REQUEST_ADDR,
+    REQUEST_ADDR_BATCH
 };
 
 struct PKIPublishRequest
@@ -87,6 +105,7 @@ struct PKIRequest
     // {
         PKIPublishRequest pubRequest;
         std::string queryRequestId;
+        std::vector<std::string> batchRequestIds;
     // };
 };
 
@@ -105,66 +124,40 @@ struct PKIPublishResponse
 };
 
 static constexpr uint16_t PKI_PORT = 10501;
+static constexpr uint32_t PKI_MAX_BATCH = 1024;
 
 /** Network io */
 
-static PKIRequest PKIRecvRequest(int s)
-{
-    uint32_t type;
-    CHECK(netRead(s, type));
-
-    PKIRequest req;
-    switch(type)
-    {
-        case REQUEST_PUBLISH:
-            req.type = REQUEST_PUBLISH;
-
-            CHECK(netRead(s, req.pubRequest.id));
-            CHECK(netRead(s, req.pubRequest.port));
-
-            uint32_t count;
-            CHECK(netRead(s, count));
-            for(uint32_t idx = 0; idx < count; ++idx)
-            {
-                Bytes bs;
-                CHECK(netRead(s, bs));
-                req.pubRequest.keys.emplace_back(bs);
-            }
-            break;
-
-        case REQUEST_QUERY:
-            req.type = REQUEST_QUERY;
-            CHECK(netRead(s, req.queryRequestId));
-            break;
-
-        case REQUEST_ADDR:
-            req.type = REQUEST_ADDR;
-            CHECK(netRead(s, req.queryRequestId));
-            break;
-
-        default:
-            ERROR("Invalid PKI Request Type");
-    }
-
-    return req;
-}
-
 static void PKISendRequest(int s, const PKIRequest & req)
 {
+    // Serialized first and written at once: small writes of the same request
+    //  would otherwise wait for delayed acks (Nagle's algorithm)
+    std::vector<uint8_t> buffer;
+    ByteWriter out{buffer};
+
     if(req.type == REQUEST_PUBLISH)
     {
-        CHECK(netWrite(s, (uint32_t) req.type));
-        CHECK(netWrite(s, req.pubRequest.id));
-        CHECK(netWrite(s, req.pubRequest.port));
-        CHECK(netWrite(s, (uint32_t) req.pubRequest.keys.size()));
+        netWrite(out, (uint32_t) req.type);
+        netWrite(out, req.pubRequest.id);
+        netWrite(out, req.pubRequest.port);
+        netWrite(out, (uint32_t) req.pubRequest.keys.size());
         for(const auto& bs : req.pubRequest.keys)
-            CHECK(netWrite(s, bs));
+            netWrite(out, bs);
     }
     else if(req.type == REQUEST_QUERY || req.type == REQUEST_ADDR)
     {
-        CHECK(netWrite(s, (uint32_t) req.type));
-        CHECK(netWrite(s, req.queryRequestId));
+        netWrite(out, (uint32_t) req.type);
+        netWrite(out, req.queryRequestId);
+    }
+    else if(req.type == REQUEST_ADDR_BATCH)
+    {
+        netWrite(out, (uint32_t) req.type);
+        netWrite(out, (uint32_t) req.batchRequestIds.size());
+        for(const auto & id : req.batchRequestIds)
+            netWrite(out, id);
     }
+
+    CHECK(netWrite(s, buffer.data(), buffer.size()));
 }
 
 static PKIQueryResponse PKIRecvQueryResponse(int s)
@@ -202,6 +195,19 @@ static PKIQueryResponse PKIRecvAddrResponse(int s)
     return resp;
 }
 
+static std::vector<PKIQueryResponse> PKIRecvAddrBatchResponse(int s)
+{
+    uint32_t count;
+    CHECK(netRead(s, count));
+
+    std::vector<PKIQueryResponse> resps;
+    resps.reserve(count);
+    for(uint32_t idx = 0; idx < count; ++idx)
+        resps.emplace_back(PKIRecvAddrResponse(s));
+
+    return resps;
+}
+
 static PKIPublishResponse PKIRecvPublishResponse(int s)
 {
     PKIPublishResponse resp;
@@ -209,50 +215,103 @@ static PKIPublishResponse PKIRecvPublishResponse(int s)
     return resp;
 }
 
-static void PKISendQueryResponse(int s, const PKIQueryResponse & resp)
+/** Server side, over a socket or an in memory stream (ByteReader/ByteWriter) */
+
+// Returns no request once the connection is closed or on a malformed request
+template <typename Stream>
+static std::optional<PKIRequest> PKIRecvRequest(Stream & s)
 {
-    if(!netWrite(s, resp.success))
-    {
-        fprintf(stderr, "Error send query response on %d\n", s);
-        return;
-    }
+    uint32_t type;
+    if(!netRead(s, type))
+        return std::nullopt;
 
-    if(resp.success)
+    PKIRequest req;
+    uint32_t count;
+    switch(type)
     {
-        bool success = netWrite(s, (uint32_t) resp.ip.s_addr)
-            && netWrite(s, resp.port)
-            && netWrite(s, resp.preKey);
+        case REQUEST_PUBLISH:
+            req.type = REQUEST_PUBLISH;
 
-        if(!success)
-            fprintf(stderr, "Error send query response on %d\n", s);
+            if(!netRead(s, req.pubRequest.id) || !netRead(s, req.pubRequest.port)
+                || !netRead(s, count))
+                return std::nullopt;
+
+            for(uint32_t idx = 0; idx < count; ++idx)
+            {
+                Bytes bs;
+                if(!netRead(s, bs))
+                    return std::nullopt;
+                req.pubRequest.keys.emplace_back(std::move(bs));
+            }
+            break;
+
+        case REQUEST_QUERY:
+        case REQUEST_ADDR:
+            req.type = (PKIRequestType) type;
+            if(!netRead(s, req.queryRequestId))
+                return std::nullopt;
+            break;
+
+        case REQUEST_ADDR_BATCH:
+            req.type = REQUEST_ADDR_BATCH;
+
+            if(!netRead(s, count) || count > PKI_MAX_BATCH)
+                return std::nullopt;
+
+            req.batchRequestIds.resize(count);
+            for(auto & id : req.batchRequestIds)
+                if(!netRead(s, id))
+                    return std::nullopt;
+            break;
+
+        default:
+            fprintf(stderr, "Invalid PKI Request Type %u\n", type);
+            return std::nullopt;
     }
+
+    return req;
 }
 
-static void PKISendAddrResponse(int s, const PKIQueryResponse & resp)
+template <typename Stream>
+static bool PKISendQueryResponse(Stream & s, const PKIQueryResponse & resp)
 {
     if(!netWrite(s, resp.success))
-    {
-        fprintf(stderr, "Error send addr response on %d\n", s);
-        return;
-    }
+        return false;
 
-    if(resp.success)
-    {
-        bool success = netWrite(s, (uint32_t) resp.ip.s_addr)
-            && netWrite(s, resp.port);
-
-        if(!success)
-            fprintf(stderr, "Error send addr response on %d\n", s);
-    }
+    return !resp.success
+        || (netWrite(s, (uint32_t) resp.ip.s_addr)
+            && netWrite(s, resp.port)
+            && netWrite(s, resp.preKey));
 }
 
-static void PKISendPublishResponse(int s, const PKIPublishResponse & resp)
+template <typename Stream>
+static bool PKISendAddrResponse(Stream & s, const PKIQueryResponse & resp)
 {
     if(!netWrite(s, resp.success))
-    {
-        fprintf(stderr, "Error send publish response on %d\n", s);
-        return;
-    }
+        return false;
+
+    return !resp.success
+        || (netWrite(s, (uint32_t) resp.ip.s_addr)
+            && netWrite(s, resp.port));
+}
+
+template <typename Stream>
+static bool PKISendAddrBatchResponse(Stream & s, const std::vector<PKIQueryResponse> & resps)
+{
+    if(!netWrite(s, (uint32_t) resps.size()))
+        return false;
+
+    for(const auto & resp : resps)
+        if(!PKISendAddrResponse(s, resp))
+            return false;
+
+    return true;
+}
+
+template <typename Stream>
+static bool PKISendPublishResponse(Stream & s, const PKIPublishResponse & resp)
+{
+    return netWrite(s, resp.success);
 }
 
 #endif
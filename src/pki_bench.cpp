@@ -0,0 +1,162 @@
+/**
+ * @file pki_bench.cpp
+ * @author Ludovic PAILLAT (Ludovic.PAILLAT@hivenet.com)
+ * @brief Load generator for the PKI
+ *
+ * Usage: ./pki_bench <pki-addr> [connections] [duration] [mode] [batch]
+ *  - pki-addr:    address of the pki to be benchmarked
+ *  - connections: number of concurrent sessions, one thread each (default: 8)
+ *  - duration:    length of the run in seconds (default: 10)
+ *  - mode:        request sent in a closed loop (default: addr)
+ *      -> addr:    address of one identity
+ *      -> batch:   addresses of <batch> identities in one request
+ *      -> publish: publication of a key package
+ *  - batch:       identities per batch request (default: 100)
+ *
+ * Output: requests per second and latency percentiles (p50, p99, p99.9)
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <netinet/in.h>
+
+#include "check.hpp"
+#include "message.hpp"
+#include "pki.hpp"
+#include "pki_client.hpp"
+
+static constexpr size_t IDENTITY_COUNT = 10000;
+static constexpr size_t KEY_PACKAGE_SIZE = 512; // Order of magnitude of an Ed448 key package
+
+using benchClock = std::chrono::steady_clock;
+
+static std::string identity(size_t idx)
+{
+    return "bench-" + std::to_string(idx);
+}
+
+static Bytes keyPackage()
+{
+    Bytes bs{KEY_PACKAGE_SIZE};
+    memset(bs.content, 0xAB, bs.size);
+    return bs;
+}
+
+static struct sockaddr_in fakeAddress(size_t idx)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(1024 + idx % 60000)
+    };
+    return addr;
+}
+
+int main(int argc, char * argv[])
+{
+    if(argc < 2)
+    {
+        fprintf(stderr, "usage: %s <pki-addr> [connections] [duration] [addr|batch|publish] [batch]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    const char * pkiAddress = argv[1];
+    const int connections = argc > 2 ? atoi(argv[2]) : 8;
+    const int duration = argc > 3 ? atoi(argv[3]) : 10;
+    const std::string mode = argc > 4 ? argv[4] : "addr";
+    const size_t batch = argc > 5 ? atoi(argv[5]) : 100;
+
+    if(connections <= 0 || duration <= 0 || batch == 0 || batch > PKI_MAX_BATCH
+        || (mode != "addr" && mode != "batch" && mode != "publish"))
+    {
+        fprintf(stderr, "Invalid arguments\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Identities looked up by the benchmark
+    {
+        PKISession setup{pkiAddress};
+        for(size_t idx = 0; idx < IDENTITY_COUNT; ++idx)
+            setup.publish(fakeAddress(idx), identity(idx), keyPackage());
+    }
+
+    std::atomic<bool> running = true;
+    std::vector<std::vector<uint32_t>> latencies(connections); // In us
+    std::vector<size_t> lookups(connections, 0);
+
+    std::vector<std::thread> threads;
+    for(int thread = 0; thread < connections; ++thread)
+        threads.emplace_back([&, thread]()
+        {
+            PKISession session{pkiAddress};
+            size_t next = thread;
+
+            while(running)
+            {
+                const auto start = benchClock::now();
+
+                if(mode == "addr")
+                    CHECK(session.queryAddr(identity(next++ % IDENTITY_COUNT)).success);
+                else if(mode == "batch")
+                {
+                    std::vector<std::string> ids;
+                    for(size_t idx = 0; idx < batch; ++idx)
+                        ids.emplace_back(identity(next++ % IDENTITY_COUNT));
+
+                    for(const auto & resp : session.queryAddr(ids))
+                        CHECK(resp.success);
+                    lookups[thread] += batch;
+                }
+                else
+                {
+                    const size_t idx = next++ % IDENTITY_COUNT;
+                    session.publish(fakeAddress(idx), identity(idx), keyPackage());
+                }
+
+                const auto elapsed = benchClock::now() - start;
+                latencies[thread].push_back(
+                    std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+            }
+        });
+
+    std::this_thread::sleep_for(std::chrono::seconds{duration});
+    running = false;
+    for(auto & thread : threads)
+        thread.join();
+
+    std::vector<uint32_t> all;
+    size_t totalLookups = 0;
+    for(int thread = 0; thread < connections; ++thread)
+    {
+        all.insert(all.end(), latencies[thread].begin(), latencies[thread].end());
+        totalLookups += lookups[thread];
+    }
+    std::sort(all.begin(), all.end());
+
+    if(all.empty())
+    {
+        fprintf(stderr, "No request completed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    const auto percentile = [&](double p)
+    {
+        return all[std::min(all.size() - 1, (size_t) (p * all.size()))];
+    };
+
+    printf("mode %s, %d connections, %d s\n", mode.c_str(), connections, duration);
+    printf("requests: %zu (%.0f req/s)\n", all.size(), (double) all.size() / duration);
+    if(mode == "batch")
+        printf("lookups:  %zu (%.0f lookups/s)\n", totalLookups, (double) totalLookups / duration);
+    printf("latency:  p50 %u us, p99 %u us, p99.9 %u us, max %u us\n",
+        percentile(0.5), percentile(0.99), percentile(0.999), all.back());
+
+    return 0;
+}
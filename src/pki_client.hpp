@@ -7,8 +7,13 @@
 #ifndef __PKI_CLIENT_HPP__
 #define __PKI_CLIENT_HPP__
 
+#include <algorithm>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
 
 #include "check.hpp"
 #include "pki.hpp"
@@ -48,55 +53,121 @@ static int connectToPKI(const char * hostname)
     if(connect(client, (struct sockaddr *) &PKIAddr, sizeof(struct sockaddr_in)) == -1)
         sys_error("Error connecting to PKI");
 
+    // Pipelined requests are small, send them right away
+    const int enable = 1;
+    PCHECK(setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)));
+
     return client;
 }
 
-static void publishToPKI(const char * pkiAddress, struct sockaddr_in addr,
-    std::string id, Bytes keyPackage)
+/**
+ * Long-lived connection to the PKI, requests are pipelined on it: several
+ *  requests are written before reading their responses, in order
+ */
+class PKISession
 {
-    int client = connectToPKI(pkiAddress);
+public:
+    PKISession(const char * pkiAddress)
+        : m_pkiAddress(pkiAddress)
+    { }
 
-    PKIRequest req;
-    req.type = REQUEST_PUBLISH;
-    req.pubRequest = PKIPublishRequest{id, ntohs(addr.sin_port), {keyPackage}};
-    PKISendRequest(client, req);
+    ~PKISession()
+    {
+        if(m_socket != -1)
+            close(m_socket);
+    }
 
-    PKIPublishResponse resp = PKIRecvPublishResponse(client);
-    CHECK(resp.success);
+    PKISession(const PKISession &) = delete;
+    PKISession & operator=(const PKISession &) = delete;
 
-    PCHECK(close(client));
-}
+    void publish(struct sockaddr_in addr, std::string id, Bytes keyPackage)
+    {
+        std::vector<Bytes> keyPackages;
+        keyPackages.emplace_back(std::move(keyPackage));
+        publish(addr, std::move(id), std::move(keyPackages));
+    }
 
-static PKIQueryResponse queryPKI(const char * pkiAddress, std::string id)
-{
-    int client = connectToPKI(pkiAddress);
+    // Each query of the id then consumes one of them
+    void publish(struct sockaddr_in addr, std::string id, std::vector<Bytes> keyPackages)
+    {
+        PKIRequest req;
+        req.type = REQUEST_PUBLISH;
+        req.pubRequest = PKIPublishRequest{id, ntohs(addr.sin_port)};
+        for(auto & keyPackage : keyPackages)
+            req.pubRequest.keys.emplace_back(std::move(keyPackage));
+        PKISendRequest(socket(), req);
+
+        PKIPublishResponse resp = PKIRecvPublishResponse(socket());
+        CHECK(resp.success);
+    }
 
-    PKIRequest req;
-    req.type = REQUEST_QUERY;
-    req.queryRequestId = id;
-    PKISendRequest(client, req);
+    PKIQueryResponse query(const std::string & id)
+    {
+        return std::move(query(std::vector<std::string>{id}).front());
+    }
 
-    PKIQueryResponse resp = PKIRecvQueryResponse(client);
-    CHECK(resp.success);
+    // Consume one prekey of each user, one round trip for all of them
+    std::vector<PKIQueryResponse> query(const std::vector<std::string> & ids)
+    {
+        PKIRequest req;
+        req.type = REQUEST_QUERY;
+        for(const auto & id : ids)
+        {
+            req.queryRequestId = id;
+            PKISendRequest(socket(), req);
+        }
+
+        std::vector<PKIQueryResponse> resps;
+        resps.reserve(ids.size());
+        for(size_t idx = 0; idx < ids.size(); ++idx)
+            resps.emplace_back(PKIRecvQueryResponse(socket()));
+
+        return resps;
+    }
 
-    PCHECK(close(client));
-    return resp;
-}
+    PKIQueryResponse queryAddr(const std::string & id)
+    {
+        PKIRequest req;
+        req.type = REQUEST_ADDR;
+        req.queryRequestId = id;
+        PKISendRequest(socket(), req);
 
-static PKIQueryResponse queryAddrPKI(const char * pkiAddress, std::string id)
-{
-    int client = connectToPKI(pkiAddress);
+        return PKIRecvAddrResponse(socket());
+    }
 
-    PKIRequest req;
-    req.type = REQUEST_ADDR;
-    req.queryRequestId = id;
-    PKISendRequest(client, req);
+    // Address of each user, in order, using batch requests of PKI_MAX_BATCH ids
+    std::vector<PKIQueryResponse> queryAddr(const std::vector<std::string> & ids)
+    {
+        size_t batchCount = 0;
+        for(size_t first = 0; first < ids.size(); first += PKI_MAX_BATCH, ++batchCount)
+        {
+            PKIRequest req;
+            req.type = REQUEST_ADDR_BATCH;
+            req.batchRequestIds = { ids.begin() + first,
+                ids.begin() + std::min<size_t>(first + PKI_MAX_BATCH, ids.size()) };
+            PKISendRequest(socket(), req);
+        }
+
+        std::vector<PKIQueryResponse> resps;
+        resps.reserve(ids.size());
+        for(size_t batch = 0; batch < batchCount; ++batch)
+            for(auto & resp : PKIRecvAddrBatchResponse(socket()))
+                resps.emplace_back(std::move(resp));
+
+        return resps;
+    }
 
-    PKIQueryResponse resp = PKIRecvAddrResponse(client);
-    CHECK(resp.success);
+protected:
+    int socket()
+    {
+        if(m_socket == -1)
+            m_socket = connectToPKI(m_pkiAddress);
+        return m_socket;
+    }
 
-    PCHECK(close(client));
-    return resp;
-}
+private:
+    const char * m_pkiAddress;
+    int m_socket = -1;
+};
 
 #endif
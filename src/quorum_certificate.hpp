@@ -0,0 +1,127 @@
+/**
+ * @file quorum_certificate.hpp
+ * @author Ludovic PAILLAT (Ludovic.PAILLAT@hivenet.com)
+ * @brief Compact encoding of a set of CAC signatures used as a proof
+ *
+ * Signatures on the same statement (witness or ready of a message) are grouped
+ *  in a certificate holding the statement once, a bitmap of the signers indexed
+ *  by LeafIndex, their sequence and bare signature. Each ControlSignature is
+ *  rebuilt on receipt, its epoch being the current one.
+ */
+
+#ifndef __QUORUM_CERTIFICATE_HPP__
+#define __QUORUM_CERTIFICATE_HPP__
+
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "bytes/bytes.h"
+#include "mls/messages.h"
+#include "mls/tree_math.h"
+#include "tls/tls_syntax.h"
+
+#include "cac_signature.hpp"
+#include "control_signature.hpp"
+#include "extended_mls_state.hpp"
+
+struct QuorumCertificate
+{
+    uint8_t witnessOrReady;                         // WITNESS_CODE or READY_CODE
+    MessageRef messageReference;
+    std::vector<uint8_t> signers;                   // Bitmap indexed by LeafIndex
+    std::vector<uint32_t> sequences;                // By increasing LeafIndex
+    std::vector<mls::bytes_ns::bytes> signatures;   // By increasing LeafIndex
+
+    TLS_SERIALIZABLE(witnessOrReady, messageReference, signers, sequences, signatures);
+
+    bool hasSigner(uint32_t leaf) const
+    {
+        return leaf / 8 < signers.size() && (signers[leaf / 8] >> (leaf % 8)) & 1;
+    }
+
+    // Deterministic: the same set of signatures always gives the same certificates
+    static std::vector<QuorumCertificate> fromSignatures(const std::vector<CACSignature> & sigs)
+    {
+        std::map<std::pair<uint8_t, MessageRef>,
+            std::map<uint32_t, std::vector<const CACSignature *>>> statements;
+        for(const auto & sig : sigs)
+        {
+            const uint8_t code = sig.isWitness() ? CACSignature::WITNESS_CODE : CACSignature::READY_CODE;
+            statements[{code, sig.referencedMessage}][sig.sender().val].push_back(&sig);
+        }
+
+        std::vector<QuorumCertificate> certificates;
+        for(const auto & [statement, bySigner] : statements)
+        {
+            // A signer appearing twice on a statement needs another certificate
+            for(size_t round = 0; ; ++round)
+            {
+                QuorumCertificate certificate{ statement.first, statement.second };
+                for(const auto & [leaf, signerSigs] : bySigner)
+                {
+                    if(round >= signerSigs.size())
+                        continue;
+
+                    if(certificate.signers.size() <= leaf / 8)
+                        certificate.signers.resize(leaf / 8 + 1, 0);
+                    certificate.signers[leaf / 8] |= 1 << (leaf % 8);
+
+                    certificate.sequences.push_back(signerSigs[round]->sequence);
+                    certificate.signatures.push_back(signerSigs[round]->controlSignature.signature);
+                }
+
+                if(certificate.signatures.empty())
+                    break;
+                certificates.emplace_back(std::move(certificate));
+            }
+        }
+
+        return certificates;
+    }
+
+    // Returns the verified signatures, or nothing if any of them is invalid
+    static std::optional<std::vector<CACSignature>> toSignatures(const ExtendedMLSState & state,
+        const std::vector<QuorumCertificate> & certificates)
+    {
+        std::vector<CACSignature> sigs;
+
+        for(const auto & certificate : certificates)
+        {
+            if(certificate.sequences.size() != certificate.signatures.size())
+                return {};
+
+            size_t idx = 0;
+            for(uint32_t leaf = 0; leaf < 8 * certificate.signers.size(); ++leaf)
+            {
+                if(!certificate.hasSigner(leaf))
+                    continue;
+                if(idx == certificate.signatures.size())
+                    return {}; // More signers than signatures
+
+                const auto sig = CACSignature::verifyAndConvert(state, (ControlSignature) {
+                    .type = certificate.witnessOrReady,
+                    .signer = leaf,
+                    .epoch = state.epoch(),
+                    .sequence = certificate.sequences[idx],
+                    .reference = certificate.messageReference,
+                    .signature = certificate.signatures[idx]
+                });
+
+                if(!sig)
+                    return {};
+                sigs.emplace_back(sig.value());
+                ++idx;
+            }
+
+            if(idx != certificate.signatures.size())
+                return {};
+        }
+
+        return sigs;
+    }
+};
+
+#endif
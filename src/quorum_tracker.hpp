@@ -0,0 +1,223 @@
+/**
+ * @file quorum_tracker.hpp
+ * @author Ludovic PAILLAT (Ludovic.PAILLAT@hivenet.com)
+ * @brief Flat tracking of the witness and ready signatures of CAC statements
+ *
+ * Signers are kept in bitsets indexed by LeafIndex, statements in a dense
+ *  vector of slots found through a small open addressing table on their
+ *  reference. Counters and the lists of statements crossing the thresholds
+ *  are maintained on each new signature, so that the CAC conditions do not
+ *  need to scan every statement.
+ */
+
+#ifndef __QUORUM_TRACKER_HPP__
+#define __QUORUM_TRACKER_HPP__
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "mls/tree_math.h"
+
+#include "extended_mls_state.hpp"
+
+class LeafBitset
+{
+public:
+    void reset(size_t leaves)
+    {
+        m_words.assign((leaves + 63) / 64, 0);
+        m_count = 0;
+    }
+
+    // Returns whether the leaf was not there yet
+    bool insert(uint32_t leaf)
+    {
+        if(leaf / 64 >= m_words.size())
+            m_words.resize(leaf / 64 + 1, 0);
+
+        const uint64_t bit = uint64_t{1} << (leaf % 64);
+        if(m_words[leaf / 64] & bit)
+            return false;
+
+        m_words[leaf / 64] |= bit;
+        m_count++;
+        return true;
+    }
+
+    bool contains(uint32_t leaf) const
+    {
+        return leaf / 64 < m_words.size() && (m_words[leaf / 64] >> (leaf % 64)) & 1;
+    }
+
+    bool contains(const mls::LeafIndex & leaf) const
+    {
+        return contains(leaf.val);
+    }
+
+    size_t count() const { return m_count; }
+
+    // By increasing LeafIndex
+    std::vector<mls::LeafIndex> leaves() const
+    {
+        std::vector<mls::LeafIndex> leaves;
+        leaves.reserve(m_count);
+
+        for(size_t word = 0; word < m_words.size(); ++word)
+            for(uint64_t bits = m_words[word]; bits; bits &= bits - 1)
+                leaves.emplace_back(mls::LeafIndex{
+                    (uint32_t) (64 * word + std::countr_zero(bits)) });
+
+        return leaves;
+    }
+
+private:
+    std::vector<uint64_t> m_words;
+    size_t m_count = 0;
+};
+
+template <typename Payload>
+class QuorumTracker
+{
+public:
+    struct Statement
+    {
+        MessageRef ref;
+        LeafBitset witnesses, readies;
+        Payload payload = {};
+
+        bool hasSignatures() const
+        { return witnesses.count() + readies.count() > 0; }
+    };
+
+    // Statements witnessed by at least k and qw signers are listed
+    void reset(size_t leaves, size_t k, size_t qw)
+    {
+        m_leaves = leaves, m_k = k, m_qw = qw;
+
+        m_statements.clear();
+        m_buckets.assign(INITIAL_BUCKETS, EMPTY);
+        m_conflicting.clear(), m_ready.clear();
+        m_maxWitnesses = 0, m_witnessed = 0, m_signed = 0;
+    }
+
+    std::optional<uint32_t> find(const MessageRef & ref) const
+    {
+        for(size_t bucket = hash(ref); ; bucket = (bucket + 1) & (m_buckets.size() - 1))
+        {
+            if(m_buckets[bucket] == EMPTY)
+                return {};
+            if(m_statements[m_buckets[bucket]].ref == ref)
+                return m_buckets[bucket];
+        }
+    }
+
+    // Slot of the statement, created if absent
+    uint32_t slot(const MessageRef & ref)
+    {
+        const auto found = find(ref);
+        if(found)
+            return found.value();
+
+        // Load factor under 1/2, probes stay short
+        if(2 * (m_statements.size() + 1) > m_buckets.size())
+            grow();
+
+        const uint32_t slot = m_statements.size();
+        m_statements.push_back({ .ref = ref });
+        m_statements.back().witnesses.reset(m_leaves);
+        m_statements.back().readies.reset(m_leaves);
+        place(slot);
+
+        return slot;
+    }
+
+    Statement & operator[](uint32_t slot) { return m_statements[slot]; }
+    const Statement & operator[](uint32_t slot) const { return m_statements[slot]; }
+
+    std::vector<Statement> & statements() { return m_statements; }
+    size_t size() const { return m_statements.size(); }
+
+    // Returns whether the signature is new
+    bool witness(uint32_t slot, const mls::LeafIndex & signer)
+    {
+        Statement & statement = m_statements[slot];
+        const bool hadSignatures = statement.hasSignatures();
+        if(!statement.witnesses.insert(signer.val))
+            return false;
+
+        const size_t count = statement.witnesses.count();
+        m_maxWitnesses = std::max(m_maxWitnesses, count);
+        if(count == 1)
+            m_witnessed++;
+        if(count == m_k)
+            m_conflicting.push_back(slot);
+        if(count == m_qw)
+            m_ready.push_back(slot);
+        if(!hadSignatures)
+            m_signed++;
+
+        return true;
+    }
+
+    bool ready(uint32_t slot, const mls::LeafIndex & signer)
+    {
+        Statement & statement = m_statements[slot];
+        const bool hadSignatures = statement.hasSignatures();
+        if(!statement.readies.insert(signer.val))
+            return false;
+
+        if(!hadSignatures)
+            m_signed++;
+
+        return true;
+    }
+
+    // Witnessed by at least k signers
+    const std::vector<uint32_t> & conflicting() const { return m_conflicting; }
+    // Witnessed by at least qw signers
+    const std::vector<uint32_t> & ready() const { return m_ready; }
+
+    size_t maxWitnesses() const { return m_maxWitnesses; }
+    size_t witnessedCount() const { return m_witnessed; }   // With one witness or more
+    size_t signedCount() const { return m_signed; }         // With one signature or more
+
+private:
+    static constexpr uint32_t EMPTY = UINT32_MAX;
+    static constexpr size_t INITIAL_BUCKETS = 16; // Power of two
+
+    // References are hashes, their first bytes are uniformly distributed
+    size_t hash(const MessageRef & ref) const
+    {
+        return SignatureHash{}(ref) & (m_buckets.size() - 1);
+    }
+
+    void place(uint32_t slot)
+    {
+        size_t bucket = hash(m_statements[slot].ref);
+        while(m_buckets[bucket] != EMPTY)
+            bucket = (bucket + 1) & (m_buckets.size() - 1);
+
+        m_buckets[bucket] = slot;
+    }
+
+    void grow()
+    {
+        m_buckets.assign(2 * m_buckets.size(), EMPTY);
+        for(uint32_t slot = 0; slot < m_statements.size(); ++slot)
+            place(slot);
+    }
+
+    size_t m_leaves = 0, m_k = 0, m_qw = 0;
+
+    std::vector<Statement> m_statements;
+    std::vector<uint32_t> m_buckets = std::vector<uint32_t>(INITIAL_BUCKETS, EMPTY);
+
+    std::vector<uint32_t> m_conflicting, m_ready;
+    size_t m_maxWitnesses = 0, m_witnessed = 0, m_signed = 0;
+};
+
+#endif
@@ -0,0 +1,169 @@
+/**
+ * @file relay_tree.hpp
+ * @author Ludovic PAILLAT (Ludovic.PAILLAT@hivenet.com)
+ * @brief Dissemination of large Cascade Consensus messages along a k-ary tree
+ *  of the members, instead of a unicast to each of them by the sender
+ *
+ * The tree of an epoch is rooted at the sender and follows the leaf order of
+ *  the ratchet tree: the member at position p after the sender relays to the
+ *  ones at positions k.p + 1 to k.p + k. Each member sends at most k copies
+ *  and the last ones are reached after log_k(n) hops. Members relay once they
+ *  decrypted the message, so faulty or slow relays can cut a subtree: the
+ *  sender broadcasts it directly if the epoch is not over after a timeout.
+ */
+
+#ifndef __RELAY_TREE_HPP__
+#define __RELAY_TREE_HPP__
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "mls/messages.h"
+#include "mls/tree_math.h"
+
+#include "dds_message.hpp"
+#include "extended_mls_state.hpp"
+#include "network.hpp"
+
+static constexpr size_t DEFAULT_RELAY_FANOUT = 0; // Disabled, direct broadcasts
+static constexpr size_t DEFAULT_RELAY_BYTES = 1024;
+static constexpr int RELAY_FALLBACK_RTTS = 2;     // On top of the depth of the tree
+
+class RelayTree
+{
+public:
+    explicit RelayTree(Network & network)
+        : m_network(network)
+    { }
+
+    // Children of each member, 0 to broadcast directly
+    void setFanout(size_t fanout)
+    {
+        m_fanout = std::min<size_t>(fanout, UINT8_MAX);
+    }
+    // Smaller messages, e.g. only carrying signatures, are sent directly
+    void setMinBytes(size_t bytes)
+    {
+        m_minBytes = bytes;
+    }
+
+    void newEpoch(const ExtendedMLSState & state)
+    {
+        cancelFallbacks();
+
+        m_epoch = state.epoch();
+        m_self = state.index();
+        m_members.clear();
+        for(const auto & member : state.members().indexes())
+            m_members.emplace_back(member, state.members().name(member));
+    }
+
+    // Sent down the tree rooted at this member, false if it should be
+    //  broadcast directly
+    bool disseminate(const mls::MLSMessage & message, const SharedBytes & directFrame, int rtt)
+    {
+        if(m_fanout == 0 || directFrame.size() < m_minBytes || message.epoch() != m_epoch)
+            return false;
+
+        send((RelayMessage) {
+            .origin = m_self.val,
+            .fanout = (uint8_t) m_fanout,
+            .message = message
+        });
+
+        const int timeout = (depth(m_fanout) + RELAY_FALLBACK_RTTS) * rtt;
+        m_fallbacks.emplace_back(m_network.registerTimeout(timeout, [this, directFrame](auto id)
+        {
+            std::erase(m_fallbacks, id);
+            m_network.broadcast(directFrame);
+        }));
+
+        return true;
+    }
+
+    // Relay a message received from the parent, once decrypted
+    void forward(const RelayMessage & relay)
+    {
+        if(relay.fanout > 0 && relay.message.epoch() == m_epoch)
+            send(relay);
+    }
+
+protected:
+    void send(const RelayMessage & relay)
+    {
+        const auto children = this->children(mls::LeafIndex{relay.origin}, relay.fanout);
+        if(children.empty())
+            return;
+
+        DDSMessage msg = {
+            .content = { relay }
+        };
+        const SharedBytes frame = marshalToBytes(msg);
+        for(const auto * child : children)
+            m_network.send(*child, frame);
+    }
+
+    std::vector<const std::string *> children(mls::LeafIndex origin, size_t fanout) const
+    {
+        const auto position = [this](mls::LeafIndex leaf) -> std::optional<size_t>
+        {
+            const auto it = std::lower_bound(m_members.begin(), m_members.end(), leaf,
+                [](const auto & member, mls::LeafIndex leaf){ return member.first < leaf; });
+            if(it == m_members.end() || it->first != leaf)
+                return {};
+
+            return it - m_members.begin();
+        };
+
+        const auto originPos = position(origin), selfPos = position(m_self);
+        if(!originPos || !selfPos)
+            return {}; // Not members of the epoch
+
+        // Positions counted from the origin, around the leaf order
+        const size_t n = m_members.size();
+        const size_t rank = (selfPos.value() + n - originPos.value()) % n;
+
+        std::vector<const std::string *> children;
+        for(size_t child = fanout * rank + 1; child <= fanout * rank + fanout && child < n; ++child)
+            children.emplace_back(&m_members[(originPos.value() + child) % n].second);
+
+        return children;
+    }
+
+    // Hops to reach the last member
+    int depth(size_t fanout) const
+    {
+        int depth = 0;
+        for(size_t reached = 1, level = 1; reached < m_members.size(); ++depth)
+        {
+            level *= fanout;
+            reached += level;
+        }
+
+        return depth;
+    }
+
+    void cancelFallbacks()
+    {
+        for(const auto id : m_fallbacks)
+            m_network.unregisterTimeout(id);
+        m_fallbacks.clear();
+    }
+
+private:
+    Network & m_network;
+    size_t m_fanout = DEFAULT_RELAY_FANOUT;
+    size_t m_minBytes = DEFAULT_RELAY_BYTES;
+
+    mls::epoch_t m_epoch = 0;
+    mls::LeafIndex m_self{0};
+    std::vector<std::pair<mls::LeafIndex, std::string>> m_members; // By increasing LeafIndex
+    std::vector<timeoutID> m_fallbacks; // Direct broadcasts of the epoch
+};
+
+#endif
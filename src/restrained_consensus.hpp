@@ -3,6 +3,12 @@
  * @author Ludovic PAILLAT (Ludovic.PAILLAT@hivenet.com)
  * @brief Implementation of Cascade Consensus's Restrained Consensus for
  *  Distributed Delivery Service
+ *
+ *  Instead of signing every element of the power set of the conflict set
+ *      containing itself, a member signs the sorted conflict set once, which
+ *      endorses all of these elements. Subsets are handled as bitmasks over
+ *      the sorted conflict set, retracted members are removed from the mask
+ *      of the candidate subset.
  */
 
 #ifndef __RESTRAINED_CONSENSUS_HPP__
@@ -16,6 +22,7 @@
 #include <cstdio>
 #include <functional>
 #include <iterator>
+#include <map>
 #include <optional>
 #include <set>
 #include <string>
@@ -29,16 +36,20 @@
 #include "tls/tls_syntax.h"
 
 #include "cac_signature.hpp"
+#include "control_signature.hpp"
 #include "dds_message.hpp"
 #include "extended_mls_state.hpp"
 #include "network.hpp"
+#include "quorum_certificate.hpp"
+#include "rtt_estimator.hpp"
 
 class RestrainedConsensus
 {
 public:
+    // Decided messages, endorsements with the conflict set each signs, retractions
     using DecideCallback = std::function<void(const std::vector<MessageRef> &,
-        const std::vector<mls::AuthenticatedContent> &,
-        const std::vector<mls::AuthenticatedContent> &)>;
+        const std::vector<ControlSignature> &, const std::vector<ConflictSet> &,
+        const std::vector<ControlSignature> &)>;
     using BottomCallback = std::function<void()>;
     using BroadcastCallback = std::function<void(const RestrainedConsensusMessage &,
         const std::vector<std::string> &)>;
@@ -50,12 +61,25 @@ public:
             m_bottom(bottomCallback), m_broadcast(broadcastCallback)
     { }
 
+    // Send proofs as quorum certificates instead of full CAC signatures
+    void setQuorumCertificates(bool enabled)
+    {
+        m_quorumCertificates = enabled;
+    }
+
+    // Timeouts follow the measured rtt instead of the configured one
+    void setRttEstimator(const RttEstimator * estimator)
+    {
+        m_rttEstimator = estimator;
+    }
+
     void newEpoch(ExtendedMLSState * state)
     {
         m_state = state;
 
         m_retract = false, m_hasDelivered = false, m_hasFinished = false;
-        m_powerSet.clear(), m_signed.clear(), m_retracted.clear();
+        m_conflictSet.clear(), m_endorsements.clear(), m_retracted.clear();
+        m_alive = 0;
 
         resetTimeout();
     }
@@ -67,36 +91,37 @@ public:
         {
             m_hasDelivered = true;
 
-            std::vector<mls::AuthenticatedContent> sigSet;
+            m_conflictSet = sortedConflictSet(conflictSet);
+            if(m_conflictSet.size() > RC_MAX_CONFLICTS || !position(m_state->index()))
+            {
+                bottom();
+                return;
+            }
 
-            m_powerSet = powerSet(conflictSet);
-            for(const auto & elt : m_powerSet)
-                if(std::any_of(elt.begin(), elt.end(),
-                    [this](const auto & pair)
-                    { return pair.first == m_state->index(); }))
-                {
-                    const auto sig = m_state->sign(
-                        mls::tls::marshal(elt));
-                    sigSet.emplace_back(sig);
+            m_alive = fullMask(m_conflictSet.size());
+            m_endorsements.assign(m_conflictSet.size(), std::nullopt);
 
-                    m_signed[{elt.begin(), elt.end()}][m_state->index()] = sig;
-                }
+            // Signing the conflict set endorses every subset containing this member
+            const auto sig = m_state->signControl(CONTROL_RC_SUBSET, 0,
+                conflictSetReference(*m_state, m_conflictSet));
+            m_endorsements[position(m_state->index()).value()] = { m_alive, sig, m_conflictSet };
 
             for(const auto & retract : m_retracted)
-            {
-                const auto retracted = std::get<mls::MemberSender>(
-                        retract.content.sender.sender).sender;
-                handleRetract(retracted);
-            }
+                handleRetract(mls::LeafIndex{ retract.signer });
 
-            std::vector<mls::AuthenticatedContent> proofs;
-            std::transform(sigs.begin(), sigs.end(),
-                std::back_inserter(proofs),
-                [](const auto & sig){ return sig.authContent; });
+            std::vector<ControlSignature> proofs;
+            std::vector<QuorumCertificate> proofCertificates;
+            if(m_quorumCertificates)
+                proofCertificates = QuorumCertificate::fromSignatures(sigs);
+            else
+                std::transform(sigs.begin(), sigs.end(),
+                    std::back_inserter(proofs),
+                    [](const auto & sig){ return sig.controlSignature; });
             RestrainedConsContent content = {
-                .sigSet = sigSet,
-                .powerConflictSet = m_powerSet,
-                .proofs = proofs
+                .signature = sig,
+                .conflictSet = m_conflictSet,
+                .proofs = proofs,
+                .proofCertificates = proofCertificates
             };
 
             // Allow to test delay before sending restrained cons (otherwise with no delay everybody else immediately RETRACT)
@@ -122,8 +147,10 @@ public:
                     getParticipants(conflictSet));
             }
 
-            m_timeout = m_network.registerTimeout(2 * m_networkRtt,
+            m_timeout = m_network.registerTimeout(2 * rtt(),
                 [this](auto){ m_timeout = {}; bottom(); });
+
+            checkCompletion(); // Everybody else may have retracted already
         }   
     }
 
@@ -142,7 +169,43 @@ public:
         }
     }
 
+    static constexpr size_t RC_MAX_CONFLICTS = 64; // Subsets are 64 bits masks
+
+    // Each endorsement of a decision signs a conflict set, sorted and
+    //  containing its signer and every decided message
+    static bool verifyDecision(const ExtendedMLSState & state, const CAC2Content & decision)
+    {
+        size_t endorsements = 0;
+        for(const auto & sig : decision.signatures)
+        {
+            if(sig.type != CONTROL_RC_SUBSET)
+                continue;
+            if(endorsements >= decision.endorsedSets.size())
+                return false;
+
+            const auto & conflictSet = decision.endorsedSets[endorsements++];
+            const mls::LeafIndex signer{ sig.signer };
+            if(conflictSet.size() > RC_MAX_CONFLICTS || conflictSet != sortedConflictSet(conflictSet)
+                || std::none_of(conflictSet.begin(), conflictSet.end(),
+                    [signer](const auto & pair){ return pair.first == signer; }))
+                return false;
+
+            for(const auto & decided : decision.conflictingMessages)
+                if(std::none_of(conflictSet.begin(), conflictSet.end(),
+                    [&decided](const auto & pair){ return pair.second == decided; }))
+                    return false;
+
+            if(sig.reference != conflictSetReference(state, conflictSet) || !state.verify(sig))
+                return false;
+        }
+
+        return endorsements == decision.endorsedSets.size();
+    }
+
 protected:
+    // Subset of the sorted conflict set, bit i for its i-th element
+    using SubsetMask = uint64_t;
+
     void handleRestrainedCons(const RestrainedConsContent & content)
     {
         // Check "foreign-proofs is invalid"
@@ -159,6 +222,15 @@ protected:
                 proofs.emplace_back(cacSig.value());
         }
 
+        const auto certifiedProofs = QuorumCertificate::toSignatures(*m_state, content.proofCertificates);
+        if(!certifiedProofs)
+        {
+            bottom();
+            return;
+        }
+        for(const auto & sig : certifiedProofs.value())
+            proofs.emplace_back(sig);
+
         // Then we need to check the correct sequencing of messages (check there's no gap)
         std::map<mls::LeafIndex, std::set<uint32_t>> sequences;
         for(const auto & sig : proofs)
@@ -170,148 +242,112 @@ protected:
                 return;
             }
 
-        // Who sent the restrained-cons ?
-        if(content.sigSet.empty()
-            || content.sigSet[0].content.sender.sender_type() != mls::SenderType::member)
+        // Check "the signature is invalid": one signature on the whole
+        //  conflict set, sorted and containing its sender
+        const auto & sig = content.signature;
+        const mls::LeafIndex sender{ sig.signer };
+        if(sig.type != CONTROL_RC_SUBSET || content.conflictSet.size() > RC_MAX_CONFLICTS
+            || content.conflictSet != sortedConflictSet(content.conflictSet)
+            || std::none_of(content.conflictSet.begin(), content.conflictSet.end(),
+                [sender](const auto & pair){ return pair.first == sender; })
+            || sig.reference != conflictSetReference(*m_state, content.conflictSet)
+            || !m_state->verify(sig))
         {
             bottom();
             return;
         }
-        const mls::LeafIndex sender = std::get<mls::MemberSender>(
-            content.sigSet[0].content.sender.sender).sender;
-
-        // Check "a signature in sigset is invalid"
-        std::map<std::set<std::pair<mls::LeafIndex, MessageRef>>,
-            mls::AuthenticatedContent> signedSet;
-        for(const auto & sig : content.sigSet)
-        {
-            if(!m_state->verify(sig)
-                || sig.content.sender.sender_type() != mls::SenderType::member
-                || std::get<mls::MemberSender>(
-                    content.sigSet[0].content.sender.sender).sender != sender)
-            {
-                bottom();
-                return;
-            }
-
-            try
-            {
-                std::vector<std::pair<mls::LeafIndex, MessageRef>> signedContent;
-                mls::tls::unmarshal(
-                    std::get<mls::ApplicationData>(sig.content.content).data,
-                    signedContent);
-
-                signedSet[{signedContent.begin(), signedContent.end()}] = sig;
-            }
-            catch(const std::exception &)
-            {
-                bottom();
-                return;
-            }
-        }
 
         // TODO Other verifications
 
         if(m_hasDelivered)
         {
-            for(const auto & [signedElt, sig] : signedSet)
-                m_signed[signedElt][sender] = sig;
+            // The sender endorses the subsets of our conflict set that it
+            //  contains, and only if it is part of them
+            const auto senderPosition = position(sender);
+            if(senderPosition && !m_endorsements[senderPosition.value()])
+            {
+                SubsetMask endorsed = 0;
+                for(const auto & pair : content.conflictSet)
+                {
+                    const auto eltIt = std::lower_bound(m_conflictSet.begin(), m_conflictSet.end(), pair);
+                    if(eltIt != m_conflictSet.end() && *eltIt == pair)
+                        endorsed |= SubsetMask{1} << (eltIt - m_conflictSet.begin());
+                }
+
+                m_endorsements[senderPosition.value()] = { endorsed, sig, content.conflictSet };
+            }
 
             checkCompletion();
         }
         else
         {
-            const auto & sig = m_state->sign(mls::bytes_ns::from_ascii("RETRACT"));
+            const auto sig = m_state->signControl(CONTROL_RC_RETRACT, 0, {});
 
             m_retract = true;
-            m_broadcast(RestrainedConsensusMessage{ sig }, getParticipants(content.powerConflictSet));
+            m_broadcast(RestrainedConsensusMessage{ sig }, getParticipants(content.conflictSet));
 
             // TODO Why timeout, if I retract I will never decide but other can still decide
             // if(!m_timeout)
-            //     m_timeout = m_network.registerTimeout(2 * m_networkRtt,
+            //     m_timeout = m_network.registerTimeout(2 * rtt(),
             //         [this](auto){ m_timeout = {}; bottom(); });
         }
     }
 
-    void handleRetract(const mls::AuthenticatedContent & retract)
+    void handleRetract(const ControlSignature & retract)
     {
-        if(retract.content.sender.sender_type() != mls::SenderType::member)
-            return; // Invalid sender;
-
-        if(retract.content.epoch != m_state->epoch())
-            return; // Replay message attack
+        if(retract.type != CONTROL_RC_RETRACT)
+            return; // Invalid statement
 
         if(!m_state->verify(retract))
-            return; // Invalid
+            return; // Invalid, or replay of another epoch
 
         if(std::any_of(m_retracted.begin(), m_retracted.end(),
-            [&retract](const auto & retracted){ return retracted.content.sender == retract.content.sender; }))
+            [&retract](const auto & retracted){ return retracted.signer == retract.signer; }))
             return; // Already retracted
 
         m_retracted.emplace_back(retract);
-        const auto retracted = std::get<mls::MemberSender>(retract.content.sender.sender).sender;
 
-        handleRetract(retracted);
+        handleRetract(mls::LeafIndex{ retract.signer });
 
         checkCompletion();
     }
 
+    // Subsets containing a retracted member cannot be decided anymore
     void handleRetract(const mls::LeafIndex & retracted)
     {
-        m_powerSet.erase(std::remove_if(m_powerSet.begin(), m_powerSet.end(),
-            [retracted](const auto & elt)
-            {
-                return std::any_of(elt.begin(), elt.end(),
-                    [retracted](const auto & pair){ return pair.first == retracted; });
-            }), m_powerSet.end());
+        const auto retractedPosition = position(retracted);
+        if(retractedPosition)
+            m_alive &= ~(SubsetMask{1} << retractedPosition.value());
     }
 
+    // The biggest subset left is the conflict set without the retracted
+    //  members, decided once each of its members endorsed it
     void checkCompletion()
     {
-        if(m_powerSet.empty())
+        if(!m_hasDelivered || m_hasFinished)
             return;
 
-        // Look for biggest element in powerSet
-        std::vector<std::pair<mls::LeafIndex, MessageRef>> biggest = m_powerSet[0];
-        bool uniqueBiggest = true;
-        for(auto it = std::next(m_powerSet.begin()); it != m_powerSet.end(); ++it)
+        std::vector<MessageRef> messages;
+        std::vector<ControlSignature> sigs;
+        std::vector<ConflictSet> endorsedSets;
+        for(size_t idx = 0; idx < m_conflictSet.size(); ++idx)
         {
-            if(it->size() > biggest.size())
-            {
-                biggest = *it;
-                uniqueBiggest = true;
-            }
-            else if(it->size() == biggest.size())
-                uniqueBiggest = false;
-        }
+            if(!(m_alive >> idx & 1))
+                continue;
 
-        if(!uniqueBiggest)
-        {
-            bottom();
-            return;
-        }
-        else
-        {
-            const auto biggestSigs = m_signed[{biggest.begin(), biggest.end()}];
-
-            if(biggestSigs.size() == biggest.size())
-            {
-                m_hasFinished = true;
-                resetTimeout();
+            const auto & endorsement = m_endorsements[idx];
+            if(!endorsement || (m_alive & ~endorsement->endorsed) != 0)
+                return; // Not endorsed (yet) by this member
 
-                std::vector<MessageRef> messages;
-                std::transform(biggest.begin(), biggest.end(),
-                    std::back_inserter(messages),
-                    [](const auto & pair){ return pair.second; });
+            messages.emplace_back(m_conflictSet[idx].second);
+            sigs.emplace_back(endorsement->signature);
+            endorsedSets.emplace_back(endorsement->conflictSet);
+        }
 
-                std::vector<mls::AuthenticatedContent> sigs;
-                std::transform(biggestSigs.begin(), biggestSigs.end(),
-                    std::back_inserter(sigs),
-                    [](const auto & pair){ return pair.second; });
+        m_hasFinished = true;
+        resetTimeout();
 
-                m_decide(messages, sigs, m_retracted);
-            }
-        }
+        m_decide(messages, sigs, endorsedSets, m_retracted);
     }
 
     void bottom()
@@ -334,63 +370,61 @@ protected:
         }
     }
 
-    std::vector<std::string> getParticipants(
+    static std::vector<std::pair<mls::LeafIndex, MessageRef>> sortedConflictSet(
         const std::vector<std::pair<mls::LeafIndex, MessageRef>> & conflictSet)
     {
-        std::vector<std::string> participants;
+        auto sorted = conflictSet;
+        std::sort(sorted.begin(), sorted.end());
+        sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
 
-        for(const auto & [index, _] : conflictSet)
-        {
-            const auto & name = m_state->getMemberNameByIndex(index);
+        return sorted;
+    }
 
-            participants.emplace_back(std::string{name.data(), name.data() + name.size()});
-        }
+    static SubsetMask fullMask(size_t size)
+    {
+        return size >= 64 ? ~SubsetMask{0} : (SubsetMask{1} << size) - 1;
+    }
 
-        return participants;
+    // Position of a member in our sorted conflict set
+    std::optional<size_t> position(const mls::LeafIndex & member) const
+    {
+        for(size_t idx = 0; idx < m_conflictSet.size(); ++idx)
+            if(m_conflictSet[idx].first == member)
+                return idx;
+
+        return {};
+    }
+
+    // The sorted conflict set is signed through its reference
+    static MessageRef conflictSetReference(const ExtendedMLSState & state, const ConflictSet & conflictSet)
+    {
+        static const auto label = mls::bytes_ns::from_ascii(
+            "Distributed Delivery Service 1.0 RC Conflict Set");
+        return state.cipher_suite().raw_ref(label, mls::tls::marshal(conflictSet));
     }
 
     std::vector<std::string> getParticipants(
-        const std::vector<std::vector<std::pair<mls::LeafIndex, MessageRef>>> & powerSet)
+        const std::vector<std::pair<mls::LeafIndex, MessageRef>> & conflictSet)
     {
         std::vector<std::string> participants;
 
-        for(const auto & elt : powerSet)
+        for(const auto & [index, _] : conflictSet)
         {
-            if(elt.size() != 1)
-                continue; // Optimize time (there will be an elt of size 1 for each sender)
-
-            const auto & [index, _] = elt[0];
-            const auto & name = m_state->getMemberNameByIndex(index);
-            participants.emplace_back(std::string{name.data(), name.data() + name.size()});
+            participants.emplace_back(m_state->members().name(index));
         }
 
         return participants;
     }
 
-    template <typename T>
-    std::vector<std::vector<T>> powerSet(const std::vector<T>& input, size_t index = 0)
+    int rtt() const
     {
-        if(index == input.size())
-        {
-            return {{}};
-        }
-
-        std::vector<std::vector<T>> subsets = powerSet(input, index + 1);
-
-        size_t subsetCount = subsets.size();
-        for(size_t i = 0; i < subsetCount; ++i)
-        {
-            std::vector<T> currentSubset = subsets[i];
-            currentSubset.push_back(input[index]);
-            subsets.push_back(currentSubset);
-        }
-
-        return subsets;
+        return m_rttEstimator ? m_rttEstimator->rtt() : m_networkRtt;
     }
 
 private:
     Network & m_network;
     const int m_networkRtt;
+    const RttEstimator * m_rttEstimator = nullptr;
 
     ExtendedMLSState * m_state = nullptr;
 
@@ -398,12 +432,19 @@ private:
     const BottomCallback m_bottom;
     const BroadcastCallback m_broadcast;
 
+    bool m_quorumCertificates = false;
     bool m_retract, m_hasDelivered, m_hasFinished;
-    std::vector<std::vector<std::pair<mls::LeafIndex, MessageRef>>> m_powerSet;
-    std::map<
-        std::set<std::pair<mls::LeafIndex, MessageRef>>,
-        std::map<mls::LeafIndex, mls::AuthenticatedContent>> m_signed;
-    std::vector<mls::AuthenticatedContent> m_retracted;
+    std::vector<std::pair<mls::LeafIndex, MessageRef>> m_conflictSet; // Sorted
+    SubsetMask m_alive; // Members not retracted
+    // Subsets endorsed by a member, its signature and the conflict set it signs
+    struct Endorsement
+    {
+        SubsetMask endorsed;
+        ControlSignature signature;
+        ConflictSet conflictSet;
+    };
+    std::vector<std::optional<Endorsement>> m_endorsements; // By position in the conflict set
+    std::vector<ControlSignature> m_retracted;
 
     std::optional<timeoutID> m_timeout = {};
 };
@@ -0,0 +1,101 @@
+/**
+ * @file rtt_estimator.hpp
+ * @author Ludovic PAILLAT (Ludovic.PAILLAT@hivenet.com)
+ * @brief Per-peer round trip time estimation, from which the timeouts of the
+ *  protocols are derived instead of a fixed network-rtt
+ *
+ * Each peer has a smoothed rtt and variation (RFC 6298). The rtt used by the
+ *  protocols is the one of the quorum-th closest peer: waiting for the farthest
+ *  peers is not needed to reach a quorum. Until enough peers are measured,
+ *  the configured network-rtt is used.
+ */
+
+#ifndef __RTT_ESTIMATOR_HPP__
+#define __RTT_ESTIMATOR_HPP__
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+static constexpr int DEFAULT_RTT_PROBE_INTERVAL_MS = 1000;
+static constexpr int MIN_RTT_MS = 2;
+static constexpr int MAX_RTT_FACTOR = 4; // Times the configured network-rtt
+
+class RttEstimator
+{
+public:
+    explicit RttEstimator(int networkRtt)
+        : m_networkRtt(networkRtt)
+    { }
+
+    // Number of peers whose answer is needed, the others may be slower
+    void setQuorum(size_t quorum)
+    {
+        m_quorum = quorum;
+    }
+
+    void sample(const std::string & peer, double rttMs)
+    {
+        auto [peerIt, isNew] = m_peers.try_emplace(peer);
+        auto & estimate = peerIt->second;
+
+        if(isNew)
+        {
+            estimate.srtt = rttMs;
+            estimate.rttvar = rttMs / 2;
+        }
+        else
+        {
+            estimate.rttvar = 0.75 * estimate.rttvar + 0.25 * std::abs(estimate.srtt - rttMs);
+            estimate.srtt = 0.875 * estimate.srtt + 0.125 * rttMs;
+        }
+    }
+
+    void forget(const std::string & peer)
+    {
+        m_peers.erase(peer);
+    }
+
+    // Rtt of the quorum-th closest peer, the configured one if not enough are known
+    int rtt() const
+    {
+        if(m_quorum == 0 || m_peers.size() < m_quorum)
+            return m_networkRtt;
+
+        std::vector<double> timeouts;
+        timeouts.reserve(m_peers.size());
+        for(const auto & [_, estimate] : m_peers)
+            timeouts.emplace_back(estimate.srtt + 4 * estimate.rttvar);
+
+        std::nth_element(timeouts.begin(), timeouts.begin() + (m_quorum - 1), timeouts.end());
+        return std::clamp((int) timeouts[m_quorum - 1] + 1, MIN_RTT_MS,
+            std::max(MIN_RTT_MS, MAX_RTT_FACTOR * m_networkRtt));
+    }
+
+    size_t measuredPeers() const { return m_peers.size(); }
+
+    // Local clock carried by probes and echoed back by the peer
+    template <typename TimePoint>
+    static uint64_t timestamp(const TimePoint & time)
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            time.time_since_epoch()).count();
+    }
+
+private:
+    struct Estimate
+    {
+        double srtt = 0, rttvar = 0; // ms
+    };
+
+    const int m_networkRtt;
+    size_t m_quorum = 0;
+    std::unordered_map<std::string, Estimate> m_peers;
+};
+
+#endif
@@ -0,0 +1,84 @@
+/**
+ * @file sharded_map.hpp
+ * @author Ludovic PAILLAT (Ludovic.PAILLAT@hivenet.com)
+ * @brief Hash map split in independently locked shards, so that threads
+ *  working on different keys rarely contend
+ */
+
+#ifndef __SHARDED_MAP_HPP__
+#define __SHARDED_MAP_HPP__
+
+#include <array>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+
+template <typename Key, typename Value, size_t ShardCount = 64,
+    typename Hash = std::hash<Key>>
+class ShardedMap
+{
+public:
+    // Call f(Value &) with the shard locked, the value is created if absent
+    template <typename F>
+    auto modify(const Key & key, F && f)
+    {
+        Shard & shard = shardOf(key);
+        std::lock_guard lock{shard.mutex};
+
+        return f(shard.map[key]);
+    }
+
+    // Call f(Value &) with the shard locked if the key is present,
+    //  returns whether it was
+    template <typename F>
+    bool visit(const Key & key, F && f)
+    {
+        Shard & shard = shardOf(key);
+        std::lock_guard lock{shard.mutex};
+
+        auto it = shard.map.find(key);
+        if(it == shard.map.end())
+            return false;
+
+        f(it->second);
+        return true;
+    }
+
+    bool erase(const Key & key)
+    {
+        Shard & shard = shardOf(key);
+        std::lock_guard lock{shard.mutex};
+
+        return shard.map.erase(key) > 0;
+    }
+
+    size_t size() const
+    {
+        size_t total = 0;
+        for(const auto & shard : m_shards)
+        {
+            std::lock_guard lock{shard.mutex};
+            total += shard.map.size();
+        }
+
+        return total;
+    }
+
+private:
+    // Shards on their own cache lines, locking one does not slow its neighbours
+    struct alignas(64) Shard
+    {
+        mutable std::mutex mutex;
+        std::unordered_map<Key, Value, Hash> map;
+    };
+
+    Shard & shardOf(const Key & key)
+    {
+        return m_shards[Hash{}(key) % ShardCount];
+    }
+
+    std::array<Shard, ShardCount> m_shards;
+};
+
+#endif
@@ -0,0 +1,207 @@
+/**
+ * @file verification_pipeline.hpp
+ * @author Ludovic PAILLAT (Ludovic.PAILLAT@hivenet.com)
+ * @brief Verification of the control signatures of Cascade Consensus messages
+ *  on a WorkerPool, out of the network thread
+ *
+ * Messages are decrypted and parsed on the network thread, their signatures
+ *  not verified yet are split in batches verified by the pool. Results come
+ *  back through Network::post() and the messages are handed to the protocols
+ *  in their order of arrival, once all their signatures are checked: the
+ *  protocols only see verified signatures and the same message sequence as
+ *  without pipeline. Pending messages are dropped with their epoch.
+ */
+
+#ifndef __VERIFICATION_PIPELINE_HPP__
+#define __VERIFICATION_PIPELINE_HPP__
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <vector>
+
+#include "control_signature.hpp"
+#include "dds_message.hpp"
+#include "extended_mls_state.hpp"
+#include "network.hpp"
+#include "worker_pool.hpp"
+
+class VerificationPipeline
+{
+public:
+    using ReadyCallback = std::function<void(const CascadeConsensusMessage &)>;
+
+    static constexpr size_t VERIFICATION_BATCH = 8; // Signatures per task
+
+    VerificationPipeline(Network & network, const ReadyCallback & readyCallback)
+        : m_network(network), m_ready(readyCallback)
+    { }
+
+    // Shared by the groups of the process, its threads are to be joined before
+    //  the pipeline is destroyed. Without pool, messages are handed over
+    //  directly
+    void setPool(WorkerPool * pool)
+    {
+        m_pool = pool;
+    }
+
+    void newEpoch(ExtendedMLSState * state)
+    {
+        m_state = state;
+        m_pending.clear();
+        m_generation++;
+    }
+
+    void receiveMessage(const CascadeConsensusMessage & message)
+    {
+        std::vector<ExtendedMLSState::DetachedVerification> verifications;
+        if(m_pool)
+            for(const auto * sig : controlSignatures(message))
+                if(auto verification = m_state->detachVerification(*sig))
+                    verifications.emplace_back(std::move(verification.value()));
+
+        if(verifications.empty() && m_pending.empty())
+        {
+            m_ready(message);
+            return;
+        }
+
+        const size_t batches = (verifications.size() + VERIFICATION_BATCH - 1) / VERIFICATION_BATCH;
+        const uint64_t sequence = m_firstSequence + m_pending.size();
+        m_pending.push_back({ message, batches });
+
+        for(size_t batch = 0; batch < batches; ++batch)
+        {
+            auto tasks = std::make_shared<std::vector<ExtendedMLSState::DetachedVerification>>(
+                std::make_move_iterator(verifications.begin() + batch * VERIFICATION_BATCH),
+                std::make_move_iterator(verifications.begin()
+                    + std::min(verifications.size(), (batch + 1) * VERIFICATION_BATCH)));
+
+            m_pool->submit([this, tasks, sequence, generation = m_generation]()
+            {
+                // Invalid signatures are left out, verify() will reject them
+                auto verified = std::make_shared<std::vector<ExtendedMLSState::DetachedVerification>>();
+                for(auto & verification : *tasks)
+                    if(verification.run())
+                        verified->emplace_back(std::move(verification));
+
+                m_network.post([this, verified, sequence, generation]()
+                {
+                    handleVerified(*verified, sequence, generation);
+                });
+            });
+        }
+
+        release();
+    }
+
+    size_t pendingMessages() const { return m_pending.size(); }
+
+protected:
+    void handleVerified(const std::vector<ExtendedMLSState::DetachedVerification> & verified,
+        uint64_t sequence, uint64_t generation)
+    {
+        if(generation != m_generation)
+            return; // Epoch of the message is over
+
+        for(const auto & verification : verified)
+            m_state->markVerified(verification);
+
+        m_pending[sequence - m_firstSequence].remainingBatches--;
+        release();
+    }
+
+    // Hand over the messages verified, in order
+    void release()
+    {
+        const uint64_t generation = m_generation;
+        while(!m_pending.empty() && m_pending.front().remainingBatches == 0)
+        {
+            const CascadeConsensusMessage message = std::move(m_pending.front().message);
+            m_pending.pop_front();
+            m_firstSequence++;
+
+            m_ready(message);
+            if(generation != m_generation)
+                return; // The message led to another epoch
+        }
+    }
+
+    static std::vector<const ControlSignature *> controlSignatures(
+        const CascadeConsensusMessage & message)
+    {
+        std::vector<const ControlSignature *> sigs;
+        const auto append = [&sigs](const std::vector<ControlSignature> & others)
+        {
+            for(const auto & sig : others)
+                sigs.emplace_back(&sig);
+        };
+
+        if(message.isCAC())
+            append(message.cacMessage().sigs);
+        else if(message.isCAC2())
+        {
+            append(message.cac2Message().sigs);
+            if(message.cac2Message().hasBroadcastMessage())
+                append(message.cac2Message().broadcastMessage().signatures);
+        }
+        else if(message.isRestrainedConsensus())
+        {
+            const auto & rcMessage = message.restrainedConsensusMessage();
+            if(rcMessage.isRestrainedCons())
+            {
+                sigs.emplace_back(&rcMessage.restrainedCons().signature);
+                append(rcMessage.restrainedCons().proofs);
+            }
+            else
+                sigs.emplace_back(&rcMessage.retract());
+        }
+        else if(message.isFullConsensus())
+        {
+            const auto & fcMessage = message.fullConsensusMessage();
+            switch(fcMessage.type())
+            {
+            case CONSENSUS_PRE_PREPARE:
+                sigs.emplace_back(&fcMessage.prePrepareMessage().signedContent);
+                break;
+            case CONSENSUS_PREPARE:
+                sigs.emplace_back(&fcMessage.prepareMessage().signedContent);
+                break;
+            case CONSENSUS_COMMIT:
+                sigs.emplace_back(&fcMessage.commitMessage().signedContent);
+                break;
+            case CONSENSUS_VIEW_CHANGE:
+                sigs.emplace_back(&fcMessage.viewChange().signedContent);
+                append(fcMessage.viewChange().prepared);
+                break;
+            default:
+                break;
+            }
+        }
+
+        return sigs;
+    }
+
+private:
+    struct PendingMessage
+    {
+        CascadeConsensusMessage message;
+        size_t remainingBatches;
+    };
+
+    Network & m_network;
+    const ReadyCallback m_ready;
+    ExtendedMLSState * m_state = nullptr;
+
+    std::deque<PendingMessage> m_pending; // By order of arrival
+    uint64_t m_firstSequence = 0;         // Of m_pending.front()
+    uint64_t m_generation = 0;            // Incremented by newEpoch
+
+    WorkerPool * m_pool = nullptr;
+};
+
+#endif
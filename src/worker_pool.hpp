@@ -0,0 +1,172 @@
+/**
+ * @file worker_pool.hpp
+ * @author Ludovic PAILLAT (Ludovic.PAILLAT@hivenet.com)
+ * @brief Threads running tasks out of the event loop, results are handed back
+ *  to the loop using Network::post()
+ *
+ * Each thread has its own queue, tasks are spread over the queues in turn. A
+ *  thread takes the oldest task of its queue, or steals the newest task of
+ *  another queue when its own is empty, so that a few long tasks do not hold
+ *  back the others. A pool may instead hand its tasks to an executor, which
+ *  runs them later, e.g. on the virtual clock of the simulation.
+ */
+
+#ifndef __WORKER_POOL_HPP__
+#define __WORKER_POOL_HPP__
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class WorkerPool
+{
+public:
+    using Executor = std::function<void(std::function<void()>)>;
+
+    explicit WorkerPool(size_t threads = 1)
+    {
+        for(size_t idx = 0; idx < threads; ++idx)
+            m_queues.emplace_back(std::make_unique<Queue>());
+
+        for(size_t idx = 0; idx < threads; ++idx)
+            m_threads.emplace_back([this, idx](){ run(idx); });
+    }
+
+    // Without threads, the tasks are run when the executor decides to
+    explicit WorkerPool(const Executor & executor)
+        : m_executor(executor)
+    { }
+
+    // Pending tasks are dropped, running ones are waited for
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard lock{m_mutex};
+            m_stopped = true;
+        }
+        m_wakeup.notify_all();
+
+        for(auto & thread : m_threads)
+            thread.join();
+    }
+
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool & operator=(const WorkerPool &) = delete;
+
+    size_t threads() const { return m_threads.size(); }
+
+    // Without threads nor executor, the task is run by the caller
+    void submit(std::function<void()> task)
+    {
+        if(m_executor)
+        {
+            m_executor([task = std::move(task)](){ execute(task); });
+            return;
+        }
+
+        if(m_queues.empty())
+        {
+            execute(task);
+            return;
+        }
+
+        auto & queue = *m_queues[m_nextQueue++ % m_queues.size()];
+        {
+            std::lock_guard lock{queue.mutex};
+            queue.tasks.emplace_back(std::move(task));
+        }
+
+        {
+            std::lock_guard lock{m_mutex};
+            m_queued++;
+        }
+        m_wakeup.notify_one();
+    }
+
+private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    void run(size_t self)
+    {
+        while(true)
+        {
+            {
+                std::unique_lock lock{m_mutex};
+                m_wakeup.wait(lock, [this](){ return m_stopped || m_queued > 0; });
+                if(m_stopped)
+                    return;
+
+                m_queued--; // One of the queues holds a task for this thread
+            }
+
+            std::function<void()> task;
+            while(!task)
+                task = take(self);
+
+            execute(task);
+        }
+    }
+
+    std::function<void()> take(size_t self)
+    {
+        std::function<void()> task;
+
+        for(size_t offset = 0; offset < m_queues.size() && !task; ++offset)
+        {
+            auto & queue = *m_queues[(self + offset) % m_queues.size()];
+            std::lock_guard lock{queue.mutex};
+            if(queue.tasks.empty())
+                continue;
+
+            if(offset == 0) // Own queue, oldest first
+            {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+            else
+            {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            }
+        }
+
+        return task;
+    }
+
+    static void execute(const std::function<void()> & task)
+    {
+        try
+        {
+            task();
+        }
+        catch(const std::exception & e)
+        {
+            printf("Worker task failed: %s\n", e.what());
+        }
+    }
+
+    const Executor m_executor;
+    std::vector<std::unique_ptr<Queue>> m_queues;
+    std::atomic<size_t> m_nextQueue = 0;
+
+    std::mutex m_mutex;
+    std::condition_variable m_wakeup;
+    size_t m_queued = 0; // Tasks not taken by a thread yet
+    bool m_stopped = false;
+
+    std::vector<std::thread> m_threads;
+};
+
+#endif